@@ -0,0 +1,206 @@
+#include <cuda_runtime.h>
+
+#include "atrous_denoiser.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define ATROUS_USE_SSE 1
+#endif
+
+namespace {
+    const float KERNEL[5] = {1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f};
+
+    // Coefficients of 2^f on [0, 1), to better than 1e-3 relative error
+    const float EXP2_C1 = 0.69583356f;
+    const float EXP2_C2 = 0.22606716f;
+    const float EXP2_C3 = 0.07944023f;
+
+    // exp(-x) for x >= 0, expf dominates the filter otherwise
+    inline float negExp(float x) {
+        const float t = -1.44269504f * (x < 80.f ? x : 80.f);
+        const float fi = floorf(t);
+        const float f = t - fi;
+        const float p = 1.f + f * (EXP2_C1 + f * (EXP2_C2 + f * EXP2_C3));
+        union {
+            int32_t i;
+            float f;
+        } scale;
+        scale.i = (static_cast<int32_t>(fi) + 127) << 23;
+        return p * scale.f;
+    }
+
+    inline float distance2(const float4 &a, const float4 &b) {
+        const float dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+        return dx * dx + dy * dy + dz * dz;
+    }
+
+#ifdef ATROUS_USE_SSE
+    inline __m128 negExp4(__m128 x) {
+        const __m128 t = _mm_mul_ps(_mm_min_ps(x, _mm_set1_ps(80.f)), _mm_set1_ps(-1.44269504f));
+        // t <= 0 and truncation rounds towards zero, so step down where that rounded up
+        __m128 fi = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+        fi = _mm_sub_ps(fi, _mm_and_ps(_mm_cmpgt_ps(fi, t), _mm_set1_ps(1.f)));
+        const __m128 f = _mm_sub_ps(t, fi);
+        __m128 p = _mm_add_ps(_mm_set1_ps(EXP2_C2), _mm_mul_ps(f, _mm_set1_ps(EXP2_C3)));
+        p = _mm_add_ps(_mm_set1_ps(EXP2_C1), _mm_mul_ps(f, p));
+        p = _mm_add_ps(_mm_set1_ps(1.f), _mm_mul_ps(f, p));
+        const __m128i exponent = _mm_add_epi32(_mm_cvttps_epi32(fi), _mm_set1_epi32(127));
+        return _mm_mul_ps(p, _mm_castsi128_ps(_mm_slli_epi32(exponent, 23)));
+    }
+
+    // Squared xyz distances of center to four taps, one per lane
+    inline __m128 distance2x4(__m128 center, const float4 *taps, int step) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(&taps[0].x), center);
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(&taps[step].x), center);
+        __m128 d2 = _mm_sub_ps(_mm_loadu_ps(&taps[2 * step].x), center);
+        __m128 d3 = _mm_sub_ps(_mm_loadu_ps(&taps[3 * step].x), center);
+        d0 = _mm_mul_ps(d0, d0);
+        d1 = _mm_mul_ps(d1, d1);
+        d2 = _mm_mul_ps(d2, d2);
+        d3 = _mm_mul_ps(d3, d3);
+        _MM_TRANSPOSE4_PS(d0, d1, d2, d3);
+        return _mm_add_ps(_mm_add_ps(d0, d1), d2);
+    }
+
+    template<int LANE>
+    inline __m128 lane(__m128 v) {
+        return _mm_shuffle_ps(v, v, _MM_SHUFFLE(LANE, LANE, LANE, LANE));
+    }
+#endif
+}
+
+AtrousDenoiser::AtrousDenoiser() {
+    setNumThreads(0);
+}
+
+void AtrousDenoiser::setNumThreads(unsigned int num_threads) {
+    m_num_threads = num_threads > 0 ? num_threads : std::thread::hardware_concurrency();
+    if (m_num_threads == 0) m_num_threads = 1;
+}
+
+void AtrousDenoiser::filterRows(const float4 *input, const float4 *albedo, const float4 *normal, float4 *output,
+                                int width, int height, int step, float inv_sigma_color2,
+                                int row_begin, int row_end) const {
+    const float inv_sigma_normal2 = 1.f / (settings.sigma_normal * settings.sigma_normal);
+    const float inv_sigma_albedo2 = 1.f / (settings.sigma_albedo * settings.sigma_albedo);
+
+    for (int y = row_begin; y < row_end; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const int center = y * width + x;
+
+#ifdef ATROUS_USE_SSE
+            if (x >= 2 * step && x + 2 * step < width) {
+                // Taps 0-3 of a kernel row are weighted in one go, tap 4 on its own
+                const __m128 c_p = _mm_loadu_ps(&input[center].x);
+                const __m128 n_p = normal ? _mm_loadu_ps(&normal[center].x) : _mm_setzero_ps();
+                const __m128 a_p = albedo ? _mm_loadu_ps(&albedo[center].x) : _mm_setzero_ps();
+                const __m128 kernel_row = _mm_loadu_ps(KERNEL);
+
+                __m128 sum = _mm_setzero_ps();
+                __m128 weight_sum = _mm_setzero_ps();
+                float weight_sum_last = 0.f;
+                for (int j = 0; j < 5; ++j) {
+                    const int qy = y + (j - 2) * step;
+                    if (qy < 0 || qy >= height) continue;
+                    const int q = qy * width + x - 2 * step;
+                    const int q_last = q + 4 * step;
+
+                    __m128 exponent = _mm_mul_ps(distance2x4(c_p, input + q, step), _mm_set1_ps(inv_sigma_color2));
+                    float exponent_last = distance2(input[center], input[q_last]) * inv_sigma_color2;
+                    if (normal) {
+                        exponent = _mm_add_ps(exponent, _mm_mul_ps(distance2x4(n_p, normal + q, step),
+                                                                   _mm_set1_ps(inv_sigma_normal2)));
+                        exponent_last += distance2(normal[center], normal[q_last]) * inv_sigma_normal2;
+                    }
+                    if (albedo) {
+                        exponent = _mm_add_ps(exponent, _mm_mul_ps(distance2x4(a_p, albedo + q, step),
+                                                                   _mm_set1_ps(inv_sigma_albedo2)));
+                        exponent_last += distance2(albedo[center], albedo[q_last]) * inv_sigma_albedo2;
+                    }
+
+                    const __m128 w = _mm_mul_ps(negExp4(exponent), _mm_mul_ps(kernel_row, _mm_set1_ps(KERNEL[j])));
+                    const float w_last = KERNEL[4] * KERNEL[j] * negExp(exponent_last);
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&input[q].x), lane<0>(w)));
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&input[q + step].x), lane<1>(w)));
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&input[q + 2 * step].x), lane<2>(w)));
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&input[q + 3 * step].x), lane<3>(w)));
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&input[q_last].x), _mm_set1_ps(w_last)));
+                    weight_sum = _mm_add_ps(weight_sum, w);
+                    weight_sum_last += w_last;
+                }
+                float lanes[4];
+                _mm_storeu_ps(lanes, weight_sum);
+                const float total = lanes[0] + lanes[1] + lanes[2] + lanes[3] + weight_sum_last;
+                _mm_storeu_ps(&output[center].x, _mm_mul_ps(sum, _mm_set1_ps(1.f / total)));
+                continue;
+            }
+#endif
+
+            // Pixels whose footprint crosses the left or right border, and all pixels without SSE
+            const float4 &c_p = input[center];
+            float4 sum = make_float4(0.f);
+            float weight_sum = 0.f;
+            for (int j = 0; j < 5; ++j) {
+                const int qy = y + (j - 2) * step;
+                if (qy < 0 || qy >= height) continue;
+                for (int i = 0; i < 5; ++i) {
+                    const int qx = x + (i - 2) * step;
+                    if (qx < 0 || qx >= width) continue;
+                    const int q = qy * width + qx;
+
+                    float exponent = distance2(c_p, input[q]) * inv_sigma_color2;
+                    if (normal) exponent += distance2(normal[center], normal[q]) * inv_sigma_normal2;
+                    if (albedo) exponent += distance2(albedo[center], albedo[q]) * inv_sigma_albedo2;
+
+                    const float w = KERNEL[i] * KERNEL[j] * negExp(exponent);
+                    sum += input[q] * w;
+                    weight_sum += w;
+                }
+            }
+            // The center tap always has weight KERNEL[2]^2, so weight_sum > 0
+            output[center] = sum / weight_sum;
+        }
+    }
+}
+
+void AtrousDenoiser::denoise(const float4 *color, const float4 *albedo, const float4 *normal,
+                             int width, int height, float4 *output) {
+    const size_t num_pixels = static_cast<size_t>(width) * height;
+    if (num_pixels == 0) return;
+    m_ping.resize(num_pixels);
+    m_pong.resize(num_pixels);
+
+    // Bands of rows per thread, each iteration reads the whole result of the previous one
+    const unsigned int num_threads = std::min<unsigned int>(m_num_threads, height);
+    const float4 *input = color;
+    for (int iteration = 0; iteration < settings.iterations; ++iteration) {
+        float4 *target = iteration == settings.iterations - 1 ? output
+                                                              : (iteration % 2 == 0 ? m_ping.data() : m_pong.data());
+        // The caller may filter in place, the last pass must not read what it writes
+        if (target == input) target = iteration % 2 == 0 ? m_pong.data() : m_ping.data();
+
+        const float sigma_color = settings.sigma_color * std::pow(0.5f, static_cast<float>(iteration));
+        const float inv_sigma_color2 = 1.f / (sigma_color * sigma_color);
+        const int step = 1 << iteration;
+
+        std::vector<std::thread> threads;
+        for (unsigned int t = 1; t < num_threads; ++t) {
+            threads.emplace_back([=]() {
+                filterRows(input, albedo, normal, target, width, height, step, inv_sigma_color2,
+                           height * t / num_threads, height * (t + 1) / num_threads);
+            });
+        }
+        filterRows(input, albedo, normal, target, width, height, step, inv_sigma_color2, 0, height / num_threads);
+        for (auto &thread: threads) thread.join();
+        input = target;
+    }
+
+    if (input != output) {
+        std::copy(input, input + num_pixels, output);
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <sutil/vec_math.h>
+
+#include <vector>
+
+/*
+*   Edge-avoiding A-Trous wavelet filter (Dammertz et al. 2010, the spatial part of SVGF)
+*   running on the host. Used in place of the OptiX denoiser where no GPU denoiser is
+*   available. Every iteration applies the 5x5 B3-spline kernel with holes of 2^i pixels,
+*   with each tap weighted down by its colour, normal and albedo distance to the center.
+*/
+
+struct AtrousSettings {
+    int iterations = 5;
+    float sigma_color = 0.5f;   // halved with every iteration, as the image gets smoother
+    float sigma_normal = 0.3f;
+    float sigma_albedo = 0.1f;
+};
+
+class AtrousDenoiser {
+public:
+    AtrousDenoiser();
+
+    // 0 uses one thread per hardware thread
+    void setNumThreads(unsigned int num_threads);
+
+    /*
+    *   Filters a width x height float4 image into output, which may alias color. albedo and
+    *   normal are optional per-pixel guides in the same layout, pass nullptr to not use one.
+    */
+    void denoise(const float4 *color, const float4 *albedo, const float4 *normal,
+                 int width, int height, float4 *output);
+
+    AtrousSettings settings;
+
+private:
+    void filterRows(const float4 *input, const float4 *albedo, const float4 *normal, float4 *output,
+                    int width, int height, int step, float inv_sigma_color2, int row_begin, int row_end) const;
+
+    unsigned int m_num_threads;
+    std::vector<float4> m_ping;
+    std::vector<float4> m_pong;
+};
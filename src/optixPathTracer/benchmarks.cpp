@@ -0,0 +1,2177 @@
+#include <optix.h>
+#include <optix_stubs.h>
+#include <cuda_runtime.h>
+
+#include <glm/gtx/transform.hpp>
+
+#include <sutil/CUDAOutputBuffer.h>
+#include <sutil/Exception.h>
+#include <sutil/WorkDistribution.h>
+#include <sutil/sutil.h>
+#include <sutil/vec_math.h>
+
+#include <GLFW/glfw3.h>
+
+#include <cuda/random.h>
+#include "benchmarks.h"
+#include "path_tracer.h"
+#include "camera_path.h"
+#include "cpu_bvh.h"
+#include "image_metrics.h"
+#include "light_sampling.h"
+#include "light_tree.h"
+#include "render_session.h"
+#include "scene_parser.h"
+#include "scene_snapshot.h"
+#include "session_scheduler.h"
+#include "tcp_socket.h"
+#include "tile_cluster.h"
+#include "stb_image.h"
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+BenchBackend bench_backend = BENCH_BACKEND_AUTO;
+int32_t bench_subframes = 16;
+int32_t bench_width = 0;
+double replay_fps = 30.0;
+
+namespace {
+    const int32_t CPU_BENCH_MAX_WIDTH = 256;
+
+    // Simulated rebalancing of DynamicWorkDistribution (--bench-work-distribution)
+    const double WORK_DISTRIBUTION_BENCH_MAX_ERROR = 0.02;     // of a share against the worker's part of the speed
+
+    // --bench-cluster
+    const double CLUSTER_BENCH_REPLY_DELAY_MS = 100.0;      // of the slowed down local worker
+
+    // --bench-fanout
+    const uint32_t FANOUT_BENCH_FRAMES = 120;
+    const double FANOUT_BENCH_FPS = 60.0;
+    const double FANOUT_BENCH_SLOW_VIEWER_MS = 50.0;
+
+    // --bench-metrics
+    const uint32_t METRICS_BENCH_UPDATES = 1000000;     // per thread and metric
+
+    // --bench-memory
+    const uint32_t MEMORY_BENCH_ALLOCATIONS = 200000;   // per thread
+
+    // --bench-camera-path
+    const double CAMERA_BENCH_SECONDS = 4.0;    // of the synthetic path
+    const int32_t CAMERA_BENCH_WIDTH = 64;
+
+    // Golden image regression (--golden), the settings are part of the references
+    const int32_t GOLDEN_WIDTH = 128;
+    const int32_t GOLDEN_SUBFRAMES = 8;
+    const int32_t GOLDEN_SAMPLES_PER_LAUNCH = 4;
+    const double GOLDEN_MIN_PSNR = 40.0;
+    const double GOLDEN_MIN_SSIM = 0.99;
+}
+
+/*
+*   Simulates DynamicWorkDistribution on workers of skewed speeds: every subframe a worker
+*   takes its tiles over its speed, with up to 10% jitter, then the distribution rebalances.
+*   The shares have to converge to the speed ratios, again after the fastest worker slowed
+*   down and right after the slowest worker left, and every tile of the raster has to belong
+*   to exactly one worker in every subframe.
+*/
+bool benchmarkWorkDistribution(int num_subframes) {
+    const int32_t num_workers = 4;
+    const int raster_width = 1920, raster_height = 1080;
+    double speeds[num_workers] = {1000.0, 2000.0, 4000.0, 9000.0};     // tiles per second
+    DynamicWorkDistribution distribution;
+    distribution.setNumWorkers(num_workers);
+    distribution.setRasterSize(raster_width, raster_height);
+    const int tile_cols = (raster_width + DynamicWorkDistribution::tileWidth() - 1) /
+                          DynamicWorkDistribution::tileWidth();
+
+    unsigned int seed = tea<4>(num_subframes, 26);
+    std::vector<int> owners(distribution.numTiles());
+    bool covered = true;
+    double frame_s = 0.0;
+    const auto simulate = [&]() {
+        for (int subframe = 0; subframe < num_subframes; ++subframe) {
+            std::fill(owners.begin(), owners.end(), 0);
+            frame_s = 0.0;
+            for (int32_t w = 0; w < distribution.numWorkers(); ++w) {
+                for (int32_t t = 0; t < distribution.numTiles(w); ++t) {
+                    const int2 origin = distribution.getTileOrigin(w, t);
+                    ++owners[origin.y / DynamicWorkDistribution::tileHeight() * tile_cols +
+                             origin.x / DynamicWorkDistribution::tileWidth()];
+                }
+                const double seconds = distribution.numTiles(w) / speeds[w] * (1.0 + 0.1 * rnd(seed));
+                frame_s = std::max(frame_s, seconds);
+                distribution.reportWorkerTime(w, seconds);
+            }
+            covered = covered && std::count(owners.begin(), owners.end(), 1) == distribution.numTiles();
+            distribution.rebalance();
+        }
+    };
+    // Largest difference of a share to the worker's part of the total speed
+    const auto shareError = [&]() {
+        double total_speed = 0.0, error = 0.0;
+        for (int32_t w = 0; w < distribution.numWorkers(); ++w) total_speed += speeds[w];
+        for (int32_t w = 0; w < distribution.numWorkers(); ++w)
+            error = std::max(error, std::fabs(distribution.share(w) - speeds[w] / total_speed));
+        return error;
+    };
+    const auto report = [&](const char *phase, double error) {
+        double total_speed = 0.0;
+        for (int32_t w = 0; w < distribution.numWorkers(); ++w) total_speed += speeds[w];
+        std::cout << "  " << phase << ": shares";
+        for (int32_t w = 0; w < distribution.numWorkers(); ++w) std::cout << " " << distribution.share(w);
+        std::cout << ", off by " << error << ", frame time " << 100.0 * distribution.numTiles() / total_speed / frame_s
+                  << "% of ideal" << std::endl;
+    };
+
+    std::cout << std::fixed << std::setprecision(3) << num_workers << " workers on " << raster_width << "x"
+              << raster_height << ", " << num_subframes << " subframes per phase" << std::endl;
+    simulate();
+    const double skewed_error = shareError();
+    report("skewed speeds", skewed_error);
+    speeds[num_workers - 1] = 1500.0;
+    simulate();
+    const double slowed_error = shareError();
+    report("fastest slowed", slowed_error);
+    // The slowest worker leaves, the others start from what was measured of them
+    distribution.removeWorker(0);
+    std::copy(speeds + 1, speeds + num_workers, speeds);
+    frame_s = 0.0;
+    for (int32_t w = 0; w < distribution.numWorkers(); ++w)
+        frame_s = std::max(frame_s, distribution.numTiles(w) / speeds[w]);
+    const double removed_error = shareError();
+    report("slowest removed", removed_error);
+    std::cout << "  every tile " << (covered ? "owned once" : "NOT owned exactly once") << " per subframe" << std::endl;
+    return covered && skewed_error < WORK_DISTRIBUTION_BENCH_MAX_ERROR &&
+           slowed_error < WORK_DISTRIBUTION_BENCH_MAX_ERROR && removed_error < WORK_DISTRIBUTION_BENCH_MAX_ERROR;
+}
+
+/*
+*   Shading points on a jittered grid in scanline order, so that consecutive points of a
+*   thread are as coherent as the pixels of a tile would be. Points on emitters are skipped.
+*/
+static void collectShadingPoints(const CpuScene &scene, int num_points, std::vector<float3> &points,
+                                 std::vector<float3> &normals) {
+    float3 U, V, W;
+    camera.setAspectRatio(static_cast<float>(width) / static_cast<float>(height));
+    camera.UVWFrame(U, V, W);
+    const int grid = std::max(1, static_cast<int>(sqrtf(static_cast<float>(num_points))));
+    unsigned int seed = tea<4>(grid, 0);
+    for (int y = 0; y < grid; ++y) {
+        for (int x = 0; x < grid; ++x) {
+            const float2 d = 2.0f * make_float2((x + rnd(seed)) / grid, (y + rnd(seed)) / grid) - 1.0f;
+            const CpuRay primary = {camera.eye(), normalize(d.x * U + d.y * V + W), 0.01f, 1e16f};
+            CpuHit hit;
+            if (!scene.intersect(primary, hit) || scene.material(hit).mat == EMISSIVE)
+                continue;
+
+            const float3 P = primary.origin + hit.t * primary.direction;
+            const float3 N_0 = scene.normal(hit, P);
+            points.push_back(P);
+            normals.push_back(faceforward(N_0, -primary.direction, N_0));
+        }
+    }
+}
+
+/*
+*   Builds the shadow rays the device integrator would trace towards every light from
+*   shading points seen by the camera, then traces them on the CPU scene the renderer uses,
+*   instances included, with a closest hit traversal, the any-hit traversal and the any-hit
+*   traversal with a per-thread last-occluder cache. Returns false if the traversals
+*   disagree on occlusion or there are no shadow rays to compare them on.
+*/
+bool benchmarkShadowRays(int num_points) {
+    CpuScene scene;
+    auto t0 = std::chrono::steady_clock::now();
+    buildCpuScene(scene);
+    auto t1 = std::chrono::steady_clock::now();
+    size_t bvh_bytes = scene.bvh.memoryUsage() + scene.instance_bvh.memoryUsage();
+    for (const CpuMesh &mesh: scene.meshes) bvh_bytes += mesh.bvh.memoryUsage();
+    std::cout << "BVH build: " << scene.bvh.numTriangles() << " triangles, " << scene.bvh.numNodes() << " nodes, "
+              << scene.meshes.size() << " meshes in " << scene.instance_bvh.numInstances() << " instances, "
+              << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms, "
+              << bvh_bytes / (1024.0 * 1024.0) << " MB" << std::endl;
+
+    std::vector<float3> points, normals;
+    collectShadingPoints(scene, num_points, points, normals);
+    unsigned int seed = tea<4>(num_points, 1);
+    std::vector<CpuRay> rays;
+    for (size_t i = 0; i < points.size(); ++i) {
+        const float3 &P = points[i];
+        const float3 &N = normals[i];
+        for (const Light &light: d_lights) {
+            float3 light_pos = light.corner;
+            if (light.shape == AREA_LIGHT)
+                light_pos = light.corner + light.v1 * rnd(seed) + light.v2 * rnd(seed);
+            const float dist = length(light_pos - P);
+            if (dist <= 0.01f) continue;
+            const float3 L = normalize(light_pos - P);
+            if (dot(N, L) <= 0.f) continue;
+            if (light.shape == AREA_LIGHT && -dot(light.normal, L) <= 0.f) continue;
+            rays.push_back({P, L, 0.01f, dist - 0.01f});
+        }
+    }
+    if (rays.empty()) {
+        std::cout << "FAIL, no shadow rays to trace - the camera sees no lit geometry" << std::endl;
+        return false;
+    }
+
+    const unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    const char *mode_names[] = {"closest hit", "any hit", "any hit + cache"};
+    double rays_per_second[3];
+    size_t occluded_count[3];
+    for (int mode = 0; mode < 3; ++mode) {
+        std::atomic<size_t> occluded(0);
+        std::atomic<uint64_t> cache_hits(0), cache_lookups(0);
+        std::vector<std::thread> threads;
+        t0 = std::chrono::steady_clock::now();
+        for (unsigned int t = 0; t < num_threads; ++t) {
+            threads.emplace_back([&, t]() {
+                const size_t begin = rays.size() * t / num_threads;
+                const size_t end = rays.size() * (t + 1) / num_threads;
+                CpuSceneOcclusionCache cache;
+                size_t count = 0;
+                for (size_t i = begin; i < end; ++i) {
+                    if (mode == 0) {
+                        CpuHit hit;
+                        count += scene.intersect(rays[i], hit);
+                    } else {
+                        count += scene.occluded(rays[i], mode == 2 ? &cache : nullptr);
+                    }
+                }
+                occluded += count;
+                cache_hits += cache.world.hits + cache.instances.hits;
+                cache_lookups += cache.world.lookups + cache.instances.lookups;
+            });
+        }
+        for (auto &thread: threads) thread.join();
+        t1 = std::chrono::steady_clock::now();
+
+        rays_per_second[mode] = rays.size() / std::chrono::duration<double>(t1 - t0).count();
+        occluded_count[mode] = occluded;
+        std::cout << std::setw(16) << mode_names[mode] << ": " << std::fixed << std::setprecision(2)
+                  << rays_per_second[mode] * 1e-6 << " Mrays/s, " << occluded_count[mode] << "/" << rays.size()
+                  << " occluded";
+        if (mode > 0)
+            std::cout << ", " << rays_per_second[mode] / rays_per_second[0] << "x";
+        if (mode == 2)
+            std::cout << ", cache hit rate " << 100.0 * cache_hits / std::max<uint64_t>(1, cache_lookups) << "%";
+        std::cout << std::endl;
+    }
+    const bool agree = occluded_count[0] == occluded_count[1] && occluded_count[1] == occluded_count[2];
+    if (!agree) std::cout << "FAIL, traversal modes disagree on occlusion" << std::endl;
+    return agree;
+}
+
+
+/*
+*   Estimates direct lighting at shading points seen by the camera with the same one-light
+*   estimator as __closesthit__radiance, once with uniform light selection and once with
+*   the light tree, and compares the per-point variance of both. Returns false if their
+*   means disagree, or there is nothing to light.
+*/
+bool benchmarkLightSampling(int num_points) {
+    if (d_lights.empty()) {
+        std::cout << "FAIL, no lights in the scene" << std::endl;
+        return false;
+    }
+    const int SAMPLES_PER_POINT = 64;
+
+    CpuScene scene;
+    buildCpuScene(scene);
+    auto t0 = std::chrono::steady_clock::now();
+    const std::vector<LightTreeNode> tree = buildLightTree(d_lights);
+    auto t1 = std::chrono::steady_clock::now();
+    std::cout << "Light tree build: " << d_lights.size() << " lights, " << tree.size() << " nodes, "
+              << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms" << std::endl;
+
+    std::vector<float3> points, normals;
+    collectShadingPoints(scene, num_points, points, normals);
+    if (points.empty()) {
+        std::cout << "FAIL, no shading points - the camera sees no lit geometry" << std::endl;
+        return false;
+    }
+
+    const unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    const char *mode_names[] = {"uniform", "light tree"};
+    double variance[2], mean[2], seconds[2];
+    for (int mode = 0; mode < 2; ++mode) {
+        std::vector<double> thread_variance(num_threads, 0.0), thread_mean(num_threads, 0.0);
+        std::vector<std::thread> threads;
+        t0 = std::chrono::steady_clock::now();
+        for (unsigned int t = 0; t < num_threads; ++t) {
+            threads.emplace_back([&, t]() {
+                const size_t begin = points.size() * t / num_threads;
+                const size_t end = points.size() * (t + 1) / num_threads;
+                CpuSceneOcclusionCache cache;
+                for (size_t i = begin; i < end; ++i) {
+                    const float3 &P = points[i];
+                    const float3 &N = normals[i];
+                    // Same seed for both modes, so the only difference is how lights are chosen
+                    unsigned int seed = tea<4>(static_cast<unsigned int>(i), 0);
+                    double sum = 0.0, sum_sq = 0.0;
+                    for (int s = 0; s < SAMPLES_PER_POINT; ++s) {
+                        const float z1 = rnd(seed);
+                        const float z2 = rnd(seed);
+                        const float u = rnd(seed);
+                        int light_idx;
+                        float selection_weight = 1.f;
+                        if (mode == 0) {
+                            light_idx = std::min(static_cast<int>(u * d_lights.size()),
+                                                 static_cast<int>(d_lights.size()) - 1);
+                        } else {
+                            float pdf;
+                            light_idx = sampleLightTree(tree.data(), P, N, u, pdf);
+                            if (light_idx >= 0) selection_weight = 1.f / (pdf * d_lights.size());
+                        }
+
+                        float value = 0.f;
+                        LightSample sample;
+                        if (light_idx >= 0 && sampleLight(d_lights[light_idx], P, N, z1, z2, sample)) {
+                            const CpuRay shadow_ray = {P, sample.direction, 0.01f, sample.distance - 0.01f};
+                            if (!scene.occluded(shadow_ray, &cache)) {
+                                const float3 c = sample.radiance * selection_weight;
+                                value = 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+                            }
+                        }
+                        sum += value;
+                        sum_sq += static_cast<double>(value) * value;
+                    }
+                    const double point_mean = sum / SAMPLES_PER_POINT;
+                    thread_mean[t] += point_mean;
+                    thread_variance[t] += std::max(0.0, sum_sq / SAMPLES_PER_POINT - point_mean * point_mean);
+                }
+            });
+        }
+        for (auto &thread: threads) thread.join();
+        t1 = std::chrono::steady_clock::now();
+
+        seconds[mode] = std::chrono::duration<double>(t1 - t0).count();
+        mean[mode] = variance[mode] = 0.0;
+        for (unsigned int t = 0; t < num_threads; ++t) {
+            mean[mode] += thread_mean[t] / points.size();
+            variance[mode] += thread_variance[t] / points.size();
+        }
+        std::cout << std::setw(12) << mode_names[mode] << ": mean " << std::scientific << std::setprecision(4)
+                  << mean[mode] << ", variance per sample " << variance[mode] << ", " << std::fixed
+                  << std::setprecision(1) << seconds[mode] * 1e9 / (points.size() * SAMPLES_PER_POINT)
+                  << " ns/sample" << std::endl;
+    }
+    if (variance[1] > 0.0 && seconds[1] > 0.0) {
+        std::cout << "Variance reduction " << std::setprecision(2) << variance[0] / variance[1]
+                  << "x, efficiency (1 / (variance * time)) " << variance[0] * seconds[0] / (variance[1] * seconds[1])
+                  << "x" << std::endl;
+    }
+    const bool agree = std::abs(mean[0] - mean[1]) <= 0.05 * std::max(mean[0], mean[1]);
+    if (!agree) std::cout << "FAIL, light selection strategies disagree on the mean" << std::endl;
+    return agree;
+}
+
+
+/*
+*   Runs the A-Trous denoiser on a noisy frame, without and with guide buffers if given,
+*   and reports PSNR / SSIM against a high sample count reference and the time per frame.
+*   files holds the noisy image and the reference, optionally followed by albedo and normal.
+*   Returns false if a denoised frame is not closer to the reference than the noisy one.
+*/
+bool benchmarkDenoiser(const std::vector<std::string> &files) {
+    const int RUNS = 10;
+    std::vector<sutil::ImageBuffer> images;
+    for (const std::string &file: files) {
+        images.push_back(sutil::loadImage(file.c_str(), 4));
+        if (images.back().width != images[0].width || images.back().height != images[0].height)
+            throw sutil::Exception(("Image size of " + file + " does not match " + files[0]).c_str());
+    }
+    const int w = static_cast<int>(images[0].width);
+    const int h = static_cast<int>(images[0].height);
+    const float4 *noisy = reinterpret_cast<const float4 *>(images[0].data);
+    const float4 *reference = reinterpret_cast<const float4 *>(images[1].data);
+    const float4 *albedo = images.size() > 3 ? reinterpret_cast<const float4 *>(images[2].data) : nullptr;
+    const float4 *normal = images.size() > 3 ? reinterpret_cast<const float4 *>(images[3].data) : nullptr;
+
+    const double noisy_psnr = computePSNR(noisy, reference, w * h);
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << std::setw(16) << "noisy" << ": PSNR " << noisy_psnr << " dB, SSIM "
+              << computeSSIM(noisy, reference, w, h) << std::endl;
+
+    AtrousDenoiser denoiser;
+    std::vector<float4> output(static_cast<size_t>(w) * h);
+    bool improved = true;
+    for (int guided = 0; guided < (albedo ? 2 : 1); ++guided) {
+        auto t0 = std::chrono::steady_clock::now();
+        for (int run = 0; run < RUNS; ++run)
+            denoiser.denoise(noisy, guided ? albedo : nullptr, guided ? normal : nullptr, w, h, output.data());
+        auto t1 = std::chrono::steady_clock::now();
+        const double psnr = computePSNR(output.data(), reference, w * h);
+        improved = improved && psnr > noisy_psnr;
+        std::cout << std::setw(16) << (guided ? "atrous + guides" : "atrous") << ": PSNR " << psnr << " dB, SSIM "
+                  << computeSSIM(output.data(), reference, w, h) << ", "
+                  << std::chrono::duration<double, std::milli>(t1 - t0).count() / RUNS << " ms/frame" << std::endl;
+    }
+
+    for (sutil::ImageBuffer &image: images)
+        delete[] reinterpret_cast<float4 *>(image.data);
+    if (!improved) std::cout << "FAIL, the denoiser does not bring the frame closer to the reference" << std::endl;
+    return improved;
+}
+
+static bool gpuAvailable() {
+    int device_count = 0;
+    if (cudaGetDeviceCount(&device_count) != cudaSuccess || device_count == 0)
+        return false;
+    return optixInit() == OPTIX_SUCCESS;
+}
+
+/*
+*   Renders a synthetic camera path on the CPU: a slow pan with a dolly, one noisy launch
+*   per frame. The shading is a noise free diffuse term, so every frame has an exact
+*   reference. Compares restarting the accumulation on every camera change against the
+*   temporal reprojection, returns false if the reprojection is not closer to the reference.
+*   With a GPU the frames also go through the device resolve of the render loop, which has
+*   to match the host resolve.
+*/
+bool benchmarkTemporal(int num_frames) {
+    const int w = 320;
+    const int h = std::max(1, w * height / width);
+    const size_t num_pixels = static_cast<size_t>(w) * h;
+    const float4 *vertices = reinterpret_cast<const float4 *>(d_vertices.data());
+
+    CpuBvh bvh;
+    bvh.build(vertices, d_vertices.size() / 3);
+
+    ReprojectionCamera view;
+    camera.setAspectRatio(static_cast<float>(w) / static_cast<float>(h));
+    view.eye = camera.eye();
+    camera.UVWFrame(view.U, view.V, view.W);
+    const float3 up = normalize(view.V);
+    const float3 light_dir = normalize(make_float3(0.3f, 1.f, 0.2f));
+
+    std::vector<float4> reference(num_pixels), noisy(num_pixels), normal(num_pixels), resolved(num_pixels);
+    std::vector<float> depth(num_pixels);
+    TemporalReprojection temporal;
+    double psnr_restart = 0.0, psnr_temporal = 0.0, coverage = 0.0, resolve_ms = 0.0;
+
+    const bool use_gpu = gpuAvailable();
+    float4 *d_accum = nullptr, *d_normal = nullptr, *d_output = nullptr;
+    float *d_depth = nullptr;
+    TemporalDeviceBuffers device_buffers;
+    cudaEvent_t device_start = nullptr, device_stop = nullptr;
+    std::vector<float4> device_resolved(num_pixels);
+    double psnr_device = 0.0, device_ms = 0.0;
+    if (use_gpu) {
+        CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>(&d_accum), num_pixels * sizeof(float4)));
+        CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>(&d_normal), num_pixels * sizeof(float4)));
+        CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>(&d_output), num_pixels * sizeof(float4)));
+        CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>(&d_depth), num_pixels * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>(&device_buffers.frame), num_pixels * sizeof(float4)));
+        CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>(&device_buffers.depth), num_pixels * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>(&device_buffers.normal), num_pixels * sizeof(float3)));
+        CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>(&device_buffers.history), num_pixels * sizeof(float4)));
+        CUDA_CHECK(cudaMemset(device_buffers.history, 0, num_pixels * sizeof(float4)));
+        CUDA_CHECK(cudaEventCreate(&device_start));
+        CUDA_CHECK(cudaEventCreate(&device_stop));
+    }
+    ReprojectionCamera device_camera = view;
+    unsigned int seed = tea<4>(num_frames, 7);
+    for (int frame = 0; frame < num_frames; ++frame) {
+        const float3 U_n = normalize(view.U), V_n = normalize(view.V), W_n = normalize(view.W);
+        for (int y = 0; y < h; ++y) {
+            for (int x = 0; x < w; ++x) {
+                const int i = y * w + x;
+                const float2 d = 2.0f * make_float2((x + 0.5f) / w, (y + 0.5f) / h) - 1.0f;
+                const CpuRay ray = {view.eye, normalize(d.x * view.U + d.y * view.V + view.W), 0.01f, 1e16f};
+                CpuHit hit;
+                if (!bvh.intersect(ray, hit)) {
+                    reference[i] = noisy[i] = make_float4(0.f, 0.f, 0.f, 1.f);
+                    normal[i] = make_float4(0.f);
+                    depth[i] = 0.f;
+                    continue;
+                }
+                const float3 v0 = make_float3(vertices[3 * hit.prim + 0]);
+                const float3 v1 = make_float3(vertices[3 * hit.prim + 1]);
+                const float3 v2 = make_float3(vertices[3 * hit.prim + 2]);
+                const float3 N_0 = normalize(cross(v1 - v0, v2 - v0));
+                const float3 N = faceforward(N_0, -ray.direction, N_0);
+                const uint32_t mat = d_material_indices[hit.prim];
+                const float3 albedo = d_mat_types[mat] == EMISSIVE ? make_float3(1.f) : d_diffuse_colors[mat];
+                const float3 shade = albedo * (0.2f + 0.6f * std::max(0.f, dot(N, light_dir)));
+
+                // Exponentially distributed noise with mean one, heavy tailed like a few path samples
+                const float noise = -logf(std::max(1.f - rnd(seed), 1e-6f));
+                reference[i] = make_float4(shade, 1.f);
+                noisy[i] = make_float4(shade * noise, 1.f);
+                normal[i] = make_float4(dot(N, U_n), dot(N, V_n), dot(N, W_n), 0.f);
+                depth[i] = hit.t;
+            }
+        }
+
+        auto t0 = std::chrono::steady_clock::now();
+        temporal.resolve(noisy.data(), depth.data(), normal.data(), w, h, view, frame > 0, resolved.data());
+        auto t1 = std::chrono::steady_clock::now();
+        resolve_ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+        psnr_restart += computePSNR(noisy.data(), reference.data(), num_pixels);
+        psnr_temporal += computePSNR(resolved.data(), reference.data(), num_pixels);
+        coverage += temporal.historyCoverage();
+
+        if (use_gpu) {
+            // Only the kernels are timed, the render loop resolves the launch buffers in place
+            CUDA_CHECK(cudaMemcpy(d_accum, noisy.data(), num_pixels * sizeof(float4), cudaMemcpyHostToDevice));
+            CUDA_CHECK(cudaMemcpy(d_normal, normal.data(), num_pixels * sizeof(float4), cudaMemcpyHostToDevice));
+            CUDA_CHECK(cudaMemcpy(d_depth, depth.data(), num_pixels * sizeof(float), cudaMemcpyHostToDevice));
+            CUDA_CHECK(cudaEventRecord(device_start));
+            resolveTemporalOnDevice(d_accum, d_depth, d_normal, w, h, view, device_camera, frame > 0,
+                                    temporal.settings, device_buffers, d_output, 0);
+            CUDA_CHECK(cudaEventRecord(device_stop));
+            CUDA_CHECK(cudaEventSynchronize(device_stop));
+            float ms = 0.f;
+            CUDA_CHECK(cudaEventElapsedTime(&ms, device_start, device_stop));
+            device_ms += ms;
+            device_camera = view;
+            CUDA_CHECK(cudaMemcpy(device_resolved.data(), d_output, num_pixels * sizeof(float4),
+                                  cudaMemcpyDeviceToHost));
+            psnr_device += computePSNR(device_resolved.data(), reference.data(), num_pixels);
+        }
+
+        // Pan by a quarter degree around the up axis and move forward a little
+        const float angle = 0.25f * M_PIf / 180.f;
+        const float c = cosf(angle), s = sinf(angle);
+        const auto rotate = [&](const float3 &v) {
+            return v * c + cross(up, v) * s + up * dot(up, v) * (1.f - c);
+        };
+        view.U = rotate(view.U);
+        view.V = rotate(view.V);
+        view.W = rotate(view.W);
+        view.eye += 0.002f * view.W;
+    }
+
+    std::cout << std::fixed << std::setprecision(2) << num_frames << " frames at " << w << "x" << h << std::endl;
+    std::cout << "  restart on camera change: PSNR " << psnr_restart / num_frames << " dB" << std::endl;
+    std::cout << "  temporal reprojection   : PSNR " << psnr_temporal / num_frames << " dB, history coverage "
+              << 100.0 * coverage / std::max(1, num_frames - 1) << "%, " << resolve_ms / num_frames
+              << " ms/frame on the host" << std::endl;
+    bool passed = psnr_temporal > psnr_restart;
+    if (!passed) std::cout << "FAIL, the reprojection is no closer to the reference than restarting" << std::endl;
+    if (use_gpu) {
+        std::cout << "  device resolve          : PSNR " << psnr_device / num_frames << " dB, " << device_ms / num_frames
+                  << " ms/frame" << std::endl;
+        // Contracted multiply-adds on the device may flip single depth or normal tests of the warp
+        if (std::fabs(psnr_device - psnr_temporal) > 0.05 * num_frames) {
+            std::cout << "FAIL, the device resolve does not match the host resolve" << std::endl;
+            passed = false;
+        }
+        CUDA_CHECK(cudaEventDestroy(device_start));
+        CUDA_CHECK(cudaEventDestroy(device_stop));
+        for (void *buffer: {static_cast<void *>(d_accum), static_cast<void *>(d_normal),
+                            static_cast<void *>(d_output), static_cast<void *>(d_depth),
+                            static_cast<void *>(device_buffers.frame), static_cast<void *>(device_buffers.depth),
+                            static_cast<void *>(device_buffers.normal), static_cast<void *>(device_buffers.history)})
+            CUDA_CHECK(cudaFree(buffer));
+    } else {
+        std::cout << "  no GPU, the device resolve of the render loop is not checked" << std::endl;
+    }
+    return passed;
+}
+
+namespace {
+    // Tokenization of the previous readSceneFile(), a stringstream per line and per vector
+    void legacyParseLine(const std::string &line, double &checksum) {
+        std::stringstream tokenizer(line);
+        std::string token;
+        std::vector<std::string> tokens;
+        while (std::getline(tokenizer, token, ' ')) {
+            tokens.push_back(token);
+        }
+        if (tokens.size() != 7 || tokens[0] != "GEOMETRY") return;
+        checksum += atoi(tokens[2].c_str());
+        for (size_t i = 3; i < 6; ++i) {
+            std::vector<float> values;
+            std::stringstream vec3_tokenizer(tokens[i]);
+            std::string float_token;
+            while (std::getline(vec3_tokenizer, float_token, ',')) {
+                values.push_back(atof(float_token.c_str()));
+            }
+            if (values.size() == 3)
+                checksum += values[0] + values[1] + values[2];
+        }
+    }
+}
+
+/*
+*   Writes a synthetic scene with num_lines lines, mostly GEOMETRY lines like an instancing
+*   heavy generated scene, and times tokenizing and number parsing of the previous
+*   stringstream parser against the SceneFile tokenizer. Geometry is not created. Fails
+*   when the two parsers read different values.
+*/
+bool benchmarkSceneParser(int num_lines) {
+    const std::string filename = "bench_parse_scene.txt";
+    {
+        std::ofstream out(filename.c_str());
+        out << "CAMERA 1000 768 0,5,15 0,5,0 0,1,0 45\n";
+        out << "MATERIAL DIFFUSE 0.8,0.05,0.05 0,0,0 0,0,0 0 0\n";
+        out << std::fixed << std::setprecision(4);
+        unsigned int seed = tea<4>(num_lines, 11);
+        for (int i = 2; i < num_lines; ++i) {
+            out << "GEOMETRY CUBE 0 " << 100.f * rnd(seed) - 50.f << "," << 100.f * rnd(seed) << ","
+                << -100.f * rnd(seed) << " 0," << 360.f * rnd(seed) << ",0 " << 0.5f + rnd(seed) << ","
+                << 0.5f + rnd(seed) << "," << 0.5f + rnd(seed) << " -\n";
+        }
+    }
+
+    const int RUNS = 5;
+    double legacy_ms = 1e30, tokenizer_ms = 1e30;
+    double legacy_checksum = 0.0, tokenizer_checksum = 0.0;
+    for (int run = 0; run < RUNS; ++run) {
+        legacy_checksum = 0.0;
+        auto t0 = std::chrono::steady_clock::now();
+        std::ifstream in(filename.c_str());
+        std::string text_line;
+        while (std::getline(in, text_line)) {
+            legacyParseLine(text_line, legacy_checksum);
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        legacy_ms = std::min(legacy_ms, std::chrono::duration<double, std::milli>(t1 - t0).count());
+
+        tokenizer_checksum = 0.0;
+        t0 = std::chrono::steady_clock::now();
+        SceneFile file;
+        file.open(filename);
+        SceneLine line;
+        while (file.nextLine(line)) {
+            if (line.count != 7 || line.tokens[0] != "GEOMETRY") continue;
+            int id;
+            if (parseSceneInt(line.tokens[2], id)) tokenizer_checksum += id;
+            for (int i = 3; i < 6; ++i) {
+                float3 v;
+                if (parseSceneVec3(line.tokens[i], v)) tokenizer_checksum += v.x + v.y + v.z;
+            }
+        }
+        t1 = std::chrono::steady_clock::now();
+        tokenizer_ms = std::min(tokenizer_ms, std::chrono::duration<double, std::milli>(t1 - t0).count());
+    }
+    std::remove(filename.c_str());
+
+    std::cout << std::fixed << std::setprecision(2) << num_lines << " lines, best of " << RUNS << std::endl;
+    std::cout << "  stringstream: " << legacy_ms << " ms (" << num_lines / legacy_ms << " lines/ms)" << std::endl;
+    std::cout << "  tokenizer   : " << tokenizer_ms << " ms (" << num_lines / tokenizer_ms << " lines/ms), "
+              << legacy_ms / tokenizer_ms << "x" << std::endl;
+    if (std::fabs(legacy_checksum - tokenizer_checksum) > 1e-6 * std::fabs(legacy_checksum)) {
+        std::cout << "FAIL, parsed values differ (" << legacy_checksum << " vs " << tokenizer_checksum << ")"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Mesh files the scene references that do not exist, loadMesh() exits on those
+static std::string missingSceneFiles(const std::string &scene_file) {
+    SceneFile file;
+    SceneLine line;
+    std::string missing;
+    if (!file.open(scene_file)) return missing;
+    while (file.nextLine(line)) {
+        if (line.count != 7 || (line.tokens[0] != "GEOMETRY" && line.tokens[0] != "INSTANCE") ||
+            line.tokens[1] != "MESH")
+            continue;
+        const std::string obj_file = line.tokens[6].str();
+        if (!std::ifstream(obj_file.c_str()))
+            missing += (missing.empty() ? "" : " ") + obj_file;
+    }
+    return missing;
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+static std::string jsonEscape(const std::string &text) {
+    std::string escaped;
+    for (char c: text) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+// --bench-width or the scene's size, capped on the CPU, with the scene's aspect ratio
+static void benchImageSize(bool use_gpu, int &w, int &h) {
+    w = width;
+    h = height;
+    const int max_width = bench_width > 0 ? bench_width : (use_gpu ? w : std::min(w, CPU_BENCH_MAX_WIDTH));
+    if (w != max_width) {
+        h = std::max(1, h * max_width / w);
+        w = max_width;
+    }
+}
+
+/*
+*   Renders bench_subframes subframes of a scene without a window and appends one JSON
+*   object per line to out_file. Subframe indices start at 0 after one warm-up launch, so
+*   every run traces the same paths. Peak RSS is the process high-water mark, run one scene
+*   per process to compare it between scenes. Returns false if the last subframe has pixels
+*   that are not finite; a scene skipped for missing files passes.
+*/
+bool benchmarkScene(std::string &scene_file, const std::string &out_file) {
+    std::ofstream out(out_file.c_str(), std::ios::app);
+    if (!out)
+        throw std::runtime_error("Could not open " + out_file);
+    const std::string name = scene_file.substr(scene_file.find_last_of("/\\") + 1);
+    out << "{\"scene\":\"" << jsonEscape(name) << "\"";
+
+    const std::string missing = missingSceneFiles(scene_file);
+    if (!missing.empty()) {
+        out << ",\"error\":\"missing " << jsonEscape(missing) << "\"}" << std::endl;
+        std::cerr << name << ": skipped, missing " << missing << std::endl;
+        return true;
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    loadScene(scene_file);
+    auto t1 = std::chrono::steady_clock::now();
+    const double load_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+    const bool use_gpu = bench_backend == BENCH_BACKEND_GPU || (bench_backend == BENCH_BACKEND_AUTO && gpuAvailable());
+    int w, h;
+    benchImageSize(use_gpu, w, h);
+
+    double build_ms = 0.0, first_frame_ms = 0.0;
+    std::vector<double> frame_ms;
+    bool finite = true;
+    const auto checkFinite = [&finite](const float4 *pixels, size_t num_pixels) {
+        for (size_t i = 0; finite && i < num_pixels; ++i)
+            finite = std::isfinite(pixels[i].x) && std::isfinite(pixels[i].y) && std::isfinite(pixels[i].z);
+    };
+    if (use_gpu) {
+        PathTracerState state;
+        state.params.width = w;
+        state.params.height = h;
+        state.params.denoiser = 0u;
+        createContext(state);
+        t0 = std::chrono::steady_clock::now();
+        buildMeshAccel(state);
+        t1 = std::chrono::steady_clock::now();
+        build_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+        createModule(state);
+        createProgramGroups(state);
+        createPipeline(state);
+        if (MODEL && !MODEL->textures.empty()) {
+            createTextures();
+        }
+        createSBT(state);
+        initLaunchParams(state);
+        handleCameraUpdate(state.params);
+        if (prepared_scene_stale) savePreparedScene(prepared_scene_file, &state, nullptr);
+
+        {
+            sutil::CUDAOutputBuffer<float4> output_buffer(sutil::CUDAOutputBufferType::CUDA_DEVICE, w, h);
+            for (int i = -1; i < bench_subframes; ++i) {
+                state.params.subframe_index = std::max(i, 0);
+                t0 = std::chrono::steady_clock::now();
+                launchSubframe(output_buffer, state);
+                t1 = std::chrono::steady_clock::now();
+                const double ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+                if (i < 0)
+                    first_frame_ms = ms;
+                else
+                    frame_ms.push_back(ms);
+            }
+            checkFinite(output_buffer.getHostPointer(), static_cast<size_t>(w) * h);
+        }
+        // The textures and device buffers of this scene must not stay behind for the next one
+        cleanupState(state);
+    } else {
+        CpuScene scene;
+        t0 = std::chrono::steady_clock::now();
+        buildCpuScene(scene);
+        t1 = std::chrono::steady_clock::now();
+        build_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+        if (prepared_scene_stale) savePreparedScene(prepared_scene_file, nullptr, &scene.bvh);
+
+        CpuFrame frame;
+        initCpuFrame(frame, w, h);
+
+        CpuRenderer renderer;
+        for (int i = -1; i < bench_subframes; ++i) {
+            frame.params.subframe_index = std::max(i, 0);
+            t0 = std::chrono::steady_clock::now();
+            renderer.launch(scene, frame.params);
+            t1 = std::chrono::steady_clock::now();
+            const double ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+            if (i < 0)
+                first_frame_ms = ms;
+            else
+                frame_ms.push_back(ms);
+        }
+        checkFinite(frame.frame.data(), frame.frame.size());
+    }
+
+    double total_ms = 0.0;
+    for (double ms: frame_ms) total_ms += ms;
+    std::sort(frame_ms.begin(), frame_ms.end());
+    const double samples = static_cast<double>(w) * h * samples_per_launch * frame_ms.size();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    out << std::fixed << std::setprecision(3)
+        << ",\"backend\":\"" << (use_gpu ? "gpu" : "cpu") << "\""
+        << ",\"width\":" << w << ",\"height\":" << h
+        << ",\"subframes\":" << frame_ms.size() << ",\"samples_per_launch\":" << samples_per_launch
+        << ",\"triangles\":" << d_vertices.size() / 3 << ",\"lights\":" << d_lights.size()
+        << ",\"load_ms\":" << load_ms << ",\"build_ms\":" << build_ms
+        << ",\"first_frame_ms\":" << first_frame_ms
+        << ",\"samples_per_sec\":" << (total_ms > 0.0 ? samples / (total_ms * 1e-3) : 0.0)
+        << ",\"frame_ms\":{\"mean\":" << (frame_ms.empty() ? 0.0 : total_ms / frame_ms.size())
+        << ",\"p50\":" << percentile(frame_ms, 0.50) << ",\"p95\":" << percentile(frame_ms, 0.95)
+        << ",\"p99\":" << percentile(frame_ms, 0.99) << ",\"max\":" << (frame_ms.empty() ? 0.0 : frame_ms.back())
+        << "},\"peak_rss_mb\":" << usage.ru_maxrss / 1024.0 << ",\"finite\":" << (finite ? "true" : "false")
+        << "}" << std::endl;
+    std::cout << name << ": " << (use_gpu ? "gpu" : "cpu") << " " << w << "x" << h << ", "
+              << percentile(frame_ms, 0.50) << " ms/subframe (p50)" << (finite ? "" : ", FAIL, pixels not finite")
+              << std::endl;
+    return finite;
+}
+
+/*
+*   Golden image regression of the integrator: renders a small, fixed version of the scene
+*   on the CPU path, where every pixel is seeded with tea<4> from subframe 0, and compares
+*   the result to golden/<scene>.exr next to the scene file. The reference is stored as half
+*   floats, so an unchanged integrator lands far above the thresholds while a different
+*   estimator (sampling, roulette, Fresnel branches, missed hits) drops to noise level.
+*   Returns false when the image no longer matches, or when there is no reference to compare
+*   to; a fresh checkout has none until they are bootstrapped.
+*/
+bool checkGoldenImage(std::string &scene_file, GoldenMode mode) {
+    const std::string::size_type slash = scene_file.find_last_of("/\\");
+    const std::string dir = slash == std::string::npos ? "." : scene_file.substr(0, slash);
+    std::string name = scene_file.substr(slash == std::string::npos ? 0 : slash + 1);
+    name = name.substr(0, name.find_last_of('.'));
+    const std::string golden_file = dir + "/golden/" + name + ".exr";
+
+    const std::string missing = missingSceneFiles(scene_file);
+    if (!missing.empty()) {
+        std::cout << name << ": SKIP, missing " << missing << std::endl;
+        return true;
+    }
+    const bool have_reference = static_cast<bool>(std::ifstream(golden_file.c_str()));
+    if (mode == GOLDEN_COMPARE && !have_reference) {
+        std::cerr << name << ": SETUP ERROR, there is no reference image " << golden_file << ". Render the "
+                  << "references once on a known good build with the golden_bootstrap target (or --golden-bootstrap)"
+                  << " and commit them." << std::endl;
+        return false;
+    }
+    const bool update = mode == GOLDEN_UPDATE || (mode == GOLDEN_BOOTSTRAP && !have_reference);
+    readSceneFile(scene_file);
+
+    const int w = GOLDEN_WIDTH;
+    const int h = std::max(1, height * GOLDEN_WIDTH / width);
+    CpuScene scene;
+    buildCpuScene(scene);
+    CpuFrame frame;
+    initCpuFrame(frame, w, h);
+    frame.params.samples_per_launch = GOLDEN_SAMPLES_PER_LAUNCH;
+
+    CpuRenderer renderer;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < GOLDEN_SUBFRAMES; ++i) {
+        frame.params.subframe_index = i;
+        renderer.launch(scene, frame.params);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    const double render_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+    sutil::ImageBuffer image;
+    image.data = frame.frame.data();
+    image.width = w;
+    image.height = h;
+    image.pixel_format = sutil::BufferImageFormat::FLOAT4;
+    std::cout << std::fixed << std::setprecision(2);
+    if (update) {
+        sutil::saveImage(golden_file.c_str(), image, true);
+        std::cout << name << ": wrote " << golden_file << " (" << render_ms << " ms)" << std::endl;
+        return true;
+    }
+
+    sutil::ImageBuffer reference = sutil::loadImage(golden_file.c_str(), 4);
+    const float4 *expected = reinterpret_cast<const float4 *>(reference.data);
+    bool pass = reference.width == static_cast<unsigned int>(w) && reference.height == static_cast<unsigned int>(h);
+    double psnr = 0.0, ssim = 0.0;
+    if (pass) {
+        psnr = computePSNR(frame.frame.data(), expected, frame.frame.size());
+        ssim = computeSSIM(frame.frame.data(), expected, w, h);
+        pass = psnr >= GOLDEN_MIN_PSNR && ssim >= GOLDEN_MIN_SSIM;
+    }
+    delete[] reinterpret_cast<float4 *>(reference.data);
+
+    std::cout << name << ": " << (pass ? "PASS" : "FAIL");
+    if (reference.width != static_cast<unsigned int>(w) || reference.height != static_cast<unsigned int>(h)) {
+        std::cout << ", reference is " << reference.width << "x" << reference.height << " instead of " << w << "x" << h;
+    } else {
+        std::cout << ", PSNR " << psnr << " dB (min " << GOLDEN_MIN_PSNR << "), SSIM " << std::setprecision(4) << ssim
+                  << " (min " << GOLDEN_MIN_SSIM << ")" << std::setprecision(2);
+    }
+    std::cout << ", " << render_ms << " ms for " << GOLDEN_SUBFRAMES << " subframes at " << w << "x" << h << std::endl;
+    return pass;
+}
+
+/*
+*   Applies num_deltas random scene updates to the loaded scene (object moves, removes and
+*   adds, material edits, light moves), each committed on its own like an interactive edit,
+*   and compares their latency to rebuilding the whole scene. Runs on the GPU when one is
+*   available, otherwise on the CPU scene, where the updated scene is also checked against
+*   a full rebuild. Returns false when it differs.
+*/
+bool benchmarkSceneUpdates(int num_deltas) {
+    // Bounds of the scene, objects are moved around inside them
+    float3 bmin = make_float3(1e30f), bmax = make_float3(-1e30f);
+    for (const Vertex &v: d_vertices) {
+        bmin = fminf(bmin, make_float3(v.x, v.y, v.z));
+        bmax = fmaxf(bmax, make_float3(v.x, v.y, v.z));
+    }
+    if (bmin.x > bmax.x) {
+        bmin = make_float3(-1.f);
+        bmax = make_float3(1.f);
+    }
+    const float3 extent = bmax - bmin;
+
+    int diffuse_mat = -1;
+    for (int i = 0; i < MAT_COUNT && diffuse_mat < 0; ++i)
+        if (d_mat_types[i] != EMISSIVE) diffuse_mat = i;
+    if (diffuse_mat < 0) {
+        std::cout << "The scene has no material to place objects with" << std::endl;
+        return false;
+    }
+    // Scenes without INSTANCE lines get a few objects to move
+    if (scene_instances.empty()) {
+        for (int i = 0; i < 16; ++i) {
+            const glm::vec3 pos(bmin.x + extent.x * (i % 4 + 0.5f) / 4.f, bmin.y + extent.y * 0.25f,
+                                bmin.z + extent.z * (i / 4 + 0.5f) / 4.f);
+            addSceneInstance(i % 2 ? CUBE : ICOSPHERE, diffuse_mat, pos, glm::vec3(0.f),
+                             glm::vec3(0.05f * fmaxf(extent.x, fmaxf(extent.y, extent.z))), "");
+        }
+    }
+    scene_updates = SceneUpdates();
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+    const auto randomObject = [&]() {
+        uint32_t id;
+        do {
+            id = static_cast<uint32_t>(rng() % scene_instances.size());
+        } while (!scene_instances[id].visible);
+        return id;
+    };
+    const auto applyDelta = [&]() {
+        const float kind = uniform(rng);
+        if (kind < 0.5f) {
+            // Keep the scale, new position and rotation about y
+            const uint32_t id = randomObject();
+            const float *m = scene_instances[id].transform;
+            const glm::vec3 s(glm::length(glm::vec3(m[0], m[4], m[8])), glm::length(glm::vec3(m[1], m[5], m[9])),
+                              glm::length(glm::vec3(m[2], m[6], m[10])));
+            const glm::vec3 pos(bmin.x + extent.x * uniform(rng), bmin.y + extent.y * uniform(rng),
+                                bmin.z + extent.z * uniform(rng));
+            transformSceneObject(id, pos, glm::vec3(0.f, 360.f * uniform(rng), 0.f), s);
+        } else if (kind < 0.75f) {
+            // Replace an object by one of the same mesh, which reuses its slot
+            const uint32_t id = randomObject();
+            const Instance instance = scene_instances[id];
+            const std::string &key = mesh_cache[instance.mesh].key;
+            const Geom type = key == "CUBE" ? CUBE : (key == "ICOSPHERE" ? ICOSPHERE : MESH);
+            const std::vector<uint32_t> &materials = instance_bindings[instance.binding].materials;
+            removeSceneObject(id);
+            const glm::vec3 pos(instance.transform[3], instance.transform[7], instance.transform[11]);
+            addSceneObject(type, static_cast<int>(materials[0]), pos, glm::vec3(0.f, 360.f * uniform(rng), 0.f),
+                           glm::vec3(glm::length(glm::vec3(instance.transform[0], instance.transform[4],
+                                                           instance.transform[8]))), type == MESH ? key : "");
+        } else if (kind < 0.9f || d_lights.empty()) {
+            const int mat = static_cast<int>(rng() % MAT_COUNT);
+            updateSceneMaterial(mat, make_float3(uniform(rng), uniform(rng), uniform(rng)), d_spec_colors[mat],
+                                d_emission_colors[mat], d_spec_exp[mat], d_ior[mat]);
+        } else {
+            const float3 offset = 0.01f * extent * make_float3(uniform(rng) - 0.5f, 0.f, uniform(rng) - 0.5f);
+            moveSceneLight(static_cast<uint32_t>(rng() % d_lights.size()), offset);
+        }
+    };
+
+    const bool use_gpu = bench_backend == BENCH_BACKEND_GPU || (bench_backend == BENCH_BACKEND_AUTO && gpuAvailable());
+    const int num_rebuilds = 8;
+    std::vector<double> update_ms, rebuild_ms;
+    bool matches = true;
+    if (use_gpu) {
+        PathTracerState state;
+        state.params.width = width;
+        state.params.height = height;
+        state.params.denoiser = 0u;
+        createContext(state);
+        buildMeshAccel(state);
+        createModule(state);
+        createProgramGroups(state);
+        createPipeline(state);
+        if (MODEL && !MODEL->textures.empty()) {
+            createTextures();
+        }
+        createSBT(state);
+        initLaunchParams(state);
+        CUDA_SYNC_CHECK();
+
+        for (int i = 0; i < num_deltas; ++i) {
+            const auto t0 = std::chrono::steady_clock::now();
+            applyDelta();
+            commitSceneUpdates(state);
+            CUDA_SYNC_CHECK();
+            const auto t1 = std::chrono::steady_clock::now();
+            update_ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+        }
+        for (int i = 0; i < num_rebuilds; ++i) {
+            const auto t0 = std::chrono::steady_clock::now();
+            rebuildScene(state);
+            CUDA_SYNC_CHECK();
+            const auto t1 = std::chrono::steady_clock::now();
+            rebuild_ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+        }
+        cleanupState(state);
+    } else {
+        CpuScene scene;
+        buildCpuScene(scene);
+        const int w = 64, h = std::max(1, 64 * height / std::max(1, width));
+        CpuFrame frame;
+        initCpuFrame(frame, w, h);
+
+        for (int i = 0; i < num_deltas; ++i) {
+            const auto t0 = std::chrono::steady_clock::now();
+            applyDelta();
+            commitCpuSceneUpdates(scene, frame);
+            const auto t1 = std::chrono::steady_clock::now();
+            update_ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+        }
+        CpuScene rebuilt;
+        for (int i = 0; i < num_rebuilds; ++i) {
+            const auto t0 = std::chrono::steady_clock::now();
+            rebuilt = CpuScene();
+            buildCpuScene(rebuilt);
+            const auto t1 = std::chrono::steady_clock::now();
+            rebuild_ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+        }
+
+        // The updated scene has to render exactly like one built from scratch
+        CpuRenderer renderer;
+        frame.params.subframe_index = 0;
+        renderer.launch(scene, frame.params);
+        const std::vector<float4> updated = frame.frame;
+        CpuFrame reference;
+        initCpuFrame(reference, w, h);
+        renderer.launch(rebuilt, reference.params);
+        matches = memcmp(updated.data(), reference.frame.data(), updated.size() * sizeof(float4)) == 0;
+    }
+
+    std::sort(update_ms.begin(), update_ms.end());
+    std::sort(rebuild_ms.begin(), rebuild_ms.end());
+    double total_ms = 0.0;
+    for (double ms: update_ms) total_ms += ms;
+    const double mean_ms = total_ms / std::max<size_t>(1, update_ms.size());
+    const double rebuild_p50 = percentile(rebuild_ms, 0.5);
+    std::cout << std::fixed << std::setprecision(3) << (use_gpu ? "gpu" : "cpu") << ": " << update_ms.size()
+              << " scene updates on " << scene_instances.size() << " objects, " << d_lights.size() << " lights, "
+              << d_vertices.size() / 3 << " triangles" << std::endl;
+    std::cout << "  update + commit: mean " << mean_ms << " ms, p50 " << percentile(update_ms, 0.5) << " ms, p95 "
+              << percentile(update_ms, 0.95) << " ms, p99 " << percentile(update_ms, 0.99) << " ms, max "
+              << (update_ms.empty() ? 0.0 : update_ms.back()) << " ms" << std::endl;
+    std::cout << "  full rebuild:    p50 " << rebuild_p50 << " ms (" << num_rebuilds << " runs), "
+              << std::setprecision(1) << rebuild_p50 / std::max(mean_ms, 1e-6) << "x the mean update" << std::endl;
+    if (!use_gpu)
+        std::cout << "  updated scene " << (matches ? "renders like" : "DIFFERS from") << " a full rebuild" << std::endl;
+    return matches;
+}
+
+/*
+*   Stand-in for a remote viewer of a render session. It checks the frames it receives on
+*   the render thread, and steers the camera from a thread of its own when interactive.
+*/
+class StandInClient : public FrameSink {
+public:
+    void sendFrame(const RenderSession &session, const float4 *pixels, int w, int h) override {
+        bool ok = w == session.width() && h == session.height();
+        for (size_t i = 0; ok && i < static_cast<size_t>(w) * h; ++i)
+            ok = std::isfinite(pixels[i].x) && std::isfinite(pixels[i].y) && std::isfinite(pixels[i].z);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_frames;
+        if (!ok) ++m_bad_frames;
+        m_last_frame.assign(pixels, pixels + static_cast<size_t>(w) * h);
+    }
+
+    // Orbits the camera of session around its look at point until stop is set
+    void steer(RenderSession &session, const std::atomic<bool> &stop) {
+        while (!stop) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            sutil::Camera view = session.camera();
+            const glm::vec3 offset(view.eye().x - view.lookat().x, view.eye().y - view.lookat().y,
+                                   view.eye().z - view.lookat().z);
+            const glm::vec3 rotated = glm::vec3(glm::rotate(0.05f, glm::vec3(0.f, 1.f, 0.f)) * glm::vec4(offset, 0.f));
+            view.setEye(view.lookat() + make_float3(rotated.x, rotated.y, rotated.z));
+            session.setCamera(view);
+        }
+    }
+
+    uint64_t frames() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_frames;
+    }
+
+    uint64_t badFrames() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_bad_frames;
+    }
+
+    std::vector<float4> lastFrame() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_last_frame;
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    uint64_t m_frames = 0;
+    uint64_t m_bad_frames = 0;
+    std::vector<float4> m_last_frame;
+};
+
+/*
+*   Serves num_sessions sessions of the loaded scene from one RenderServer, each viewing it
+*   from another angle. Odd sessions are interactive, their stand-in clients keep moving the
+*   camera; even ones render bench_subframes subframes of a static view, which then have to
+*   match the same view rendered by a session of its own. Returns false if they do not, or
+*   if a client received a broken frame.
+*/
+bool benchmarkSessions(int num_sessions) {
+    CpuScene scene;
+    buildCpuScene(scene);
+    // Lights, light tree and sampling settings, the sessions bring buffers and camera
+    CpuFrame shared;
+    initCpuFrame(shared, 1, 1);
+
+    const int w = bench_width > 0 ? bench_width : std::min(width, CPU_BENCH_MAX_WIDTH / 2);
+    const int h = std::max(1, height * w / std::max(1, width));
+    const auto viewFrom = [&](int i) {
+        sutil::Camera view = camera;
+        const float angle = 2.f * static_cast<float>(M_PI) * i / num_sessions;
+        const glm::vec3 offset(camera.eye().x - camera.lookat().x, camera.eye().y - camera.lookat().y,
+                               camera.eye().z - camera.lookat().z);
+        const glm::vec3 rotated = glm::vec3(glm::rotate(angle, glm::vec3(0.f, 1.f, 0.f)) * glm::vec4(offset, 0.f));
+        view.setEye(camera.lookat() + make_float3(rotated.x, rotated.y, rotated.z));
+        return view;
+    };
+
+    RenderServer server(scene, shared.params);
+    std::vector<std::unique_ptr<StandInClient>> clients;
+    std::vector<std::shared_ptr<RenderSession>> sessions;
+    for (int i = 0; i < num_sessions; ++i) {
+        clients.emplace_back(new StandInClient());
+        sessions.push_back(server.openSession(w, h, viewFrom(i), clients.back().get()));
+        if (i % 2 == 0) sessions.back()->setSampleBudget(bench_subframes);
+    }
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> steering;
+    for (int i = 1; i < num_sessions; i += 2)
+        steering.emplace_back(&StandInClient::steer, clients[i].get(), std::ref(*sessions[i]), std::cref(stop));
+
+    // Until the static sessions spent their budget
+    const auto t0 = std::chrono::steady_clock::now();
+    size_t rounds = 0, subframes = 0;
+    const auto staticActive = [&]() {
+        for (int i = 0; i < num_sessions; i += 2)
+            if (sessions[i]->active()) return true;
+        return false;
+    };
+    while (staticActive()) {
+        subframes += server.renderRound();
+        ++rounds;
+    }
+    const auto t1 = std::chrono::steady_clock::now();
+    stop = true;
+    for (std::thread &thread: steering)
+        thread.join();
+
+    std::vector<SessionStats> stats;
+    for (const std::shared_ptr<RenderSession> &session: sessions) {
+        stats.push_back(session->stats());
+        server.closeSession(session->id());
+    }
+    const uint64_t frames_before = clients[0]->frames();
+    const bool closed = server.renderRound() == 0 && clients[0]->frames() == frames_before;
+
+    // A static view renders the same with or without other sessions
+    bool ok = closed;
+    for (int i = 0; i < num_sessions; i += 2) {
+        StandInClient reference;
+        RenderServer single(scene, shared.params);
+        std::shared_ptr<RenderSession> session = single.openSession(w, h, viewFrom(i), &reference);
+        session->setSampleBudget(bench_subframes);
+        while (single.renderRound() > 0) {}
+        const std::vector<float4> expected = reference.lastFrame();
+        const std::vector<float4> served = clients[i]->lastFrame();
+        if (served.size() != expected.size() ||
+            memcmp(served.data(), expected.data(), served.size() * sizeof(float4)) != 0) {
+            std::cout << "session " << sessions[i]->id() << " differs from rendering its view alone" << std::endl;
+            ok = false;
+        }
+    }
+
+    size_t scene_bytes = d_vertices.size() * sizeof(Vertex) + d_texcoords.size() * sizeof(float2) +
+                         d_material_indices.size() * sizeof(uint32_t) + scene.bvh.memoryUsage() +
+                         scene.instance_bvh.memoryUsage();
+    for (const CpuMesh &mesh: scene.meshes)
+        scene_bytes += mesh.bvh.memoryUsage();
+    const double seconds = std::chrono::duration<double>(t1 - t0).count();
+    std::cout << std::fixed << std::setprecision(2) << num_sessions << " sessions of " << w << "x" << h << ", "
+              << rounds << " rounds, " << subframes << " subframes in " << seconds << " s ("
+              << subframes / std::max(seconds, 1e-9) << " subframes/s)" << std::endl;
+    std::cout << "  id  kind         subframes    fps  ms/subframe  camera changes  frames  bad" << std::endl;
+    for (int i = 0; i < num_sessions; ++i) {
+        const SessionStats &s = stats[i];
+        std::cout << std::setw(4) << sessions[i]->id() << "  " << std::left << std::setw(11)
+                  << (i % 2 ? "interactive" : "static") << std::right << std::setw(11) << s.subframes
+                  << std::setw(7) << s.fps << std::setw(13) << s.render_ms / std::max<uint64_t>(1, s.subframes)
+                  << std::setw(16) << s.camera_changes << std::setw(8) << clients[i]->frames()
+                  << std::setw(5) << clients[i]->badFrames() << std::endl;
+        if (clients[i]->badFrames() > 0 || clients[i]->frames() != s.subframes) ok = false;
+    }
+    std::cout << "  scene " << scene_bytes / (1024.0 * 1024.0) << " MB held once, "
+              << sessions[0]->memoryUsage() / (1024.0 * 1024.0) << " MB per session, "
+              << num_sessions * scene_bytes / (1024.0 * 1024.0) << " MB of scene with a process per viewer"
+              << std::endl;
+    std::cout << "  " << (ok ? "all sessions passed" : "FAILED") << std::endl;
+    return ok;
+}
+
+/*
+*   One static session with four times the pixels of the others shares the CPU with
+*   interactive ones whose stand-in clients keep moving the camera, for seconds with whole
+*   subframes in turn (RenderServer::renderRound) and then for seconds with quanta handed out
+*   by SessionScheduler. Prints what every session achieved under both and the queue depth.
+*   Returns false if a static view rendered in quanta differs from the same view rendered
+*   whole, or if a client received a broken frame.
+*/
+bool benchmarkFairness(double seconds, int num_interactive) {
+    CpuScene scene;
+    buildCpuScene(scene);
+    CpuFrame shared;
+    initCpuFrame(shared, 1, 1);
+
+    const int w = bench_width > 0 ? bench_width : std::min(width, CPU_BENCH_MAX_WIDTH / 2);
+    const int h = std::max(1, height * w / std::max(1, width));
+    const int num_sessions = num_interactive + 1;
+    bool ok = true;
+
+    struct Run {
+        std::vector<SessionStats> stats;
+        double mean_depth = 0.0;
+        size_t max_depth = 0;
+        uint64_t quanta = 0, late_quanta = 0;
+    };
+    const auto run = [&](bool scheduled) {
+        RenderServer server(scene, shared.params);
+        std::vector<std::unique_ptr<StandInClient>> clients;
+        std::vector<std::shared_ptr<RenderSession>> sessions;
+        for (int i = 0; i < num_sessions; ++i) {
+            clients.emplace_back(new StandInClient());
+            sessions.push_back(server.openSession(i == 0 ? 2 * w : w, i == 0 ? 2 * h : h, camera,
+                                                  clients.back().get()));
+        }
+        std::atomic<bool> stop(false);
+        std::vector<std::thread> steering;
+        for (int i = 1; i < num_sessions; ++i)
+            steering.emplace_back(&StandInClient::steer, clients[i].get(), std::ref(*sessions[i]), std::cref(stop));
+
+        Run result;
+        const auto t0 = std::chrono::steady_clock::now();
+        const auto elapsed = [&]() {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        };
+        if (scheduled) {
+            SessionScheduler scheduler(server);
+            scheduler.start();
+            size_t samples = 0;
+            while (elapsed() < seconds) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                const SchedulerStats stats = scheduler.stats();
+                result.mean_depth += stats.queue_depth;
+                result.max_depth = std::max(result.max_depth, stats.queue_depth);
+                ++samples;
+            }
+            scheduler.stop();
+            const SchedulerStats stats = scheduler.stats();
+            result.mean_depth /= std::max<size_t>(1, samples);
+            result.quanta = stats.quanta;
+            result.late_quanta = stats.late_quanta;
+        } else {
+            while (elapsed() < seconds)
+                server.renderRound();
+        }
+        stop = true;
+        for (std::thread &thread: steering)
+            thread.join();
+        for (int i = 0; i < num_sessions; ++i) {
+            result.stats.push_back(sessions[i]->stats());
+            server.closeSession(sessions[i]->id());
+            if (clients[i]->badFrames() > 0 || clients[i]->frames() != result.stats.back().subframes) ok = false;
+        }
+        return result;
+    };
+    const Run round_robin = run(false);
+    const Run fair = run(true);
+
+    // Quanta of a subframe render the pixels a whole launch does
+    {
+        StandInClient whole, pieces;
+        RenderServer single(scene, shared.params);
+        std::shared_ptr<RenderSession> session = single.openSession(w, h, camera, &whole);
+        session->setSampleBudget(bench_subframes);
+        while (single.renderRound() > 0) {}
+
+        RenderServer scheduled_server(scene, shared.params);
+        session = scheduled_server.openSession(w, h, camera, &pieces);
+        session->setSampleBudget(bench_subframes);
+        SessionScheduler scheduler(scheduled_server);
+        scheduler.start();
+        while (session->active())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        scheduler.stop();
+        const std::vector<float4> expected = whole.lastFrame();
+        const std::vector<float4> served = pieces.lastFrame();
+        if (served.size() != expected.size() ||
+            memcmp(served.data(), expected.data(), served.size() * sizeof(float4)) != 0) {
+            std::cout << "a view rendered in quanta differs from rendering it whole" << std::endl;
+            ok = false;
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(2) << "1 static " << 2 * w << "x" << 2 * h << " and "
+              << num_interactive << " interactive " << w << "x" << h << " sessions, " << seconds
+              << " s per scheduler" << std::endl;
+    std::cout << "                      round robin                fair share" << std::endl;
+    std::cout << "  id  kind          fps  latency ms  late      fps  latency ms  late" << std::endl;
+    for (int i = 0; i < num_sessions; ++i) {
+        const SessionStats &a = round_robin.stats[i];
+        const SessionStats &b = fair.stats[i];
+        std::cout << std::setw(4) << i + 1 << "  " << std::left << std::setw(11) << (i ? "interactive" : "static")
+                  << std::right << std::setw(6) << a.fps << std::setw(12) << a.last_latency_ms << std::setw(6)
+                  << a.late_subframes << std::setw(9) << b.fps << std::setw(12) << b.last_latency_ms
+                  << std::setw(6) << b.late_subframes << std::endl;
+    }
+    std::cout << "  fair share: " << fair.quanta << " quanta of " << SCHEDULER_QUANTUM_ROWS << " rows, "
+              << fair.late_quanta << " run first past a latency target, queue depth mean " << fair.mean_depth
+              << " max " << fair.max_depth << std::endl;
+    std::cout << "  " << (ok ? "all sessions passed" : "FAILED") << std::endl;
+    return ok;
+}
+
+/*
+*   Renders bench_subframes subframes of the loaded scene once locally and once through a
+*   TileCoordinator, and checks that both frames are identical. Without --cluster-workers
+*   num_workers workers are forked on localhost, the last one replies late and the first one
+*   is killed halfway, so the fallbacks for slow and dead workers are part of the check.
+*   Returns false if the frames differ.
+*/
+bool benchmarkCluster(int num_workers) {
+    CpuScene scene;
+    buildCpuScene(scene);
+    const int w = bench_width > 0 ? bench_width : std::min(width, CPU_BENCH_MAX_WIDTH);
+    const int h = std::max(1, height * w / std::max(1, width));
+    CpuFrame local, distributed;
+    initCpuFrame(local, w, h);
+    initCpuFrame(distributed, w, h);
+    // Adaptive sampling is not distributed, every pixel gets every launch on both sides
+    local.params.adaptive_threshold = 0.f;
+    distributed.params.adaptive_threshold = 0.f;
+
+    std::vector<std::string> addresses = cluster_worker_addresses;
+    std::vector<pid_t> children;
+    if (addresses.empty()) {
+        const unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency() / std::max(1, num_workers));
+        for (int i = 0; i < num_workers; ++i) {
+            uint16_t port = 0;
+            const int listen_fd = listenTcp(0, true, &port);
+            if (listen_fd < 0) break;
+            const pid_t pid = fork();
+            if (pid == 0) {
+                // Forked with the scene already loaded, like a worker started with the same options
+                const int fd = acceptTcp(listen_fd);
+                closeSocket(listen_fd);
+                TileWorker worker(scene, local.params, num_threads);
+                if (num_workers > 1 && i == num_workers - 1) worker.setReplyDelay(CLUSTER_BENCH_REPLY_DELAY_MS);
+                worker.serve(fd);
+                _exit(0);
+            }
+            closeSocket(listen_fd);
+            if (pid < 0) break;
+            children.push_back(pid);
+            addresses.push_back(std::to_string(port));
+        }
+    }
+    TileCoordinator coordinator(scene, distributed.params);
+    for (const std::string &address: addresses)
+        if (!coordinator.addWorker(address)) std::cout << "cannot reach render worker " << address << std::endl;
+    const size_t connected = coordinator.numWorkers();
+
+    CpuRenderer renderer;
+    std::vector<double> local_ms, distributed_ms;
+    for (int i = 0; i < bench_subframes; ++i) {
+        local.params.subframe_index = i;
+        const auto t0 = std::chrono::steady_clock::now();
+        renderer.launch(scene, local.params);
+        local_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+    }
+    for (int i = 0; i < bench_subframes; ++i) {
+        if (children.size() > 1 && i == bench_subframes / 2) kill(children[0], SIGKILL);
+        distributed.params.subframe_index = i;
+        coordinator.launch(distributed.params);
+        distributed_ms.push_back(coordinator.stats().last_subframe_ms);
+    }
+    for (pid_t pid: children) {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+    }
+
+    const size_t num_pixels = static_cast<size_t>(w) * h;
+    const bool ok = memcmp(local.accum.data(), distributed.accum.data(), num_pixels * sizeof(float4)) == 0 &&
+                    memcmp(local.frame.data(), distributed.frame.data(), num_pixels * sizeof(float4)) == 0;
+    std::sort(local_ms.begin(), local_ms.end());
+    std::sort(distributed_ms.begin(), distributed_ms.end());
+    const ClusterStats &stats = coordinator.stats();
+    std::cout << std::fixed << std::setprecision(2) << connected << " render workers"
+              << (children.empty() ? "" : " on localhost, the last one slowed down, the first one killed halfway")
+              << ", " << w << "x" << h << ", " << bench_subframes << " subframes" << std::endl;
+    std::cout << "  local:       p50 " << percentile(local_ms, 0.5) << " ms/subframe" << std::endl;
+    std::cout << "  distributed: p50 " << percentile(distributed_ms, 0.5) << " ms/subframe, p95 "
+              << percentile(distributed_ms, 0.95) << " ms, " << stats.requests << " requests, " << stats.late_replies
+              << " late, " << stats.lost_workers << " workers lost, " << stats.local_tiles
+              << " tiles rendered by the coordinator" << std::endl;
+    std::cout << "               " << stats.bytes_sent / (1024.0 * 1024.0) << " MB sent, "
+              << stats.bytes_received / (1024.0 * 1024.0) << " MB received, shares";
+    for (size_t i = 0; i < coordinator.numWorkers(); ++i)
+        std::cout << " " << coordinator.workerShare(i);
+    std::cout << std::endl;
+    std::cout << "  distributed frame " << (ok ? "matches" : "DIFFERS from") << " the local one" << std::endl;
+    return ok;
+}
+
+/*
+*   Renders bench_subframes subframes of the loaded scene on the CPU at the bench width and
+*   encodes the frame the way the render loop streams it, as PPM
+*/
+static void encodeBenchFrame(std::vector<unsigned char> &ppm, int &w, int &h) {
+    CpuScene scene;
+    buildCpuScene(scene);
+    w = bench_width > 0 ? bench_width : std::min(width, CPU_BENCH_MAX_WIDTH);
+    h = std::max(1, height * w / std::max(1, width));
+    CpuFrame frame;
+    initCpuFrame(frame, w, h);
+    CpuRenderer renderer;
+    for (int i = 0; i < bench_subframes; ++i) {
+        frame.params.subframe_index = i;
+        renderer.launch(scene, frame.params);
+    }
+    sutil::ImageBuffer image;
+    image.data = frame.frame.data();
+    image.width = w;
+    image.height = h;
+    image.pixel_format = sutil::BufferImageFormat::FLOAT4;
+    sutil::encodeImage("bench.ppm", image, false, ppm);
+}
+
+/*
+*   Publishes FANOUT_BENCH_FRAMES encoded frames of the loaded scene at FANOUT_BENCH_FPS to
+*   num_viewers viewers on localhost: the last one never reads, the one before it reads one
+*   frame every FANOUT_BENCH_SLOW_VIEWER_MS and the others read as fast as they can. Each
+*   frame carries its number in its last pixel bytes. Returns false unless the fast viewers
+*   receive every frame intact and in order and the slow one intact frames in order up to
+*   the last.
+*/
+bool benchmarkFanout(int num_viewers) {
+    num_viewers = std::max(3, num_viewers);
+    int w, h;
+    std::vector<unsigned char> reference;
+    encodeBenchFrame(reference, w, h);
+    const size_t stamp = reference.size() - sizeof(uint32_t);
+
+    FrameFanout fanout;
+    uint16_t port = 0;
+    if (!fanout.listen(0, &port)) {
+        std::cout << "cannot listen for viewers" << std::endl;
+        return false;
+    }
+    struct Viewer {
+        int fd = -1;
+        uint32_t received = 0;
+        uint32_t last = 0;
+        bool intact = true;
+    };
+    std::vector<Viewer> viewers(num_viewers);
+    for (Viewer &viewer: viewers) {
+        viewer.fd = connectTcp(std::to_string(port));
+        if (viewer.fd < 0) {
+            std::cout << "cannot connect a viewer" << std::endl;
+            return false;
+        }
+    }
+    while (fanout.numSubscribers() < viewers.size())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    const int slow = num_viewers - 2;
+    std::vector<std::thread> readers;
+    for (int i = 0; i <= slow; ++i) {
+        readers.emplace_back([&, i]() {
+            Viewer &viewer = viewers[i];
+            std::vector<unsigned char> data(reference.size());
+            while (viewer.last < FANOUT_BENCH_FRAMES && recvAll(viewer.fd, data.data(), data.size())) {
+                uint32_t number;
+                memcpy(&number, data.data() + stamp, sizeof(number));
+                viewer.intact = viewer.intact && number > viewer.last &&
+                                memcmp(data.data(), reference.data(), stamp) == 0;
+                viewer.last = number;
+                ++viewer.received;
+                if (i == slow)
+                    std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(FANOUT_BENCH_SLOW_VIEWER_MS));
+            }
+        });
+    }
+
+    std::vector<double> publish_ms;
+    auto next = std::chrono::steady_clock::now();
+    for (uint32_t number = 1; number <= FANOUT_BENCH_FRAMES; ++number) {
+        std::vector<unsigned char> encoded(reference);
+        memcpy(encoded.data() + stamp, &number, sizeof(number));
+        const auto t0 = std::chrono::steady_clock::now();
+        fanout.publish(std::move(encoded));
+        publish_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+        next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(1.0 / FANOUT_BENCH_FPS));
+        std::this_thread::sleep_until(next);
+    }
+    for (std::thread &reader: readers)
+        reader.join();
+
+    bool ok = true;
+    for (int i = 0; i <= slow; ++i) {
+        const Viewer &viewer = viewers[i];
+        ok = ok && viewer.intact && viewer.last == FANOUT_BENCH_FRAMES &&
+             (i == slow || viewer.received == FANOUT_BENCH_FRAMES);
+    }
+    std::sort(publish_ms.begin(), publish_ms.end());
+    std::cout << std::fixed << std::setprecision(3) << num_viewers - 2 << " fast, 1 slow and 1 stalled viewer, "
+              << FANOUT_BENCH_FRAMES << " frames of " << reference.size() / 1024.0 << " KB at " << FANOUT_BENCH_FPS
+              << " fps" << std::endl;
+    std::cout << "  publish: p50 " << percentile(publish_ms, 0.5) << " ms, p99 " << percentile(publish_ms, 0.99)
+              << " ms, max " << publish_ms.back() << " ms" << std::endl;
+    printFanoutStats(fanout);
+    std::cout << "  slow viewer received " << viewers[slow].received << " of " << FANOUT_BENCH_FRAMES << " frames" << std::endl;
+    std::cout << "  viewers " << (ok ? "received" : "DID NOT receive") << " intact frames in order" << std::endl;
+    for (const Viewer &viewer: viewers)
+        closeSocket(viewer.fd);
+    return ok;
+}
+
+/*
+*   Times JPEG encoding of a frame of the loaded scene in one piece and in slices on every
+*   core, then fetches frames frames from an MjpegServer on localhost with a client reading
+*   the multipart stream. Returns false unless the sliced JPEG and every fetched frame decode
+*   to the pixels of the JPEG encoded in one piece, and nothing is encoded without a viewer.
+*/
+bool benchmarkMjpeg(int frames) {
+    const int ENCODE_REPEATS = 10;
+    int w, h;
+    std::vector<unsigned char> ppm;
+    encodeBenchFrame(ppm, w, h);
+    const size_t pixel_bytes = static_cast<size_t>(w) * h * 3;
+    const unsigned char *rgb = ppm.data() + ppm.size() - pixel_bytes;
+
+    const auto decode = [](const std::vector<unsigned char> &jpeg, int w, int h) {
+        int x, y, channels;
+        unsigned char *pixels = stbi_load_from_memory(jpeg.data(), static_cast<int>(jpeg.size()), &x, &y, &channels, 3);
+        std::vector<unsigned char> decoded;
+        if (pixels && x == w && y == h) decoded.assign(pixels, pixels + static_cast<size_t>(w) * h * 3);
+        stbi_image_free(pixels);
+        return decoded;
+    };
+    SliceJpegEncoder single(1), sliced;
+    std::vector<unsigned char> single_jpeg, sliced_jpeg;
+    std::vector<double> single_ms, sliced_ms;
+    for (int i = 0; i < ENCODE_REPEATS; ++i) {
+        auto t0 = std::chrono::steady_clock::now();
+        single.encode(rgb, w, h, single_jpeg);
+        auto t1 = std::chrono::steady_clock::now();
+        sliced.encode(rgb, w, h, sliced_jpeg);
+        const auto t2 = std::chrono::steady_clock::now();
+        single_ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+        sliced_ms.push_back(std::chrono::duration<double, std::milli>(t2 - t1).count());
+    }
+    const std::vector<unsigned char> reference = decode(single_jpeg, w, h);
+    bool ok = !reference.empty() && decode(sliced_jpeg, w, h) == reference;
+    std::sort(single_ms.begin(), single_ms.end());
+    std::sort(sliced_ms.begin(), sliced_ms.end());
+    const double megabytes = pixel_bytes / (1024.0 * 1024.0);
+    std::cout << std::fixed << std::setprecision(2) << w << "x" << h << " JPEG encoding, quality " << MJPEG_QUALITY
+              << std::endl;
+    std::cout << "  1 thread:   p50 " << percentile(single_ms, 0.5) << " ms, "
+              << megabytes / (percentile(single_ms, 0.5) / 1000.0) << " MB/s, " << single_jpeg.size() / 1024.0 << " KB"
+              << std::endl;
+    std::cout << "  " << sliced.numThreads() << " threads: p50 " << percentile(sliced_ms, 0.5) << " ms, "
+              << megabytes / (percentile(sliced_ms, 0.5) / 1000.0) << " MB/s, " << sliced_jpeg.size() / 1024.0 << " KB"
+              << std::endl;
+
+    MjpegServer server;
+    uint16_t port = 0;
+    if (!server.listen(0, &port)) {
+        std::cout << "cannot serve the MJPEG preview" << std::endl;
+        return false;
+    }
+    const bool encoded_without_viewer = server.submit(rgb, w, h) || server.stats().frames_encoded > 0;
+    const int fd = connectTcp(std::to_string(port));
+    const std::string request = "GET /stream.mjpg HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    if (fd < 0 || !sendAll(fd, request.data(), request.size())) {
+        std::cout << "cannot connect to the MJPEG preview" << std::endl;
+        return false;
+    }
+    while (server.numViewers() == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    // Submits like the render loop until the client has what it came for
+    std::atomic<bool> fetched(false);
+    std::thread producer([&]() {
+        while (!fetched) {
+            server.submit(rgb, w, h);
+            std::this_thread::sleep_for(std::chrono::milliseconds(16));
+        }
+    });
+    const auto t0 = std::chrono::steady_clock::now();
+    std::string stream;
+    char chunk[65536];
+    int received = 0;
+    bool intact = true;
+    while (received < frames) {
+        const ssize_t size = recv(fd, chunk, sizeof(chunk), 0);
+        if (size <= 0) break;
+        stream.append(chunk, static_cast<size_t>(size));
+        for (;;) {
+            const size_t part = stream.find("--frame\r\n");
+            const size_t body = part == std::string::npos ? part : stream.find("\r\n\r\n", part);
+            const size_t length = body == std::string::npos ? body : stream.find("Content-Length: ", part);
+            if (length == std::string::npos || length > body) break;
+            const size_t jpeg_size = strtoul(stream.c_str() + length + 16, nullptr, 10);
+            if (stream.size() < body + 4 + jpeg_size + 2) break;
+            const std::vector<unsigned char> jpeg(stream.begin() + body + 4, stream.begin() + body + 4 + jpeg_size);
+            intact = intact && decode(jpeg, w, h) == reference;
+            stream.erase(0, body + 4 + jpeg_size + 2);
+            ++received;
+        }
+    }
+    const double fetch_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    fetched = true;
+    producer.join();
+    closeSocket(fd);
+
+    const MjpegStats stats = server.stats();
+    ok = ok && !encoded_without_viewer && intact && received == frames;
+    std::cout << "  preview: " << received << " of " << frames << " frames fetched in " << fetch_s << " s, "
+              << stats.frames_encoded << " encoded, " << stats.frames_replaced << " replaced before encoding, "
+              << (encoded_without_viewer ? "ENCODED" : "nothing encoded") << " without a viewer" << std::endl;
+    std::cout << "  sliced and fetched frames " << (ok ? "decode" : "DO NOT decode")
+              << " to the pixels of the single threaded JPEG" << std::endl;
+    return ok;
+}
+
+/*
+*   Renders frames frames of the loaded scene on the CPU, one more subframe each, and codes
+*   every one losslessly on one thread and in stripes on every core. Prints the compression
+*   ratio and throughput per frame and returns false unless every frame decodes to the exact
+*   RGB24 pixels it was encoded from.
+*/
+bool benchmarkLossless(int frames) {
+    CpuScene scene;
+    buildCpuScene(scene);
+    const int w = bench_width > 0 ? bench_width : std::min(width, CPU_BENCH_MAX_WIDTH);
+    const int h = std::max(1, height * w / std::max(1, width));
+    CpuFrame frame;
+    initCpuFrame(frame, w, h);
+    CpuRenderer renderer;
+    sutil::ImageBuffer image;
+    image.data = frame.frame.data();
+    image.width = w;
+    image.height = h;
+    image.pixel_format = sutil::BufferImageFormat::FLOAT4;
+
+    LosslessCodec single(1), striped;
+    std::vector<unsigned char> ppm, encoded, decoded;
+    bool ok = true;
+    std::cout << std::fixed << std::setprecision(2) << w << "x" << h << " lossless frames, " << striped.numThreads()
+              << " threads" << std::endl;
+    for (int i = 0; i < frames; ++i) {
+        frame.params.subframe_index = i;
+        renderer.launch(scene, frame.params);
+        sutil::encodeImage("bench.ppm", image, false, ppm);
+        const unsigned char *rgb = ppm.data() + ppm.size() - static_cast<size_t>(w) * h * 3;
+
+        single.encode(rgb, w, h, encoded);
+        striped.encode(rgb, w, h, encoded);
+        const LosslessFrameStats &stats = striped.lastFrame();
+        const auto t0 = std::chrono::steady_clock::now();
+        int decoded_width = 0, decoded_height = 0;
+        const bool exact = striped.decode(encoded.data(), encoded.size(), decoded, decoded_width, decoded_height) &&
+                           decoded_width == w && decoded_height == h &&
+                           memcmp(decoded.data(), rgb, decoded.size()) == 0;
+        const double decode_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        ok = ok && exact;
+        std::cout << "  subframe " << std::setw(3) << i + 1 << ": " << stats.encoded_bytes / 1024.0 << " KB, ratio "
+                  << stats.ratio() << ", encode " << stats.megabytesPerSecond() << " MB/s (1 thread "
+                  << single.lastFrame().megabytesPerSecond() << " MB/s), decode "
+                  << stats.raw_bytes / (1024.0 * 1024.0) / (decode_ms / 1000.0) << " MB/s, "
+                  << (exact ? "exact" : "DIFFERS") << std::endl;
+    }
+    std::cout << "  raw RGB24 " << static_cast<size_t>(w) * h * 3 / 1024.0 << " KB per frame" << std::endl;
+    return ok;
+}
+
+/*
+*   GETs path from the server on the local port, the whole response ends up in response.
+*   False unless the server answered with 200
+*/
+static bool httpGet(uint16_t port, const std::string &path, std::string &response) {
+    response.clear();
+    const int fd = connectTcp(std::to_string(port));
+    const std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    if (fd < 0 || !sendAll(fd, request.data(), request.size())) {
+        if (fd >= 0) closeSocket(fd);
+        return false;
+    }
+    char chunk[65536];
+    for (ssize_t size = recv(fd, chunk, sizeof(chunk), 0); size > 0; size = recv(fd, chunk, sizeof(chunk), 0))
+        response.append(chunk, static_cast<size_t>(size));
+    closeSocket(fd);
+    return response.compare(0, 15, "HTTP/1.0 200 OK") == 0;
+}
+
+/*
+*   Times counter, histogram and gauge updates from every core while a client keeps scraping,
+*   then renders frames frames of the loaded scene on the CPU recording them like the render
+*   loop and scrapes /metrics once more from a local client. Returns false unless the updates
+*   all counted and the scrape parses to the frames, samples and buckets that were recorded.
+*/
+bool benchmarkMetrics(int frames) {
+    MetricsServer server(metrics);
+    uint16_t port = 0;
+    if (!server.listen(0, &port)) {
+        std::cout << "cannot serve metrics" << std::endl;
+        return false;
+    }
+    registerMemoryMetrics();
+    RenderLoopMetrics loop_metrics;
+
+    // Every thread updates the same three metrics, the contended case of the render loop and
+    // the stream threads recording at once
+    const unsigned int num_threads = std::max(2u, std::thread::hardware_concurrency());
+    Counter &counter = metrics.counter("pt_bench_updates_total", "Updates of the metrics benchmark");
+    Histogram &histogram = metrics.histogram("pt_bench_values", "Values of the metrics benchmark",
+                                             exponentialBuckets(1.0, 2.0, 10));
+    Gauge &gauge = metrics.gauge("pt_bench_sum", "Sum of the metrics benchmark");
+    std::atomic<bool> updating(true);
+    std::atomic<int> scrapes_while_updating(0);
+    std::thread scraper([&]() {
+        std::string response;
+        while (updating)
+            if (httpGet(port, "/metrics", response)) ++scrapes_while_updating;
+    });
+    const auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&]() {
+            for (uint32_t i = 0; i < METRICS_BENCH_UPDATES; ++i) {
+                counter.add();
+                histogram.observe(static_cast<double>(i % 1024));
+                gauge.add(1.0);
+            }
+        });
+    }
+    for (std::thread &thread: threads)
+        thread.join();
+    const double update_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    updating = false;
+    scraper.join();
+    const uint64_t updates = static_cast<uint64_t>(num_threads) * METRICS_BENCH_UPDATES;
+    bool ok = counter.value() == updates && histogram.count() == updates &&
+              gauge.value() == static_cast<double>(updates);
+    std::cout << std::fixed << std::setprecision(2) << num_threads << " threads x " << METRICS_BENCH_UPDATES
+              << " updates of a counter, histogram and gauge: " << update_s * 1e9 / METRICS_BENCH_UPDATES / 3.0
+              << " ns per update per thread, " << scrapes_while_updating << " scrapes meanwhile, "
+              << (ok ? "all counted" : "UPDATES LOST") << std::endl;
+
+    CpuScene scene;
+    buildCpuScene(scene);
+    const int w = bench_width > 0 ? bench_width : std::min(width, CPU_BENCH_MAX_WIDTH);
+    const int h = std::max(1, height * w / std::max(1, width));
+    CpuFrame frame;
+    initCpuFrame(frame, w, h);
+    CpuRenderer renderer;
+    const uint64_t frame_samples = static_cast<uint64_t>(w) * h * frame.params.samples_per_launch;
+    for (int i = 0; i < frames; ++i) {
+        const auto frame_start = std::chrono::steady_clock::now();
+        frame.params.subframe_index = i;
+        renderer.launch(scene, frame.params);
+        loop_metrics.recordFrame(std::chrono::duration<double>(std::chrono::steady_clock::now() - frame_start).count(),
+                                 frame_samples);
+    }
+
+    std::string response;
+    const auto scrape_start = std::chrono::steady_clock::now();
+    const bool scraped = httpGet(port, "/metrics", response);
+    const double scrape_ms =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - scrape_start).count();
+    std::string not_found;
+    const bool unknown_path_refused = !httpGet(port, "/", not_found) && not_found.find(" 404 ") != std::string::npos;
+
+    // Samples of the exposition by name with labels
+    std::map<std::string, double> samples;
+    std::vector<double> buckets;
+    std::istringstream body(response.substr(std::min(response.size(), response.find("\r\n\r\n") + 4)));
+    std::string line;
+    while (std::getline(body, line)) {
+        const size_t space = line.rfind(' ');
+        if (line.empty() || line[0] == '#' || space == std::string::npos) continue;
+        const double value = atof(line.c_str() + space + 1);
+        samples[line.substr(0, space)] = value;
+        if (line.compare(0, 24, "pt_frame_seconds_bucket{") == 0) buckets.push_back(value);
+    }
+    const char *expected[] = {"pt_fps", "pt_samples_per_second", "pt_frame_latency_seconds{quantile=\"0.99\"}",
+                              "pt_process_resident_bytes", "pt_scene_load_seconds{stage=\"scene\"}"};
+    std::vector<std::string> missing;
+    for (const char *name: expected)
+        if (!samples.count(name)) missing.push_back(name);
+    const bool buckets_ok = !buckets.empty() && std::is_sorted(buckets.begin(), buckets.end()) &&
+                            buckets.back() == frames;
+    const bool recorded = samples["pt_frames_total"] == frames && samples["pt_frame_seconds_count"] == frames &&
+                          samples["pt_samples_total"] == static_cast<double>(frame_samples * frames) &&
+                          samples["pt_bench_updates_total"] == static_cast<double>(updates);
+    ok = ok && scraped && unknown_path_refused && missing.empty() && buckets_ok && recorded;
+
+    std::cout << "  " << w << "x" << h << ", " << frames << " frames recorded, scrape of " << response.size() / 1024.0
+              << " KB in " << scrape_ms << " ms: " << samples.size() << " samples, fps " << samples["pt_fps"]
+              << ", p99 latency " << samples["pt_frame_latency_seconds{quantile=\"0.99\"}"] * 1000.0 << " ms, "
+              << samples["pt_samples_per_second"] / 1e6 << " Msamples/s, resident "
+              << samples["pt_process_resident_bytes"] / (1024.0 * 1024.0) << " MB" << std::endl;
+    for (const std::string &name: missing)
+        std::cout << "  MISSING " << name << std::endl;
+    std::cout << "  scrape " << (scraped ? "answered" : "FAILED") << ", frames, samples and updates "
+              << (recorded ? "match" : "DO NOT match") << ", buckets " << (buckets_ok ? "cumulative" : "BROKEN")
+              << ", unknown path " << (unknown_path_refused ? "refused" : "SERVED") << ", " << server.scrapes()
+              << " scrapes served" << std::endl;
+    return ok;
+}
+
+/*
+*   Checks the memory accounting next to the loaded scene: a texture over the texture budget
+*   is halved until it fits, allocations that fit nowhere are refused without being accounted
+*   and threads allocating against a budget never take it over. Prints the report of the
+*   scene before and after and returns whether every check held.
+*/
+bool benchmarkMemory() {
+    MemoryAccounting &accounting = memoryAccounting();
+    accounting.report(std::cout);
+    const size_t textures_budget = accounting.budget(MEMORY_TEXTURES);
+    const size_t scratch_budget = accounting.budget(MEMORY_LOADER_SCRATCH);
+    const size_t frame_buffers_budget = accounting.budget(MEMORY_FRAME_BUFFERS);
+    const size_t total_budget = accounting.budget(MEMORY_TOTAL);
+    accounting.setBudget(MEMORY_TOTAL, 0);
+
+    // A 1024x1024 checkerboard with room for a quarter of it halves once, to mid grey
+    const size_t textures = accounting.current(MEMORY_TEXTURES, MEMORY_HOST);
+    const int size = 1024;
+    const size_t quarter_bytes = static_cast<size_t>(size / 2) * (size / 2) * sizeof(uint32_t);
+    accounting.setBudget(MEMORY_TEXTURES, textures + quarter_bytes);
+    std::unique_ptr<Texture> texture(new Texture);
+    texture->resolution = glm::ivec2(size);
+    texture->pixel = static_cast<uint32_t *>(malloc(static_cast<size_t>(size) * size * sizeof(uint32_t)));
+    for (int y = 0; y < size; ++y)
+        for (int x = 0; x < size; ++x)
+            texture->pixel[y * size + x] = (x + y) % 2 ? 0xFFFFFFFFu : 0xFF000000u;
+    const bool was_downscaled = textures_downscaled;
+    const auto t0 = std::chrono::steady_clock::now();
+    accountTexture(*texture, "checkerboard");
+    const double downscale_ms =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    textures_downscaled = was_downscaled;
+    bool grey = texture->resolution == glm::ivec2(size / 2);
+    for (size_t i = 0; grey && i < static_cast<size_t>(size / 2) * (size / 2); ++i)
+        grey = texture->pixel[i] == 0xFF808080u;
+    const bool downscaled = grey && accounting.current(MEMORY_TEXTURES, MEMORY_HOST) == textures + quarter_bytes;
+    texture.reset();
+    const bool released = accounting.current(MEMORY_TEXTURES, MEMORY_HOST) == textures;
+
+    // Not even MIN_TEXTURE_SIZE fits one byte of room, and loader scratch over its budget
+    accounting.setBudget(MEMORY_TEXTURES, textures + 1);
+    texture.reset(new Texture);
+    texture->resolution = glm::ivec2(MIN_TEXTURE_SIZE * 4);
+    texture->pixel = static_cast<uint32_t *>(calloc(MIN_TEXTURE_SIZE * MIN_TEXTURE_SIZE * 16, sizeof(uint32_t)));
+    std::string texture_error;
+    try {
+        accountTexture(*texture, "oversized");
+    } catch (std::runtime_error &e) {
+        texture_error = e.what();
+    }
+    texture.reset();
+    accounting.setBudget(MEMORY_LOADER_SCRATCH, 1024 * 1024);
+    const size_t scratch = accounting.current(MEMORY_LOADER_SCRATCH, MEMORY_HOST);
+    const bool scratch_refused = !accounting.tryAllocate(MEMORY_LOADER_SCRATCH, MEMORY_HOST, 2 * 1024 * 1024);
+    const bool refused = !texture_error.empty() && scratch_refused &&
+                         accounting.current(MEMORY_TEXTURES, MEMORY_HOST) == textures &&
+                         accounting.current(MEMORY_LOADER_SCRATCH, MEMORY_HOST) == scratch;
+
+    // Threads competing for a budget of three of their allocations
+    const size_t allocation = 1024 * 1024;
+    const size_t frame_buffers = accounting.current(MEMORY_FRAME_BUFFERS, MEMORY_DEVICE);
+    const size_t frame_buffers_limit = frame_buffers + 3 * allocation;
+    accounting.setBudget(MEMORY_FRAME_BUFFERS, frame_buffers_limit);
+    const unsigned int num_threads = std::max(4u, std::thread::hardware_concurrency());
+    std::atomic<uint64_t> refusals(0);
+    std::atomic<bool> over_budget(false);
+    const auto t1 = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&]() {
+            for (uint32_t i = 0; i < MEMORY_BENCH_ALLOCATIONS; ++i) {
+                if (!accounting.tryAllocate(MEMORY_FRAME_BUFFERS, MEMORY_DEVICE, allocation)) {
+                    ++refusals;
+                    continue;
+                }
+                if (accounting.current(MEMORY_FRAME_BUFFERS, MEMORY_DEVICE) > frame_buffers_limit) over_budget = true;
+                accounting.release(MEMORY_FRAME_BUFFERS, MEMORY_DEVICE, allocation);
+            }
+        });
+    }
+    for (std::thread &thread: threads)
+        thread.join();
+    const double allocate_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+    const bool contended = !over_budget && accounting.current(MEMORY_FRAME_BUFFERS, MEMORY_DEVICE) == frame_buffers &&
+                           accounting.peak(MEMORY_FRAME_BUFFERS, MEMORY_DEVICE) >= frame_buffers + allocation;
+
+    accounting.setBudget(MEMORY_TEXTURES, textures_budget);
+    accounting.setBudget(MEMORY_LOADER_SCRATCH, scratch_budget);
+    accounting.setBudget(MEMORY_FRAME_BUFFERS, frame_buffers_budget);
+    accounting.setBudget(MEMORY_TOTAL, total_budget);
+    std::cout << std::fixed << std::setprecision(2) << "  checkerboard " << size << "x" << size << " downscaled in "
+              << downscale_ms << " ms to " << (downscaled ? "fit" : "the WRONG size or pixels") << ", "
+              << (released ? "released" : "NOT released") << std::endl;
+    std::cout << "  refused: " << (texture_error.empty() ? "NOT the oversized texture" : texture_error) << std::endl;
+    std::cout << "  refused: " << (scratch_refused ? accounting.budgetError(MEMORY_LOADER_SCRATCH, MEMORY_HOST,
+                                                                            2 * 1024 * 1024)
+                                                   : "NOT the loader scratch") << std::endl;
+    std::cout << "  " << num_threads << " threads x " << MEMORY_BENCH_ALLOCATIONS << " allocations: "
+              << allocate_s * 1e9 / MEMORY_BENCH_ALLOCATIONS << " ns per allocation per thread, " << refusals
+              << " refused, budget " << (contended ? "held" : "BROKEN") << std::endl;
+    accounting.report(std::cout);
+    return downscaled && released && refused && contended;
+}
+
+/*
+*   Renders the frame steps of a camera path, fps per second of it, at w x h without a
+*   window and returns the milliseconds of each, after a warm-up frame that is not counted.
+*   Like the render loop, the accumulation restarts whenever the camera moved since the step
+*   before and goes on while it rests, so a path renders the same subframes on every run.
+*   frame_hashes gets a hash of each frame's pixels when given.
+*/
+static std::vector<double> renderCameraPath(const CameraPath &path, double fps, bool use_gpu, int w, int h,
+                                            std::vector<uint64_t> *frame_hashes) {
+    const int num_frames = path.numFrames(fps);
+    const size_t frame_bytes = sizeof(float4) * static_cast<size_t>(w) * h;
+    std::vector<double> frame_ms;
+    if (frame_hashes) frame_hashes->clear();
+    CameraState previous = path.sample(0.0);
+    // Moves the camera of params to step i, -1 is the warm-up
+    const auto step = [&](int i, Params &params) {
+        const CameraState view = path.sample(std::max(i, 0) / fps);
+        if (i <= 0 || view != previous) {
+            setCameraState(view);
+            handleCameraUpdate(params);
+            params.subframe_index = 0;
+        } else {
+            ++params.subframe_index;
+        }
+        previous = view;
+    };
+
+    if (use_gpu) {
+        PathTracerState state;
+        state.params.width = w;
+        state.params.height = h;
+        state.params.denoiser = 0u;
+        createContext(state);
+        buildMeshAccel(state);
+        createModule(state);
+        createProgramGroups(state);
+        createPipeline(state);
+        if (MODEL && !MODEL->textures.empty()) {
+            createTextures();
+        }
+        createSBT(state);
+        initLaunchParams(state);
+
+        sutil::CUDAOutputBuffer<float4> output_buffer(sutil::CUDAOutputBufferType::CUDA_DEVICE, w, h);
+        for (int i = -1; i < num_frames; ++i) {
+            step(i, state.params);
+            const auto t0 = std::chrono::steady_clock::now();
+            launchSubframe(output_buffer, state);
+            const auto t1 = std::chrono::steady_clock::now();
+            if (i < 0) continue;
+            frame_ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+            if (frame_hashes) frame_hashes->push_back(fnv1a64(output_buffer.getHostPointer(), frame_bytes));
+        }
+        cleanupState(state);
+    } else {
+        CpuScene scene;
+        buildCpuScene(scene);
+        CpuFrame frame;
+        initCpuFrame(frame, w, h);
+
+        CpuRenderer renderer;
+        for (int i = -1; i < num_frames; ++i) {
+            step(i, frame.params);
+            const auto t0 = std::chrono::steady_clock::now();
+            renderer.launch(scene, frame.params);
+            const auto t1 = std::chrono::steady_clock::now();
+            if (i < 0) continue;
+            frame_ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+            if (frame_hashes) frame_hashes->push_back(fnv1a64(frame.frame.data(), frame_bytes));
+        }
+    }
+    return frame_ms;
+}
+
+/*
+*   Replays a camera path recorded with --record-camera on the loaded scene at replay_fps and
+*   appends one JSON object with the time of every frame step to out_file, so the same
+*   interactive workload compares between builds and machines. Renders on the backend and at
+*   the size of --bench. False if the path cannot be read.
+*/
+bool replayCameraPath(const std::string &path_file, const std::string &scene_file, const std::string &out_file) {
+    CameraPath path;
+    std::string error;
+    if (!path.load(path_file, error)) {
+        std::cerr << error << std::endl;
+        return false;
+    }
+    std::ofstream out(out_file.c_str(), std::ios::app);
+    if (!out)
+        throw std::runtime_error("Could not open " + out_file);
+
+    const bool use_gpu = bench_backend == BENCH_BACKEND_GPU || (bench_backend == BENCH_BACKEND_AUTO && gpuAvailable());
+    int w, h;
+    benchImageSize(use_gpu, w, h);
+    const std::vector<double> frame_ms = renderCameraPath(path, replay_fps, use_gpu, w, h, nullptr);
+
+    std::vector<double> sorted = frame_ms;
+    std::sort(sorted.begin(), sorted.end());
+    double total_ms = 0.0;
+    for (double ms: frame_ms) total_ms += ms;
+    const std::string name = path_file.substr(path_file.find_last_of("/\\") + 1);
+    out << "{\"camera_path\":\"" << jsonEscape(name) << "\",\"scene\":\""
+        << jsonEscape(scene_file.substr(scene_file.find_last_of("/\\") + 1)) << "\"" << std::fixed
+        << std::setprecision(3)
+        << ",\"backend\":\"" << (use_gpu ? "gpu" : "cpu") << "\""
+        << ",\"width\":" << w << ",\"height\":" << h << ",\"samples_per_launch\":" << samples_per_launch
+        << ",\"fps\":" << replay_fps << ",\"keyframes\":" << path.keyframes().size()
+        << ",\"events\":" << path.events().size() << ",\"frames\":" << frame_ms.size()
+        << ",\"frame_ms\":{\"mean\":" << (frame_ms.empty() ? 0.0 : total_ms / frame_ms.size())
+        << ",\"p50\":" << percentile(sorted, 0.50) << ",\"p95\":" << percentile(sorted, 0.95)
+        << ",\"p99\":" << percentile(sorted, 0.99) << ",\"max\":" << (sorted.empty() ? 0.0 : sorted.back())
+        << "},\"frame_step_ms\":[";
+    for (size_t i = 0; i < frame_ms.size(); ++i)
+        out << (i > 0 ? "," : "") << frame_ms[i];
+    out << "]}" << std::endl;
+    std::cout << std::fixed << std::setprecision(2) << name << ": " << (use_gpu ? "gpu" : "cpu") << " " << w << "x"
+              << h << ", " << frame_ms.size() << " frames at " << replay_fps << " fps, " << percentile(sorted, 0.50)
+              << " ms/frame (p50), " << percentile(sorted, 0.99) << " ms (p99)" << std::endl;
+    return true;
+}
+
+/*
+*   Checks camera paths on a synthetic one around the scene camera with two orbits, a rest
+*   and a zoom. The path has to come back from its file unchanged, sample its keyframes
+*   exactly and orthonormal views between them, hold the rest, and two CPU replays of it
+*   have to render the same frames.
+*/
+bool benchmarkCameraPath() {
+    const CameraState start = currentCameraState();
+    const float3 axis = normalize(start.up);
+    const auto orbit = [&](float degrees, float fovy) {
+        const float angle = degrees * M_PIf / 180.f;
+        const float c = cosf(angle), s = sinf(angle);
+        const float3 offset = start.eye - start.lookat;
+        CameraState view = start;
+        view.eye = start.lookat + offset * c + cross(axis, offset) * s + axis * dot(axis, offset) * (1.f - c);
+        view.fovy = fovy;
+        return view;
+    };
+    CameraPath path;
+    path.addKeyframe(0.0, start);
+    path.addKeyframe(1.0, orbit(90.f, start.fovy));
+    path.addKeyframe(2.0, orbit(90.f, start.fovy));
+    path.addKeyframe(3.0, orbit(200.f, 0.5f * start.fovy));
+    path.addKeyframe(CAMERA_BENCH_SECONDS, start);
+    path.addEvent(0.5, "key " + std::to_string(GLFW_KEY_W) + " press");
+
+    const std::string filename = "bench_camera_path.txt";
+    CameraPath loaded;
+    std::string error;
+    bool round_trip = path.save(filename) && loaded.load(filename, error) &&
+                      loaded.keyframes().size() == path.keyframes().size() &&
+                      loaded.events().size() == path.events().size();
+    std::remove(filename.c_str());
+    bool exact = round_trip;
+    for (size_t i = 0; exact && i < path.keyframes().size(); ++i)
+        exact = loaded.sample(path.keyframes()[i].time) == path.keyframes()[i].camera;
+
+    const int num_frames = path.numFrames(replay_fps);
+    float error_orthonormal = 0.f;
+    for (int i = 0; round_trip && i < num_frames; ++i) {
+        round_trip = loaded.sample(i / replay_fps) == path.sample(i / replay_fps);
+        // Keyframes are on whole seconds, their up vectors and those of the rest need not be orthogonal
+        const double time = (i + 0.5) / replay_fps;
+        const CameraState view = path.sample(time);
+        if (view == path.sample(std::floor(time))) continue;
+        const float3 forward = normalize(view.lookat - view.eye);
+        error_orthonormal = std::max(error_orthonormal, std::max(fabsf(dot(forward, view.up)),
+                                                                 fabsf(length(view.up) - 1.f)));
+    }
+    const bool orthonormal = error_orthonormal < 1e-4f;
+    const bool rest = path.sample(1.5) == path.sample(1.0) && path.sample(2.0) == path.sample(1.0);
+
+    const int w = CAMERA_BENCH_WIDTH;
+    const int h = std::max(1, height * CAMERA_BENCH_WIDTH / width);
+    std::vector<uint64_t> first_hashes, second_hashes;
+    std::vector<double> frame_ms = renderCameraPath(loaded, replay_fps, false, w, h, &first_hashes);
+    renderCameraPath(loaded, replay_fps, false, w, h, &second_hashes);
+    setCameraState(start);
+    const bool deterministic = !first_hashes.empty() && first_hashes == second_hashes;
+    std::sort(frame_ms.begin(), frame_ms.end());
+
+    std::cout << std::fixed << std::setprecision(2) << "camera path: " << path.keyframes().size() << " keyframes, "
+              << num_frames << " frames at " << replay_fps << " fps" << std::endl;
+    std::cout << "  file round trip: " << (round_trip ? "unchanged" : "CHANGED " + error) << std::endl;
+    std::cout << "  keyframes sampled " << (exact ? "exactly" : "NOT exactly") << ", views between them "
+              << (orthonormal ? "orthonormal" : "NOT orthonormal") << " (" << std::scientific << std::setprecision(1)
+              << error_orthonormal << std::fixed << std::setprecision(2) << "), rest "
+              << (rest ? "held" : "NOT held") << std::endl;
+    std::cout << "  two CPU replays at " << w << "x" << h << ": " << (deterministic ? "same" : "DIFFERENT")
+              << " frames, " << percentile(frame_ms, 0.50) << " ms/frame (p50), " << percentile(frame_ms, 0.99)
+              << " ms (p99)" << std::endl;
+    return round_trip && exact && orthonormal && rest && deterministic;
+}
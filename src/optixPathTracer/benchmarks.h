@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+*   The headless modes of optixPathTracer that measure and check it: --bench and the
+*   --bench-* modes, --golden and --replay-camera. They run on the scene and the settings
+*   main() set up, print what they measured and return false when a check fails, which
+*   main() turns into exit status 1.
+*/
+
+// Headless benchmark (--bench)
+enum BenchBackend {
+    BENCH_BACKEND_AUTO,     // GPU when a device and the OptiX driver are available, the CPU renderer otherwise
+    BENCH_BACKEND_GPU,
+    BENCH_BACKEND_CPU
+};
+
+extern BenchBackend bench_backend;
+extern int32_t bench_subframes;
+extern int32_t bench_width;             // 0 keeps the scene's width on the GPU and caps it on the CPU
+
+// Camera paths (--replay-camera, --bench-camera-path)
+extern double replay_fps;               // frame steps of a replay per second of the path
+
+// What --golden does with golden/<scene>.exr
+enum GoldenMode {
+    GOLDEN_COMPARE,
+    GOLDEN_UPDATE,          // --golden-update: rewrite it
+    GOLDEN_BOOTSTRAP        // --golden-bootstrap: write it if there is none yet, compare otherwise
+};
+
+// Before the scene is loaded, these load what they need themselves
+bool benchmarkWorkDistribution(int num_subframes);
+bool benchmarkDenoiser(const std::vector<std::string> &files);
+bool benchmarkSceneParser(int num_lines);
+bool benchmarkScene(std::string &scene_file, const std::string &out_file);
+bool checkGoldenImage(std::string &scene_file, GoldenMode mode);
+
+// On the loaded scene
+bool benchmarkShadowRays(int num_points);
+bool benchmarkLightSampling(int num_points);
+bool benchmarkTemporal(int num_frames);
+bool benchmarkSceneUpdates(int num_deltas);
+bool benchmarkSessions(int num_sessions);
+bool benchmarkFairness(double seconds, int num_interactive = 3);
+bool benchmarkCluster(int num_workers);
+bool benchmarkFanout(int num_viewers);
+bool benchmarkMjpeg(int frames);
+bool benchmarkLossless(int frames);
+bool benchmarkMetrics(int frames);
+bool benchmarkMemory();
+bool replayCameraPath(const std::string &path_file, const std::string &scene_file, const std::string &out_file);
+bool benchmarkCameraPath();
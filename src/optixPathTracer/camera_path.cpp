@@ -0,0 +1,231 @@
+#include <cuda_runtime.h>
+
+#include "camera_path.h"
+
+#include <sutil/Quaternion.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+
+namespace {
+    // Below it the slerp weights divide by almost 0, the lerp of the quaternions is as good there
+    const float SLERP_LERP_COSINE = 0.9995f;
+
+    /*
+    *   Rotation taking -z to the viewing direction and y to the up direction, orthogonalized
+    *   against it like Camera::UVWFrame() does, from the matrix with the columns u, v, -w
+    */
+    sutil::Quaternion orientation(const CameraState &camera) {
+        const float3 w = normalize(camera.lookat - camera.eye);
+        const float3 u = normalize(cross(w, camera.up));
+        const float3 v = cross(u, w);
+        const float m[3][3] = {{u.x, v.x, -w.x},
+                               {u.y, v.y, -w.y},
+                               {u.z, v.z, -w.z}};
+        // Divides by the largest of the four terms, the others lose precision near their 0
+        const float trace = m[0][0] + m[1][1] + m[2][2];
+        float qw, qx, qy, qz;
+        if (trace > 0.f) {
+            const float s = 2.f * sqrtf(trace + 1.f);
+            qw = 0.25f * s;
+            qx = (m[2][1] - m[1][2]) / s;
+            qy = (m[0][2] - m[2][0]) / s;
+            qz = (m[1][0] - m[0][1]) / s;
+        } else if (m[0][0] > m[1][1] && m[0][0] > m[2][2]) {
+            const float s = 2.f * sqrtf(1.f + m[0][0] - m[1][1] - m[2][2]);
+            qw = (m[2][1] - m[1][2]) / s;
+            qx = 0.25f * s;
+            qy = (m[0][1] + m[1][0]) / s;
+            qz = (m[0][2] + m[2][0]) / s;
+        } else if (m[1][1] > m[2][2]) {
+            const float s = 2.f * sqrtf(1.f + m[1][1] - m[0][0] - m[2][2]);
+            qw = (m[0][2] - m[2][0]) / s;
+            qx = (m[0][1] + m[1][0]) / s;
+            qy = 0.25f * s;
+            qz = (m[1][2] + m[2][1]) / s;
+        } else {
+            const float s = 2.f * sqrtf(1.f + m[2][2] - m[0][0] - m[1][1]);
+            qw = (m[1][0] - m[0][1]) / s;
+            qx = (m[0][2] + m[2][0]) / s;
+            qy = (m[1][2] + m[2][1]) / s;
+            qz = 0.25f * s;
+        }
+        sutil::Quaternion q(qw, qx, qy, qz);
+        q.normalize();
+        return q;
+    }
+
+    sutil::Quaternion slerp(const sutil::Quaternion &a, const sutil::Quaternion &b, float t) {
+        // q and -q are the same rotation, the shorter arc is between a and the one closer to it
+        const float cosine = fabsf(dot(a, b));
+        const float sign = dot(a, b) < 0.f ? -1.f : 1.f;
+        float weight_a = 1.f - t, weight_b = t;
+        if (cosine <= SLERP_LERP_COSINE) {
+            const float angle = acosf(cosine);
+            weight_a = sinf((1.f - t) * angle) / sinf(angle);
+            weight_b = sinf(t * angle) / sinf(angle);
+        }
+        sutil::Quaternion q = weight_a * a + (sign * weight_b) * b;
+        q.normalize();
+        return q;
+    }
+
+    bool readVec3(std::istream &in, float3 &v) {
+        return static_cast<bool>(in >> v.x >> v.y >> v.z);
+    }
+
+    void writeVec3(std::ostream &out, const float3 &v) {
+        out << " " << v.x << " " << v.y << " " << v.z;
+    }
+}
+
+bool operator==(const CameraState &a, const CameraState &b) {
+    return a.eye.x == b.eye.x && a.eye.y == b.eye.y && a.eye.z == b.eye.z &&
+           a.lookat.x == b.lookat.x && a.lookat.y == b.lookat.y && a.lookat.z == b.lookat.z &&
+           a.up.x == b.up.x && a.up.y == b.up.y && a.up.z == b.up.z && a.fovy == b.fovy;
+}
+
+void CameraPath::addKeyframe(double time, const CameraState &camera) {
+    const size_t n = m_keyframes.size();
+    if (n > 0 && time <= m_keyframes.back().time) {
+        m_keyframes.back().camera = camera;
+        return;
+    }
+    if (n > 1 && m_keyframes[n - 1].camera == camera && m_keyframes[n - 2].camera == camera) {
+        m_keyframes.back().time = time;
+        return;
+    }
+    CameraKeyframe keyframe;
+    keyframe.time = time;
+    keyframe.camera = camera;
+    m_keyframes.push_back(keyframe);
+}
+
+void CameraPath::addEvent(double time, const std::string &description) {
+    CameraInputEvent event;
+    event.time = time;
+    event.description = description;
+    m_events.push_back(event);
+}
+
+int CameraPath::numFrames(double fps) const {
+    if (m_keyframes.empty() || fps <= 0.0) return 0;
+    // The epsilon keeps a last keyframe on a step from being lost to rounding
+    return static_cast<int>(std::floor(duration() * fps + 1e-6)) + 1;
+}
+
+CameraState CameraPath::sample(double time) const {
+    if (m_keyframes.empty()) return CameraState();
+    const auto next = std::upper_bound(m_keyframes.begin(), m_keyframes.end(), time,
+                                       [](double t, const CameraKeyframe &keyframe) { return t < keyframe.time; });
+    if (next == m_keyframes.begin()) return next->camera;
+    const CameraKeyframe &a = *(next - 1);
+    if (next == m_keyframes.end() || time == a.time) return a.camera;
+    const CameraKeyframe &b = *next;
+    // A rest, the interpolation would round it into motion
+    if (a.camera == b.camera) return a.camera;
+
+    const float t = static_cast<float>((time - a.time) / (b.time - a.time));
+    const float distance = (1.f - t) * length(a.camera.lookat - a.camera.eye) +
+                           t * length(b.camera.lookat - b.camera.eye);
+    const sutil::Matrix4x4 rotation = slerp(orientation(a.camera), orientation(b.camera), t).rotationMatrix();
+    CameraState camera;
+    camera.eye = lerp(a.camera.eye, b.camera.eye, t);
+    camera.up = make_float3(rotation[1], rotation[5], rotation[9]);
+    camera.lookat = camera.eye - distance * make_float3(rotation[2], rotation[6], rotation[10]);
+    camera.fovy = (1.f - t) * a.camera.fovy + t * b.camera.fovy;
+    return camera;
+}
+
+bool CameraPath::save(const std::string &filename) const {
+    std::ofstream out(filename.c_str());
+    if (!out) return false;
+    out << "# camera <seconds> <eye> <lookat> <up> <fovy> | event <seconds> <description>\n";
+    // Merged by time
+    size_t e = 0;
+    for (const CameraKeyframe &keyframe: m_keyframes) {
+        for (; e < m_events.size() && m_events[e].time < keyframe.time; ++e)
+            out << "event " << std::setprecision(std::numeric_limits<double>::max_digits10) << m_events[e].time
+                << " " << m_events[e].description << "\n";
+        out << "camera " << std::setprecision(std::numeric_limits<double>::max_digits10) << keyframe.time
+            << std::setprecision(std::numeric_limits<float>::max_digits10);
+        writeVec3(out, keyframe.camera.eye);
+        writeVec3(out, keyframe.camera.lookat);
+        writeVec3(out, keyframe.camera.up);
+        out << " " << keyframe.camera.fovy << "\n";
+    }
+    for (; e < m_events.size(); ++e)
+        out << "event " << std::setprecision(std::numeric_limits<double>::max_digits10) << m_events[e].time << " "
+            << m_events[e].description << "\n";
+    return static_cast<bool>(out.flush());
+}
+
+bool CameraPath::load(const std::string &filename, std::string &error) {
+    std::ifstream in(filename.c_str());
+    if (!in) {
+        error = "cannot open " + filename;
+        return false;
+    }
+    m_keyframes.clear();
+    m_events.clear();
+    std::string line;
+    for (int number = 1; std::getline(in, line); ++number) {
+        std::istringstream fields(line);
+        std::string kind;
+        if (!(fields >> kind) || kind[0] == '#') continue;
+        double time;
+        if (!(fields >> time)) {
+            error = filename + ":" + std::to_string(number) + ": no time";
+            return false;
+        }
+        if (kind == "camera") {
+            CameraKeyframe keyframe;
+            keyframe.time = time;
+            CameraState &camera = keyframe.camera;
+            if (!readVec3(fields, camera.eye) || !readVec3(fields, camera.lookat) || !readVec3(fields, camera.up) ||
+                !(fields >> camera.fovy)) {
+                error = filename + ":" + std::to_string(number) + ": expected <eye> <lookat> <up> <fovy>";
+                return false;
+            }
+            if (!m_keyframes.empty() && time <= m_keyframes.back().time) {
+                error = filename + ":" + std::to_string(number) + ": camera before the previous one";
+                return false;
+            }
+            m_keyframes.push_back(keyframe);
+        } else if (kind == "event") {
+            std::string description;
+            std::getline(fields >> std::ws, description);
+            addEvent(time, description);
+        } else {
+            error = filename + ":" + std::to_string(number) + ": unknown line '" + kind + "'";
+            return false;
+        }
+    }
+    if (m_keyframes.empty()) {
+        error = filename + ": no camera lines";
+        return false;
+    }
+    return true;
+}
+
+void CameraPathRecorder::start() {
+    m_path = CameraPath();
+    m_start = std::chrono::steady_clock::now();
+    m_recording = true;
+}
+
+double CameraPathRecorder::elapsed() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+void CameraPathRecorder::recordCamera(const CameraState &camera) {
+    if (m_recording) m_path.addKeyframe(elapsed(), camera);
+}
+
+void CameraPathRecorder::recordEvent(const std::string &description) {
+    if (m_recording) m_path.addEvent(elapsed(), description);
+}
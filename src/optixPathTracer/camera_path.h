@@ -0,0 +1,89 @@
+#pragma once
+
+#include <sutil/vec_math.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+/*
+*   Camera paths to reproduce interactive workloads in benchmarks. A recording holds the
+*   camera whenever it changed, stamped with the seconds since the recording started, and
+*   the input events that moved it. A replay samples the path at fixed steps, so every run
+*   renders the same views however fast it goes: the eye, the distance to the lookat point
+*   and the field of view are interpolated linearly, the orientation with a quaternion slerp.
+*/
+
+struct CameraState {
+    float3 eye;
+    float3 lookat;
+    float3 up;
+    float fovy;
+};
+
+bool operator==(const CameraState &a, const CameraState &b);
+inline bool operator!=(const CameraState &a, const CameraState &b) { return !(a == b); }
+
+struct CameraKeyframe {
+    double time;
+    CameraState camera;
+};
+
+struct CameraInputEvent {
+    double time;
+    std::string description;
+};
+
+class CameraPath {
+public:
+    /*
+    *   In time order, a camera at the time of the last keyframe replaces its camera. A rest
+    *   keeps its first and last keyframe only, however often the camera was added during it.
+    */
+    void addKeyframe(double time, const CameraState &camera);
+    void addEvent(double time, const std::string &description);
+
+    const std::vector<CameraKeyframe> &keyframes() const { return m_keyframes; }
+    const std::vector<CameraInputEvent> &events() const { return m_events; }
+    bool empty() const { return m_keyframes.empty(); }
+
+    // Time of the last keyframe
+    double duration() const { return m_keyframes.empty() ? 0.0 : m_keyframes.back().time; }
+    // Steps of 1 / fps seconds from 0 through the last keyframe
+    int numFrames(double fps) const;
+
+    // Held before the first and after the last keyframe, exactly a keyframe's camera at its time
+    CameraState sample(double time) const;
+
+    /*
+    *   One "camera <time> <eye> <lookat> <up> <fovy>" or "event <time> <description>" line
+    *   each with vectors as x y z, written at full precision so a loaded path samples the
+    *   same cameras. Lines starting with # are comments.
+    */
+    bool save(const std::string &filename) const;
+    // False with the line and what is wrong with it in error
+    bool load(const std::string &filename, std::string &error);
+
+private:
+    std::vector<CameraKeyframe> m_keyframes;
+    std::vector<CameraInputEvent> m_events;
+};
+
+// Appends to a path with the seconds since start()
+class CameraPathRecorder {
+public:
+    void start();
+    bool recording() const { return m_recording; }
+
+    void recordCamera(const CameraState &camera);
+    void recordEvent(const std::string &description);
+
+    const CameraPath &path() const { return m_path; }
+
+private:
+    double elapsed() const;
+
+    bool m_recording = false;
+    std::chrono::steady_clock::time_point m_start;
+    CameraPath m_path;
+};
@@ -0,0 +1,637 @@
+#include <cuda_runtime.h>
+
+#include "cpu_bvh.h"
+
+#include <algorithm>
+#include <cfloat>
+
+namespace {
+    const int SAH_BINS = 16;
+    const float TRAVERSAL_COST = 1.f;
+    const float INTERSECTION_COST = 1.f;
+    const int STACK_SIZE = 128;
+    /*
+    *   Traversal pushes at most one node per level. SAH splits stop at this depth; below it
+    *   only leaves too large to store are split at the median, which takes at most 16 more
+    *   levels for 2^32 triangles, so a degenerate SAH build cannot outgrow the stack.
+    */
+    const int MAX_SAH_DEPTH = STACK_SIZE - 32;
+
+    inline float component(const float3 &v, int axis) {
+        return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+    }
+
+    // fminf/fmaxf end up as library calls on the host, these compile to plain min/max instructions
+    inline float3 vmin(const float3 &a, const float3 &b) {
+        return make_float3(a.x < b.x ? a.x : b.x, a.y < b.y ? a.y : b.y, a.z < b.z ? a.z : b.z);
+    }
+
+    inline float3 vmax(const float3 &a, const float3 &b) {
+        return make_float3(a.x > b.x ? a.x : b.x, a.y > b.y ? a.y : b.y, a.z > b.z ? a.z : b.z);
+    }
+
+    inline float area(const float3 &bmin, const float3 &bmax) {
+        const float3 d = bmax - bmin;
+        return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    struct Bin {
+        float3 bmin = make_float3(FLT_MAX);
+        float3 bmax = make_float3(-FLT_MAX);
+        int count = 0;
+    };
+}
+
+uint32_t CpuBvh::buildRecursive(std::vector<BuildPrim> &prims, size_t begin, size_t end, const float4 *vertices,
+                                int depth) {
+    const uint32_t node_idx = static_cast<uint32_t>(m_nodes.size());
+    m_nodes.push_back(Node());
+
+    float3 bmin = make_float3(FLT_MAX), bmax = make_float3(-FLT_MAX);
+    float3 cmin = make_float3(FLT_MAX), cmax = make_float3(-FLT_MAX);
+    for (size_t i = begin; i < end; ++i) {
+        bmin = vmin(bmin, prims[i].bmin);
+        bmax = vmax(bmax, prims[i].bmax);
+        cmin = vmin(cmin, prims[i].centroid);
+        cmax = vmax(cmax, prims[i].centroid);
+    }
+    {
+        Node &node = m_nodes[node_idx];
+        node.bmin[0] = bmin.x; node.bmin[1] = bmin.y; node.bmin[2] = bmin.z;
+        node.bmax[0] = bmax.x; node.bmax[1] = bmax.y; node.bmax[2] = bmax.z;
+    }
+
+    const size_t count = end - begin;
+    int best_axis = -1;
+    int best_bin = 0;
+    float best_cost = INTERSECTION_COST * count;
+    if (count > MAX_LEAF_SIZE && depth < MAX_SAH_DEPTH) {
+        // binned SAH over all three axes
+        for (int axis = 0; axis < 3; ++axis) {
+            const float lo = component(cmin, axis);
+            const float extent = component(cmax, axis) - lo;
+            if (extent <= 0.f) continue;
+            const float scale = SAH_BINS / extent;
+
+            Bin bins[SAH_BINS];
+            for (size_t i = begin; i < end; ++i) {
+                const int b = std::min(SAH_BINS - 1, static_cast<int>((component(prims[i].centroid, axis) - lo) * scale));
+                bins[b].bmin = vmin(bins[b].bmin, prims[i].bmin);
+                bins[b].bmax = vmax(bins[b].bmax, prims[i].bmax);
+                bins[b].count++;
+            }
+
+            // sweep from the right to get the cost of every right half
+            float right_area[SAH_BINS];
+            int right_count[SAH_BINS];
+            Bin acc;
+            for (int b = SAH_BINS - 1; b > 0; --b) {
+                acc.bmin = vmin(acc.bmin, bins[b].bmin);
+                acc.bmax = vmax(acc.bmax, bins[b].bmax);
+                acc.count += bins[b].count;
+                right_area[b] = acc.count ? area(acc.bmin, acc.bmax) : 0.f;
+                right_count[b] = acc.count;
+            }
+            acc = Bin();
+            const float inv_parent_area = 1.f / std::max(area(bmin, bmax), FLT_MIN);
+            for (int b = 0; b < SAH_BINS - 1; ++b) {
+                acc.bmin = vmin(acc.bmin, bins[b].bmin);
+                acc.bmax = vmax(acc.bmax, bins[b].bmax);
+                acc.count += bins[b].count;
+                if (acc.count == 0 || right_count[b + 1] == 0) continue;
+                const float cost = TRAVERSAL_COST + INTERSECTION_COST * inv_parent_area *
+                                                    (area(acc.bmin, acc.bmax) * acc.count +
+                                                     right_area[b + 1] * right_count[b + 1]);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+    }
+
+    size_t mid = begin;
+    if (best_axis >= 0) {
+        const float lo = component(cmin, best_axis);
+        const float scale = SAH_BINS / (component(cmax, best_axis) - lo);
+        mid = std::partition(prims.begin() + begin, prims.begin() + end, [&](const BuildPrim &p) {
+            return std::min(SAH_BINS - 1, static_cast<int>((component(p.centroid, best_axis) - lo) * scale)) <= best_bin;
+        }) - prims.begin();
+    } else if (count > 0xffff) {
+        // a leaf this large can't be stored, fall back to a median split on the widest axis
+        const float3 extent = cmax - cmin;
+        best_axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        mid = begin + count / 2;
+        std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end,
+                         [&](const BuildPrim &a, const BuildPrim &b) {
+                             return component(a.centroid, best_axis) < component(b.centroid, best_axis);
+                         });
+    }
+
+    if (best_axis < 0 || mid == begin || mid == end) {
+        Node &node = m_nodes[node_idx];
+        node.offset = static_cast<uint32_t>(m_triangles.size());
+        node.count = static_cast<uint16_t>(count);
+        node.axis = 0;
+        for (size_t i = begin; i < end; ++i) {
+            const int32_t prim = prims[i].prim;
+            const float3 v0 = make_float3(vertices[3 * prim + 0]);
+            const float3 v1 = make_float3(vertices[3 * prim + 1]);
+            const float3 v2 = make_float3(vertices[3 * prim + 2]);
+            m_triangles.push_back({v0, v1 - v0, v2 - v0, prim});
+        }
+        return node_idx;
+    }
+
+    buildRecursive(prims, begin, mid, vertices, depth + 1);
+    const uint32_t right = buildRecursive(prims, mid, end, vertices, depth + 1);
+    m_nodes[node_idx].offset = right;
+    m_nodes[node_idx].count = 0;
+    m_nodes[node_idx].axis = static_cast<uint16_t>(best_axis);
+    return node_idx;
+}
+
+void CpuBvh::build(const float4 *vertices, size_t triangle_count) {
+    m_nodes.clear();
+    m_triangles.clear();
+    if (triangle_count == 0) return;
+
+    std::vector<BuildPrim> prims(triangle_count);
+    for (size_t i = 0; i < triangle_count; ++i) {
+        const float3 v0 = make_float3(vertices[3 * i + 0]);
+        const float3 v1 = make_float3(vertices[3 * i + 1]);
+        const float3 v2 = make_float3(vertices[3 * i + 2]);
+        prims[i].bmin = vmin(v0, vmin(v1, v2));
+        prims[i].bmax = vmax(v0, vmax(v1, v2));
+        prims[i].centroid = 0.5f * (prims[i].bmin + prims[i].bmax);
+        prims[i].prim = static_cast<int32_t>(i);
+    }
+    m_nodes.reserve(2 * triangle_count / MAX_LEAF_SIZE + 1);
+    m_triangles.reserve(triangle_count);
+    buildRecursive(prims, 0, triangle_count, vertices, 0);
+}
+
+bool CpuBvh::load(const void *nodes, size_t node_bytes, const void *triangles, size_t triangle_bytes,
+                  size_t triangle_count) {
+    if (node_bytes % sizeof(Node) != 0 || triangle_bytes % sizeof(Triangle) != 0) return false;
+    const Node *node_begin = static_cast<const Node *>(nodes);
+    const Triangle *triangle_begin = static_cast<const Triangle *>(triangles);
+    const size_t num_nodes = node_bytes / sizeof(Node);
+    const size_t num_triangles = triangle_bytes / sizeof(Triangle);
+    if (num_triangles != triangle_count || (num_nodes == 0) != (num_triangles == 0)) return false;
+    for (size_t i = 0; i < num_triangles; ++i)
+        if (triangle_begin[i].prim < 0 || static_cast<size_t>(triangle_begin[i].prim) >= triangle_count) return false;
+
+    // Parents come first, so one sweep sees every node reached before it is checked. Each
+    // node is the child of one parent, leaves take the triangles in order like build().
+    std::vector<int> depths(num_nodes, -1);
+    if (num_nodes > 0) depths[0] = 0;
+    size_t next_triangle = 0;
+    for (size_t n = 0; n < num_nodes; ++n) {
+        const Node &node = node_begin[n];
+        if (depths[n] < 0) return false;
+        if (node.count > 0) {
+            if (node.offset != next_triangle || node.count > num_triangles - next_triangle) return false;
+            next_triangle += node.count;
+            continue;
+        }
+        if (node.axis > 2 || depths[n] + 1 >= STACK_SIZE || node.offset <= n + 1 || node.offset >= num_nodes ||
+            depths[n + 1] >= 0 || depths[node.offset] >= 0)
+            return false;
+        depths[n + 1] = depths[node.offset] = depths[n] + 1;
+    }
+    if (next_triangle != num_triangles) return false;
+
+    m_nodes.assign(node_begin, node_begin + node_bytes / sizeof(Node));
+    m_triangles.assign(triangle_begin, triangle_begin + triangle_bytes / sizeof(Triangle));
+    return true;
+}
+
+void CpuBvh::refit(const float4 *vertices) {
+    for (Triangle &tri: m_triangles) {
+        const float3 v0 = make_float3(vertices[3 * tri.prim + 0]);
+        tri.v0 = v0;
+        tri.e1 = make_float3(vertices[3 * tri.prim + 1]) - v0;
+        tri.e2 = make_float3(vertices[3 * tri.prim + 2]) - v0;
+    }
+    // Children are stored after their parent, so a reverse sweep sees them first
+    for (size_t n = m_nodes.size(); n-- > 0;) {
+        Node &node = m_nodes[n];
+        float3 bmin = make_float3(FLT_MAX), bmax = make_float3(-FLT_MAX);
+        if (node.count) {
+            for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                const Triangle &tri = m_triangles[i];
+                const float3 v1 = tri.v0 + tri.e1;
+                const float3 v2 = tri.v0 + tri.e2;
+                bmin = vmin(bmin, vmin(tri.v0, vmin(v1, v2)));
+                bmax = vmax(bmax, vmax(tri.v0, vmax(v1, v2)));
+            }
+        } else {
+            const Node &left = m_nodes[n + 1];
+            const Node &right = m_nodes[node.offset];
+            bmin = vmin(make_float3(left.bmin[0], left.bmin[1], left.bmin[2]),
+                        make_float3(right.bmin[0], right.bmin[1], right.bmin[2]));
+            bmax = vmax(make_float3(left.bmax[0], left.bmax[1], left.bmax[2]),
+                        make_float3(right.bmax[0], right.bmax[1], right.bmax[2]));
+        }
+        node.bmin[0] = bmin.x; node.bmin[1] = bmin.y; node.bmin[2] = bmin.z;
+        node.bmax[0] = bmax.x; node.bmax[1] = bmax.y; node.bmax[2] = bmax.z;
+    }
+}
+
+void CpuBvh::bounds(float3 &bmin, float3 &bmax) const {
+    if (m_nodes.empty()) {
+        bmin = make_float3(FLT_MAX);
+        bmax = make_float3(-FLT_MAX);
+        return;
+    }
+    bmin = make_float3(m_nodes[0].bmin[0], m_nodes[0].bmin[1], m_nodes[0].bmin[2]);
+    bmax = make_float3(m_nodes[0].bmax[0], m_nodes[0].bmax[1], m_nodes[0].bmax[2]);
+}
+
+size_t CpuBvh::memoryUsage() const {
+    return m_nodes.capacity() * sizeof(Node) + m_triangles.capacity() * sizeof(Triangle);
+}
+
+namespace {
+    struct TraversalRay {
+        float3 origin;
+        float3 direction;
+        float3 inv_direction;
+    };
+
+    inline float minf(float a, float b) {
+        return a < b ? a : b;
+    }
+
+    inline float maxf(float a, float b) {
+        return a > b ? a : b;
+    }
+
+    // A NaN slab distance (ray origin on an axis aligned box face) only ever ends up as
+    // the first argument of minf/maxf and is dropped there.
+    inline bool intersectBox(const float *bmin, const float *bmax, const TraversalRay &r, float tmin, float tmax) {
+        const float tx0 = (bmin[0] - r.origin.x) * r.inv_direction.x;
+        const float tx1 = (bmax[0] - r.origin.x) * r.inv_direction.x;
+        const float ty0 = (bmin[1] - r.origin.y) * r.inv_direction.y;
+        const float ty1 = (bmax[1] - r.origin.y) * r.inv_direction.y;
+        const float tz0 = (bmin[2] - r.origin.z) * r.inv_direction.z;
+        const float tz1 = (bmax[2] - r.origin.z) * r.inv_direction.z;
+        tmin = maxf(maxf(minf(tx0, tx1), maxf(minf(ty0, ty1), minf(tz0, tz1))), tmin);
+        tmax = minf(minf(maxf(tx0, tx1), minf(maxf(ty0, ty1), maxf(tz0, tz1))), tmax);
+        return tmin <= tmax;
+    }
+
+    template<typename Tri>
+    inline bool intersectTriangle(const Tri &tri, const TraversalRay &r, float tmin, float tmax,
+                                  float &t, float &u, float &v) {
+        const float3 pvec = cross(r.direction, tri.e2);
+        const float det = dot(tri.e1, pvec);
+        if (fabsf(det) < 1e-12f) return false;
+        const float inv_det = 1.f / det;
+        const float3 tvec = r.origin - tri.v0;
+        u = dot(tvec, pvec) * inv_det;
+        if (u < 0.f || u > 1.f) return false;
+        const float3 qvec = cross(tvec, tri.e1);
+        v = dot(r.direction, qvec) * inv_det;
+        if (v < 0.f || u + v > 1.f) return false;
+        t = dot(tri.e2, qvec) * inv_det;
+        return t > tmin && t < tmax;
+    }
+
+    inline TraversalRay makeTraversalRay(const CpuRay &ray) {
+        TraversalRay r;
+        r.origin = ray.origin;
+        r.direction = ray.direction;
+        r.inv_direction = make_float3(1.f / ray.direction.x, 1.f / ray.direction.y, 1.f / ray.direction.z);
+        return r;
+    }
+}
+
+bool CpuBvh::intersect(const CpuRay &ray, CpuHit &hit) const {
+    hit.prim = -1;
+    hit.instance = -1;
+    if (m_nodes.empty()) return false;
+
+    const TraversalRay r = makeTraversalRay(ray);
+    float tmax = ray.tmax;
+    uint32_t stack[STACK_SIZE];
+    int stack_ptr = 0;
+    uint32_t node_idx = 0;
+    for (;;) {
+        const Node &node = m_nodes[node_idx];
+        if (intersectBox(node.bmin, node.bmax, r, ray.tmin, tmax)) {
+            if (node.count == 0) {
+                // descend into the near child first, the far one may be culled by then
+                const bool right_first = component(ray.direction, node.axis) < 0.f;
+                stack[stack_ptr++] = right_first ? node_idx + 1 : node.offset;
+                node_idx = right_first ? node.offset : node_idx + 1;
+                continue;
+            }
+            for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                float t, u, v;
+                if (intersectTriangle(m_triangles[i], r, ray.tmin, tmax, t, u, v)) {
+                    tmax = t;
+                    hit.t = t;
+                    hit.u = u;
+                    hit.v = v;
+                    hit.prim = m_triangles[i].prim;
+                }
+            }
+        }
+        if (stack_ptr == 0) break;
+        node_idx = stack[--stack_ptr];
+    }
+    return hit.prim >= 0;
+}
+
+bool CpuBvh::occluded(const CpuRay &ray, OcclusionCache *cache) const {
+    if (m_nodes.empty()) return false;
+
+    const TraversalRay r = makeTraversalRay(ray);
+    float t, u, v;
+    if (cache && cache->last_occluder >= 0 && cache->last_occluder < static_cast<int32_t>(m_triangles.size())) {
+        cache->lookups++;
+        if (intersectTriangle(m_triangles[cache->last_occluder], r, ray.tmin, ray.tmax, t, u, v)) {
+            cache->hits++;
+            return true;
+        }
+    }
+
+    uint32_t stack[STACK_SIZE];
+    int stack_ptr = 0;
+    uint32_t node_idx = 0;
+    for (;;) {
+        const Node &node = m_nodes[node_idx];
+        if (intersectBox(node.bmin, node.bmax, r, ray.tmin, ray.tmax)) {
+            if (node.count == 0) {
+                // same front-to-back order as closest hit: occluders close to the shading
+                // point are found first and end the traversal
+                const bool right_first = component(ray.direction, node.axis) < 0.f;
+                stack[stack_ptr++] = right_first ? node_idx + 1 : node.offset;
+                node_idx = right_first ? node.offset : node_idx + 1;
+                continue;
+            }
+            for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                if (intersectTriangle(m_triangles[i], r, ray.tmin, ray.tmax, t, u, v)) {
+                    if (cache) cache->last_occluder = static_cast<int32_t>(i);
+                    return true;
+                }
+            }
+        }
+        if (stack_ptr == 0) break;
+        node_idx = stack[--stack_ptr];
+    }
+    return false;
+}
+
+namespace {
+    inline float3 transformPoint(const float *m, const float3 &p) {
+        return make_float3(m[0] * p.x + m[1] * p.y + m[2] * p.z + m[3],
+                           m[4] * p.x + m[5] * p.y + m[6] * p.z + m[7],
+                           m[8] * p.x + m[9] * p.y + m[10] * p.z + m[11]);
+    }
+
+    inline float3 transformVector(const float *m, const float3 &v) {
+        return make_float3(m[0] * v.x + m[1] * v.y + m[2] * v.z,
+                           m[4] * v.x + m[5] * v.y + m[6] * v.z,
+                           m[8] * v.x + m[9] * v.y + m[10] * v.z);
+    }
+
+    // Inverse of an affine row major 3x4 matrix
+    void invertAffine(const float *m, float *inv) {
+        const float det = m[0] * (m[5] * m[10] - m[6] * m[9]) - m[1] * (m[4] * m[10] - m[6] * m[8]) +
+                          m[2] * (m[4] * m[9] - m[5] * m[8]);
+        const float inv_det = det != 0.f ? 1.f / det : 0.f;
+        inv[0] = (m[5] * m[10] - m[6] * m[9]) * inv_det;
+        inv[1] = (m[2] * m[9] - m[1] * m[10]) * inv_det;
+        inv[2] = (m[1] * m[6] - m[2] * m[5]) * inv_det;
+        inv[4] = (m[6] * m[8] - m[4] * m[10]) * inv_det;
+        inv[5] = (m[0] * m[10] - m[2] * m[8]) * inv_det;
+        inv[6] = (m[2] * m[4] - m[0] * m[6]) * inv_det;
+        inv[8] = (m[4] * m[9] - m[5] * m[8]) * inv_det;
+        inv[9] = (m[1] * m[8] - m[0] * m[9]) * inv_det;
+        inv[10] = (m[0] * m[5] - m[1] * m[4]) * inv_det;
+        const float3 t = transformVector(inv, make_float3(m[3], m[7], m[11]));
+        inv[3] = -t.x;
+        inv[7] = -t.y;
+        inv[11] = -t.z;
+    }
+
+    inline CpuRay toObjectSpace(const float *inverse, const CpuRay &ray, float tmax) {
+        return {transformPoint(inverse, ray.origin), transformVector(inverse, ray.direction), ray.tmin, tmax};
+    }
+
+    // First root of |o + t d| = 1 in [tmin, tmax], d is not normalized in object space
+    bool intersectUnitSphere(const CpuRay &ray, float &t) {
+        const float a = dot(ray.direction, ray.direction);
+        const float b = dot(ray.origin, ray.direction);
+        const float c = dot(ray.origin, ray.origin) - 1.f;
+        const float discriminant = b * b - a * c;
+        if (discriminant < 0.f) return false;
+        const float root = sqrtf(discriminant);
+        t = (-b - root) / a;
+        if (t < ray.tmin) t = (-b + root) / a;
+        return t >= ray.tmin && t <= ray.tmax;
+    }
+
+    // Object space ray against the bottom level of an instance
+    inline bool intersectBottom(const CpuBvh *bvh, const CpuRay &ray, CpuHit &hit) {
+        if (bvh) return bvh->intersect(ray, hit);
+        if (!intersectUnitSphere(ray, hit.t)) return false;
+        hit.u = hit.v = 0.f;
+        hit.prim = 0;
+        return true;
+    }
+
+    inline bool occludedBottom(const CpuBvh *bvh, const CpuRay &ray, OcclusionCache *cache) {
+        if (bvh) return bvh->occluded(ray, cache);
+        float t;
+        if (!intersectUnitSphere(ray, t)) return false;
+        if (cache) cache->last_occluder = -1;
+        return true;
+    }
+}
+
+uint32_t CpuInstanceBvh::buildRecursive(std::vector<BuildInstance> &build, size_t begin, size_t end,
+                                        const std::vector<CpuInstance> &instances) {
+    const uint32_t node_idx = static_cast<uint32_t>(m_nodes.size());
+    m_nodes.push_back(Node());
+
+    float3 bmin = make_float3(FLT_MAX), bmax = make_float3(-FLT_MAX);
+    float3 cmin = make_float3(FLT_MAX), cmax = make_float3(-FLT_MAX);
+    for (size_t i = begin; i < end; ++i) {
+        bmin = vmin(bmin, build[i].bmin);
+        bmax = vmax(bmax, build[i].bmax);
+        cmin = vmin(cmin, build[i].centroid);
+        cmax = vmax(cmax, build[i].centroid);
+    }
+    {
+        Node &node = m_nodes[node_idx];
+        node.bmin[0] = bmin.x; node.bmin[1] = bmin.y; node.bmin[2] = bmin.z;
+        node.bmax[0] = bmax.x; node.bmax[1] = bmax.y; node.bmax[2] = bmax.z;
+    }
+
+    // Instances are few compared to triangles and overlap a lot, a median split is good enough
+    const size_t count = end - begin;
+    if (count <= MAX_LEAF_SIZE) {
+        Node &node = m_nodes[node_idx];
+        node.offset = static_cast<uint32_t>(m_instances.size());
+        node.count = static_cast<uint16_t>(count);
+        node.axis = 0;
+        for (size_t i = begin; i < end; ++i) {
+            const CpuInstance &instance = instances[build[i].id];
+            Instance leaf;
+            invertAffine(instance.transform, leaf.inverse);
+            leaf.bvh = instance.bvh;
+            leaf.id = build[i].id;
+            m_instances.push_back(leaf);
+        }
+        return node_idx;
+    }
+
+    const float3 extent = cmax - cmin;
+    const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    const size_t mid = begin + count / 2;
+    std::nth_element(build.begin() + begin, build.begin() + mid, build.begin() + end,
+                     [&](const BuildInstance &a, const BuildInstance &b) {
+                         return component(a.centroid, axis) < component(b.centroid, axis);
+                     });
+    buildRecursive(build, begin, mid, instances);
+    const uint32_t right = buildRecursive(build, mid, end, instances);
+    m_nodes[node_idx].offset = right;
+    m_nodes[node_idx].count = 0;
+    m_nodes[node_idx].axis = static_cast<uint16_t>(axis);
+    return node_idx;
+}
+
+void CpuInstanceBvh::build(const std::vector<CpuInstance> &instances) {
+    m_nodes.clear();
+    m_instances.clear();
+    m_inverse_transforms.assign(12 * instances.size(), 0.f);
+
+    std::vector<BuildInstance> build;
+    build.reserve(instances.size());
+    for (size_t i = 0; i < instances.size(); ++i) {
+        const float *m = instances[i].transform;
+        invertAffine(m, &m_inverse_transforms[12 * i]);
+
+        float3 obj_min = make_float3(-1.f), obj_max = make_float3(1.f);
+        if (instances[i].bvh) instances[i].bvh->bounds(obj_min, obj_max);
+        if (obj_min.x > obj_max.x) continue;
+        BuildInstance b;
+        b.bmin = make_float3(FLT_MAX);
+        b.bmax = make_float3(-FLT_MAX);
+        for (int corner = 0; corner < 8; ++corner) {
+            const float3 p = make_float3(corner & 1 ? obj_max.x : obj_min.x, corner & 2 ? obj_max.y : obj_min.y,
+                                         corner & 4 ? obj_max.z : obj_min.z);
+            const float3 w = transformPoint(m, p);
+            b.bmin = vmin(b.bmin, w);
+            b.bmax = vmax(b.bmax, w);
+        }
+        b.centroid = 0.5f * (b.bmin + b.bmax);
+        b.id = static_cast<int32_t>(i);
+        build.push_back(b);
+    }
+    if (build.empty()) return;
+    m_nodes.reserve(2 * build.size() / MAX_LEAF_SIZE + 1);
+    m_instances.reserve(build.size());
+    buildRecursive(build, 0, build.size(), instances);
+}
+
+bool CpuInstanceBvh::intersect(const CpuRay &ray, CpuHit &hit) const {
+    hit.prim = -1;
+    hit.instance = -1;
+    if (m_nodes.empty()) return false;
+
+    const TraversalRay r = makeTraversalRay(ray);
+    float tmax = ray.tmax;
+    uint32_t stack[STACK_SIZE];
+    int stack_ptr = 0;
+    uint32_t node_idx = 0;
+    for (;;) {
+        const Node &node = m_nodes[node_idx];
+        if (intersectBox(node.bmin, node.bmax, r, ray.tmin, tmax)) {
+            if (node.count == 0) {
+                const bool right_first = component(ray.direction, node.axis) < 0.f;
+                stack[stack_ptr++] = right_first ? node_idx + 1 : node.offset;
+                node_idx = right_first ? node.offset : node_idx + 1;
+                continue;
+            }
+            for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                const Instance &instance = m_instances[i];
+                CpuHit instance_hit;
+                if (intersectBottom(instance.bvh, toObjectSpace(instance.inverse, ray, tmax), instance_hit)) {
+                    tmax = instance_hit.t;
+                    hit = instance_hit;
+                    hit.instance = instance.id;
+                }
+            }
+        }
+        if (stack_ptr == 0) break;
+        node_idx = stack[--stack_ptr];
+    }
+    return hit.prim >= 0;
+}
+
+bool CpuInstanceBvh::occluded(const CpuRay &ray, OcclusionCache *cache) const {
+    if (m_nodes.empty()) return false;
+
+    // Try the instance of the last occluder first, with the cache pointing into its BVH
+    int32_t cached = -1;
+    if (cache && cache->last_instance >= 0 && cache->last_instance < static_cast<int32_t>(m_instances.size())) {
+        cached = cache->last_instance;
+        const Instance &instance = m_instances[cached];
+        if (occludedBottom(instance.bvh, toObjectSpace(instance.inverse, ray, ray.tmax), cache))
+            return true;
+    }
+
+    const TraversalRay r = makeTraversalRay(ray);
+    uint32_t stack[STACK_SIZE];
+    int stack_ptr = 0;
+    uint32_t node_idx = 0;
+    for (;;) {
+        const Node &node = m_nodes[node_idx];
+        if (intersectBox(node.bmin, node.bmax, r, ray.tmin, ray.tmax)) {
+            if (node.count == 0) {
+                const bool right_first = component(ray.direction, node.axis) < 0.f;
+                stack[stack_ptr++] = right_first ? node_idx + 1 : node.offset;
+                node_idx = right_first ? node.offset : node_idx + 1;
+                continue;
+            }
+            for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                if (static_cast<int32_t>(i) == cached) continue;
+                const Instance &instance = m_instances[i];
+                OcclusionCache instance_cache;
+                if (occludedBottom(instance.bvh, toObjectSpace(instance.inverse, ray, ray.tmax),
+                                   cache ? &instance_cache : nullptr)) {
+                    if (cache) {
+                        cache->last_occluder = instance_cache.last_occluder;
+                        cache->last_instance = static_cast<int32_t>(i);
+                    }
+                    return true;
+                }
+            }
+        }
+        if (stack_ptr == 0) break;
+        node_idx = stack[--stack_ptr];
+    }
+    return false;
+}
+
+float3 CpuInstanceBvh::normalToWorld(int32_t instance, const float3 &normal) const {
+    const float *m = &m_inverse_transforms[12 * instance];
+    return make_float3(m[0] * normal.x + m[4] * normal.y + m[8] * normal.z,
+                       m[1] * normal.x + m[5] * normal.y + m[9] * normal.z,
+                       m[2] * normal.x + m[6] * normal.y + m[10] * normal.z);
+}
+
+float3 CpuInstanceBvh::pointToObject(int32_t instance, const float3 &point) const {
+    return transformPoint(&m_inverse_transforms[12 * instance], point);
+}
+
+size_t CpuInstanceBvh::memoryUsage() const {
+    return m_nodes.capacity() * sizeof(Node) + m_instances.capacity() * sizeof(Instance) +
+           m_inverse_transforms.capacity() * sizeof(float);
+}
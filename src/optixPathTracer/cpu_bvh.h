@@ -0,0 +1,173 @@
+#pragma once
+
+#include <sutil/vec_math.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+*   Bounding volume hierarchy over the triangle soup that is uploaded to the device
+*   (three float4 vertices per triangle, see d_vertices), used to trace rays on the host.
+*/
+
+struct CpuRay {
+    float3 origin;
+    float3 direction;
+    float tmin;
+    float tmax;
+};
+
+struct CpuHit {
+    float t;
+    float u, v;         // barycentrics of vertex 1 and 2, same convention as optixGetTriangleBarycentrics
+    int32_t prim;       // index of the triangle in the input buffer, -1 on a miss
+    int32_t instance;   // index of the instance hit by CpuInstanceBvh, -1 for a CpuBvh traced directly
+};
+
+/*
+*   Shadow rays cast from neighbouring shading points tend to be blocked by the same
+*   triangle. Each tracing thread keeps one of these and passes it to occluded(), so the
+*   last occluder is tested before any traversal happens.
+*/
+struct OcclusionCache {
+    int32_t last_occluder = -1;   // index into the BVH's reordered triangles
+    int32_t last_instance = -1;   // CpuInstanceBvh: index into its reordered instances, owner of last_occluder
+    uint64_t hits = 0;
+    uint64_t lookups = 0;
+};
+
+class CpuBvh {
+public:
+    static const int MAX_LEAF_SIZE = 4;
+
+    void build(const float4 *vertices, size_t triangle_count);
+
+    // Recomputes the triangles and node bounds after vertices moved, keeping the topology.
+    // Cheap, but the tree degrades when triangles move far from where they were built.
+    void refit(const float4 *vertices);
+
+    // Closest hit in [tmin, tmax]
+    bool intersect(const CpuRay &ray, CpuHit &hit) const;
+
+    // Any hit in [tmin, tmax]. Returns as soon as one intersection is found.
+    bool occluded(const CpuRay &ray, OcclusionCache *cache = nullptr) const;
+
+    // Bounds of all triangles, empty (min > max) without any
+    void bounds(float3 &bmin, float3 &bmax) const;
+
+    size_t numTriangles() const { return m_triangles.size(); }
+    size_t numNodes() const { return m_nodes.size(); }
+    size_t memoryUsage() const;
+
+    // The built node and triangle arrays, to store a BVH in a prepared scene snapshot
+    const void *nodeData() const { return m_nodes.data(); }
+    size_t nodeBytes() const { return m_nodes.size() * sizeof(Node); }
+    const void *triangleData() const { return m_triangles.data(); }
+    size_t triangleBytes() const { return m_triangles.size() * sizeof(Triangle); }
+
+    /*
+    *   Restores the arrays of nodeData() and triangleData() of a BVH over triangle_count
+    *   triangles. False if they are not a tree build() could have made: the sizes, every
+    *   child, leaf range and triangle index are checked and the depth against the traversal
+    *   stack, so a damaged snapshot is rebuilt instead of traced out of bounds.
+    */
+    bool load(const void *nodes, size_t node_bytes, const void *triangles, size_t triangle_bytes,
+              size_t triangle_count);
+
+    // Sizes of the stored node and triangle, part of what a snapshot has to match
+    static size_t nodeSize() { return sizeof(Node); }
+    static size_t triangleSize() { return sizeof(Triangle); }
+
+private:
+    // 32 bytes, the left child of an interior node directly follows its parent
+    struct Node {
+        float bmin[3];
+        uint32_t offset;    // interior: index of the right child, leaf: index of the first triangle
+        float bmax[3];
+        uint16_t count;     // number of triangles, 0 for interior nodes
+        uint16_t axis;      // split axis of interior nodes
+    };
+
+    // Precomputed for the Moeller-Trumbore test
+    struct Triangle {
+        float3 v0;
+        float3 e1;
+        float3 e2;
+        int32_t prim;
+    };
+
+    struct BuildPrim {
+        float3 bmin;
+        float3 bmax;
+        float3 centroid;
+        int32_t prim;
+    };
+
+    uint32_t buildRecursive(std::vector<BuildPrim> &prims, size_t begin, size_t end, const float4 *vertices,
+                            int depth);
+
+    std::vector<Node> m_nodes;
+    std::vector<Triangle> m_triangles;
+};
+
+// An instance of a bottom level CpuBvh, the BVH has to outlive the CpuInstanceBvh
+struct CpuInstance {
+    float transform[12];    // object to world, row major 3x4 like OptixInstance::transform
+    const CpuBvh *bvh;      // nullptr places an analytic unit sphere, hit as prim 0
+};
+
+/*
+*   Top level of a two level hierarchy, a BVH over the world bounds of instances. Rays are
+*   transformed into the object space of every instance they reach. The transform is affine,
+*   so hit.t is the same ray parameter in both spaces and hits compare across instances.
+*/
+class CpuInstanceBvh {
+public:
+    void build(const std::vector<CpuInstance> &instances);
+
+    bool intersect(const CpuRay &ray, CpuHit &hit) const;
+    bool occluded(const CpuRay &ray, OcclusionCache *cache = nullptr) const;
+
+    // Object space normal to world space (inverse transpose of the instance's transform)
+    float3 normalToWorld(int32_t instance, const float3 &normal) const;
+
+    // World space point to the object space of an instance
+    float3 pointToObject(int32_t instance, const float3 &point) const;
+
+    bool empty() const { return m_instances.empty(); }
+    size_t numInstances() const { return m_instances.size(); }
+    size_t memoryUsage() const;
+
+private:
+    static const int MAX_LEAF_SIZE = 2;
+
+    // Same layout as CpuBvh::Node, leaves index m_instances
+    struct Node {
+        float bmin[3];
+        uint32_t offset;
+        float bmax[3];
+        uint16_t count;
+        uint16_t axis;
+    };
+
+    struct Instance {
+        float inverse[12];      // world to object
+        const CpuBvh *bvh;      // nullptr for the unit sphere
+        int32_t id;             // index in the build input
+    };
+
+    struct BuildInstance {
+        float3 bmin;
+        float3 bmax;
+        float3 centroid;
+        int32_t id;
+    };
+
+    uint32_t buildRecursive(std::vector<BuildInstance> &build, size_t begin, size_t end,
+                            const std::vector<CpuInstance> &instances);
+
+    std::vector<Node> m_nodes;
+    std::vector<Instance> m_instances;
+    std::vector<float> m_inverse_transforms;    // 12 per build input instance, world to object
+};
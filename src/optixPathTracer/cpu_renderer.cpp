@@ -0,0 +1,451 @@
+#include <optix.h>
+#include <cuda_runtime.h>
+
+#include "cpu_renderer.h"
+#include "light_sampling.h"
+
+#include <cuda/random.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+#define TWO_PI            6.2831853071795864769252867665590057683943f
+#define EPSILON           0.00001f
+
+namespace {
+    // Rows handed to a thread at a time, small enough to balance uneven scenes
+    const int ROWS_PER_TASK = 4;
+
+    struct RadiancePRD {
+        float3 emitted;
+        float3 radiance;
+        float3 attenuation;
+        float3 origin;
+        float3 direction;
+        float3 albedo;
+        float3 normal;
+        float depth;
+        unsigned int seed;
+        bool countEmitted;
+        bool done;
+        bool hitLight;
+    };
+
+    struct Onb {
+        explicit Onb(const float3 &normal) {
+            m_normal = normal;
+            if (fabsf(m_normal.x) > fabsf(m_normal.z)) {
+                m_binormal = make_float3(-m_normal.y, m_normal.x, 0.f);
+            } else {
+                m_binormal = make_float3(0.f, -m_normal.z, m_normal.y);
+            }
+            m_binormal = normalize(m_binormal);
+            m_tangent = cross(m_binormal, m_normal);
+        }
+
+        void inverseTransform(float3 &p) const {
+            p = normalize(p.x * m_tangent + p.y * m_binormal + p.z * m_normal);
+        }
+
+        static float3 refractRay(const float eta, const float3 &p, const float3 &n) {
+            const float k = 1.f - eta * eta * (1.f - dot(n, p) * dot(n, p));
+            if (k < 0.f) return make_float3(0.f);
+            return eta * p + (eta * dot(n, p) - sqrtf(k)) * n;
+        }
+
+        void computeFresnelDirection(const float u1, const float ior, float3 &p) const {
+            float cosine = clamp(dot(p, m_normal), -1.f, 1.f);
+            float3 n = m_normal;
+            float etaI = 1.f;
+            float etaT = ior;
+            if (cosine < 0.f) {
+                cosine = -cosine;
+            } else {
+                std::swap(etaI, etaT);
+                n = -n;
+            }
+            const float3 refract_dir = refractRay(etaI / etaT, p, n);
+            float reflect_prob = 1.f;
+            if (length(refract_dir) != 0.f) {
+                float R0 = (etaI - etaT) / (etaI + etaT);
+                R0 *= R0;
+                reflect_prob = R0 + (1.f - R0) * powf(1.f - cosine, 5.f);
+            }
+            p = u1 < reflect_prob ? reflect(p, m_normal) : refract_dir;
+        }
+
+        float3 m_tangent;
+        float3 m_binormal;
+        float3 m_normal;
+    };
+
+    inline void cosineSampleHemisphere(const float u1, const float u2, float3 &p) {
+        const float r = sqrtf(u1);
+        const float phi = 2.0f * M_PIf * u2;
+        p.x = r * cosf(phi);
+        p.y = r * sinf(phi);
+        const float z2 = 1.0f - p.x * p.x - p.y * p.y;
+        p.z = sqrtf(z2 > 0.f ? z2 : 0.f);
+    }
+
+    inline void glossyLobeSample(const float u1, const float u2, const float spec_exp, float3 &p) {
+        const float theta = acosf(powf(u1, 1.f / (spec_exp + 1.f)));
+        const float phi = TWO_PI * u2;
+        p = make_float3(cosf(phi) * sinf(theta), sinf(phi) * sinf(theta), cosf(theta));
+    }
+
+    void computeNewDirection(const float u1, const float u2, const float ior, const float spec_exp, float3 &p,
+                             const Material m, const float3 &normal) {
+        const Onb onb(normal);
+        switch (m) {
+            case DIFFUSE:
+            case TEXTURE:
+                cosineSampleHemisphere(u1, u2, p);
+                onb.inverseTransform(p);
+                break;
+            case MIRROR:
+                p = reflect(p, normal);
+                break;
+            case FRESNEL:
+                onb.computeFresnelDirection(u1, ior, p);
+                break;
+            case GLOSSY:
+                glossyLobeSample(u1, u2, spec_exp, p);
+                onb.inverseTransform(p);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Bilinear lookup with wrapping, like tex2D on the texture objects of createTextures()
+    float3 sampleTexture(const CpuTexture &texture, float s, float t) {
+        const float x = s * texture.width - 0.5f;
+        const float y = t * texture.height - 0.5f;
+        const float fx = x - floorf(x);
+        const float fy = y - floorf(y);
+        const int x0 = static_cast<int>(floorf(x));
+        const int y0 = static_cast<int>(floorf(y));
+        const auto texel = [&texture](int tx, int ty) {
+            tx %= texture.width;
+            ty %= texture.height;
+            if (tx < 0) tx += texture.width;
+            if (ty < 0) ty += texture.height;
+            const uint32_t c = texture.pixels[ty * texture.width + tx];
+            return make_float3(c & 0xff, (c >> 8) & 0xff, (c >> 16) & 0xff) * (1.f / 255.f);
+        };
+        return lerp(lerp(texel(x0, y0), texel(x0 + 1, y0), fx),
+                    lerp(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), fx), fy);
+    }
+
+    inline float luminance(const float3 &c) {
+        return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+    }
+
+    inline float pixelError(const float2 &moments, const float launches) {
+        const float variance = std::max(moments.y - moments.x * moments.x, 0.0f);
+        return sqrtf(variance / launches) / std::max(moments.x, 0.01f);
+    }
+
+    inline float4 heatmapColor(const float t) {
+        const float x = clamp(t, 0.0f, 2.0f) * 0.5f;
+        return make_float4(clamp(2.0f * x - 0.5f, 0.0f, 1.0f),
+                           clamp(1.5f - fabsf(4.0f * x - 2.0f), 0.0f, 1.0f),
+                           clamp(1.5f - 2.0f * x, 0.0f, 1.0f) * 0.8f,
+                           1.0f);
+    }
+
+    // __closesthit__radiance and __miss__radiance
+    void traceRadiance(const CpuScene &scene, const Params &params, const float3 &ray_origin,
+                       const float3 &ray_dir, RadiancePRD &prd, CpuSceneOcclusionCache &occlusion) {
+        const CpuRay ray = {ray_origin, ray_dir, 0.01f, 1e16f};
+        CpuHit hit;
+        if (!scene.intersect(ray, hit)) {
+            prd.radiance = scene.bg_color;
+            prd.done = true;
+            return;
+        }
+
+        // Instanced geometry is in object space, like the vertices a closest hit program sees
+        const CpuMeshInstance *instance = hit.instance >= 0 ? &scene.instances[hit.instance] : nullptr;
+        const CpuMesh *mesh = instance ? &scene.meshes[instance->mesh] : nullptr;
+        const float2 *texcoords = mesh ? mesh->texcoords : scene.texcoords;
+        const int vert_idx_offset = hit.prim * 3;
+        const CpuMaterial &material = scene.material(hit);
+        const Material mat = material.mat;
+        const float3 P = ray_origin + hit.t * ray_dir;
+        const float3 N_0 = scene.normal(hit, P);
+        const float3 N = faceforward(N_0, -ray_dir, N_0);
+
+        const bool first_hit = prd.countEmitted;
+        prd.emitted = prd.countEmitted ? material.emission_color : make_float3(0.0f);
+        if (first_hit) {
+            prd.normal = N;
+            prd.depth = hit.t;
+        }
+
+        if (mat == EMISSIVE) {
+            if (first_hit) prd.albedo = clamp(material.emission_color, 0.0f, 1.0f);
+            prd.hitLight = true;
+            prd.radiance += material.emission_color;
+            return;
+        }
+
+        unsigned int seed = prd.seed;
+        {
+            const float z1 = rnd(seed);
+            const float z2 = rnd(seed);
+
+            float3 w_in = ray_dir;
+            computeNewDirection(z1, z2, material.ior, material.spec_exp, w_in, mat, N);
+            prd.direction = w_in;
+            prd.origin = P + prd.direction * EPSILON;
+
+            float3 color = material.diffuse_color;
+            if (mat == GLOSSY || mat == MIRROR || mat == FRESNEL) {
+                color = material.specular_color;
+            } else if (mat == TEXTURE && texcoords && material.texture.pixels) {
+                const float2 tc = (1.f - hit.u - hit.v) * texcoords[vert_idx_offset + 0]
+                                  + hit.u * texcoords[vert_idx_offset + 1]
+                                  + hit.v * texcoords[vert_idx_offset + 2];
+                color = sampleTexture(material.texture, tc.x, tc.y);
+            }
+            prd.attenuation *= color;
+            if (first_hit) prd.albedo = color;
+            prd.countEmitted = false;
+        }
+
+        const float z1 = rnd(seed);
+        const float z2 = rnd(seed);
+        prd.seed = seed;
+
+        if (params.num_lights == 0) return;
+        unsigned int light_idx;
+        float selection_weight = 1.f;
+        if (params.light_tree) {
+            float pdf;
+            const int picked = sampleLightTree(params.light_tree, P, N, rnd(seed), pdf);
+            if (picked < 0 || pdf <= 0.f) return;
+            light_idx = picked;
+            selection_weight = 1.f / (pdf * params.num_lights);
+        } else {
+            light_idx = lcg(seed) % params.num_lights;
+        }
+
+        LightSample sample;
+        if (!sampleLight(params.lights[light_idx], P, N, z1, z2, sample)) {
+            if (sample.hit_light) {
+                prd.hitLight = true;
+                prd.radiance += material.emission_color;
+            }
+            return;
+        }
+
+        const CpuRay shadow_ray = {P, sample.direction, 0.01f, sample.distance - 0.01f};
+        if (!scene.occluded(shadow_ray, &occlusion))
+            prd.radiance += sample.radiance * selection_weight;
+    }
+}
+
+bool CpuScene::intersect(const CpuRay &ray, CpuHit &hit) const {
+    const bool world_hit = bvh.intersect(ray, hit);
+    CpuRay instance_ray = ray;
+    if (world_hit) instance_ray.tmax = hit.t;
+    CpuHit instance_hit;
+    if (!instance_bvh.intersect(instance_ray, instance_hit)) return world_hit;
+    hit = instance_hit;
+    return true;
+}
+
+bool CpuScene::occluded(const CpuRay &ray, CpuSceneOcclusionCache *cache) const {
+    return bvh.occluded(ray, cache ? &cache->world : nullptr) ||
+           instance_bvh.occluded(ray, cache ? &cache->instances : nullptr);
+}
+
+float3 CpuScene::normal(const CpuHit &hit, const float3 &P) const {
+    if (hit.instance < 0) {
+        const float3 v0 = make_float3(vertices[3 * hit.prim + 0]);
+        const float3 v1 = make_float3(vertices[3 * hit.prim + 1]);
+        const float3 v2 = make_float3(vertices[3 * hit.prim + 2]);
+        return normalize(cross(v1 - v0, v2 - v0));
+    }
+    const CpuMesh &mesh = meshes[instances[hit.instance].mesh];
+    float3 N_0;
+    if (mesh.sphere) {
+        // The object space hit point of the unit sphere is its normal
+        N_0 = instance_bvh.pointToObject(hit.instance, P);
+    } else {
+        const float3 v0 = make_float3(mesh.vertices[3 * hit.prim + 0]);
+        const float3 v1 = make_float3(mesh.vertices[3 * hit.prim + 1]);
+        const float3 v2 = make_float3(mesh.vertices[3 * hit.prim + 2]);
+        N_0 = cross(v1 - v0, v2 - v0);
+    }
+    return normalize(instance_bvh.normalToWorld(hit.instance, N_0));
+}
+
+const CpuMaterial &CpuScene::material(const CpuHit &hit) const {
+    if (hit.instance < 0) return materials[material_indices[hit.prim]];
+    const CpuMeshInstance &instance = instances[hit.instance];
+    return materials[instance.materials[meshes[instance.mesh].material_indices[hit.prim]]];
+}
+
+CpuRenderer::CpuRenderer() {
+    setNumThreads(0);
+}
+
+void CpuRenderer::setNumThreads(unsigned int num_threads) {
+    m_num_threads = num_threads > 0 ? num_threads : std::thread::hardware_concurrency();
+    if (m_num_threads == 0) m_num_threads = 1;
+}
+
+unsigned int CpuRenderer::launchRect(const CpuScene &scene, const Params &params, int x0, int y0, int x1,
+                                     int y1) const {
+    const int w = params.width;
+    const int h = params.height;
+    const float3 U = params.U;
+    const float3 V = params.V;
+    const float3 W = params.W;
+    const float3 U_n = normalize(U), V_n = normalize(V), W_n = normalize(W);
+    const float threshold = params.adaptive_threshold > 0.0f ? params.adaptive_threshold : 0.01f;
+    unsigned int active = 0;
+    // Neighbouring pixels of the rectangle tend to be shadowed by the same triangles
+    CpuSceneOcclusionCache occlusion;
+
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            const unsigned int image_index = y * params.width + x;
+
+            const float4 accum_prev = params.subframe_index > 0 ? params.accum_buffer[image_index] : make_float4(0.0f);
+            const float2 moments_prev =
+                    params.subframe_index > 0 ? params.moments_buffer[image_index] : make_float2(0.0f);
+            const float launches = accum_prev.w;
+            if (params.redraw_only || (params.adaptive_threshold > 0.0f && launches >= params.adaptive_min_samples
+                                       && pixelError(moments_prev, launches) < threshold)) {
+                params.frame_buffer[image_index] = params.show_convergence
+                                                   ? heatmapColor(pixelError(moments_prev, launches) / threshold)
+                                                   : make_float4(make_float3(accum_prev), 1.f);
+                continue;
+            }
+
+            unsigned int seed = tea<4>(y * w + x, params.subframe_index);
+
+            float3 result = make_float3(0.0f);
+            float3 albedo = make_float3(0.0f);
+            float3 normal = make_float3(0.0f);
+            float first_depth = 0.0f;
+            int i = params.samples_per_launch;
+            do {
+                const float2 subpixel_jitter = make_float2(rnd(seed), rnd(seed));
+                const float2 d = 2.0f * make_float2(
+                        (static_cast<float>(x) + subpixel_jitter.x) / static_cast<float>(w),
+                        (static_cast<float>(y) + subpixel_jitter.y) / static_cast<float>(h)
+                ) - 1.0f;
+                float3 ray_direction = normalize(d.x * U + d.y * V + W);
+                float3 ray_origin = params.eye;
+
+                RadiancePRD prd;
+                prd.emitted = make_float3(0.f);
+                prd.radiance = make_float3(0.f);
+                prd.attenuation = make_float3(1.f);
+                prd.countEmitted = true;
+                prd.done = false;
+                prd.seed = seed;
+                prd.hitLight = false;
+                prd.albedo = make_float3(0.f);
+                prd.normal = make_float3(0.f);
+                prd.depth = 0.f;
+
+                unsigned int depth = 0;
+                for (;;) {
+                    traceRadiance(scene, params, ray_origin, ray_direction, prd, occlusion);
+
+                    if (depth == 0) {
+                        albedo += prd.albedo;
+                        normal += prd.normal;
+                        if (i == static_cast<int>(params.samples_per_launch))
+                            first_depth = prd.depth;
+                    }
+
+                    result += prd.emitted;
+                    result += prd.radiance * prd.attenuation;
+
+                    if (depth >= params.depth || prd.hitLight)
+                        break;
+
+                    if (prd.done) {
+                        result = make_float3(0.f);
+                        break;
+                    }
+
+                    ray_origin = prd.origin;
+                    ray_direction = prd.direction;
+
+                    // Russian roulette
+                    if (depth > 2) {
+                        const float3 &a = prd.attenuation;
+                        const float maxComp = a.x > a.y ? (a.x > a.z ? a.x : a.z) : (a.y > a.z ? a.y : a.z);
+                        const float r = rnd(prd.seed);
+                        if (r > maxComp)
+                            break;
+                        prd.attenuation /= maxComp;
+                    }
+                    ++depth;
+                }
+            } while (--i);
+
+            const float inv_spp = 1.f / static_cast<float>(params.samples_per_launch);
+            const float3 launch_color = result * inv_spp;
+            const float3 launch_albedo = albedo * inv_spp;
+            const float3 launch_normal = make_float3(dot(normal, U_n), dot(normal, V_n), dot(normal, W_n)) * inv_spp;
+            const float launch_lum = luminance(launch_color);
+            float3 accum_color = launch_color;
+            float2 moments = make_float2(launch_lum, launch_lum * launch_lum);
+            float3 accum_albedo = launch_albedo;
+            float3 accum_normal = launch_normal;
+
+            if (launches > 0.0f) {
+                const float a = 1.0f / (launches + 1.0f);
+                accum_color = lerp(make_float3(accum_prev), accum_color, a);
+                moments = lerp(moments_prev, moments, a);
+                accum_albedo = lerp(make_float3(params.albedo_buffer[image_index]), accum_albedo, a);
+                accum_normal = lerp(make_float3(params.normal_buffer[image_index]), accum_normal, a);
+            }
+            params.accum_buffer[image_index] = make_float4(accum_color, launches + 1.0f);
+            params.moments_buffer[image_index] = moments;
+            params.albedo_buffer[image_index] = make_float4(accum_albedo, 1.0f);
+            params.normal_buffer[image_index] = make_float4(accum_normal, 0.0f);
+            params.depth_buffer[image_index] = first_depth;
+
+            const float error = pixelError(moments, launches + 1.0f);
+            if (launches + 1.0f < params.adaptive_min_samples || error >= threshold)
+                ++active;
+
+            params.frame_buffer[image_index] = params.show_convergence ? heatmapColor(error / threshold)
+                                                                       : make_float4(accum_color, 1.f);
+        }
+    }
+    return active;
+}
+
+void CpuRenderer::launch(const CpuScene &scene, const Params &params) const {
+    const int height = static_cast<int>(params.height);
+    std::atomic<int> next_row(0);
+    std::atomic<unsigned int> active(0);
+    const auto worker = [&]() {
+        unsigned int thread_active = 0;
+        for (int y = next_row.fetch_add(ROWS_PER_TASK); y < height; y = next_row.fetch_add(ROWS_PER_TASK)) {
+            thread_active += launchRect(scene, params, 0, y, params.width, std::min(y + ROWS_PER_TASK, height));
+        }
+        active += thread_active;
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int t = 1; t < m_num_threads; ++t)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &thread: threads) thread.join();
+
+    if (params.active_pixels) *params.active_pixels = active;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <sutil/vec_math.h>
+
+#include "optixPathTracer.h"
+#include "cpu_bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+/*
+*   Host implementation of the path tracing kernels in optixPathTracer.cu, for machines
+*   without an OptiX capable GPU (benchmarks, regression renders, CPU workers). Pixels are
+*   seeded with tea<4> like on the device, so a launch with the same Params produces the
+*   same estimator, up to floating point differences.
+*/
+
+// RGBA8 texels as uploaded by createTextures(), sampled like the device texture object
+struct CpuTexture {
+    const uint32_t *pixels = nullptr;
+    int width = 0;
+    int height = 0;
+};
+
+// Per material data of the radiance hit group records
+struct CpuMaterial {
+    Material mat;
+    float3 emission_color;
+    float3 diffuse_color;
+    float3 specular_color;
+    float spec_exp;
+    float ior;
+    CpuTexture texture;     // TEXTURE materials only
+};
+
+// Object space geometry of an instanced mesh, the bottom level of the instance hierarchy
+struct CpuMesh {
+    const float4 *vertices = nullptr;           // three per triangle
+    const float2 *texcoords = nullptr;          // three per triangle
+    const uint32_t *material_indices = nullptr; // one per triangle, into the materials of an instance
+    CpuBvh bvh;
+    bool sphere = false;                        // traced as the analytic unit sphere, bvh stays empty
+};
+
+// What an entry of CpuScene::instance_bvh refers to
+struct CpuMeshInstance {
+    uint32_t mesh;                              // index into CpuScene::meshes
+    const uint32_t *materials = nullptr;        // mesh material index -> index into CpuScene::materials
+};
+
+// Last occluders of both levels of a CpuScene, one per tracing thread
+struct CpuSceneOcclusionCache {
+    OcclusionCache world;       // CpuScene::bvh
+    OcclusionCache instances;   // CpuScene::instance_bvh
+};
+
+// The scene buffers the device sees through the SBT, in host memory
+struct CpuScene {
+    const float4 *vertices = nullptr;           // three per triangle
+    const float2 *texcoords = nullptr;          // three per triangle
+    const uint32_t *material_indices = nullptr; // one per triangle
+    std::vector<CpuMaterial> materials;
+    float3 bg_color = make_float3(0.f);
+    CpuBvh bvh;
+
+    // Instanced meshes, traced besides bvh. instance_bvh points to the BVHs in meshes,
+    // which must not be reallocated after it is built.
+    std::vector<CpuMesh> meshes;
+    std::vector<CpuMeshInstance> instances;     // in the order of the instance_bvh build input
+    CpuInstanceBvh instance_bvh;
+
+    // Closest hit in bvh and the instances, hit.instance is -1 for bvh
+    bool intersect(const CpuRay &ray, CpuHit &hit) const;
+    // Any hit in bvh or the instances
+    bool occluded(const CpuRay &ray, CpuSceneOcclusionCache *cache = nullptr) const;
+
+    // World space geometric normal at the point P of a hit, not faced towards the ray
+    float3 normal(const CpuHit &hit, const float3 &P) const;
+    const CpuMaterial &material(const CpuHit &hit) const;
+};
+
+class CpuRenderer {
+public:
+    CpuRenderer();
+
+    // 0 uses one thread per hardware thread
+    void setNumThreads(unsigned int num_threads);
+
+    /*
+    *   Host equivalent of optixLaunch with __raygen__rg over the whole image. The buffers
+    *   in params must point to host memory, lights and light_tree too. params.handle is
+    *   ignored, rays are traced against scene.bvh and its instances. Counts the still
+    *   active pixels into *params.active_pixels when it is set.
+    */
+    void launch(const CpuScene &scene, const Params &params) const;
+
+    // Renders the pixels of [x0, x1) x [y0, y1) on the calling thread, returns the number of active ones
+    unsigned int launchRect(const CpuScene &scene, const Params &params, int x0, int y0, int x1, int y1) const;
+
+private:
+    unsigned int m_num_threads;
+};
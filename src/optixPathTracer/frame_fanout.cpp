@@ -0,0 +1,189 @@
+#include "frame_fanout.h"
+#include "tcp_socket.h"
+
+#include <algorithm>
+#include <cerrno>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    bool writeAll(int fd, bool is_socket, const unsigned char *data, size_t size) {
+        if (is_socket) return sendAll(fd, data, size);
+        while (size > 0) {
+            const ssize_t written = write(fd, data, size);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return false;
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    std::string peerName(int fd) {
+        sockaddr_in address;
+        socklen_t size = sizeof(address);
+        char host[INET_ADDRSTRLEN] = "?";
+        if (getpeername(fd, reinterpret_cast<sockaddr *>(&address), &size) != 0 || address.sin_family != AF_INET)
+            return "viewer";
+        inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+        return std::string(host) + ":" + std::to_string(ntohs(address.sin_port));
+    }
+}
+
+FrameFanout::FrameFanout(size_t queue_frames) : m_queue_frames(std::max<size_t>(1, queue_frames)) {}
+
+FrameFanout::~FrameFanout() {
+    if (m_listen_fd >= 0) {
+        // Wakes the acceptor blocked in accept()
+        shutdown(m_listen_fd, SHUT_RDWR);
+        m_acceptor.join();
+        closeSocket(m_listen_fd);
+    }
+    std::vector<std::unique_ptr<Subscriber>> subscribers;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        subscribers.swap(m_subscribers);
+        for (std::unique_ptr<Subscriber> &subscriber: subscribers) {
+            subscriber->closing = true;
+            subscriber->wake.notify_one();
+            if (subscriber->owns_fd) shutdown(subscriber->fd, SHUT_RDWR);
+        }
+    }
+    for (std::unique_ptr<Subscriber> &subscriber: subscribers) {
+        subscriber->sender.join();
+        if (subscriber->owns_fd) closeSocket(subscriber->fd);
+    }
+}
+
+uint32_t FrameFanout::subscribe(int fd, const std::string &name, bool owns_fd) {
+    struct stat info;
+    const bool is_socket = fstat(fd, &info) == 0 && S_ISSOCK(info.st_mode);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::unique_ptr<Subscriber> subscriber(new Subscriber());
+    subscriber->stats.id = m_next_id++;
+    subscriber->stats.name = name;
+    subscriber->stats.connected = true;
+    subscriber->fd = fd;
+    subscriber->is_socket = is_socket;
+    subscriber->owns_fd = owns_fd;
+    // Lag counts from the frames published after it subscribed
+    subscriber->last_sequence = m_sequence;
+    subscriber->sender = std::thread(&FrameFanout::send, this, subscriber.get());
+    m_subscribers.push_back(std::move(subscriber));
+    return m_subscribers.back()->stats.id;
+}
+
+void FrameFanout::unsubscribe(uint32_t id) {
+    std::unique_ptr<Subscriber> subscriber;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto found = std::find_if(m_subscribers.begin(), m_subscribers.end(),
+                                        [id](const std::unique_ptr<Subscriber> &s) { return s->stats.id == id; });
+        if (found == m_subscribers.end()) return;
+        subscriber = std::move(*found);
+        m_subscribers.erase(found);
+        subscriber->closing = true;
+        subscriber->wake.notify_one();
+        if (subscriber->owns_fd) shutdown(subscriber->fd, SHUT_RDWR);
+    }
+    // A caller's fd is not shut down, a write in progress to it is waited for
+    subscriber->sender.join();
+    if (subscriber->owns_fd) closeSocket(subscriber->fd);
+}
+
+bool FrameFanout::listen(uint16_t port, uint16_t *bound_port) {
+    if (m_listen_fd >= 0) return false;
+    m_listen_fd = listenTcp(port, false, bound_port);
+    if (m_listen_fd < 0) return false;
+    m_acceptor = std::thread(&FrameFanout::accept, this);
+    return true;
+}
+
+void FrameFanout::accept() {
+    for (int fd = acceptTcp(m_listen_fd); fd >= 0; fd = acceptTcp(m_listen_fd))
+        subscribe(fd, peerName(fd), true);
+}
+
+void FrameFanout::send(Subscriber *subscriber) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        subscriber->wake.wait(lock, [subscriber]() { return subscriber->closing || !subscriber->queue.empty(); });
+        if (subscriber->closing) break;
+        const Frame frame = subscriber->queue.front();
+        subscriber->queue.pop_front();
+        lock.unlock();
+        const bool ok = writeAll(subscriber->fd, subscriber->is_socket, frame.data->data(), frame.data->size());
+        const auto written = std::chrono::steady_clock::now();
+        lock.lock();
+        if (!ok) break;
+        SubscriberStats &stats = subscriber->stats;
+        ++stats.frames_sent;
+        stats.bytes_sent += frame.data->size();
+        stats.last_latency_ms = std::chrono::duration<double, std::milli>(written - frame.published).count();
+        stats.max_latency_ms = std::max(stats.max_latency_ms, stats.last_latency_ms);
+        subscriber->last_sequence = frame.sequence;
+    }
+    subscriber->stats.connected = false;
+    subscriber->queue.clear();
+}
+
+void FrameFanout::reap(std::vector<std::unique_ptr<Subscriber>> &finished) {
+    for (auto it = m_subscribers.begin(); it != m_subscribers.end();) {
+        if ((*it)->stats.connected) {
+            ++it;
+            continue;
+        }
+        finished.push_back(std::move(*it));
+        it = m_subscribers.erase(it);
+    }
+}
+
+void FrameFanout::publish(std::vector<unsigned char> &&frame) {
+    std::vector<std::unique_ptr<Subscriber>> finished;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const Frame shared = {std::make_shared<const std::vector<unsigned char>>(std::move(frame)), ++m_sequence,
+                              std::chrono::steady_clock::now()};
+        reap(finished);
+        for (std::unique_ptr<Subscriber> &subscriber: m_subscribers) {
+            if (subscriber->queue.size() >= m_queue_frames) {
+                subscriber->queue.pop_front();
+                ++subscriber->stats.frames_dropped;
+                ++m_frames_dropped;
+            }
+            subscriber->queue.push_back(shared);
+            subscriber->wake.notify_one();
+        }
+    }
+    // Their senders returned when they disconnected
+    for (std::unique_ptr<Subscriber> &subscriber: finished) {
+        subscriber->sender.join();
+        if (subscriber->owns_fd) closeSocket(subscriber->fd);
+    }
+}
+
+size_t FrameFanout::numSubscribers() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return static_cast<size_t>(std::count_if(m_subscribers.begin(), m_subscribers.end(),
+                                             [](const std::unique_ptr<Subscriber> &s) { return s->stats.connected; }));
+}
+
+uint64_t FrameFanout::framesDropped() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_frames_dropped;
+}
+
+std::vector<SubscriberStats> FrameFanout::stats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<SubscriberStats> stats;
+    for (const std::unique_ptr<Subscriber> &subscriber: m_subscribers) {
+        stats.push_back(subscriber->stats);
+        stats.back().queued = subscriber->queue.size();
+        stats.back().lag_frames = m_sequence - subscriber->last_sequence;
+    }
+    return stats;
+}
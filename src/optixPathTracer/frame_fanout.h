@@ -0,0 +1,94 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+*   Hands every encoded frame to any number of subscribers without copying it per subscriber
+*   and without waiting for any of them. Each subscriber has a sender thread and a queue of
+*   at most queue_frames frames; when it falls behind, its oldest queued frame is dropped, so
+*   a slow viewer loses frames instead of holding up the render loop and the other viewers.
+*/
+
+const size_t FANOUT_QUEUE_FRAMES = 4;
+
+struct SubscriberStats {
+    uint32_t id = 0;
+    std::string name;
+    bool connected = false;
+    uint64_t frames_sent = 0;
+    uint64_t frames_dropped = 0;
+    uint64_t bytes_sent = 0;
+    size_t queued = 0;
+    uint64_t lag_frames = 0;        // published since the frame it was sent last
+    double last_latency_ms = 0.0;   // from publish() to written
+    double max_latency_ms = 0.0;
+};
+
+class FrameFanout {
+public:
+    explicit FrameFanout(size_t queue_frames = FANOUT_QUEUE_FRAMES);
+    ~FrameFanout();
+
+    FrameFanout(const FrameFanout &) = delete;
+    FrameFanout &operator=(const FrameFanout &) = delete;
+
+    // Frames are written to fd (socket or pipe), which is closed once it is unsubscribed or
+    // disconnected if owns_fd and stays the caller's otherwise. Returns its id
+    uint32_t subscribe(int fd, const std::string &name, bool owns_fd = false);
+    void unsubscribe(uint32_t id);
+
+    // Accepts viewers on port (0 picks one, returned in bound_port) from a thread of its own,
+    // each one becomes a subscriber until it disconnects
+    bool listen(uint16_t port, uint16_t *bound_port = nullptr);
+
+    // Queues the frame for every subscriber and returns without writing anything
+    void publish(std::vector<unsigned char> &&frame);
+
+    // Connected subscribers
+    size_t numSubscribers() const;
+    // By every subscriber so far, including the ones gone since
+    uint64_t framesDropped() const;
+    std::vector<SubscriberStats> stats() const;
+
+private:
+    struct Frame {
+        std::shared_ptr<const std::vector<unsigned char>> data;
+        uint64_t sequence;
+        std::chrono::steady_clock::time_point published;
+    };
+
+    struct Subscriber {
+        SubscriberStats stats;
+        int fd = -1;
+        bool is_socket = false;
+        bool owns_fd = false;
+        bool closing = false;
+        uint64_t last_sequence = 0; // of the last frame sent
+        std::deque<Frame> queue;
+        std::condition_variable wake;
+        std::thread sender;
+    };
+
+    void send(Subscriber *subscriber);
+    void accept();
+    // Moves out the subscribers whose senders returned, with m_mutex held; they are joined without it
+    void reap(std::vector<std::unique_ptr<Subscriber>> &finished);
+
+    const size_t m_queue_frames;
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<Subscriber>> m_subscribers;
+    uint32_t m_next_id = 1;
+    uint64_t m_sequence = 0;
+    uint64_t m_frames_dropped = 0;
+
+    int m_listen_fd = -1;
+    std::thread m_acceptor;
+};
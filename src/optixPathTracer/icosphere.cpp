@@ -0,0 +1,85 @@
+#include <cuda_runtime.h>
+
+#include "icosphere.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+    // Same arithmetic as the unindexed subdivision this replaces, so the positions are bit identical
+    float3 toUnitSphere(float x, float y, float z) {
+        const float length = sqrtf(x * x + y * y + z * z);
+        return make_float3(x / length, y / length, z / length);
+    }
+
+    // Source: http://blog.andreaskahler.com/2009/06/creating-icosphere-mesh-in-code.html
+    IcosphereMesh icosahedron() {
+        const float t = (1.f + sqrtf(5.f)) / 2.f;
+        IcosphereMesh mesh;
+        mesh.vertices = {
+                toUnitSphere(-1.f, t, 0.f), toUnitSphere(1.f, t, 0.f),
+                toUnitSphere(-1.f, -t, 0.f), toUnitSphere(1.f, -t, 0.f),
+                toUnitSphere(0.f, -1.f, t), toUnitSphere(0.f, 1.f, t),
+                toUnitSphere(0.f, -1.f, -t), toUnitSphere(0.f, 1.f, -t),
+                toUnitSphere(t, 0.f, -1.f), toUnitSphere(t, 0.f, 1.f),
+                toUnitSphere(-t, 0.f, -1.f), toUnitSphere(-t, 0.f, 1.f)
+        };
+        mesh.indices = {0, 11, 5, 0, 5, 1, 0, 1, 7, 0, 7, 10, 0, 10, 11,
+                        1, 5, 9, 5, 11, 4, 11, 10, 2, 10, 7, 6, 7, 1, 8,
+                        3, 9, 4, 3, 4, 2, 3, 2, 6, 3, 6, 8, 3, 8, 9,
+                        4, 9, 5, 2, 4, 11, 6, 2, 10, 8, 6, 7, 9, 8, 1};
+        return mesh;
+    }
+
+    // Splits every triangle into four, the midpoint of an edge is created by the first triangle that uses it
+    IcosphereMesh subdivide(const IcosphereMesh &coarse) {
+        IcosphereMesh fine;
+        const size_t triangle_count = coarse.indices.size() / 3;
+        // A closed triangle mesh has 3/2 edges per triangle
+        fine.vertices.reserve(coarse.vertices.size() + triangle_count * 3 / 2);
+        fine.indices.reserve(coarse.indices.size() * 4);
+        fine.vertices = coarse.vertices;
+
+        std::unordered_map<uint64_t, uint32_t> midpoints;
+        midpoints.reserve(triangle_count * 3 / 2);
+        const auto midpoint = [&](uint32_t a, uint32_t b) {
+            const uint64_t key = (static_cast<uint64_t>(std::min(a, b)) << 32) | std::max(a, b);
+            const auto found = midpoints.find(key);
+            if (found != midpoints.end()) return found->second;
+            const float3 &p = fine.vertices[a];
+            const float3 &q = fine.vertices[b];
+            const uint32_t index = static_cast<uint32_t>(fine.vertices.size());
+            fine.vertices.push_back(toUnitSphere((p.x + q.x) / 2.f, (p.y + q.y) / 2.f, (p.z + q.z) / 2.f));
+            midpoints.emplace(key, index);
+            return index;
+        };
+
+        for (size_t i = 0; i < coarse.indices.size(); i += 3) {
+            const uint32_t v1 = coarse.indices[i];
+            const uint32_t v2 = coarse.indices[i + 1];
+            const uint32_t v3 = coarse.indices[i + 2];
+            const uint32_t mid1 = midpoint(v1, v2);
+            const uint32_t mid2 = midpoint(v2, v3);
+            const uint32_t mid3 = midpoint(v1, v3);
+            const uint32_t triangles[] = {v1, mid1, mid3, v2, mid2, mid1, v3, mid3, mid2, mid1, mid2, mid3};
+            fine.indices.insert(fine.indices.end(), triangles, triangles + 12);
+        }
+        return fine;
+    }
+}
+
+const IcosphereMesh &unitIcosphere(int level) {
+    static std::mutex mutex;
+    static std::unique_ptr<IcosphereMesh> levels[MAX_ICOSPHERE_LEVEL + 1];
+
+    level = std::max(0, std::min(level, MAX_ICOSPHERE_LEVEL));
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!levels[0]) levels[0].reset(new IcosphereMesh(icosahedron()));
+    for (int i = 1; i <= level; ++i) {
+        if (!levels[i]) levels[i].reset(new IcosphereMesh(subdivide(*levels[i - 1])));
+    }
+    return *levels[level];
+}
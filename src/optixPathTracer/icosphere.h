@@ -0,0 +1,22 @@
+#pragma once
+
+#include <sutil/vec_math.h>
+
+#include <cstdint>
+#include <vector>
+
+/*
+*   Indexed unit icospheres. Every subdivision level is generated once, each edge is split
+*   through an edge hash so neighbouring triangles share their midpoint, and the result is
+*   kept for the lifetime of the process. Shapes reference it and only apply their transform.
+*/
+
+struct IcosphereMesh {
+    std::vector<float3> vertices;       // on the unit sphere
+    std::vector<uint32_t> indices;      // three per triangle, counter clockwise seen from outside
+};
+
+const int MAX_ICOSPHERE_LEVEL = 7;      // 327680 triangles
+
+// The icosahedron subdivided level times, level is clamped to [0, MAX_ICOSPHERE_LEVEL]
+const IcosphereMesh &unitIcosphere(int level);
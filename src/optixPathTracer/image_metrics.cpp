@@ -0,0 +1,98 @@
+#include <cuda_runtime.h>
+
+#include "image_metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace {
+    inline float saturate(float v) {
+        return v < 0.f ? 0.f : (v > 1.f ? 1.f : v);
+    }
+
+    inline float luminance(const float4 &c) {
+        return 0.2126f * saturate(c.x) + 0.7152f * saturate(c.y) + 0.0722f * saturate(c.z);
+    }
+
+    // Separable gaussian blur with clamped borders, sigma = 1.5 and radius 5 as in the SSIM paper
+    void blur(std::vector<float> &image, int width, int height) {
+        const int RADIUS = 5;
+        float kernel[2 * RADIUS + 1];
+        float sum = 0.f;
+        for (int i = -RADIUS; i <= RADIUS; ++i) {
+            kernel[i + RADIUS] = expf(-0.5f * i * i / (1.5f * 1.5f));
+            sum += kernel[i + RADIUS];
+        }
+        for (float &k: kernel) k /= sum;
+
+        std::vector<float> tmp(image.size());
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                float v = 0.f;
+                for (int i = -RADIUS; i <= RADIUS; ++i) {
+                    const int sx = std::min(std::max(x + i, 0), width - 1);
+                    v += kernel[i + RADIUS] * image[y * width + sx];
+                }
+                tmp[y * width + x] = v;
+            }
+        }
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                float v = 0.f;
+                for (int i = -RADIUS; i <= RADIUS; ++i) {
+                    const int sy = std::min(std::max(y + i, 0), height - 1);
+                    v += kernel[i + RADIUS] * tmp[sy * width + x];
+                }
+                image[y * width + x] = v;
+            }
+        }
+    }
+}
+
+double computePSNR(const float4 *image, const float4 *reference, size_t num_pixels) {
+    double squared_error = 0.0;
+    for (size_t i = 0; i < num_pixels; ++i) {
+        const double dr = saturate(image[i].x) - saturate(reference[i].x);
+        const double dg = saturate(image[i].y) - saturate(reference[i].y);
+        const double db = saturate(image[i].z) - saturate(reference[i].z);
+        squared_error += dr * dr + dg * dg + db * db;
+    }
+    if (squared_error == 0.0) return std::numeric_limits<double>::infinity();
+    const double mse = squared_error / (3.0 * num_pixels);
+    return 10.0 * log10(1.0 / mse);
+}
+
+double computeSSIM(const float4 *image, const float4 *reference, int width, int height) {
+    const double C1 = 0.01 * 0.01;
+    const double C2 = 0.03 * 0.03;
+    const size_t num_pixels = static_cast<size_t>(width) * height;
+    if (num_pixels == 0) return 1.0;
+
+    std::vector<float> mu_x(num_pixels), mu_y(num_pixels), xx(num_pixels), yy(num_pixels), xy(num_pixels);
+    for (size_t i = 0; i < num_pixels; ++i) {
+        const float x = luminance(image[i]);
+        const float y = luminance(reference[i]);
+        mu_x[i] = x;
+        mu_y[i] = y;
+        xx[i] = x * x;
+        yy[i] = y * y;
+        xy[i] = x * y;
+    }
+    blur(mu_x, width, height);
+    blur(mu_y, width, height);
+    blur(xx, width, height);
+    blur(yy, width, height);
+    blur(xy, width, height);
+
+    double ssim = 0.0;
+    for (size_t i = 0; i < num_pixels; ++i) {
+        const double mx = mu_x[i], my = mu_y[i];
+        const double var_x = xx[i] - mx * mx;
+        const double var_y = yy[i] - my * my;
+        const double cov = xy[i] - mx * my;
+        ssim += ((2.0 * mx * my + C1) * (2.0 * cov + C2)) / ((mx * mx + my * my + C1) * (var_x + var_y + C2));
+    }
+    return ssim / num_pixels;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <sutil/vec_math.h>
+
+#include <cstddef>
+
+/*
+*   Image quality metrics against a reference, computed on the RGB channels of float4
+*   images after clamping to [0, 1] (the range that ends up in the streamed frames).
+*/
+
+// Peak signal to noise ratio in dB, infinity for identical images
+double computePSNR(const float4 *image, const float4 *reference, size_t num_pixels);
+
+// Mean structural similarity of the luminance (Wang et al. 2004, 11x11 gaussian window)
+double computeSSIM(const float4 *image, const float4 *reference, int width, int height);
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <sutil/vec_math.h>
+
+#include "optixPathTracer.h"
+
+/*
+*   Direct light sampling shared by the device integrator and the CPU code paths.
+*   Nothing in here traces rays - callers test the returned shadow ray for occlusion.
+*/
+
+struct LightSample {
+    float3 direction;   // from the shading point towards the sampled point on the light
+    float distance;
+    float3 radiance;    // contribution if the shadow ray is not occluded
+    bool hit_light;     // the shading point lies on a point or spot light
+};
+
+/*
+*   Evaluates the contribution of one light at shading point P with normal N.
+*   Returns false if the light cannot contribute, in which case no shadow ray is needed.
+*/
+SUTIL_INLINE SUTIL_HOSTDEVICE bool sampleLight(const Light &light, const float3 &P, const float3 &N,
+                                               const float z1, const float z2, LightSample &sample) {
+    sample.radiance = make_float3(0.f);
+    sample.hit_light = false;
+
+    if (light.shape == POINT_LIGHT || light.shape == SPOT_LIGHT) {
+        sample.distance = length(light.corner - P);
+        if (sample.distance <= 0.01f) {
+            // too close to the light -> consider this as intersection with the light
+            sample.hit_light = true;
+            return false;
+        }
+        sample.direction = normalize(light.corner - P);
+        const float nDl = dot(N, sample.direction);
+        if (nDl <= 0.f) return false;
+
+        // With scenes of only point lights we expect sharp shadows
+        float falloff = 1.f;
+        if (light.shape == SPOT_LIGHT) {
+            const float cos_angle = dot(-sample.direction, light.normal);
+            if (cos_angle < light.width) return false;
+            if (cos_angle <= light.falloff_start) {
+                falloff = 0.f;
+                if (light.falloff_start - light.width != 0.f) {
+                    const float delta = (cos_angle - light.width) / (light.falloff_start - light.width);
+                    falloff = delta * delta * delta * delta;
+                }
+            }
+        }
+        sample.radiance = light.emission * (nDl * falloff / (sample.distance * sample.distance));
+        return true;
+    }
+
+    const float3 light_pos = light.corner + light.v1 * z1 + light.v2 * z2;
+
+    // Calculate properties of light sample (for area based pdf)
+    sample.distance = length(light_pos - P);
+    sample.direction = normalize(light_pos - P);
+    const float nDl = dot(N, sample.direction);
+    const float LnDl = -dot(light.normal, sample.direction);
+    if (nDl <= 0.f || LnDl <= 0.f) return false;
+
+    const float A = length(cross(light.v1, light.v2));
+    sample.radiance = light.emission * (nDl * LnDl * A / (M_PIf * sample.distance * sample.distance));
+    return true;
+}
+
+/*
+*   Upper bound of the contribution of the emitters below a light tree node to a shading
+*   point, following the bounds-and-cone estimate of Conty and Kulla, "Importance
+*   Sampling of Many Lights with Adaptive Tree Splitting".
+*/
+SUTIL_INLINE SUTIL_HOSTDEVICE float lightTreeImportance(const LightTreeNode &node, const float3 &P, const float3 &N) {
+    const float3 center = 0.5f * (node.bmin + node.bmax);
+    const float3 diagonal = node.bmax - node.bmin;
+    const float radius2 = 0.25f * dot(diagonal, diagonal);
+    const float3 to_center = center - P;
+    const float dist2 = dot(to_center, to_center);
+
+    // Inside the bounds every direction is possible
+    if (dist2 <= radius2) return node.energy / fmaxf(radius2, 1e-4f);
+
+    const float dist = sqrtf(dist2);
+    const float3 w = to_center / dist;
+    const float theta_u = asinf(fminf(sqrtf(radius2 / dist2), 1.f));
+
+    // Receiver: the bounds must reach above the surface
+    const float theta_i = acosf(clamp(dot(N, w), -1.f, 1.f));
+    const float theta_i_min = fmaxf(theta_i - theta_u, 0.f);
+    if (theta_i_min >= M_PI_2f) return 0.f;
+
+    // Emitter: the shading point must lie inside the emission cone
+    const float theta = acosf(clamp(dot(node.axis, -w), -1.f, 1.f));
+    const float theta_min = fmaxf(theta - node.theta_o - theta_u, 0.f);
+    if (theta_min > node.theta_e) return 0.f;
+
+    return node.energy * cosf(theta_i_min) * cosf(fminf(theta_min, M_PI_2f)) / fmaxf(dist2, radius2);
+}
+
+/*
+*   Walks the light tree from the root, choosing a child with probability proportional to
+*   its importance. Returns the index of the chosen light or -1 if no light can contribute;
+*   pdf receives the probability with which the light was chosen.
+*/
+SUTIL_INLINE SUTIL_HOSTDEVICE int sampleLightTree(const LightTreeNode *nodes, const float3 &P, const float3 &N,
+                                                  float u, float &pdf) {
+    pdf = 1.f;
+    int node_idx = 0;
+    while (nodes[node_idx].light < 0) {
+        const int left = nodes[node_idx].child;
+        const float importance_left = lightTreeImportance(nodes[left], P, N);
+        const float importance_right = lightTreeImportance(nodes[left + 1], P, N);
+        const float total = importance_left + importance_right;
+        if (total <= 0.f) return -1;
+
+        const float p_left = importance_left / total;
+        if (u < p_left) {
+            u = fminf(u / p_left, 0.99999994f);
+            pdf *= p_left;
+            node_idx = left;
+        } else {
+            u = fminf((u - p_left) / (1.f - p_left), 0.99999994f);
+            pdf *= 1.f - p_left;
+            node_idx = left + 1;
+        }
+    }
+    return nodes[node_idx].light;
+}
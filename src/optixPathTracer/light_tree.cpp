@@ -0,0 +1,129 @@
+#include <optix.h>
+#include <cuda_runtime.h>
+
+#include "light_tree.h"
+
+#include <algorithm>
+#include <cfloat>
+
+namespace {
+    struct BuildLight {
+        LightTreeNode node;
+        float3 centroid;
+    };
+
+    inline float component(const float3 &v, int axis) {
+        return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+    }
+
+    inline float luminance(const float3 &c) {
+        return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+    }
+
+    // Smallest cone containing both orientation cones
+    void coneUnion(const LightTreeNode &a_in, const LightTreeNode &b_in, LightTreeNode &out) {
+        const LightTreeNode &a = a_in.theta_o >= b_in.theta_o ? a_in : b_in;
+        const LightTreeNode &b = a_in.theta_o >= b_in.theta_o ? b_in : a_in;
+        out.theta_e = std::max(a.theta_e, b.theta_e);
+
+        const float cos_d = clamp(dot(a.axis, b.axis), -1.f, 1.f);
+        const float theta_d = acosf(cos_d);
+        if (std::min(theta_d + b.theta_o, M_PIf) <= a.theta_o) {
+            out.axis = a.axis;
+            out.theta_o = a.theta_o;
+            return;
+        }
+
+        const float theta_o = 0.5f * (a.theta_o + theta_d + b.theta_o);
+        const float3 ortho = b.axis - a.axis * cos_d;
+        if (theta_o >= M_PIf || dot(ortho, ortho) < 1e-12f) {
+            out.axis = a.axis;
+            out.theta_o = M_PIf;
+            return;
+        }
+
+        // Rotate the axis of a towards b so the new cone just touches the far side of both
+        const float theta_r = theta_o - a.theta_o;
+        out.axis = normalize(a.axis * cosf(theta_r) + normalize(ortho) * sinf(theta_r));
+        out.theta_o = theta_o;
+    }
+
+    void buildRecursive(std::vector<BuildLight> &lights, size_t begin, size_t end, int node_idx,
+                        std::vector<LightTreeNode> &nodes) {
+        if (end - begin == 1) {
+            nodes[node_idx] = lights[begin].node;
+            return;
+        }
+
+        // Median split along the largest extent of the light centroids
+        float3 cmin = make_float3(FLT_MAX), cmax = make_float3(-FLT_MAX);
+        for (size_t i = begin; i < end; ++i) {
+            cmin = fminf(cmin, lights[i].centroid);
+            cmax = fmaxf(cmax, lights[i].centroid);
+        }
+        const float3 extent = cmax - cmin;
+        const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+        const size_t mid = begin + (end - begin) / 2;
+        std::nth_element(lights.begin() + begin, lights.begin() + mid, lights.begin() + end,
+                         [axis](const BuildLight &a, const BuildLight &b) {
+                             return component(a.centroid, axis) < component(b.centroid, axis);
+                         });
+
+        const int left = static_cast<int>(nodes.size());
+        nodes.resize(nodes.size() + 2);
+        buildRecursive(lights, begin, mid, left, nodes);
+        buildRecursive(lights, mid, end, left + 1, nodes);
+
+        const LightTreeNode &l = nodes[left];
+        const LightTreeNode &r = nodes[left + 1];
+        LightTreeNode node;
+        node.bmin = fminf(l.bmin, r.bmin);
+        node.bmax = fmaxf(l.bmax, r.bmax);
+        coneUnion(l, r, node);
+        node.energy = l.energy + r.energy;
+        node.child = left;
+        node.light = -1;
+        nodes[node_idx] = node;
+    }
+}
+
+std::vector<LightTreeNode> buildLightTree(const std::vector<Light> &lights) {
+    std::vector<LightTreeNode> nodes;
+    if (lights.empty()) return nodes;
+
+    std::vector<BuildLight> build_lights(lights.size());
+    for (size_t i = 0; i < lights.size(); ++i) {
+        const Light &light = lights[i];
+        LightTreeNode &node = build_lights[i].node;
+        node.child = -1;
+        node.light = static_cast<int>(i);
+        node.energy = luminance(light.emission);
+
+        if (light.shape == AREA_LIGHT) {
+            const float3 far = light.corner + light.v1 + light.v2;
+            node.bmin = fminf(fminf(light.corner, far), fminf(light.corner + light.v1, light.corner + light.v2));
+            node.bmax = fmaxf(fmaxf(light.corner, far), fmaxf(light.corner + light.v1, light.corner + light.v2));
+            // One sided lambertian emitter, matches the A / pi factor of sampleLight()
+            node.energy *= length(cross(light.v1, light.v2)) / M_PIf;
+            node.axis = light.normal;
+            node.theta_o = 0.f;
+            node.theta_e = M_PI_2f;
+        } else if (light.shape == SPOT_LIGHT) {
+            node.bmin = node.bmax = light.corner;
+            node.axis = light.normal;
+            node.theta_o = acosf(clamp(light.width, -1.f, 1.f));
+            node.theta_e = 0.f;
+        } else {
+            node.bmin = node.bmax = light.corner;
+            node.axis = make_float3(0.f, 0.f, 1.f);
+            node.theta_o = M_PIf;
+            node.theta_e = M_PI_2f;
+        }
+        build_lights[i].centroid = 0.5f * (node.bmin + node.bmax);
+    }
+
+    nodes.reserve(2 * lights.size() - 1);
+    nodes.resize(1);
+    buildRecursive(build_lights, 0, build_lights.size(), 0, nodes);
+    return nodes;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <sutil/vec_math.h>
+
+#include "optixPathTracer.h"
+
+#include <vector>
+
+/*
+*   Builds the light tree sampled by sampleLightTree() (see light_sampling.h). Node 0 is
+*   the root and the two children of an interior node are stored next to each other.
+*   Returns an empty vector if there are no lights.
+*/
+std::vector<LightTreeNode> buildLightTree(const std::vector<Light> &lights);
@@ -0,0 +1,229 @@
+#include "lossless_codec.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+namespace {
+    const int MIN_STRIPE_ROWS = 16;
+    const size_t HEADER_BYTES = 20;
+    const unsigned char MAGIC[4] = {'P', 'T', 'Q', '1'};
+
+    // QOI operations
+    const unsigned char OP_INDEX = 0x00;
+    const unsigned char OP_DIFF = 0x40;
+    const unsigned char OP_LUMA = 0x80;
+    const unsigned char OP_RUN = 0xC0;
+    const unsigned char OP_RGB = 0xFE;
+    const unsigned char OP_MASK = 0xC0;
+    const int MAX_RUN = 62;
+
+    struct Pixel {
+        unsigned char r, g, b, a;
+
+        bool operator==(const Pixel &other) const {
+            return r == other.r && g == other.g && b == other.b && a == other.a;
+        }
+    };
+
+    int slot(const Pixel &p) {
+        return (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) % 64;
+    }
+
+    // Returns the encoded size, out has room for 4 bytes per pixel
+    size_t encodeStripe(const unsigned char *rgb, size_t num_pixels, unsigned char *out) {
+        Pixel index[64];
+        memset(index, 0, sizeof(index));
+        Pixel prev = {0, 0, 0, 255};
+        size_t pos = 0;
+        int run = 0;
+        for (size_t i = 0; i < num_pixels; ++i, rgb += 3) {
+            const Pixel p = {rgb[0], rgb[1], rgb[2], 255};
+            if (p == prev) {
+                if (++run == MAX_RUN || i + 1 == num_pixels) {
+                    out[pos++] = static_cast<unsigned char>(OP_RUN | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                out[pos++] = static_cast<unsigned char>(OP_RUN | (run - 1));
+                run = 0;
+            }
+            const int s = slot(p);
+            if (index[s] == p) {
+                out[pos++] = static_cast<unsigned char>(OP_INDEX | s);
+            } else {
+                index[s] = p;
+                const int dr = static_cast<signed char>(p.r - prev.r);
+                const int dg = static_cast<signed char>(p.g - prev.g);
+                const int db = static_cast<signed char>(p.b - prev.b);
+                const int dr_dg = dr - dg;
+                const int db_dg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    out[pos++] = static_cast<unsigned char>(OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                    out[pos++] = static_cast<unsigned char>(OP_LUMA | (dg + 32));
+                    out[pos++] = static_cast<unsigned char>((dr_dg + 8) << 4 | (db_dg + 8));
+                } else {
+                    out[pos++] = OP_RGB;
+                    out[pos++] = p.r;
+                    out[pos++] = p.g;
+                    out[pos++] = p.b;
+                }
+            }
+            prev = p;
+        }
+        return pos;
+    }
+
+    // False unless data holds exactly num_pixels pixels
+    bool decodeStripe(const unsigned char *data, size_t size, unsigned char *rgb, size_t num_pixels) {
+        Pixel index[64];
+        memset(index, 0, sizeof(index));
+        Pixel p = {0, 0, 0, 255};
+        size_t pos = 0;
+        int run = 0;
+        for (size_t i = 0; i < num_pixels; ++i, rgb += 3) {
+            if (run > 0) {
+                --run;
+            } else {
+                if (pos >= size) return false;
+                const unsigned char op = data[pos++];
+                if (op == OP_RGB) {
+                    if (pos + 3 > size) return false;
+                    p.r = data[pos];
+                    p.g = data[pos + 1];
+                    p.b = data[pos + 2];
+                    pos += 3;
+                } else if (op == 0xFF) {
+                    return false;   // QOI_OP_RGBA, frames have no alpha
+                } else if ((op & OP_MASK) == OP_INDEX) {
+                    p = index[op];
+                } else if ((op & OP_MASK) == OP_DIFF) {
+                    p.r += ((op >> 4) & 3) - 2;
+                    p.g += ((op >> 2) & 3) - 2;
+                    p.b += (op & 3) - 2;
+                } else if ((op & OP_MASK) == OP_LUMA) {
+                    if (pos >= size) return false;
+                    const unsigned char next = data[pos++];
+                    const int dg = (op & 0x3F) - 32;
+                    p.r += dg - 8 + ((next >> 4) & 0xF);
+                    p.g += dg;
+                    p.b += dg - 8 + (next & 0xF);
+                } else {
+                    run = op & 0x3F;
+                }
+                index[slot(p)] = p;
+            }
+            rgb[0] = p.r;
+            rgb[1] = p.g;
+            rgb[2] = p.b;
+        }
+        return pos == size && run == 0;
+    }
+
+    void putUint32(unsigned char *out, uint32_t value) {
+        out[0] = static_cast<unsigned char>(value);
+        out[1] = static_cast<unsigned char>(value >> 8);
+        out[2] = static_cast<unsigned char>(value >> 16);
+        out[3] = static_cast<unsigned char>(value >> 24);
+    }
+
+    uint32_t getUint32(const unsigned char *in) {
+        return in[0] | static_cast<uint32_t>(in[1]) << 8 | static_cast<uint32_t>(in[2]) << 16 |
+               static_cast<uint32_t>(in[3]) << 24;
+    }
+
+    // Calls stripe(i) for every i < num_stripes on up to num_threads threads
+    template<typename Function>
+    void forEachStripe(unsigned int num_threads, int num_stripes, const Function &stripe) {
+        std::atomic<int> next(0);
+        const auto worker = [&]() {
+            for (int i = next++; i < num_stripes; i = next++)
+                stripe(i);
+        };
+        std::vector<std::thread> threads;
+        for (int t = 1; t < std::min(static_cast<int>(num_threads), num_stripes); ++t)
+            threads.emplace_back(worker);
+        worker();
+        for (std::thread &thread: threads)
+            thread.join();
+    }
+}
+
+LosslessCodec::LosslessCodec(unsigned int num_threads)
+        : m_num_threads(num_threads > 0 ? num_threads : std::max(1u, std::thread::hardware_concurrency())) {}
+
+void LosslessCodec::encode(const unsigned char *rgb, int width, int height, std::vector<unsigned char> &frame) {
+    const auto t0 = std::chrono::steady_clock::now();
+    const int stripe_rows = std::max(MIN_STRIPE_ROWS, (height + static_cast<int>(m_num_threads) - 1) /
+                                                      static_cast<int>(m_num_threads));
+    const int num_stripes = std::max(1, (height + stripe_rows - 1) / stripe_rows);
+    const size_t row_pixels = static_cast<size_t>(std::max(width, 0));
+    m_stripes.resize(num_stripes);
+    std::vector<size_t> sizes(num_stripes);
+    forEachStripe(m_num_threads, num_stripes, [&](int i) {
+        const int y = i * stripe_rows;
+        const size_t num_pixels = row_pixels * std::max(0, std::min(stripe_rows, height - y));
+        m_stripes[i].resize(num_pixels * 4);
+        sizes[i] = encodeStripe(rgb + row_pixels * y * 3, num_pixels, m_stripes[i].data());
+    });
+
+    size_t total = HEADER_BYTES + 4 * static_cast<size_t>(num_stripes);
+    for (size_t size: sizes)
+        total += size;
+    frame.resize(total);
+    unsigned char *out = frame.data();
+    memcpy(out, MAGIC, sizeof(MAGIC));
+    putUint32(out + 4, static_cast<uint32_t>(width));
+    putUint32(out + 8, static_cast<uint32_t>(height));
+    putUint32(out + 12, static_cast<uint32_t>(stripe_rows));
+    putUint32(out + 16, static_cast<uint32_t>(num_stripes));
+    out += HEADER_BYTES;
+    for (size_t size: sizes) {
+        putUint32(out, static_cast<uint32_t>(size));
+        out += 4;
+    }
+    for (int i = 0; i < num_stripes; ++i) {
+        memcpy(out, m_stripes[i].data(), sizes[i]);
+        out += sizes[i];
+    }
+
+    m_last_frame.raw_bytes = row_pixels * std::max(height, 0) * 3;
+    m_last_frame.encoded_bytes = frame.size();
+    m_last_frame.stripes = static_cast<unsigned int>(num_stripes);
+    m_last_frame.encode_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+bool LosslessCodec::decode(const unsigned char *data, size_t size, std::vector<unsigned char> &rgb, int &width,
+                           int &height) {
+    if (size < HEADER_BYTES || memcmp(data, MAGIC, sizeof(MAGIC)) != 0) return false;
+    const uint32_t w = getUint32(data + 4);
+    const uint32_t h = getUint32(data + 8);
+    const uint32_t stripe_rows = getUint32(data + 12);
+    const uint32_t num_stripes = getUint32(data + 16);
+    if (w == 0 || h == 0 || w > 0xFFFF || h > 0xFFFF || stripe_rows == 0 ||
+        num_stripes != (h + stripe_rows - 1) / stripe_rows || size < HEADER_BYTES + 4 * static_cast<size_t>(num_stripes))
+        return false;
+    std::vector<size_t> offsets(num_stripes + 1);
+    offsets[0] = HEADER_BYTES + 4 * static_cast<size_t>(num_stripes);
+    for (uint32_t i = 0; i < num_stripes; ++i)
+        offsets[i + 1] = offsets[i] + getUint32(data + HEADER_BYTES + 4 * i);
+    if (offsets[num_stripes] != size) return false;
+
+    rgb.resize(static_cast<size_t>(w) * h * 3);
+    std::atomic<bool> ok(true);
+    forEachStripe(m_num_threads, static_cast<int>(num_stripes), [&](int i) {
+        const uint32_t y = i * stripe_rows;
+        const size_t num_pixels = static_cast<size_t>(w) * std::min(stripe_rows, h - y);
+        if (!decodeStripe(data + offsets[i], offsets[i + 1] - offsets[i], rgb.data() + static_cast<size_t>(w) * y * 3,
+                          num_pixels))
+            ok = false;
+    });
+    width = static_cast<int>(w);
+    height = static_cast<int>(h);
+    return ok;
+}
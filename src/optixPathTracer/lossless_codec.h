@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+*   Lossless RGB24 frames for viewers on the LAN: pixel exact like PPM at a fraction of its
+*   bandwidth. The image is cut into stripes of whole rows that are encoded and decoded on
+*   worker threads, each with the QOI operations (https://qoiformat.org) and a fresh QOI
+*   state, so a stripe is a QOI data stream without QOI's header and end marker.
+*
+*   A frame is, in little endian:
+*       "PTQ1", uint32 width, height, stripe_rows, num_stripes
+*       uint32 encoded size of every stripe
+*       the stripes, top to bottom
+*   Every stripe has stripe_rows rows but the last, which has the rest.
+*/
+
+const uint16_t LOSSLESS_PORT = 7610;    // default of --lossless-port
+
+struct LosslessFrameStats {
+    size_t raw_bytes = 0;       // RGB24
+    size_t encoded_bytes = 0;
+    unsigned int stripes = 0;
+    double encode_ms = 0.0;
+
+    double ratio() const { return encoded_bytes > 0 ? static_cast<double>(raw_bytes) / encoded_bytes : 0.0; }
+    // Of RGB24 input
+    double megabytesPerSecond() const { return encode_ms > 0.0 ? raw_bytes / (1024.0 * 1024.0) / (encode_ms / 1000.0) : 0.0; }
+};
+
+class LosslessCodec {
+public:
+    explicit LosslessCodec(unsigned int num_threads = 0);
+
+    // rgb holds width x height pixels, top row first
+    void encode(const unsigned char *rgb, int width, int height, std::vector<unsigned char> &frame);
+
+    // False if data is not a whole frame
+    bool decode(const unsigned char *data, size_t size, std::vector<unsigned char> &rgb, int &width, int &height);
+
+    const LosslessFrameStats &lastFrame() const { return m_last_frame; }
+    unsigned int numThreads() const { return m_num_threads; }
+
+private:
+    unsigned int m_num_threads;
+    std::vector<std::vector<unsigned char>> m_stripes;
+    LosslessFrameStats m_last_frame;
+};
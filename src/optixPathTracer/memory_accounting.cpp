@@ -0,0 +1,137 @@
+#include "memory_accounting.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+    const char *const TAG_NAMES[] = {"geometry", "textures", "frame_buffers", "acceleration", "loader_scratch",
+                                     "total"};
+    const char *const SPACE_NAMES[] = {"host", "device"};
+    const double MB = 1024.0 * 1024.0;
+}
+
+const char *memoryTagName(MemoryTag tag) {
+    return TAG_NAMES[tag];
+}
+
+const char *memorySpaceName(MemorySpace space) {
+    return SPACE_NAMES[space];
+}
+
+MemoryAccounting::MemoryAccounting() {
+    for (int tag = 0; tag <= MEMORY_TOTAL; ++tag) {
+        for (int space = 0; space < MEMORY_SPACE_COUNT; ++space) {
+            m_current[tag][space].store(0, std::memory_order_relaxed);
+            m_peak[tag][space].store(0, std::memory_order_relaxed);
+        }
+        m_budgets[tag].store(0, std::memory_order_relaxed);
+    }
+}
+
+void MemoryAccounting::raisePeak(MemoryTag tag, MemorySpace space, size_t bytes) {
+    std::atomic<size_t> &peak = m_peak[tag][space];
+    size_t current = peak.load(std::memory_order_relaxed);
+    while (bytes > current && !peak.compare_exchange_weak(current, bytes, std::memory_order_relaxed)) {}
+}
+
+bool MemoryAccounting::reserve(MemoryTag tag, MemorySpace space, size_t bytes) {
+    const size_t limit = budget(tag);
+    std::atomic<size_t> &used = m_current[tag][space];
+    size_t current = used.load(std::memory_order_relaxed);
+    do {
+        if (limit > 0 && current + bytes > limit) return false;
+    } while (!used.compare_exchange_weak(current, current + bytes, std::memory_order_relaxed));
+    raisePeak(tag, space, current + bytes);
+    return true;
+}
+
+bool MemoryAccounting::tryAllocate(MemoryTag tag, MemorySpace space, size_t bytes) {
+    if (!reserve(tag, space, bytes)) return false;
+    if (!reserve(MEMORY_TOTAL, space, bytes)) {
+        m_current[tag][space].fetch_sub(bytes, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void MemoryAccounting::release(MemoryTag tag, MemorySpace space, size_t bytes) {
+    m_current[tag][space].fetch_sub(bytes, std::memory_order_relaxed);
+    m_current[MEMORY_TOTAL][space].fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+void MemoryAccounting::trackAddress(const void *address, MemoryTag tag, MemorySpace space, size_t bytes) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Allocation &allocation = m_addresses[address];
+    allocation.tag = tag;
+    allocation.space = space;
+    allocation.bytes = bytes;
+}
+
+void MemoryAccounting::releaseAddress(const void *address) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto found = m_addresses.find(address);
+    if (found == m_addresses.end()) return;
+    release(found->second.tag, found->second.space, found->second.bytes);
+    m_addresses.erase(found);
+}
+
+void MemoryAccounting::setBudget(MemoryTag tag, size_t bytes) {
+    m_budgets[tag].store(bytes, std::memory_order_relaxed);
+}
+
+std::string MemoryAccounting::budgetError(MemoryTag tag, MemorySpace space, size_t bytes) const {
+    // Names whichever budget refuses, the subsystem's first
+    const MemoryTag over = budget(tag) > 0 && current(tag, space) + bytes > budget(tag) ? tag : MEMORY_TOTAL;
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2) << bytes / MB << " MB more " << memoryTagName(tag) << " on the "
+        << memorySpaceName(space) << " would take " << memoryTagName(over) << " over its budget of "
+        << budget(over) / MB << " MB, " << current(over, space) / MB << " MB are in use";
+    return out.str();
+}
+
+void MemoryAccounting::report(std::ostream &out) const {
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(2) << std::left << std::setw(17) << "Memory in MB" << std::right
+        << std::setw(9) << "host" << std::setw(9) << "peak" << std::setw(9) << "device" << std::setw(9) << "peak"
+        << std::setw(10) << "budget" << std::endl;
+    for (int i = 0; i <= MEMORY_TOTAL; ++i) {
+        const MemoryTag tag = static_cast<MemoryTag>(i);
+        out << "  " << std::left << std::setw(15) << memoryTagName(tag) << std::right;
+        for (int space = 0; space < MEMORY_SPACE_COUNT; ++space)
+            out << std::setw(9) << current(tag, static_cast<MemorySpace>(space)) / MB << std::setw(9)
+                << peak(tag, static_cast<MemorySpace>(space)) / MB;
+        if (budget(tag) > 0)
+            out << std::setw(10) << budget(tag) / MB;
+        else
+            out << std::setw(10) << "none";
+        out << std::endl;
+    }
+    out.flags(flags);
+    out.precision(precision);
+}
+
+MemoryAccounting &memoryAccounting() {
+    static MemoryAccounting accounting;
+    return accounting;
+}
+
+bool parseMemoryBudgets(const std::string &list, MemoryAccounting &accounting) {
+    std::stringstream entries(list);
+    std::string entry;
+    while (std::getline(entries, entry, ',')) {
+        const size_t colon = entry.find(':');
+        if (colon == std::string::npos) return false;
+        const std::string name = entry.substr(0, colon);
+        char *end = nullptr;
+        const double megabytes = strtod(entry.c_str() + colon + 1, &end);
+        if (end == entry.c_str() + colon + 1 || *end != '\0' || megabytes < 0.0) return false;
+        int tag = 0;
+        while (tag <= MEMORY_TOTAL && name != TAG_NAMES[tag])
+            ++tag;
+        if (tag > MEMORY_TOTAL) return false;
+        accounting.setBudget(static_cast<MemoryTag>(tag), static_cast<size_t>(megabytes * MB));
+    }
+    return true;
+}
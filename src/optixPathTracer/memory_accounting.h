@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+/*
+*   Bytes in use per subsystem, on the host and on the device, with their high-water marks
+*   and optional budgets. Allocations of a subsystem are refused once they would take it or
+*   the total of its memory space over budget, so a scene that does not fit stops with a
+*   message naming the subsystem instead of being OOM-killed. A budget caps the host and the
+*   device usage of its subsystem each. Accounting is atomic, the metrics endpoint reads it
+*   while the render loop allocates.
+*/
+
+enum MemoryTag {
+    MEMORY_GEOMETRY,        // vertices, texture coordinates, material indices, lights, instances
+    MEMORY_TEXTURES,        // Texture::pixel and the texture arrays
+    MEMORY_FRAME_BUFFERS,   // per-pixel buffers of the launches and the denoiser
+    MEMORY_ACCELERATION,    // GAS, IAS and their build buffers
+    MEMORY_LOADER_SCRATCH,  // tinyobj's arrays while a mesh is built from them
+    MEMORY_TOTAL            // the sum of the above, not a tag to allocate with
+};
+
+enum MemorySpace {
+    MEMORY_HOST,
+    MEMORY_DEVICE,
+    MEMORY_SPACE_COUNT
+};
+
+const char *memoryTagName(MemoryTag tag);
+const char *memorySpaceName(MemorySpace space);
+
+class MemoryAccounting {
+public:
+    MemoryAccounting();
+
+    // Accounts bytes unless they take tag or the total of space over budget, returns whether it did
+    bool tryAllocate(MemoryTag tag, MemorySpace space, size_t bytes);
+    void release(MemoryTag tag, MemorySpace space, size_t bytes);
+
+    // Remembers accounted bytes by their address, for frees that only know the pointer
+    void trackAddress(const void *address, MemoryTag tag, MemorySpace space, size_t bytes);
+    // Releases what was tracked at address, nothing if it was not
+    void releaseAddress(const void *address);
+
+    // 0 for none, MEMORY_TOTAL caps the sum
+    void setBudget(MemoryTag tag, size_t bytes);
+    size_t budget(MemoryTag tag) const { return m_budgets[tag].load(std::memory_order_relaxed); }
+
+    size_t current(MemoryTag tag, MemorySpace space) const {
+        return m_current[tag][space].load(std::memory_order_relaxed);
+    }
+    size_t peak(MemoryTag tag, MemorySpace space) const { return m_peak[tag][space].load(std::memory_order_relaxed); }
+
+    // Why bytes more of tag do not fit in space
+    std::string budgetError(MemoryTag tag, MemorySpace space, size_t bytes) const;
+
+    // One line per subsystem with the usage, high-water marks and budget in MB
+    void report(std::ostream &out) const;
+
+private:
+    struct Allocation {
+        MemoryTag tag;
+        MemorySpace space;
+        size_t bytes;
+    };
+
+    bool reserve(MemoryTag tag, MemorySpace space, size_t bytes);
+    void raisePeak(MemoryTag tag, MemorySpace space, size_t bytes);
+
+    std::atomic<size_t> m_current[MEMORY_TOTAL + 1][MEMORY_SPACE_COUNT];
+    std::atomic<size_t> m_peak[MEMORY_TOTAL + 1][MEMORY_SPACE_COUNT];
+    std::atomic<size_t> m_budgets[MEMORY_TOTAL + 1];
+
+    std::mutex m_mutex;     // guards m_addresses
+    std::map<const void *, Allocation> m_addresses;
+};
+
+// The accounting of the process
+MemoryAccounting &memoryAccounting();
+
+/*
+*   Sets the budgets of a list like "textures:512,total:4096" in MB, with the subsystem names
+*   of memoryTagName(). False, with the budgets before the bad entry set, on anything else
+*/
+bool parseMemoryBudgets(const std::string &list, MemoryAccounting &accounting);
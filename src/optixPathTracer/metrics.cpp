@@ -0,0 +1,230 @@
+#include "metrics.h"
+#include "tcp_socket.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+    const int REQUEST_TIMEOUT_S = 2;
+
+    std::string formatValue(double value) {
+        if (std::isnan(value)) return "NaN";
+        if (std::isinf(value)) return value > 0.0 ? "+Inf" : "-Inf";
+        char text[32];
+        snprintf(text, sizeof(text), "%.9g", value);
+        return text;
+    }
+
+    void addTo(std::atomic<double> &target, double delta) {
+        double current = target.load(std::memory_order_relaxed);
+        while (!target.compare_exchange_weak(current, current + delta, std::memory_order_relaxed)) {}
+    }
+
+    // name{labels,extra} with whichever of the two are set
+    std::string seriesName(const std::string &name, const std::string &labels, const std::string &extra = "") {
+        if (labels.empty() && extra.empty()) return name;
+        return name + "{" + labels + (labels.empty() || extra.empty() ? "" : ",") + extra + "}";
+    }
+}
+
+void Gauge::add(double delta) {
+    addTo(m_value, delta);
+}
+
+Histogram::Histogram(const std::vector<double> &upper_bounds)
+        : m_upper_bounds(upper_bounds), m_buckets(new std::atomic<uint64_t>[upper_bounds.size() + 1]) {
+    std::sort(m_upper_bounds.begin(), m_upper_bounds.end());
+    for (size_t i = 0; i <= m_upper_bounds.size(); ++i)
+        m_buckets[i].store(0, std::memory_order_relaxed);
+}
+
+void Histogram::observe(double value) {
+    // Prometheus buckets include their upper bound
+    const size_t bucket = std::lower_bound(m_upper_bounds.begin(), m_upper_bounds.end(), value) -
+                          m_upper_bounds.begin();
+    m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    addTo(m_sum, value);
+}
+
+double Histogram::quantile(double q) const {
+    std::vector<uint64_t> counts(m_upper_bounds.size() + 1);
+    uint64_t total = 0;
+    for (size_t i = 0; i < counts.size(); ++i)
+        total += counts[i] = bucketCount(i);
+    if (total == 0) return 0.0;
+    const double rank = std::max(0.0, std::min(q, 1.0)) * total;
+    uint64_t below = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (below + counts[i] >= rank && counts[i] > 0) {
+            // Observations above the last bound are reported at it, like Prometheus does
+            if (i == m_upper_bounds.size()) return m_upper_bounds.empty() ? 0.0 : m_upper_bounds.back();
+            const double lower = i == 0 ? 0.0 : m_upper_bounds[i - 1];
+            return lower + (m_upper_bounds[i] - lower) * (rank - below) / counts[i];
+        }
+        below += counts[i];
+    }
+    return m_upper_bounds.empty() ? 0.0 : m_upper_bounds.back();
+}
+
+std::vector<double> exponentialBuckets(double start, double factor, int count) {
+    std::vector<double> bounds;
+    for (int i = 0; i < count; ++i, start *= factor)
+        bounds.push_back(start);
+    return bounds;
+}
+
+size_t processResidentBytes() {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm) return 0;
+    unsigned long size = 0, resident = 0;
+    const int fields = fscanf(statm, "%lu %lu", &size, &resident);
+    fclose(statm);
+    return fields == 2 ? static_cast<size_t>(resident) * static_cast<size_t>(sysconf(_SC_PAGESIZE)) : 0;
+}
+
+MetricsRegistry::Series &MetricsRegistry::series(const std::string &name, const std::string &help, const char *type,
+                                                 const std::string &labels, bool &created) {
+    Family &family = m_families[name];
+    if (family.type.empty()) {
+        family.type = type;
+        family.help = help;
+    } else if (family.type != type) {
+        throw std::logic_error("metric " + name + " is a " + family.type + ", not a " + type);
+    }
+    for (Series &existing: family.series) {
+        if (existing.labels == labels) {
+            created = false;
+            return existing;
+        }
+    }
+    family.series.emplace_back();
+    family.series.back().labels = labels;
+    created = true;
+    return family.series.back();
+}
+
+Counter &MetricsRegistry::counter(const std::string &name, const std::string &help, const std::string &labels) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    bool created;
+    Series &s = series(name, help, "counter", labels, created);
+    if (!s.counter) s.counter.reset(new Counter());
+    return *s.counter;
+}
+
+Gauge &MetricsRegistry::gauge(const std::string &name, const std::string &help, const std::string &labels) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    bool created;
+    Series &s = series(name, help, "gauge", labels, created);
+    if (!s.gauge) s.gauge.reset(new Gauge());
+    return *s.gauge;
+}
+
+Histogram &MetricsRegistry::histogram(const std::string &name, const std::string &help,
+                                      const std::vector<double> &upper_bounds, const std::string &labels) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    bool created;
+    Series &s = series(name, help, "histogram", labels, created);
+    if (!s.histogram) s.histogram.reset(new Histogram(upper_bounds));
+    return *s.histogram;
+}
+
+void MetricsRegistry::gaugeCallback(const std::string &name, const std::string &help, const std::string &labels,
+                                    const std::function<double()> &read) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    bool created;
+    series(name, help, "gauge", labels, created).read = read;
+}
+
+void MetricsRegistry::counterCallback(const std::string &name, const std::string &help, const std::string &labels,
+                                      const std::function<double()> &read) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    bool created;
+    series(name, help, "counter", labels, created).read = read;
+}
+
+void MetricsRegistry::removeCallback(const std::string &name, const std::string &labels) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto family = m_families.find(name);
+    if (family == m_families.end()) return;
+    std::vector<Series> &series = family->second.series;
+    series.erase(std::remove_if(series.begin(), series.end(),
+                                [&labels](const Series &s) { return s.read && s.labels == labels; }),
+                 series.end());
+    if (series.empty()) m_families.erase(family);
+}
+
+std::string MetricsRegistry::exposition() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::ostringstream out;
+    for (const auto &entry: m_families) {
+        const std::string &name = entry.first;
+        const Family &family = entry.second;
+        out << "# HELP " << name << " " << family.help << "\n";
+        out << "# TYPE " << name << " " << family.type << "\n";
+        for (const Series &s: family.series) {
+            if (s.histogram) {
+                const Histogram &histogram = *s.histogram;
+                uint64_t cumulative = 0;
+                for (size_t i = 0; i < histogram.upperBounds().size(); ++i) {
+                    cumulative += histogram.bucketCount(i);
+                    out << seriesName(name + "_bucket", s.labels,
+                                      "le=\"" + formatValue(histogram.upperBounds()[i]) + "\"") << " " << cumulative
+                        << "\n";
+                }
+                cumulative += histogram.bucketCount(histogram.upperBounds().size());
+                out << seriesName(name + "_bucket", s.labels, "le=\"+Inf\"") << " " << cumulative << "\n";
+                out << seriesName(name + "_sum", s.labels) << " " << formatValue(histogram.sum()) << "\n";
+                out << seriesName(name + "_count", s.labels) << " " << cumulative << "\n";
+            } else if (s.read) {
+                out << seriesName(name, s.labels) << " " << formatValue(s.read()) << "\n";
+            } else if (s.counter) {
+                out << seriesName(name, s.labels) << " " << s.counter->value() << "\n";
+            } else if (s.gauge) {
+                out << seriesName(name, s.labels) << " " << formatValue(s.gauge->value()) << "\n";
+            }
+        }
+    }
+    return out.str();
+}
+
+MetricsServer::~MetricsServer() {
+    if (m_listen_fd >= 0) {
+        // Wakes the acceptor blocked in accept()
+        shutdown(m_listen_fd, SHUT_RDWR);
+        m_acceptor.join();
+        closeSocket(m_listen_fd);
+    }
+}
+
+bool MetricsServer::listen(uint16_t port, uint16_t *bound_port) {
+    if (m_listen_fd >= 0) return false;
+    m_listen_fd = listenTcp(port, false, bound_port);
+    if (m_listen_fd < 0) return false;
+    m_acceptor = std::thread(&MetricsServer::accept, this);
+    return true;
+}
+
+void MetricsServer::accept() {
+    for (int fd = acceptTcp(m_listen_fd); fd >= 0; fd = acceptTcp(m_listen_fd)) {
+        const std::string path = readHttpGet(fd, REQUEST_TIMEOUT_S);
+        if (path == "/metrics" || path.compare(0, 9, "/metrics?") == 0) {
+            const std::string body = m_registry.exposition();
+            const std::string header = "HTTP/1.0 200 OK\r\n"
+                                       "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                                       "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                                       "Connection: close\r\n\r\n";
+            if (sendAll(fd, header.data(), header.size()) && sendAll(fd, body.data(), body.size()))
+                m_scrapes.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            sendHttpStatus(fd, "404 Not Found");
+        }
+        closeSocket(fd);
+    }
+}
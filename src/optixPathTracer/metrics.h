@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+*   Counters, gauges and histograms rendered in the Prometheus text exposition format.
+*   Updating a metric is a relaxed atomic operation and never locks, so the render loop and
+*   the worker threads record from their hot paths; only registering metrics and rendering
+*   the exposition lock the registry. A metric keeps its address for the registry's life,
+*   register it once and keep the reference. Callback metrics are read while the exposition
+*   is rendered, for values that live elsewhere like queue depths.
+*/
+
+const uint16_t METRICS_PORT = 9464;     // default of --metrics-port
+
+class Counter {
+public:
+    void add(uint64_t n = 1) { m_value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> m_value{0};
+};
+
+class Gauge {
+public:
+    void set(double value) { m_value.store(value, std::memory_order_relaxed); }
+    void add(double delta);
+    double value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> m_value{0.0};
+};
+
+class Histogram {
+public:
+    // Ascending upper bounds of the buckets, +Inf is implied
+    explicit Histogram(const std::vector<double> &upper_bounds);
+
+    void observe(double value);
+
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+    double sum() const { return m_sum.load(std::memory_order_relaxed); }
+    const std::vector<double> &upperBounds() const { return m_upper_bounds; }
+    // Observations in bucket i alone, i == upperBounds().size() is the +Inf bucket
+    uint64_t bucketCount(size_t i) const { return m_buckets[i].load(std::memory_order_relaxed); }
+
+    // Estimated like Prometheus' histogram_quantile(), linearly within the bucket
+    double quantile(double q) const;
+
+private:
+    std::vector<double> m_upper_bounds;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_buckets;
+    std::atomic<uint64_t> m_count{0};
+    std::atomic<double> m_sum{0.0};
+};
+
+// count upper bounds from start, each factor times the one before
+std::vector<double> exponentialBuckets(double start, double factor, int count);
+
+// Resident set size of this process, 0 where /proc is missing
+size_t processResidentBytes();
+
+class MetricsRegistry {
+public:
+    /*
+    *   The metric name with the labels, like `subsystem="textures"` or empty for none. The
+    *   same name and labels return the same metric; a name registered with another type
+    *   throws std::logic_error.
+    */
+    Counter &counter(const std::string &name, const std::string &help, const std::string &labels = "");
+    Gauge &gauge(const std::string &name, const std::string &help, const std::string &labels = "");
+    Histogram &histogram(const std::string &name, const std::string &help, const std::vector<double> &upper_bounds,
+                         const std::string &labels = "");
+    void gaugeCallback(const std::string &name, const std::string &help, const std::string &labels,
+                       const std::function<double()> &read);
+    void counterCallback(const std::string &name, const std::string &help, const std::string &labels,
+                         const std::function<double()> &read);
+    // Drops a callback metric whose value went away, like the one of a closed session
+    void removeCallback(const std::string &name, const std::string &labels);
+
+    std::string exposition() const;
+
+private:
+    struct Series {
+        std::string labels;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+        std::function<double()> read;
+    };
+
+    struct Family {
+        std::string help;
+        std::string type;
+        std::vector<Series> series;
+    };
+
+    Series &series(const std::string &name, const std::string &help, const char *type, const std::string &labels,
+                   bool &created);
+
+    mutable std::mutex m_mutex;
+    std::map<std::string, Family> m_families;
+};
+
+// Serves the exposition of a registry on /metrics
+class MetricsServer {
+public:
+    explicit MetricsServer(const MetricsRegistry &registry) : m_registry(registry) {}
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer &) = delete;
+    MetricsServer &operator=(const MetricsServer &) = delete;
+
+    // Port 0 picks one which is stored in *bound_port
+    bool listen(uint16_t port, uint16_t *bound_port = nullptr);
+
+    uint64_t scrapes() const { return m_scrapes.load(std::memory_order_relaxed); }
+
+private:
+    void accept();
+
+    const MetricsRegistry &m_registry;
+    int m_listen_fd = -1;
+    std::thread m_acceptor;
+    std::atomic<uint64_t> m_scrapes{0};
+};
@@ -0,0 +1,229 @@
+#include "mjpeg_server.h"
+#include "tcp_socket.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include <sys/socket.h>
+
+// A private copy, so the encoder neither shares sutil's stb_image_write state nor clashes with its symbols
+#define STB_IMAGE_WRITE_STATIC
+#define STBI_WRITE_NO_STDIO
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+
+#include "stb_image_write.h"
+
+namespace {
+    const int MAX_RESTART_INTERVAL = 0xFFFF;   // blocks, the DRI field has 16 bits
+    const int REQUEST_TIMEOUT_S = 2;
+    const size_t MJPEG_VIEWER_QUEUE_FRAMES = 2;
+    const char *const MJPEG_BOUNDARY = "frame";
+
+    void appendBytes(void *context, void *data, int size) {
+        std::vector<unsigned char> &out = *static_cast<std::vector<unsigned char> *>(context);
+        out.insert(out.end(), static_cast<unsigned char *>(data), static_cast<unsigned char *>(data) + size);
+    }
+
+    struct JpegLayout {
+        size_t sof = 0;         // SOF0 marker
+        size_t sos = 0;         // SOS marker
+        size_t entropy = 0;     // first byte after the SOS segment
+    };
+
+    // Finds the segments stb_image_write writes in front of the entropy coded data
+    bool scanJpeg(const std::vector<unsigned char> &jpeg, JpegLayout &layout) {
+        size_t pos = 2;
+        while (pos + 4 <= jpeg.size() && jpeg[pos] == 0xFF) {
+            const unsigned char marker = jpeg[pos + 1];
+            const size_t length = (static_cast<size_t>(jpeg[pos + 2]) << 8) | jpeg[pos + 3];
+            if (marker == 0xC0) layout.sof = pos;
+            if (marker == 0xDA) {
+                layout.sos = pos;
+                layout.entropy = pos + 2 + length;
+                return layout.sof > 0 && layout.entropy + 2 <= jpeg.size();
+            }
+            pos += 2 + length;
+        }
+        return false;
+    }
+}
+
+SliceJpegEncoder::SliceJpegEncoder(unsigned int num_threads, int quality)
+        : m_num_threads(num_threads > 0 ? num_threads : std::max(1u, std::thread::hardware_concurrency())),
+          m_quality(quality) {}
+
+bool SliceJpegEncoder::encode(const unsigned char *rgb, int width, int height, std::vector<unsigned char> &jpeg) {
+    jpeg.clear();
+    if (!rgb || width < 1 || height < 1 || width > 0xFFFF || height > 0xFFFF) return false;
+    const int blocks_per_row = (width + 7) / 8;
+    const int block_rows = (height + 7) / 8;
+    const int slice_block_rows = std::max(1, std::min((block_rows + static_cast<int>(m_num_threads) - 1) /
+                                                      static_cast<int>(m_num_threads),
+                                                      MAX_RESTART_INTERVAL / blocks_per_row));
+    const int num_slices = (block_rows + slice_block_rows - 1) / slice_block_rows;
+    m_slices.resize(num_slices);
+
+    std::atomic<int> next_slice(0);
+    std::atomic<bool> failed(false);
+    const auto worker = [&]() {
+        for (int slice = next_slice++; slice < num_slices; slice = next_slice++) {
+            const int y = slice * slice_block_rows * 8;
+            const int rows = std::min(slice_block_rows * 8, height - y);
+            std::vector<unsigned char> &out = m_slices[slice];
+            out.clear();
+            if (!stbi_write_jpg_to_func(appendBytes, &out, width, rows, 3, rgb + static_cast<size_t>(y) * width * 3,
+                                        m_quality))
+                failed = true;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < std::min(static_cast<int>(m_num_threads), num_slices); ++t)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread &thread: threads)
+        thread.join();
+    if (failed) return false;
+    if (num_slices == 1) {
+        jpeg.swap(m_slices[0]);
+        return true;
+    }
+
+    // Headers of the first slice with the full height and a restart interval of one slice,
+    // then the entropy coded data of every slice. stb_image_write starts every slice with
+    // zero DC predictions and pads its last byte with ones, as a restart interval has to be
+    JpegLayout layout;
+    if (!scanJpeg(m_slices[0], layout)) return false;
+    const std::vector<unsigned char> &first = m_slices[0];
+    const int restart_interval = slice_block_rows * blocks_per_row;
+    jpeg.insert(jpeg.end(), first.begin(), first.begin() + layout.sos);
+    jpeg[layout.sof + 5] = static_cast<unsigned char>(height >> 8);
+    jpeg[layout.sof + 6] = static_cast<unsigned char>(height);
+    const unsigned char dri[] = {0xFF, 0xDD, 0, 4, static_cast<unsigned char>(restart_interval >> 8),
+                                 static_cast<unsigned char>(restart_interval)};
+    jpeg.insert(jpeg.end(), dri, dri + sizeof(dri));
+    jpeg.insert(jpeg.end(), first.begin() + layout.sos, first.begin() + layout.entropy);
+    for (int slice = 0; slice < num_slices; ++slice) {
+        const std::vector<unsigned char> &data = m_slices[slice];
+        JpegLayout slice_layout;
+        if (!scanJpeg(data, slice_layout)) return false;
+        if (slice > 0) {
+            jpeg.push_back(0xFF);
+            jpeg.push_back(static_cast<unsigned char>(0xD0 + (slice - 1) % 8));
+        }
+        // Without the EOI marker
+        jpeg.insert(jpeg.end(), data.begin() + slice_layout.entropy, data.end() - 2);
+    }
+    jpeg.push_back(0xFF);
+    jpeg.push_back(0xD9);
+    return true;
+}
+
+MjpegServer::MjpegServer(unsigned int num_threads, int quality)
+        : m_fanout(MJPEG_VIEWER_QUEUE_FRAMES), m_encoder(num_threads, quality) {
+    m_encoder_thread = std::thread(&MjpegServer::encode, this);
+}
+
+MjpegServer::~MjpegServer() {
+    if (m_listen_fd >= 0) {
+        // Wakes the acceptor blocked in accept()
+        shutdown(m_listen_fd, SHUT_RDWR);
+        m_acceptor.join();
+        closeSocket(m_listen_fd);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_one();
+    m_encoder_thread.join();
+}
+
+bool MjpegServer::listen(uint16_t port, uint16_t *bound_port) {
+    if (m_listen_fd >= 0) return false;
+    m_listen_fd = listenTcp(port, false, bound_port);
+    if (m_listen_fd < 0) return false;
+    m_acceptor = std::thread(&MjpegServer::accept, this);
+    return true;
+}
+
+void MjpegServer::accept() {
+    for (int fd = acceptTcp(m_listen_fd); fd >= 0; fd = acceptTcp(m_listen_fd)) {
+        // A client that never sends its request must not hold up the next ones for long
+        const std::string path = readHttpGet(fd, REQUEST_TIMEOUT_S);
+        if (path != "/" && path != "/stream.mjpg") {
+            sendHttpStatus(fd, "404 Not Found");
+            closeSocket(fd);
+            continue;
+        }
+        const std::string header = std::string("HTTP/1.0 200 OK\r\n"
+                                               "Cache-Control: no-cache\r\n"
+                                               "Pragma: no-cache\r\n"
+                                               "Connection: close\r\n"
+                                               "Content-Type: multipart/x-mixed-replace; boundary=") +
+                                   MJPEG_BOUNDARY + "\r\n\r\n";
+        if (!sendAll(fd, header.data(), header.size())) {
+            closeSocket(fd);
+            continue;
+        }
+        m_fanout.subscribe(fd, "mjpeg viewer " + std::to_string(++m_accepted), true);
+    }
+}
+
+bool MjpegServer::submit(const unsigned char *rgb, int width, int height) {
+    if (m_fanout.numSubscribers() == 0) return false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_stats.frames_submitted;
+        if (m_has_pending) ++m_stats.frames_replaced;
+        m_pending.assign(rgb, rgb + static_cast<size_t>(width) * height * 3);
+        m_pending_width = width;
+        m_pending_height = height;
+        m_has_pending = true;
+    }
+    m_wake.notify_one();
+    return true;
+}
+
+void MjpegServer::encode() {
+    std::vector<unsigned char> jpeg;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_wake.wait(lock, [this]() { return m_stopping || m_has_pending; });
+        if (m_stopping) break;
+        m_encoding.swap(m_pending);
+        const int width = m_pending_width;
+        const int height = m_pending_height;
+        m_has_pending = false;
+        lock.unlock();
+
+        const auto t0 = std::chrono::steady_clock::now();
+        const bool ok = m_encoder.encode(m_encoding.data(), width, height, jpeg);
+        const double encode_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        if (ok) {
+            const std::string part_header = std::string("--") + MJPEG_BOUNDARY +
+                                            "\r\nContent-Type: image/jpeg\r\nContent-Length: " +
+                                            std::to_string(jpeg.size()) + "\r\n\r\n";
+            std::vector<unsigned char> part;
+            part.reserve(part_header.size() + jpeg.size() + 2);
+            part.insert(part.end(), part_header.begin(), part_header.end());
+            part.insert(part.end(), jpeg.begin(), jpeg.end());
+            part.push_back('\r');
+            part.push_back('\n');
+            m_fanout.publish(std::move(part));
+        }
+
+        lock.lock();
+        if (ok) {
+            ++m_stats.frames_encoded;
+            m_stats.last_encode_ms = encode_ms;
+            m_stats.last_frame_bytes = jpeg.size();
+        }
+    }
+}
+
+MjpegStats MjpegServer::stats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
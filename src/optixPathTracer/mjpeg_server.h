@@ -0,0 +1,88 @@
+#pragma once
+
+#include "frame_fanout.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+*   Preview of the render loop as MJPEG over HTTP, for a browser or ffplay on a machine
+*   without the RTMP stack. Frames are only encoded while a viewer is connected, on a thread
+*   of the server's own so the render loop only pays for a copy. Viewers get the parts of
+*   the multipart stream through a FrameFanout, so a slow one drops frames.
+*/
+
+const uint16_t MJPEG_PORT = 8080;   // default of --mjpeg-port
+const int MJPEG_QUALITY = 80;
+
+/*
+*   Encodes RGB24 images with the vendored stb_image_write, split into horizontal slices of
+*   whole 8x8 block rows that are encoded on worker threads. The slices are joined into one
+*   baseline JPEG with a restart marker in front of every slice but the first, so it decodes
+*   to exactly the pixels of the same image encoded in one piece.
+*/
+class SliceJpegEncoder {
+public:
+    explicit SliceJpegEncoder(unsigned int num_threads = 0, int quality = MJPEG_QUALITY);
+
+    // rgb holds width x height pixels, top row first. False if stb_image_write fails
+    bool encode(const unsigned char *rgb, int width, int height, std::vector<unsigned char> &jpeg);
+
+    unsigned int numThreads() const { return m_num_threads; }
+
+private:
+    unsigned int m_num_threads;
+    int m_quality;
+    std::vector<std::vector<unsigned char>> m_slices;
+};
+
+struct MjpegStats {
+    uint64_t frames_submitted = 0;  // while a viewer was connected
+    uint64_t frames_replaced = 0;   // submitted again before the encoder got to them
+    uint64_t frames_encoded = 0;
+    double last_encode_ms = 0.0;
+    size_t last_frame_bytes = 0;
+};
+
+class MjpegServer {
+public:
+    explicit MjpegServer(unsigned int num_threads = 0, int quality = MJPEG_QUALITY);
+    ~MjpegServer();
+
+    MjpegServer(const MjpegServer &) = delete;
+    MjpegServer &operator=(const MjpegServer &) = delete;
+
+    // Serves the stream on / and /stream.mjpg, port 0 picks one which is stored in *bound_port
+    bool listen(uint16_t port, uint16_t *bound_port = nullptr);
+
+    // Copies the RGB24 frame for the encoder unless no viewer is connected, returns whether it did
+    bool submit(const unsigned char *rgb, int width, int height);
+
+    size_t numViewers() const { return m_fanout.numSubscribers(); }
+    uint64_t framesDropped() const { return m_fanout.framesDropped(); }
+    MjpegStats stats() const;
+    std::vector<SubscriberStats> viewerStats() const { return m_fanout.stats(); }
+
+private:
+    void accept();
+    void encode();
+
+    FrameFanout m_fanout;
+    SliceJpegEncoder m_encoder;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_stopping = false;
+    bool m_has_pending = false;
+    std::vector<unsigned char> m_pending, m_encoding;
+    int m_pending_width = 0, m_pending_height = 0;
+    MjpegStats m_stats;
+    std::thread m_encoder_thread;
+
+    int m_listen_fd = -1;
+    std::thread m_acceptor;
+    uint32_t m_accepted = 0;
+};
@@ -45,6 +45,7 @@
 #include <sutil/Exception.h>
 #include <sutil/GLDisplay.h>
 #include <sutil/Matrix.h>
+#include <sutil/Profiler.h>
 #include <sutil/Trackball.h>
 #include <sutil/sutil.h>
 #include <sutil/vec_math.h>
@@ -52,15 +53,42 @@
 
 #include <GLFW/glfw3.h>
 #include "optixPathTracer.h"
+#include "atrous_denoiser.h"
+#include "benchmarks.h"
+#include "camera_path.h"
+#include "cpu_bvh.h"
+#include "cpu_renderer.h"
+#include "frame_fanout.h"
+#include "icosphere.h"
+#include "light_tree.h"
+#include "lossless_codec.h"
+#include "memory_accounting.h"
+#include "metrics.h"
+#include "mjpeg_server.h"
+#include "path_tracer.h"
+#include "scene_parser.h"
+#include "render_session.h"
+#include "scene_snapshot.h"
+#include "session_scheduler.h"
+#include "session_server.h"
+#include "tcp_socket.h"
+#include "tile_cluster.h"
+#include "temporal_reprojection.h"
 #include "tiny_obj_loader.h"
 #include <map>
 #include <array>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <sstream>
 #include <string>
+#include <memory>
 #include <set>
 #include <vector>
 //#include <opencv2/dnn.hpp>
@@ -74,6 +102,7 @@
 #include "stb_image.h"
 
 #include <stdio.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -106,6 +135,9 @@ bool resize_dirty = false;
 bool minimized = false;
 bool saveRequestedFull = false;
 bool saveRequestedQuarter = false;
+bool saveRequestedAovs = false;
+bool saveRequestedProfile = false;
+bool memoryReportRequested = false;
 bool re_render = true;
 
 // Camera state
@@ -124,114 +156,72 @@ int depth = 3;
 int width = 768;
 int height = 768;
 
-bool denoiser_enabled = true;
-bool scene_changed = false;
-std::string new_scene_file;
-
-//------------------------------------------------------------------------------
-//
-// Local types
-// TODO: some of these should move to sutil or optix util header
-//
-//------------------------------------------------------------------------------
-
-template<typename T>
-struct Record {
-    __align__(OPTIX_SBT_RECORD_ALIGNMENT) char header[OPTIX_SBT_RECORD_HEADER_SIZE];
-    T data;
-};
-
-typedef Record<RayGenData> RayGenRecord;
-typedef Record<MissData> MissRecord;
-typedef Record<HitGroupData> HitGroupRecord;
-
-struct Vertex {
-    float x, y, z, pad;
-};
-
-
-struct IndexedTriangle {
-    uint32_t v1, v2, v3, pad;
-};
+// ICOSPHERE tessellation, every sphere references the one unit icosphere of this level
+int icosphere_level = 3;
+// Trace ICOSPHEREs as analytic spheres on the CPU path, they become instances of the unit sphere
+bool analytic_spheres = false;
 
+// Prepared scene snapshot (--prepared), replaces loading the scene while none of its input files changed
+std::string prepared_scene_file;
 
-struct Instance {
-    float transform[12];
-};
+// Scene updates: IAS refits in a row before it is rebuilt, refits keep the topology and the tree degrades
+const int32_t IAS_MAX_REFITS = 64;
 
-struct Triangle {
-    glm::vec3 vertex[3];     // Vertices
-    glm::vec3 normal;        // Normal
-    glm::vec2 texcoord;
-    //Material data;
-    glm::vec3 diffuse;
+enum DenoiserType {
+    DENOISER_NONE,
+    DENOISER_OPTIX,
+    DENOISER_ATROUS     // CPU filter, for hosts without the OptiX denoiser
 };
 
-struct Texture {
-    ~Texture() {
-        if (pixel) delete[] pixel;
-    }
-
-    uint32_t *pixel{nullptr};
-    glm::ivec2 resolution{-1};
-};
+DenoiserType denoiser_type = DENOISER_OPTIX;
+bool denoiser_enabled = true;
 
-struct Mesh {
-    std::vector<Triangle *> triangles;
-    std::vector<glm::vec3> vertex;
-    std::vector<glm::vec3> normal;
-    std::vector<glm::vec2> texcoord;
-    std::vector<glm::ivec3> index;
+// Adaptive sampling
+float adaptive_threshold = 0.f;     // relative error per pixel, 0 disables adaptive sampling
+int32_t adaptive_min_samples = 4;   // launches every pixel gets before it may converge
+bool show_convergence = false;
 
-    glm::vec3 diffuse;
-    int diffuseTextureID{-1};
-};
+// Reproject the previous frame instead of starting from scratch after camera motion
+bool temporal_enabled = false;
 
-struct Model {
-    ~Model() {
-        for (auto mesh: meshes) delete mesh;
-    }
+// Chrome trace written on exit and on the T key, empty while profiling is off
+std::string profile_file;
 
-    bool material;
-    std::vector<Mesh *> meshes;
-    std::vector<Texture *> textures;
-};
+// Render sessions served to remote viewers (--serve), rendered on the host
+const int32_t SESSION_MAX_WIDTH = 640;
 
-struct PathTracerState {
-    OptixDeviceContext context = 0;
+// Distributed rendering (--render-worker, --bench-cluster)
+std::vector<std::string> cluster_worker_addresses;     // host:port, empty forks workers on localhost
 
-    OptixTraversableHandle gas_handle = 0;  // Traversable handle for triangle AS
-    CUdeviceptr d_gas_output_buffer = 0;  // Triangle AS memory
-    CUdeviceptr d_vertices = 0;
-    CUdeviceptr d_texcoords = 0;
-    CUdeviceptr d_lights = 0;
+// Streamed frames go to ffmpeg and to viewers on --fanout-port through a FrameFanout
+int32_t fanout_port = 0;                    // 0 streams to ffmpeg only
+const double FANOUT_STATS_INTERVAL = 5.0;   // seconds between subscriber stats in the render loop
 
-    OptixModule ptx_module = 0;
-    OptixPipelineCompileOptions pipeline_compile_options = {};
-    OptixPipeline pipeline = 0;
+// MJPEG preview over HTTP (--mjpeg-port, --bench-mjpeg)
+int32_t mjpeg_port = 0;                     // 0 serves no preview
 
-    OptixProgramGroup raygen_prog_group = 0;
-    OptixProgramGroup radiance_miss_group = 0;
-    OptixProgramGroup occlusion_miss_group = 0;
-    OptixProgramGroup radiance_hit_group = 0;
-    OptixProgramGroup occlusion_hit_group = 0;
+// Lossless frames for LAN viewers (--lossless-port, --bench-lossless)
+int32_t lossless_port = 0;                  // 0 serves none
 
-    CUstream stream = 0;
-    Params params;
-    Params *d_params;
+// Prometheus metrics (--metrics-port, --bench-metrics)
+int32_t metrics_port = 0;                   // 0 serves none
+MetricsRegistry metrics;
+const double METRICS_RATE_SMOOTHING = 0.1;  // weight of the newest frame in pt_fps and pt_samples_per_second
 
-    OptixShaderBindingTable sbt = {};
-    Model *model;
+// Memory accounting (--memory-budget, --bench-memory)
+bool textures_downscaled = false;           // by the last loadScene(), to fit the texture budget
+size_t accounted_host_geometry = 0;         // by the last accountHostGeometry()
 
-    OptixDenoiser denoiser = nullptr;
-    CUdeviceptr denoiserScratch = 0;
-    uint32_t denoiserScratchSize;
-    CUdeviceptr denoiserState = 0;
-    uint32_t denoiserStateSize;
-    OptixDenoiserParams denoiserParams;
+// Camera path recording (--record-camera)
+std::string camera_record_file;             // written when the window closes, empty records nothing
+CameraPathRecorder camera_recorder;
 
-    int frameID = 0;
-};
+// Idle mode: once the frame is converged or the budget is spent and nothing changes, no
+// more subframes are launched and the last frame is only re-sent every keepalive interval
+int32_t max_subframes = 0;          // 0 renders until the frame converges
+double keepalive_interval = 1.0;    // seconds, 0 stops sending frames while idle
+const double IDLE_POLL_INTERVAL = 0.1;
+bool sceneReloadRequested = false;
 
 // Timer
 PerformanceTimer &timer() {
@@ -239,6 +229,26 @@ PerformanceTimer &timer() {
     return timer;
 }
 
+/*
+*   cudaMalloc() accounted under tag. Throws std::runtime_error instead of allocating if the
+*   allocation would go over the device budget of tag
+*/
+void trackedCudaMalloc(void **ptr, size_t size, MemoryTag tag) {
+    MemoryAccounting &accounting = memoryAccounting();
+    if (!accounting.tryAllocate(tag, MEMORY_DEVICE, size))
+        throw std::runtime_error(accounting.budgetError(tag, MEMORY_DEVICE, size));
+    const cudaError_t result = cudaMalloc(ptr, size);
+    if (result != cudaSuccess) accounting.release(tag, MEMORY_DEVICE, size);
+    CUDA_CHECK(result);
+    accounting.trackAddress(*ptr, tag, MEMORY_DEVICE, size);
+}
+
+// cudaFree() of memory from trackedCudaMalloc()
+void trackedCudaFree(void *ptr) {
+    memoryAccounting().releaseAddress(ptr);
+    CUDA_CHECK(cudaFree(ptr));
+}
+
 
 //------------------------------------------------------------------------------
 //
@@ -261,10 +271,31 @@ std::vector<float> d_spec_exp;
 std::vector<float> d_ior;
 std::vector<Triangle> d_triangles;
 std::vector<Light> d_lights;
+std::vector<LightSource> light_sources;     // one per light in d_lights
 std::vector<cudaArray_t> textureArrays;
 std::vector<cudaTextureObject_t> textureObjects;
 const Model *MODEL;
 
+// Instancing: meshes are loaded once per obj file (or shape) and referenced by instances
+const uint32_t INSTANCE_MATERIAL = ~0u;
+std::vector<CachedMesh> mesh_cache;
+std::map<std::string, uint32_t> mesh_cache_index;
+std::vector<InstanceBinding> instance_bindings;
+std::map<std::pair<uint32_t, uint32_t>, uint32_t> instance_binding_index;
+std::vector<Instance> scene_instances;
+std::vector<uint32_t> free_instances;      // removed slots of scene_instances
+
+SceneUpdates scene_updates;
+std::vector<SceneItem> scene_items;         // by readSceneFile(), empty for a prepared scene
+SceneFile scene_items_file;                 // mapping of the scene file scene_items point into
+
+// Prepared scenes
+std::vector<std::string> scene_inputs;      // files the last readSceneFile() read, the scene file first
+SnapshotReader prepared_scene;              // mapping of the prepared scene that was loaded
+bool prepared_gas = false;                  // prepared_scene has a scene GAS for the next buildMeshAccel()
+bool prepared_cpu_bvh = false;              // prepared_scene has a scene BVH for the next buildCpuScene()
+bool prepared_scene_stale = false;          // loading it failed, it is written once the scene is built
+
 static Vertex toVertex(glm::vec3 &v, glm::mat4 &t) {
     // transform the v
     v = glm::vec3(t * glm::vec4(v, 1.f));
@@ -282,12 +313,6 @@ static glm::vec3 randomColor(int i) {
     }
 }
 
-static Vertex fixToUnitSphere(Vertex v) {
-    // fix vertex position to be on unit sphere
-    float length = sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
-    return {v.x / length, v.y / length, v.z / length, 0.f};
-}
-
 static int addMaterial(Material m,
                        float3 dif_col,
                        float3 spec_col,
@@ -334,6 +359,61 @@ int addVertex(Mesh *mesh,
     return newID;
 }
 
+/*
+*   Halves the resolution of texture, every pixel the average of the 2x2 it covered. Rows and
+*   columns left over at odd sizes are dropped
+*/
+void halveTexture(Texture &texture) {
+    const glm::ivec2 from = texture.resolution;
+    const glm::ivec2 to(std::max(1, from.x / 2), std::max(1, from.y / 2));
+    uint32_t *pixels = static_cast<uint32_t *>(malloc(static_cast<size_t>(to.x) * to.y * sizeof(uint32_t)));
+    for (int y = 0; y < to.y; ++y) {
+        for (int x = 0; x < to.x; ++x) {
+            const int x0 = std::min(2 * x, from.x - 1), x1 = std::min(2 * x + 1, from.x - 1);
+            const int y0 = std::min(2 * y, from.y - 1), y1 = std::min(2 * y + 1, from.y - 1);
+            const uint32_t quad[4] = {texture.pixel[y0 * from.x + x0], texture.pixel[y0 * from.x + x1],
+                                      texture.pixel[y1 * from.x + x0], texture.pixel[y1 * from.x + x1]};
+            uint32_t pixel = 0;
+            for (int channel = 0; channel < 32; channel += 8) {
+                uint32_t sum = 2;   // rounds to nearest
+                for (uint32_t texel: quad)
+                    sum += (texel >> channel) & 0xFF;
+                pixel |= (sum / 4) << channel;
+            }
+            pixels[y * to.x + x] = pixel;
+        }
+    }
+    free(texture.pixel);
+    texture.pixel = pixels;
+    texture.resolution = to;
+}
+
+/*
+*   Accounts the pixels of a texture that was just loaded, halving it until it fits the
+*   texture budget next to the textures loaded before. Throws std::runtime_error, with the
+*   pixels freed, once MIN_TEXTURE_SIZE does not fit either
+*/
+void accountTexture(Texture &texture, const std::string &name) {
+    MemoryAccounting &accounting = memoryAccounting();
+    const glm::ivec2 loaded = texture.resolution;
+    while (!accounting.tryAllocate(MEMORY_TEXTURES, MEMORY_HOST, texture.bytes())) {
+        if (texture.resolution.x <= MIN_TEXTURE_SIZE && texture.resolution.y <= MIN_TEXTURE_SIZE) {
+            const std::string error = accounting.budgetError(MEMORY_TEXTURES, MEMORY_HOST, texture.bytes());
+            free(texture.pixel);
+            texture.pixel = nullptr;
+            throw std::runtime_error("Texture " + name + " does not fit even at " +
+                                     std::to_string(texture.resolution.x) + "x" +
+                                     std::to_string(texture.resolution.y) + ": " + error);
+        }
+        halveTexture(texture);
+    }
+    if (texture.resolution != loaded) {
+        textures_downscaled = true;
+        std::cout << "Texture " << name << " downscaled from " << loaded.x << "x" << loaded.y << " to "
+                  << texture.resolution.x << "x" << texture.resolution.y << " to fit the texture budget" << std::endl;
+    }
+}
+
 /*! load a texture (if not already loaded), and return its ID in the
       model's textures[] vector. Textures that could not get loaded
       return -1 */
@@ -352,6 +432,7 @@ int loadTexture(Model *model,
     for (auto &c: fileName)
         if (c == '\\') c = '/';
     fileName = modelPath + "/" + fileName;
+    scene_inputs.push_back(fileName);
 
     glm::ivec2 res;
     int comp;
@@ -375,6 +456,7 @@ int loadTexture(Model *model,
             }
         }
         model->textures.push_back(texture);
+        accountTexture(*texture, fileName);
     } else {
         std::cout << "Could not load texture from " << fileName << "!" << std::endl;
     }
@@ -385,10 +467,42 @@ int loadTexture(Model *model,
 
 
 // Reference: TinyOBJ Sample code: https://github.com/tinyobjloader/tinyobjloader
+// Loads mtl files like tinyobj does and adds them to scene_inputs
+class InputMaterialReader : public tinyobj::MaterialReader {
+public:
+    explicit InputMaterialReader(const std::string &mtl_dir) : m_mtl_dir(mtl_dir), m_reader(mtl_dir) {}
+
+    bool operator()(const std::string &mat_id, std::vector<tinyobj::material_t> *materials,
+                    std::map<std::string, int> *mat_map, std::string *warn, std::string *err) override {
+        scene_inputs.push_back(m_mtl_dir + mat_id);
+        return m_reader(mat_id, materials, mat_map, warn, err);
+    }
+
+private:
+    std::string m_mtl_dir;
+    tinyobj::MaterialFileReader m_reader;
+};
+
+template<typename T>
+size_t vectorBytes(const std::vector<T> &v) {
+    return v.capacity() * sizeof(T);
+}
+
+// What the arrays tinyobj parsed an obj file into hold
+size_t tinyObjBytes(const tinyobj::attrib_t &attrib, const std::vector<tinyobj::shape_t> &shapes) {
+    size_t bytes = vectorBytes(attrib.vertices) + vectorBytes(attrib.vertex_weights) + vectorBytes(attrib.normals) +
+                   vectorBytes(attrib.texcoords) + vectorBytes(attrib.texcoord_ws) + vectorBytes(attrib.colors);
+    for (const tinyobj::shape_t &shape: shapes)
+        bytes += vectorBytes(shape.mesh.indices) + vectorBytes(shape.mesh.num_face_vertices) +
+                 vectorBytes(shape.mesh.material_ids) + vectorBytes(shape.mesh.smoothing_group_ids);
+    return bytes;
+}
+
 Model *loadMesh(std::string filename) {
 
     const std::string mtlDir
             = filename.substr(0, filename.rfind('/') + 1);
+    scene_inputs.push_back(filename);
     Model *model = new Model;
     tinyobj::attrib_t attrib;
     std::vector<tinyobj::shape_t> shapes;
@@ -397,7 +511,13 @@ Model *loadMesh(std::string filename) {
     std::string err;
     bool material = false;
     // load obj
-    bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename.c_str(), mtlDir.c_str());
+    std::ifstream obj_stream(filename.c_str());
+    InputMaterialReader material_reader(mtlDir);
+    bool ret = false;
+    if (obj_stream)
+        ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, &obj_stream, &material_reader);
+    else
+        err = "Cannot open file [" + filename + "]";
 
     if (!warn.empty()) {
         std::cout << warn << std::endl;
@@ -411,6 +531,13 @@ Model *loadMesh(std::string filename) {
         exit(1);
     }
 
+    // tinyobj's arrays are scratch until the model is built from them
+    MemoryAccounting &accounting = memoryAccounting();
+    const size_t scratch_bytes = tinyObjBytes(attrib, shapes);
+    if (!accounting.tryAllocate(MEMORY_LOADER_SCRATCH, MEMORY_HOST, scratch_bytes))
+        throw std::runtime_error("Cannot load " + filename + ": " +
+                                 accounting.budgetError(MEMORY_LOADER_SCRATCH, MEMORY_HOST, scratch_bytes));
+
     if (!materials.empty()) {
         material = true;
         std::cout << "mtl file loaded!" << std::endl;
@@ -507,25 +634,23 @@ Model *loadMesh(std::string filename) {
         }
     }
     std::cout << "Loaded mesh with " << d_triangles.size() << " triangles from " << filename.c_str() << std::endl;
+    accounting.release(MEMORY_LOADER_SCRATCH, MEMORY_HOST, scratch_bytes);
     return model;
 }
 
-static void addSceneGeometry(Geom type,
-                             int mat_id,
-                             glm::vec3 pos,
-                             glm::vec3 rot,
-                             glm::vec3 s,
-                             std::string objfile) {
-    // create a transform matrix from the pos, rot and s
-    glm::mat4 translate = glm::translate(glm::mat4(), pos);
-    glm::mat4 rotateX = glm::rotate(rot.x, glm::vec3(1.0, 0.0, 0.0));
-    glm::mat4 rotateY = glm::rotate(rot.y, glm::vec3(0.0, 1.0, 0.0));
-    glm::mat4 rotateZ = glm::rotate(rot.z, glm::vec3(0.0, 0.0, 1.0));
-    glm::mat4 scale = glm::scale(s);
-    glm::mat4 transform = translate * rotateX * rotateY * rotateZ * scale;
-
-    // determine what kind of geometry is added
-
+/*
+*   Appends the triangles of a CUBE, ICOSPHERE or MESH with the transform applied, three
+*   vertices and texture coordinates and one material index per triangle. Returns the
+*   number of triangles added.
+*/
+static int appendShape(Geom type,
+                       int mat_id,
+                       glm::mat4 &transform,
+                       const std::string &objfile,
+                       std::vector<Vertex> &vertices,
+                       std::vector<float2> &texcoords,
+                       std::vector<uint32_t> &material_indices) {
+    int triangle_count = 0;
     if (type == CUBE) {
         // A cube is made of 12 triangles -> 36 vertices
         // First create a unit cube, then transform the vertices. A unit cube has an edge length of 1.
@@ -543,99 +668,41 @@ static void addSceneGeometry(Geom type,
                          glm::vec3(-0.5f, 0.5f, -0.5f), glm::vec3(-0.5f, -0.5f, -0.5f), glm::vec3(0.5f, -0.5f, -0.5f)};
         // Add the vertices
         for (auto elem: v) {
-            d_vertices.push_back(toVertex(elem, transform));
+            vertices.push_back(toVertex(elem, transform));
         }
-        TRIANGLE_COUNT += 12;
+        triangle_count += 12;
 
         // Add dummy texture coordinates for cube - we must add for each vertex
         for (int i = 0; i < 36; ++i)
-            d_texcoords.push_back(make_float2(0.f));
+            texcoords.push_back(make_float2(0.f));
 
         // Add material id to mat indices
         for (int i = 0; i < 12; ++i)
-            d_material_indices.push_back(mat_id);
+            material_indices.push_back(mat_id);
     } else if (type == ICOSPHERE) {
-        // a sphere can be created by subdividing an icosahedron
-        // Source: http://blog.andreaskahler.com/2009/06/creating-icosphere-mesh-in-code.html
-
-        // First, create the 12 vertices of an icosahedron -> an icosahedron has 20 faces
-        float t = (1.f + sqrtf(5.f)) / 2.f;
-        Vertex p0 = fixToUnitSphere({-1.f, t, 0.f, 0.f});
-        Vertex p1 = fixToUnitSphere({1.f, t, 0.f, 0.f});
-        Vertex p2 = fixToUnitSphere({-1.f, -t, 0.f, 0.f});
-        Vertex p3 = fixToUnitSphere({1.f, -t, 0.f, 0.f});
-
-        Vertex p4 = fixToUnitSphere({0.f, -1.f, t, 0.f});
-        Vertex p5 = fixToUnitSphere({0.f, 1.f, t, 0.f});
-        Vertex p6 = fixToUnitSphere({0.f, -1.f, -t, 0.f});
-        Vertex p7 = fixToUnitSphere({0.f, 1.f, -t, 0.f});
-
-        Vertex p8 = fixToUnitSphere({t, 0.f, -1.f, 0.f});
-        Vertex p9 = fixToUnitSphere({t, 0.f, 1.f, 0.f});
-        Vertex p10 = fixToUnitSphere({-t, 0.f, -1.f, 0.f});
-        Vertex p11 = fixToUnitSphere({-t, 0.f, 1.f, 0.f});
-
-        // create a temporary triangles vector and put all the 20 triangles into it
-        // Each triangle is made of 3 consecutive vertices
-        std::vector<Vertex> temp_triangles = {p0, p11, p5, p0, p5, p1, p0, p1, p7, p0, p7, p10, p0, p10, p11,
-                                              p1, p5, p9, p5, p11, p4, p11, p10, p2, p10, p7, p6, p7, p1, p8,
-                                              p3, p9, p4, p3, p4, p2, p3, p2, p6, p3, p6, p8, p3, p8, p9,
-                                              p4, p9, p5, p2, p4, p11, p6, p2, p10, p8, p6, p7, p9, p8, p1};
-
-        // Each edge of the icosphere will be split in half -> this will create 4 subtriangles from 1 triangle
-        int rec_level = 3; // default subdivision level is set to 3, we can change it later
-        for (int i = 0; i < rec_level; ++i) {
-            std::vector<Vertex> temp_triangles_2;
-            for (int j = 0; j < temp_triangles.size(); j += 3) {
-
-                // get the 3 vertices of the triangle
-                Vertex v1 = temp_triangles[j];
-                Vertex v2 = temp_triangles[j + 1];
-                Vertex v3 = temp_triangles[j + 2];
-
-                // replace current triangle with 4 triangles
-                Vertex mid1 = fixToUnitSphere({(v1.x + v2.x) / 2.f, (v1.y + v2.y) / 2.f, (v1.z + v2.z) / 2.f, 0.f});
-                Vertex mid2 = fixToUnitSphere({(v2.x + v3.x) / 2.f, (v2.y + v3.y) / 2.f, (v2.z + v3.z) / 2.f, 0.f});
-                Vertex mid3 = fixToUnitSphere({(v1.x + v3.x) / 2.f, (v1.y + v3.y) / 2.f, (v1.z + v3.z) / 2.f, 0.f});
-
-                temp_triangles_2.push_back(v1);
-                temp_triangles_2.push_back(mid1);
-                temp_triangles_2.push_back(mid3);
-                temp_triangles_2.push_back(v2);
-                temp_triangles_2.push_back(mid2);
-                temp_triangles_2.push_back(mid1);
-                temp_triangles_2.push_back(v3);
-                temp_triangles_2.push_back(mid3);
-                temp_triangles_2.push_back(mid2);
-                temp_triangles_2.push_back(mid1);
-                temp_triangles_2.push_back(mid2);
-                temp_triangles_2.push_back(mid3);
-            }
-            // ping-pong vectors
-            temp_triangles = temp_triangles_2;
+        // Transform the shared vertices of the cached unit icosphere once, then expand the triangles
+        const IcosphereMesh &sphere = unitIcosphere(icosphere_level);
+        std::vector<Vertex> transformed;
+        transformed.reserve(sphere.vertices.size());
+        for (const float3 &p: sphere.vertices) {
+            glm::vec3 v(p.x, p.y, p.z);
+            transformed.push_back(toVertex(v, transform));
         }
-
-        // Done with subdivision - now add the resulting vertices to the buffer as well the material indices per triangle
-        int num_triangles = 0;
-        for (int i = 0; i < temp_triangles.size(); ++i) {
-            if (i % 3 == 0) {
-                d_material_indices.push_back(mat_id);
-                num_triangles++;
-            }
-            Vertex v = temp_triangles[i];
-            auto v_temp = glm::vec3(v.x, v.y, v.z);
-            d_vertices.push_back(toVertex(v_temp, transform));
+        for (uint32_t index: sphere.indices) {
+            vertices.push_back(transformed[index]);
             // Add dummy texture coordinate per vertex
-            d_texcoords.push_back(make_float2(0.f));
+            texcoords.push_back(make_float2(0.f));
         }
-        TRIANGLE_COUNT += num_triangles;
+        const int num_triangles = static_cast<int>(sphere.indices.size() / 3);
+        material_indices.insert(material_indices.end(), num_triangles, static_cast<uint32_t>(mat_id));
+        triangle_count += num_triangles;
     } else if (type == MESH) {
         if (objfile == "") {
-            return;
+            return triangle_count;
         }
         // store vertex count before mesh is added
-        int pre_vertex_count = d_vertices.size();
-        int pre_tex_count = d_texcoords.size();
+        int pre_vertex_count = vertices.size();
+        int pre_tex_count = texcoords.size();
         Model *model = loadMesh(objfile);
 
         for (int i = 0; i < model->meshes.size(); ++i) {
@@ -644,27 +711,122 @@ static void addSceneGeometry(Geom type,
                                                                                    mesh->diffuse.z), make_float3(0.f),
                                                               make_float3(0.f), 0.f, 0.f) : mat_id;
             d_textureIds.push_back(mesh->diffuseTextureID);
-            int triangle_count = 0;
             for (int j = 0; j < mesh->vertex.size(); ++j) {
-                d_vertices.push_back(toVertex(mesh->vertex[j], transform));
+                vertices.push_back(toVertex(mesh->vertex[j], transform));
                 if (j % 3 == 0) {
-                    d_material_indices.push_back(material_id);
-                    TRIANGLE_COUNT += 1;
+                    material_indices.push_back(material_id);
+                    triangle_count += 1;
                 }
             }
             for (int k = 0; k < mesh->texcoord.size(); ++k) {
-                d_texcoords.push_back(make_float2(mesh->texcoord[k].x, mesh->texcoord[k].y));
+                texcoords.push_back(make_float2(mesh->texcoord[k].x, mesh->texcoord[k].y));
             }
         }
         d_triangles.clear();
         MODEL = model;
         // calculate the difference between pre and post mesh vertex count
         // use this to add dummy texture coordinates (if necessary)
-        int tex_to_add = d_vertices.size() - pre_vertex_count;
-        if (pre_tex_count == d_texcoords.size()) {
+        int tex_to_add = vertices.size() - pre_vertex_count;
+        if (pre_tex_count == texcoords.size()) {
             for (int i = 0; i < tex_to_add; ++i)
-                d_texcoords.push_back(make_float2(0.f));
+                texcoords.push_back(make_float2(0.f));
         }
+    }
+    return triangle_count;
+}
+
+/*
+*   Loads a CUBE, ICOSPHERE or MESH into the mesh cache the first time it is instanced,
+*   returns its index in mesh_cache
+*/
+static uint32_t cachedMesh(Geom type, const std::string &objfile) {
+    const std::string key = type == MESH ? objfile : (type == CUBE ? "CUBE" : "ICOSPHERE");
+    const auto found = mesh_cache_index.find(key);
+    if (found != mesh_cache_index.end()) return found->second;
+
+    CachedMesh mesh;
+    mesh.key = key;
+    glm::mat4 identity(1.f);
+    std::vector<uint32_t> scene_materials;
+    appendShape(type, static_cast<int>(INSTANCE_MATERIAL), identity, objfile, mesh.vertices, mesh.texcoords,
+                scene_materials);
+    // Meshes with their own materials keep them, the others take the instance's material
+    for (uint32_t scene_material: scene_materials) {
+        const auto local = std::find(mesh.materials.begin(), mesh.materials.end(), scene_material);
+        mesh.material_indices.push_back(static_cast<uint32_t>(local - mesh.materials.begin()));
+        if (local == mesh.materials.end()) mesh.materials.push_back(scene_material);
+    }
+
+    const uint32_t index = static_cast<uint32_t>(mesh_cache.size());
+    mesh_cache.push_back(std::move(mesh));
+    mesh_cache_index[key] = index;
+    return index;
+}
+
+// Same transform as addSceneGeometry(), as a row major 3x4 matrix
+static void instanceTransform(glm::vec3 pos, glm::vec3 rot, glm::vec3 s, float *instance_transform) {
+    glm::mat4 translate = glm::translate(glm::mat4(), pos);
+    glm::mat4 rotateX = glm::rotate(rot.x, glm::vec3(1.0, 0.0, 0.0));
+    glm::mat4 rotateY = glm::rotate(rot.y, glm::vec3(0.0, 1.0, 0.0));
+    glm::mat4 rotateZ = glm::rotate(rot.z, glm::vec3(0.0, 0.0, 1.0));
+    glm::mat4 scale = glm::scale(s);
+    glm::mat4 transform = translate * rotateX * rotateY * rotateZ * scale;
+    for (int r = 0; r < 3; ++r)
+        for (int c = 0; c < 4; ++c)
+            instance_transform[4 * r + c] = transform[c][r];
+}
+
+void addSceneInstance(Geom type,
+                      int mat_id,
+                      glm::vec3 pos,
+                      glm::vec3 rot,
+                      glm::vec3 s,
+                      const std::string &objfile) {
+    Instance instance;
+    instanceTransform(pos, rot, s, instance.transform);
+    instance.visible = true;
+    instance.mesh = cachedMesh(type, objfile);
+
+    const CachedMesh &mesh = mesh_cache[instance.mesh];
+    const bool uses_instance_material =
+            std::find(mesh.materials.begin(), mesh.materials.end(), INSTANCE_MATERIAL) != mesh.materials.end();
+    const std::pair<uint32_t, uint32_t> key(instance.mesh,
+                                            uses_instance_material ? static_cast<uint32_t>(mat_id) : INSTANCE_MATERIAL);
+    const auto found = instance_binding_index.find(key);
+    if (found != instance_binding_index.end()) {
+        instance.binding = found->second;
+    } else {
+        InstanceBinding binding;
+        binding.mesh = instance.mesh;
+        for (uint32_t material: mesh.materials)
+            binding.materials.push_back(material == INSTANCE_MATERIAL ? mat_id : material);
+        instance.binding = static_cast<uint32_t>(instance_bindings.size());
+        instance_bindings.push_back(binding);
+        instance_binding_index[key] = instance.binding;
+    }
+    scene_instances.push_back(instance);
+}
+
+static void addSceneGeometry(Geom type,
+                             int mat_id,
+                             glm::vec3 pos,
+                             glm::vec3 rot,
+                             glm::vec3 s,
+                             std::string objfile) {
+    // create a transform matrix from the pos, rot and s
+    glm::mat4 translate = glm::translate(glm::mat4(), pos);
+    glm::mat4 rotateX = glm::rotate(rot.x, glm::vec3(1.0, 0.0, 0.0));
+    glm::mat4 rotateY = glm::rotate(rot.y, glm::vec3(0.0, 1.0, 0.0));
+    glm::mat4 rotateZ = glm::rotate(rot.z, glm::vec3(0.0, 0.0, 1.0));
+    glm::mat4 scale = glm::scale(s);
+    glm::mat4 transform = translate * rotateX * rotateY * rotateZ * scale;
+
+    // determine what kind of geometry is added
+
+    if (type == ICOSPHERE && analytic_spheres) {
+        addSceneInstance(type, mat_id, pos, rot, s, objfile);
+    } else if (type == CUBE || type == ICOSPHERE || type == MESH) {
+        TRIANGLE_COUNT += appendShape(type, mat_id, transform, objfile, d_vertices, d_texcoords, d_material_indices);
     } else if (type == AREA_LIGHT) {
         // We create area lights from 2-D planes
         // A plane is made of 2 triangles -> 6 vertices
@@ -697,6 +859,7 @@ static void addSceneGeometry(Geom type,
             float3 v2f = make_float3(0.f, 0.f, v2.z - c.z); //v2
             float3 n = normalize(-cross(v1f, v2f));
             d_lights.push_back({AREA_LIGHT, c, v1f, v2f, n, d_emission_colors[mat_id], 0.f, 0.f});
+            light_sources.push_back({mat_id, TRIANGLE_COUNT - 2});
         }
     } else if (type == POINT_LIGHT) {
         // We only allow point geometry for light sources
@@ -707,6 +870,7 @@ static void addSceneGeometry(Geom type,
 
         float3 pos_f = make_float3(pos.x, pos.y, pos.z);
         d_lights.push_back({POINT_LIGHT, pos_f, pos_f, pos_f, make_float3(0.f), d_emission_colors[mat_id], 0.f, 0.f});
+        light_sources.push_back({mat_id, -1});
     } else if (type == SPOT_LIGHT) {
         // We only allow spot light geometry for light sources
         if (d_mat_types[mat_id] != EMISSIVE) return;
@@ -721,6 +885,113 @@ static void addSceneGeometry(Geom type,
         d_lights.push_back(
                 {SPOT_LIGHT, pos_f, pos_f, pos_f, n, d_emission_colors[mat_id], glm::cos(25.f * (float) M_PI / 180.f),
                  glm::cos(20.f * (float) M_PI / 180.f)});
+        light_sources.push_back({mat_id, -1});
+    }
+}
+
+/*
+*   Prints how much instancing saves over baking every instance into the vertex buffers
+*/
+static void reportInstancing() {
+    if (scene_instances.empty()) return;
+    size_t stored = 0, flattened = 0;
+    for (const CachedMesh &mesh: mesh_cache)
+        stored += mesh.vertices.size() / 3;
+    for (const Instance &instance: scene_instances)
+        flattened += mesh_cache[instance.mesh].vertices.size() / 3;
+    // vertices, texture coordinates and a material index per triangle, as uploaded
+    const size_t triangle_bytes = 3 * sizeof(Vertex) + 3 * sizeof(float2) + sizeof(uint32_t);
+    const double stored_mb = (stored * triangle_bytes + scene_instances.size() * sizeof(OptixInstance)) / (1024.0 * 1024.0);
+    const double flattened_mb = flattened * triangle_bytes / (1024.0 * 1024.0);
+    std::cout << std::fixed << std::setprecision(2) << scene_instances.size() << " instances of " << mesh_cache.size()
+              << " meshes: " << stored << " triangles stored for " << flattened << " placed, " << stored_mb
+              << " MB instead of " << flattened_mb << " MB of geometry buffers" << std::endl;
+}
+
+/*
+*   Scene updates. These change the host scene right away and record what changed in
+*   scene_updates, commitSceneUpdates() (or commitCpuSceneUpdates()) applies the batch.
+*   Objects are INSTANCE placements; GEOMETRY lines are baked into the scene GAS and stay
+*   where they are, apart from area lights.
+*/
+
+// Places a CUBE, ICOSPHERE or MESH like an INSTANCE line, returns its id
+uint32_t addSceneObject(Geom type, int mat_id, glm::vec3 pos, glm::vec3 rot, glm::vec3 s,
+                        const std::string &objfile) {
+    const size_t meshes = mesh_cache.size();
+    const size_t bindings = instance_bindings.size();
+    addSceneInstance(type, mat_id, pos, rot, s, objfile);
+    if (mesh_cache.size() != meshes || instance_bindings.size() != bindings)
+        scene_updates.bindings = true;
+    if (free_instances.empty()) {
+        scene_updates.instance_count = true;
+        return static_cast<uint32_t>(scene_instances.size() - 1);
+    }
+    // A removed slot keeps the instance count, so the IAS is only refit
+    const uint32_t id = free_instances.back();
+    free_instances.pop_back();
+    scene_instances[id] = scene_instances.back();
+    scene_instances.pop_back();
+    scene_updates.instances = true;
+    return id;
+}
+
+void removeSceneObject(uint32_t id) {
+    if (id >= scene_instances.size() || !scene_instances[id].visible) return;
+    scene_instances[id].visible = false;
+    free_instances.push_back(id);
+    scene_updates.instances = true;
+}
+
+void transformSceneObject(uint32_t id, glm::vec3 pos, glm::vec3 rot, glm::vec3 s) {
+    if (id >= scene_instances.size() || !scene_instances[id].visible) return;
+    instanceTransform(pos, rot, s, scene_instances[id].transform);
+    scene_updates.instances = true;
+}
+
+// New colors and coefficients for a material, the lights it emits follow. The type stays.
+void updateSceneMaterial(int mat_id, float3 dif_col, float3 spec_col, float3 em_col, float spec_exp, float ior) {
+    if (mat_id < 0 || mat_id >= MAT_COUNT) return;
+    d_diffuse_colors[mat_id] = dif_col;
+    d_spec_colors[mat_id] = spec_col;
+    d_emission_colors[mat_id] = em_col;
+    d_spec_exp[mat_id] = spec_exp;
+    d_ior[mat_id] = ior;
+    scene_updates.materials.resize(MAT_COUNT, false);
+    scene_updates.materials[mat_id] = true;
+    for (size_t i = 0; i < d_lights.size(); ++i) {
+        if (light_sources[i].material != mat_id) continue;
+        d_lights[i].emission = em_col;
+        scene_updates.lights = true;
+    }
+}
+
+// Moves a light by offset, an area light together with the two triangles of its quad
+void moveSceneLight(uint32_t light, const float3 &offset) {
+    if (light >= d_lights.size()) return;
+    Light &l = d_lights[light];
+    l.corner += offset;
+    if (l.shape != AREA_LIGHT) {
+        // v1 and v2 hold the position too
+        l.v1 = l.v2 = l.corner;
+    }
+    scene_updates.lights = true;
+
+    const int32_t first_triangle = light_sources[light].first_triangle;
+    if (first_triangle < 0) return;
+    // The prepared BVH and GAS are of the old vertices
+    prepared_gas = prepared_cpu_bvh = false;
+    for (size_t v = 3 * static_cast<size_t>(first_triangle); v < 3 * static_cast<size_t>(first_triangle + 2); ++v) {
+        d_vertices[v].x += offset.x;
+        d_vertices[v].y += offset.y;
+        d_vertices[v].z += offset.z;
+    }
+    if (scene_updates.first_triangle < 0) {
+        scene_updates.first_triangle = first_triangle;
+        scene_updates.end_triangle = first_triangle + 2;
+    } else {
+        scene_updates.first_triangle = std::min(scene_updates.first_triangle, first_triangle);
+        scene_updates.end_triangle = std::max(scene_updates.end_triangle, first_triangle + 2);
     }
 }
 
@@ -740,30 +1011,28 @@ static void mouseButtonCallback(GLFWwindow *window, int button, int action, int
     } else {
         mouse_button = -1;
     }
+    camera_recorder.recordEvent("button " + std::to_string(button) + (action == GLFW_PRESS ? " press " : " release ") +
+                                std::to_string(static_cast<int>(xpos)) + " " + std::to_string(static_cast<int>(ypos)));
 }
 
 void initOptixDenoiser(PathTracerState &state) {
-    if (!state.params.denoiser) return;
+    if (!state.denoiser) return;
     OptixDenoiserSizes denoiserReturnSizes;
     OPTIX_CHECK(optixDenoiserComputeMemoryResources(state.denoiser, state.params.width, state.params.height,
                                                     &denoiserReturnSizes));
 
     if (state.denoiserScratch) {
-        CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.denoiserScratch )));
+        trackedCudaFree(reinterpret_cast<void *>( state.denoiserScratch ));
     }
     state.denoiserScratchSize = denoiserReturnSizes.withoutOverlapScratchSizeInBytes;
-    CUDA_CHECK(cudaMalloc(
-            reinterpret_cast<void **>( &state.denoiserScratch ),
-            state.denoiserScratchSize
-    ));
+    trackedCudaMalloc(reinterpret_cast<void **>( &state.denoiserScratch ), state.denoiserScratchSize,
+                      MEMORY_FRAME_BUFFERS);
 
     if (state.denoiserState) {
-        CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.denoiserState )));
+        trackedCudaFree(reinterpret_cast<void *>( state.denoiserState ));
     }
-    CUDA_CHECK(cudaMalloc(
-            reinterpret_cast<void **>( &state.denoiserState ),
-            denoiserReturnSizes.stateSizeInBytes
-    ));
+    trackedCudaMalloc(reinterpret_cast<void **>( &state.denoiserState ), denoiserReturnSizes.stateSizeInBytes,
+                      MEMORY_FRAME_BUFFERS);
     state.denoiserStateSize = denoiserReturnSizes.stateSizeInBytes;
 
     OPTIX_CHECK(optixDenoiserSetup(state.denoiser, state.stream,
@@ -786,7 +1055,11 @@ static void cursorPosCallback(GLFWwindow *window, double xpos, double ypos) {
         trackball.setViewMode(sutil::Trackball::EyeFixed);
         trackball.updateTracking(static_cast<int>( xpos ), static_cast<int>( ypos ), params->width, params->height);
         camera_changed = true;
+    } else {
+        return;
     }
+    camera_recorder.recordEvent("drag " + std::to_string(static_cast<int>(xpos)) + " " +
+                                std::to_string(static_cast<int>(ypos)));
 }
 
 
@@ -803,6 +1076,7 @@ static void windowSizeCallback(GLFWwindow *window, int32_t res_x, int32_t res_y)
     params->height = res_y;
     camera_changed = true;
     resize_dirty = true;
+    camera_recorder.recordEvent("resize " + std::to_string(res_x) + " " + std::to_string(res_y));
 }
 
 
@@ -812,6 +1086,8 @@ static void windowIconifyCallback(GLFWwindow *window, int32_t iconified) {
 
 
 static void keyCallback(GLFWwindow *window, int32_t key, int32_t /*scancode*/, int32_t action, int32_t /*mods*/) {
+    camera_recorder.recordEvent("key " + std::to_string(key) +
+                                (action == GLFW_PRESS ? " press" : action == GLFW_REPEAT ? " repeat" : " release"));
     if (action == GLFW_PRESS) {
         if (key == GLFW_KEY_ESCAPE) {
             glfwSetWindowShouldClose(window, true);
@@ -853,14 +1129,26 @@ static void keyCallback(GLFWwindow *window, int32_t key, int32_t /*scancode*/, i
         camera_changed = true;
     } else if (key == GLFW_KEY_B) {
         denoiser_enabled = !denoiser_enabled;
-    } else if (key == GLFW_KEY_C) {
-        scene_changed = true;
-        new_scene_file = "../../scenes/living_room.txt";
+    } else if (key == GLFW_KEY_X && action == GLFW_RELEASE) {
+        // Save the denoiser guide layers
+        saveRequestedAovs = true;
+    } else if (key == GLFW_KEY_T && action == GLFW_RELEASE) {
+        // Print the stage timings and write the trace so far
+        saveRequestedProfile = true;
+    } else if (key == GLFW_KEY_M && action == GLFW_RELEASE) {
+        // Print the memory report
+        memoryReportRequested = true;
+    } else if (key == GLFW_KEY_H && action == GLFW_RELEASE) {
+        show_convergence = !show_convergence;
+    } else if (key == GLFW_KEY_C && action == GLFW_RELEASE) {
+        // Apply the edits made to the scene file since it was loaded
+        sceneReloadRequested = true;
     }
 }
 
 
 static void scrollCallback(GLFWwindow *window, double xscroll, double yscroll) {
+    camera_recorder.recordEvent("scroll " + std::to_string(static_cast<int>(yscroll)));
     if (trackball.wheelEvent((int) yscroll))
         camera_changed = true;
 }
@@ -873,21 +1161,214 @@ static void scrollCallback(GLFWwindow *window, double xscroll, double yscroll) {
 //
 //------------------------------------------------------------------------------
 
+void writeProfile() {
+    if (profile_file.empty()) return;
+    sutil::Profiler &profiler = sutil::Profiler::instance();
+    profiler.printSummary(std::cout);
+    profiler.writeChromeTrace(profile_file);
+    std::cout << "Wrote trace to " << profile_file << std::endl;
+}
+
 void printUsageAndExit(const char *argv0) {
     std::cerr << "Usage  : " << argv0 << " [options]\n";
     std::cerr << "Options: --file | -f <filename>      File for image output\n";
     std::cerr << "         --launch-samples | -s       Number of samples per pixel per launch (default 16)\n";
     std::cerr << "         --no-gl-interop             Disable GL interop for display\n";
     std::cerr << "         --dim=<width>x<height>      Set image dimensions; defaults to 768x768\n";
+    std::cerr << "         --adaptive=<error>          Stop sampling pixels below this relative error (default off)\n";
+    std::cerr << "         --adaptive-min=<launches>   Launches every pixel gets before it may converge (default 4)\n";
+    std::cerr << "         --max-subframes=<n>         Stop rendering a static view after n subframes (default 0, no limit)\n";
+    std::cerr << "         --keepalive=<seconds>       Re-send interval of the last frame while idle, 0 to stop (default 1)\n";
+    std::cerr << "         --denoiser=<type>           optix, atrous (CPU) or none (default optix)\n";
+    std::cerr << "         --bench-denoiser <noisy.exr> <reference.exr> [<albedo.exr> <normal.exr>]\n";
+    std::cerr << "                                     Measure A-Trous denoiser quality and speed and exit\n";
+    std::cerr << "         --bench <scene.txt>         Render the scene headlessly and append timings as JSON to the bench output\n";
+    std::cerr << "         --bench-out=<file>          Bench output, one JSON object per line (default ptbench.jsonl)\n";
+    std::cerr << "         --bench-subframes=<n>       Subframes to time (default 16)\n";
+    std::cerr << "         --bench-width=<pixels>      Bench image width, the height keeps the scene's aspect ratio\n";
+    std::cerr << "         --backend=<type>            Bench backend: auto, gpu or cpu (default auto)\n";
+    std::cerr << "         --golden <scene.txt>        Render the scene on the CPU and compare it to golden/<scene>.exr\n";
+    std::cerr << "         --golden-update             Write the golden image instead of comparing\n";
+    std::cerr << "         --golden-bootstrap          Write the golden image if there is none, compare otherwise\n";
+    std::cerr << "         --prepared=<file>           Prepared scene snapshot, used while its inputs are unchanged and rewritten otherwise\n";
+    std::cerr << "         --icosphere-level=<n>       ICOSPHERE subdivision level, 0 to 7 (default 3)\n";
+    std::cerr << "         --analytic-spheres          Trace ICOSPHEREs as exact spheres on the CPU path (bench, golden)\n";
+    std::cerr << "         --profile[=<trace.json>]    Time the frame stages, print percentiles and write a Chrome trace on exit\n";
+    std::cerr << "         --temporal                  Reuse the previous frame after camera motion\n";
+    std::cerr << "         --bench-temporal[=<frames>] Compare temporal reprojection and restarting on a camera path and exit\n";
+    std::cerr << "         --bench-shadow[=<points>]   Measure CPU shadow ray throughput for the scene and exit\n";
+    std::cerr << "         --bench-lights[=<points>]   Compare uniform and light tree selection variance and exit\n";
+    std::cerr << "         --bench-sessions[=<n>]      Serve n sessions to stand-in clients on the CPU, check and time them, exit\n";
+    std::cerr << "         --bench-fairness[=<s>]      Compare round robin and fair share scheduling of mixed sessions for s seconds, exit\n";
+    std::cerr << "         --serve[=<port>]            Serve render sessions of the scene to viewers on port (default 7620)\n";
+    std::cerr << "         --render-worker[=<port>]    Render tiles of the scene for a coordinator on port (default 7600)\n";
+    std::cerr << "         --bench-cluster[=<n>]       Render on n local worker processes, compare with a local render and exit\n";
+    std::cerr << "         --cluster-workers=<list>    Comma separated host:port of running render workers to render on, or for --bench-cluster\n";
+    std::cerr << "         --fanout-port=<port>        Also stream frames to viewers connecting on port, slow ones drop frames\n";
+    std::cerr << "         --bench-fanout[=<n>]        Stream frames to n fast, slow and stalled local viewers, check and time it, exit\n";
+    std::cerr << "         --mjpeg-port[=<port>]       Serve an MJPEG preview over HTTP on port (default 8080)\n";
+    std::cerr << "         --bench-mjpeg[=<frames>]    Time slice parallel JPEG encoding, fetch frames from the preview, exit\n";
+    std::cerr << "         --lossless-port[=<port>]    Stream lossless stripe coded frames to viewers on port (default 7610)\n";
+    std::cerr << "         --bench-lossless[=<frames>] Time the lossless codec on progressively converging frames and exit\n";
+    std::cerr << "         --metrics-port[=<port>]     Serve Prometheus metrics on port (default 9464)\n";
+    std::cerr << "         --bench-metrics[=<frames>]  Time metric updates, render frames and check a scrape of /metrics, then exit\n";
+    std::cerr << "         --memory-budget=<list>      Budgets in MB like textures:512,total:4096, for geometry, textures,\n";
+    std::cerr << "                                     frame_buffers, acceleration, loader_scratch or total on host and device each\n";
+    std::cerr << "         --bench-memory              Check texture downscaling and refusals against budgets and exit\n";
+    std::cerr << "         --record-camera=<file>      Record the camera and the input events, written when the window closes\n";
+    std::cerr << "         --replay-camera=<file>      Render a recorded camera path headlessly, append frame timings to the bench output\n";
+    std::cerr << "         --replay-fps=<n>            Frame steps per second of the camera path (default 30)\n";
+    std::cerr << "         --bench-camera-path         Check camera path sampling, its file and deterministic replays, then exit\n";
+    std::cerr << "         --bench-deltas[=<n>]        Time n scene updates against full rebuilds and exit\n";
+    std::cerr << "         --bench-parse[=<lines>]     Time the scene tokenizer on a synthetic scene and exit\n";
+    std::cerr << "         --bench-work-distribution[=<subframes>]\n";
+    std::cerr << "                                     Check tile shares converge for workers of skewed speeds and exit\n";
     std::cerr << "         --help | -h                 Print this usage message\n";
     exit(0);
 }
 
+/*
+*   Matches arg against the option name alone or followed by '=' and a value, so that
+*   neither "--serveX" nor "--profileX" match "--serve" or "--profile". *value points behind
+*   the '=', or is nullptr for the bare name.
+*/
+bool matchOption(const std::string &arg, const char *name, const char **value) {
+    const size_t length = strlen(name);
+    if (arg.compare(0, length, name) != 0) return false;
+    if (arg.size() == length) {
+        *value = nullptr;
+        return true;
+    }
+    if (arg[length] != '=') return false;
+    *value = arg.c_str() + length + 1;
+    return true;
+}
+
+void badOptionValue(const char *argv0, const std::string &arg) {
+    std::cerr << "Bad value in option '" << arg << "'\n";
+    printUsageAndExit(argv0);
+}
+
+// The value of an option as a whole integer in [min_value, max_value], exits with the usage otherwise
+int intOption(const char *argv0, const std::string &arg, const char *value, int min_value, int max_value) {
+    if (!value || !*value) badOptionValue(argv0, arg);
+    char *end;
+    errno = 0;
+    const long result = strtol(value, &end, 10);
+    if (*end || errno == ERANGE || result < min_value || result > max_value) badOptionValue(argv0, arg);
+    return static_cast<int>(result);
+}
+
+// The value of an option as a whole finite number in [min_value, max_value], exits with the usage otherwise
+double doubleOption(const char *argv0, const std::string &arg, const char *value, double min_value,
+                    double max_value = std::numeric_limits<double>::max()) {
+    if (!value || !*value) badOptionValue(argv0, arg);
+    char *end;
+    const double result = strtod(value, &end);
+    if (*end || !std::isfinite(result) || result < min_value || result > max_value) badOptionValue(argv0, arg);
+    return result;
+}
+
+// The non-empty value of an option, exits with the usage otherwise
+std::string stringOption(const char *argv0, const std::string &arg, const char *value) {
+    if (!value || !*value) badOptionValue(argv0, arg);
+    return value;
+}
+
+
+void freeTemporalBuffers(PathTracerState &state) {
+    TemporalDeviceBuffers &temporal = state.temporal_buffers;
+    trackedCudaFree(temporal.frame);
+    trackedCudaFree(temporal.depth);
+    trackedCudaFree(temporal.normal);
+    trackedCudaFree(temporal.history);
+    temporal = TemporalDeviceBuffers();
+}
+
+/*
+*   (Re)allocates the per-pixel buffers the raygen program accumulates into, and the history
+*   of the temporal resolve
+*/
+void allocPixelBuffers(PathTracerState &state) {
+    const size_t num_pixels = state.params.width * state.params.height;
+    trackedCudaFree(reinterpret_cast<void *>( state.params.accum_buffer ));
+    trackedCudaFree(reinterpret_cast<void *>( state.params.moments_buffer ));
+    trackedCudaFree(reinterpret_cast<void *>( state.params.albedo_buffer ));
+    trackedCudaFree(reinterpret_cast<void *>( state.params.normal_buffer ));
+    trackedCudaFree(reinterpret_cast<void *>( state.params.depth_buffer ));
+    trackedCudaMalloc(reinterpret_cast<void **>( &state.params.accum_buffer ), num_pixels * sizeof(float4),
+                      MEMORY_FRAME_BUFFERS);
+    trackedCudaMalloc(reinterpret_cast<void **>( &state.params.moments_buffer ), num_pixels * sizeof(float2),
+                      MEMORY_FRAME_BUFFERS);
+    trackedCudaMalloc(reinterpret_cast<void **>( &state.params.albedo_buffer ), num_pixels * sizeof(float4),
+                      MEMORY_FRAME_BUFFERS);
+    trackedCudaMalloc(reinterpret_cast<void **>( &state.params.normal_buffer ), num_pixels * sizeof(float4),
+                      MEMORY_FRAME_BUFFERS);
+    trackedCudaMalloc(reinterpret_cast<void **>( &state.params.depth_buffer ), num_pixels * sizeof(float),
+                      MEMORY_FRAME_BUFFERS);
+
+    if (!temporal_enabled) return;
+    TemporalDeviceBuffers &temporal = state.temporal_buffers;
+    freeTemporalBuffers(state);
+    trackedCudaMalloc(reinterpret_cast<void **>( &temporal.frame ), num_pixels * sizeof(float4), MEMORY_FRAME_BUFFERS);
+    trackedCudaMalloc(reinterpret_cast<void **>( &temporal.depth ), num_pixels * sizeof(float), MEMORY_FRAME_BUFFERS);
+    trackedCudaMalloc(reinterpret_cast<void **>( &temporal.normal ), num_pixels * sizeof(float3), MEMORY_FRAME_BUFFERS);
+    trackedCudaMalloc(reinterpret_cast<void **>( &temporal.history ), num_pixels * sizeof(float4),
+                      MEMORY_FRAME_BUFFERS);
+    CUDA_CHECK(cudaMemset(temporal.history, 0, num_pixels * sizeof(float4)));
+    state.temporal_history = false;
+}
+
+
+/*
+*   Copies the lights and their light tree to the device and points the launch parameters at
+*   them. Called again after scene updates, the buffers are reused while the counts match.
+*/
+void uploadLights(PathTracerState &state) {
+    if (state.params.num_lights != d_lights.size()) {
+        trackedCudaFree(reinterpret_cast<void *>(state.d_lights));
+        trackedCudaMalloc(reinterpret_cast<void **>(&state.d_lights), d_lights.size() * sizeof(Light), MEMORY_GEOMETRY);
+    }
+    if (!d_lights.empty()) {
+        CUDA_CHECK(cudaMemcpy(
+                reinterpret_cast<void *>(state.d_lights),
+                d_lights.data(), d_lights.size() * sizeof(Light),
+                cudaMemcpyHostToDevice
+        ));
+    }
+
+    // Only worth traversing a tree if there is more than one light to choose from
+    std::vector<LightTreeNode> light_tree;
+    if (d_lights.size() > 1) light_tree = buildLightTree(d_lights);
+    if (state.light_tree_nodes != light_tree.size()) {
+        trackedCudaFree(reinterpret_cast<void *>(state.d_light_tree));
+        state.d_light_tree = 0;
+        if (!light_tree.empty())
+            trackedCudaMalloc(reinterpret_cast<void **>(&state.d_light_tree), light_tree.size() * sizeof(LightTreeNode),
+                              MEMORY_GEOMETRY);
+        state.light_tree_nodes = light_tree.size();
+    }
+    if (!light_tree.empty()) {
+        CUDA_CHECK(cudaMemcpy(
+                reinterpret_cast<void *>(state.d_light_tree),
+                light_tree.data(), light_tree.size() * sizeof(LightTreeNode),
+                cudaMemcpyHostToDevice
+        ));
+    }
+
+    // Get light sources in the scene
+    state.params.lights = reinterpret_cast<Light *>(state.d_lights);
+    state.params.num_lights = d_lights.size();
+    state.params.light_tree = reinterpret_cast<LightTreeNode *>(state.d_light_tree);
+}
+
 
 void initLaunchParams(PathTracerState &state) {
     // create the denoiser:
-    if (state.params.denoiser) {
+    if (state.params.denoiser && denoiser_type == DENOISER_OPTIX) {
         OptixDenoiserOptions denoiserOptions = {};
+        denoiserOptions.guideAlbedo = 1;
+        denoiserOptions.guideNormal = 1;
         OPTIX_CHECK(
                 optixDenoiserCreate(state.context, OPTIX_DENOISER_MODEL_KIND_HDR, &denoiserOptions, &state.denoiser));
 
@@ -897,32 +1378,21 @@ void initLaunchParams(PathTracerState &state) {
         initOptixDenoiser(state);
     }
 
-    /*
-    * Copy light data to device
-    */
-    const size_t lights_size_in_bytes = d_lights.size() * sizeof(Light);
-    CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>(&state.d_lights), lights_size_in_bytes));
-    CUDA_CHECK(cudaMemcpy(
-            reinterpret_cast<void *>(state.d_lights),
-            d_lights.data(), lights_size_in_bytes,
-            cudaMemcpyHostToDevice
-    ));
-
-    CUDA_CHECK(cudaMalloc(
-            reinterpret_cast<void **>( &state.params.accum_buffer ),
-            state.params.width * state.params.height * sizeof(float4)
-    ));
+    uploadLights(state);
+    allocPixelBuffers(state);
+    CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>( &state.d_active_pixels ), sizeof(unsigned int)));
 
     state.params.frame_buffer = nullptr;  // Will be set when output buffer is mapped
 
     state.params.samples_per_launch = samples_per_launch;
     state.params.depth = depth;
     state.params.subframe_index = 0u;
+    state.params.adaptive_threshold = adaptive_threshold;
+    state.params.adaptive_min_samples = adaptive_min_samples;
+    state.params.active_pixels = adaptive_threshold > 0.f ? state.d_active_pixels : nullptr;
+    state.params.show_convergence = 0u;
 
-    // Get light sources in the scene
-    state.params.lights = reinterpret_cast<Light *>(state.d_lights);
-    state.params.num_lights = d_lights.size();
-    state.params.handle = state.gas_handle;
+    state.params.handle = state.ias_handle ? state.ias_handle : state.gas_handle;
 
     CUDA_CHECK(cudaStreamCreate(&state.stream));
     CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>( &state.d_params ), sizeof(Params)));
@@ -941,6 +1411,26 @@ void handleCameraUpdate(Params &params) {
 }
 
 
+CameraState currentCameraState() {
+    CameraState view;
+    view.eye = camera.eye();
+    view.lookat = camera.lookat();
+    view.up = camera.up();
+    view.fovy = camera.fovY();
+    return view;
+}
+
+
+// Moves the camera like the trackball does, the next handleCameraUpdate() picks it up
+void setCameraState(const CameraState &view) {
+    camera.setEye(view.eye);
+    camera.setLookat(view.lookat);
+    camera.setUp(view.up);
+    camera.setFovY(view.fovy);
+    camera_changed = true;
+}
+
+
 void handleResize(sutil::CUDAOutputBuffer<float4> &output_buffer, PathTracerState &state) {
     if (!resize_dirty)
         return;
@@ -950,28 +1440,53 @@ void handleResize(sutil::CUDAOutputBuffer<float4> &output_buffer, PathTracerStat
     output_buffer.resize(state.params.width, state.params.height);
 
     // Realloc accumulation buffer
-    CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.params.accum_buffer )));
-    CUDA_CHECK(cudaMalloc(
-            reinterpret_cast<void **>( &state.params.accum_buffer ),
-            state.params.width * state.params.height * sizeof(float4)
-    ));
+    allocPixelBuffers(state);
 }
 
 
 void updateState(sutil::CUDAOutputBuffer<float4> &output_buffer, PathTracerState &state) {
     // Update params on device
-    if (camera_changed || resize_dirty)
+    if (camera_changed || resize_dirty) {
         state.params.subframe_index = 0;
+        state.converged = false;
+        state.camera_moved = true;
+    }
+    // Converged pixels are not traced again, so one more launch just redraws them
+    if (state.params.show_convergence != (show_convergence ? 1u : 0u)) {
+        state.params.show_convergence = show_convergence ? 1u : 0u;
+        state.redraw = true;
+    }
+    const bool denoise = denoiser_enabled && denoiser_type != DENOISER_NONE;
+    if (state.params.denoiser != (denoise ? 1u : 0u)) {
+        state.params.denoiser = denoise ? 1u : 0u;
+        state.redraw = true;
+    }
 
     handleCameraUpdate(state.params);
     handleResize(output_buffer, state);
 }
 
 
+// No launch adds samples any more, until the accumulation is reset
+bool isFinished(const PathTracerState &state) {
+    return state.converged || (max_subframes > 0 && state.params.subframe_index >= (unsigned int) max_subframes);
+}
+
+
+bool isIdle(const PathTracerState &state) {
+    return !state.redraw && isFinished(state);
+}
+
+
 void launchSubframe(sutil::CUDAOutputBuffer<float4> &output_buffer, PathTracerState &state) {
     // Launch
+    sutil::ScopedTimer map_timer("map");
     float4 *result_buffer_data = output_buffer.map();
+    map_timer.stop();
+    sutil::ScopedTimer launch_timer("launch");
     state.params.frame_buffer = result_buffer_data;
+    if (state.params.active_pixels && !state.params.redraw_only)
+        CUDA_CHECK(cudaMemsetAsync(state.params.active_pixels, 0, sizeof(unsigned int), state.stream));
     CUDA_CHECK(cudaMemcpyAsync(
             reinterpret_cast<void *>( state.d_params ),
             &state.params, sizeof(Params),
@@ -987,13 +1502,26 @@ void launchSubframe(sutil::CUDAOutputBuffer<float4> &output_buffer, PathTracerSt
             state.params.height,  // launch height
             1                     // launch depth
     ));
-    output_buffer.unmap();
     CUDA_SYNC_CHECK();
+    launch_timer.stop();
+    {
+        SUTIL_PROFILE_SCOPE("unmap");
+        output_buffer.unmap();
+    }
+
+    if (state.params.active_pixels && !state.params.redraw_only) {
+        CUDA_CHECK(cudaMemcpy(&state.active_pixels, state.params.active_pixels, sizeof(unsigned int),
+                              cudaMemcpyDeviceToHost));
+        if (state.active_pixels == 0 && !state.converged)
+            std::cout << "Frame converged after " << state.params.subframe_index + 1 << " subframes" << std::endl;
+        state.converged = state.active_pixels == 0;
+    }
 
     state.frameID++;
 }
 
 void launchDenoisedBuffer(sutil::CUDAOutputBuffer<float4> &denoised_output_buffer, PathTracerState &state) {
+    SUTIL_PROFILE_SCOPE("denoise");
     OptixImage2D inputLayer;
     inputLayer.data = reinterpret_cast<CUdeviceptr>(state.params.frame_buffer);
     /// Width of the image (in pixels)
@@ -1023,7 +1551,12 @@ void launchDenoisedBuffer(sutil::CUDAOutputBuffer<float4> &denoised_output_buffe
     /// Pixel format.
     outputLayer.format = OPTIX_PIXEL_FORMAT_FLOAT4;
 
+    // First hit albedo and camera space normals, accumulated alongside the color
     OptixDenoiserGuideLayer denoiserGuideLayer = {};
+    denoiserGuideLayer.albedo = inputLayer;
+    denoiserGuideLayer.albedo.data = reinterpret_cast<CUdeviceptr>(state.params.albedo_buffer);
+    denoiserGuideLayer.normal = inputLayer;
+    denoiserGuideLayer.normal.data = reinterpret_cast<CUdeviceptr>(state.params.normal_buffer);
 
     OptixDenoiserLayer denoiserLayer = {};
     denoiserLayer.input = inputLayer;
@@ -1047,7 +1580,81 @@ void launchDenoisedBuffer(sutil::CUDAOutputBuffer<float4> &denoised_output_buffe
 
 }
 
+/*
+*   Filters the last subframe on the host and uploads the result into the denoised output
+*   buffer, so that it is displayed and streamed the same way as the OptiX denoiser output.
+*/
+void launchAtrousDenoiser(sutil::CUDAOutputBuffer<float4> &output_buffer,
+                          sutil::CUDAOutputBuffer<float4> &denoised_output_buffer, PathTracerState &state) {
+    SUTIL_PROFILE_SCOPE("denoise");
+    const int w = static_cast<int>(output_buffer.width());
+    const int h = static_cast<int>(output_buffer.height());
+    const size_t num_pixels = static_cast<size_t>(w) * h;
+    state.atrous_output.resize(num_pixels);
+    state.atrous_albedo.resize(num_pixels);
+    state.atrous_normal.resize(num_pixels);
+    CUDA_CHECK(cudaMemcpy(state.atrous_albedo.data(), state.params.albedo_buffer, num_pixels * sizeof(float4),
+                          cudaMemcpyDeviceToHost));
+    CUDA_CHECK(cudaMemcpy(state.atrous_normal.data(), state.params.normal_buffer, num_pixels * sizeof(float4),
+                          cudaMemcpyDeviceToHost));
+    state.atrous_denoiser.denoise(output_buffer.getHostPointer(), state.atrous_albedo.data(),
+                                  state.atrous_normal.data(), w, h, state.atrous_output.data());
+
+    CUDA_CHECK(cudaMemcpy(
+            reinterpret_cast<void *>(denoised_output_buffer.map()),
+            state.atrous_output.data(), state.atrous_output.size() * sizeof(float4),
+            cudaMemcpyHostToDevice
+    ));
+    denoised_output_buffer.unmap();
+}
+
+/*
+*   Blends the accumulation since the last camera change with the previous frame warped into
+*   the current view and writes the result to the output buffer in place of the raw frame.
+*   Runs on the device over the launch buffers, nothing is copied to the host.
+*/
+void resolveTemporal(sutil::CUDAOutputBuffer<float4> &output_buffer, PathTracerState &state) {
+    SUTIL_PROFILE_SCOPE("temporal");
+    const ReprojectionCamera view = {state.params.eye, state.params.U, state.params.V, state.params.W};
+    resolveTemporalOnDevice(state.params.accum_buffer, state.params.depth_buffer, state.params.normal_buffer,
+                            static_cast<int>(state.params.width), static_cast<int>(state.params.height), view,
+                            state.temporal_camera, state.camera_moved && state.temporal_history,
+                            state.temporal_settings, state.temporal_buffers, output_buffer.map(), state.stream);
+    output_buffer.unmap();
+    state.temporal_camera = view;
+    state.temporal_history = true;
+    state.camera_moved = false;
+}
+
+/*
+*   Writes the accumulated color and the albedo and normal guide layers as EXR files
+*/
+void saveAovs(const PathTracerState &state, const std::string &prefix) {
+    const size_t num_pixels = state.params.width * state.params.height;
+    std::vector<float4> pixels(num_pixels);
+    sutil::ImageBuffer buffer;
+    buffer.data = pixels.data();
+    buffer.width = state.params.width;
+    buffer.height = state.params.height;
+    buffer.pixel_format = sutil::BufferImageFormat::FLOAT4;
+
+    const std::pair<const char *, float4 *> layers[] = {
+            {"color",  state.params.accum_buffer},
+            {"albedo", state.params.albedo_buffer},
+            {"normal", state.params.normal_buffer}
+    };
+    for (const auto &layer: layers) {
+        CUDA_CHECK(cudaMemcpy(pixels.data(), layer.second, num_pixels * sizeof(float4), cudaMemcpyDeviceToHost));
+        // w of the accumulation buffer counts launches, not coverage
+        for (float4 &pixel: pixels) pixel.w = 1.f;
+        const std::string filename = prefix + "_" + layer.first + ".exr";
+        sutil::saveImage(filename.c_str(), buffer, false);
+        std::cout << "Saved " << filename << std::endl;
+    }
+}
+
 void displaySubframe(sutil::CUDAOutputBuffer<float4> &output_buffer, sutil::GLDisplay &gl_display, GLFWwindow *window) {
+    SUTIL_PROFILE_SCOPE("display");
     // Display
     int framebuf_res_x = 0;  // The display's resolution (could be HDPI res)
     int framebuf_res_y = 0;  //
@@ -1067,254 +1674,765 @@ static void context_log_cb(unsigned int level, const char *tag, const char *mess
 }
 
 float3 readCameraFile(std::string &scene_file) {
-    char *fname = (char *) scene_file.c_str();
-    std::ifstream read_scene(fname);
-    if (read_scene.is_open()) {
-        std::string line;
-        std::getline(read_scene, line);
-        std::stringstream tokenizer(line);
-        std::string token;
-        std::vector<std::string> tokens;
-        while (std::getline(tokenizer, token, ' ')) {
-            tokens.push_back(token);
-        }
-        if (strcmp(tokens[0].c_str(), "CAMERA") != 0) {
-            std::cout << "CAMERA SETTINGS NOT IN FIRST LINE!" << std::endl;
-            return make_float3(-1);
-        } else {
-            std::vector<float> lookat_val;
-            std::string float_token;
-            std::stringstream vec3_tokenizer(tokens[4]);
-            while (std::getline(vec3_tokenizer, float_token, ',')) {
-                lookat_val.push_back(atof(float_token.c_str()));
-            }
-            if (lookat_val.size() != 3) {
-                std::cout << "Invalid camera lookat vector " << std::endl;
-                return make_float3(-1);
-            }
-            return make_float3(lookat_val[0], lookat_val[1], lookat_val[2]);
+    SceneFile file;
+    SceneLine line;
+    if (!file.open(scene_file) || !file.nextLine(line))
+        return make_float3(-1);
+    if (line.tokens[0] != "CAMERA") {
+        std::cout << "CAMERA SETTINGS NOT IN FIRST LINE!" << std::endl;
+        return make_float3(-1);
+    }
+    float3 lookat;
+    if (line.count != 7 || !parseSceneVec3(line.tokens[4], lookat)) {
+        std::cout << "Invalid camera lookat vector " << std::endl;
+        return make_float3(-1);
+    }
+    return lookat;
+}
+
+namespace {
+    // Prints "<file>:<line>:<column>: <what> '<token>'", the line is skipped afterwards
+    void sceneError(const SceneFile &file, const SceneLine &line, const SceneToken &token, const char *what) {
+        std::cout << file.location(line, token) << ": " << what << " '" << token.str() << "'" << std::endl;
+    }
+
+    SceneItem materialItem(const SceneLine &line, float3 diffuse, float3 specular, float3 emissive, float spec_exp,
+                           float ior) {
+        SceneItem item;
+        item.kind = line.tokens[0];
+        item.type = line.tokens[1];
+        item.values[0] = diffuse;
+        item.values[1] = specular;
+        item.values[2] = emissive;
+        item.spec_exp = spec_exp;
+        item.ior = ior;
+        item.line = line.number;
+        return item;
+    }
+
+    SceneItem geometryItem(const SceneLine &line, int mat_id, float3 translate, float3 rotate, float3 scale) {
+        SceneItem item;
+        item.kind = line.tokens[0];
+        item.type = line.tokens[1];
+        item.material = mat_id;
+        item.values[0] = translate;
+        item.values[1] = rotate;
+        item.values[2] = scale;
+        item.objfile = line.tokens[6];
+        item.line = line.number;
+        return item;
+    }
+
+    // Keeps item with the instance and light that were added after there were objects and lights
+    void recordSceneItem(SceneItem item, size_t objects, size_t lights) {
+        if (scene_instances.size() > objects) item.object = static_cast<int32_t>(scene_instances.size() - 1);
+        if (d_lights.size() > lights) item.light = static_cast<int32_t>(d_lights.size() - 1);
+        scene_items.push_back(item);
+    }
+
+    // A MATERIAL, GEOMETRY or INSTANCE line without what it adds, false for any other line
+    bool parseSceneItem(const SceneLine &line, SceneItem &item) {
+        const SceneToken *tokens = line.tokens;
+        if (line.count != 7) return false;
+        // Colors start at the third token, translate, rotate and scale at the fourth
+        const int first = tokens[0] == "MATERIAL" ? 2 : 3;
+        float3 values[3];
+        for (int i = 0; i < 3; ++i)
+            if (!parseSceneVec3(tokens[first + i], values[i])) return false;
+        if (tokens[0] == "MATERIAL") {
+            float spec_exp, ior;
+            if (!parseSceneFloat(tokens[5], spec_exp) || !parseSceneFloat(tokens[6], ior)) return false;
+            item = materialItem(line, values[0], values[1], values[2], spec_exp, ior);
+            return true;
         }
+        int mat_id;
+        if ((tokens[0] != "GEOMETRY" && tokens[0] != "INSTANCE") || !parseSceneInt(tokens[2], mat_id)) return false;
+        item = geometryItem(line, mat_id, values[0], values[1], values[2]);
+        return true;
+    }
+
+    bool sameValues(const float3 &a, const float3 &b) {
+        return a.x == b.x && a.y == b.y && a.z == b.z;
+    }
+
+    // Whether two lines add the same thing, what they added aside
+    bool sameSceneItem(const SceneItem &a, const SceneItem &b) {
+        return a.kind == b.kind && a.type == b.type && (a.kind == "MATERIAL" || a.material == b.material) &&
+               sameValues(a.values[0], b.values[0]) && sameValues(a.values[1], b.values[1]) &&
+               sameValues(a.values[2], b.values[2]) && a.spec_exp == b.spec_exp && a.ior == b.ior &&
+               a.objfile == b.objfile;
+    }
+
+    // INSTANCE lines and analytic spheres are objects, the other GEOMETRY is baked into the scene GAS
+    bool placesObject(const SceneItem &item) {
+        return item.kind == "INSTANCE" || (item.kind == "GEOMETRY" && item.type == "ICOSPHERE" && analytic_spheres);
+    }
+
+    Geom objectType(const SceneItem &item) {
+        return item.type == "CUBE" ? CUBE : (item.type == "ICOSPHERE" ? ICOSPHERE : MESH);
     }
 }
 
+// The CAMERA line of a scene file
+void setSceneCamera(int scene_width, int scene_height, float3 eye, float3 lookat, float3 up, float fovy) {
+    width = scene_width;
+    height = scene_height;
+    camera.setEye(eye);
+    camera.setLookat(lookat);
+    camera.setUp(up);
+    camera.setFovY(fovy);
+    // setup trackball
+    camera_changed = true;
+    trackball.setCamera(&camera);
+    trackball.setMoveSpeed(10.0f);
+    trackball.setDirMoveSpeed(1.0f);
+    trackball.setReferenceFrame(
+            make_float3(1.0f, 0.0f, 0.0f),
+            make_float3(0.0f, 0.0f, 1.0f),
+            make_float3(0.0f, 1.0f, 0.0f)
+    );
+    trackball.setGimbalLock(true);
+}
+
 void readSceneFile(std::string &scene_file) {
+    SUTIL_PROFILE_SCOPE("scene load");
     std::cout << "Reading scene file: " << scene_file << std::endl;
-    char *fname = (char *) scene_file.c_str();
-    std::ifstream read_scene(fname);
-    int line_num = 0; // track the current line number
+    scene_inputs.assign(1, scene_file);
+    scene_items.clear();
+    SceneFile &file = scene_items_file;
+    if (!file.open(scene_file) || !file.detach()) {
+        std::cout << "Could not open scene file " << scene_file << std::endl;
+        return;
+    }
     bool cam_set = false; // have we set the scene camera yet?
-    if (read_scene.is_open()) {
-        std::string line;
-        // Read lines from the scene file
-        while (std::getline(read_scene, line)) {
-            line_num++;
-            // tokenize each line by space
-            std::stringstream tokenizer(line);
-            std::string token;
-            std::vector<std::string> tokens;
-            while (std::getline(tokenizer, token, ' ')) {
-                tokens.push_back(token);
+    SceneLine line;
+    while (file.nextLine(line)) {
+        const SceneToken *tokens = line.tokens;
+        if (line.count != 7) {
+            std::cout << file.location(line, tokens[0]) << ": expected 7 arguments, found " << line.count << std::endl;
+            continue;
+        }
+
+        // check if we're reading material, geometry or camera
+        if (tokens[0] == "MATERIAL") {
+            // read material type
+            Material type;
+            if (tokens[1] == "EMISSIVE") {
+                type = EMISSIVE;
+            } else if (tokens[1] == "DIFFUSE") {
+                type = DIFFUSE;
+            } else if (tokens[1] == "MIRROR") {
+                type = MIRROR;
+            } else if (tokens[1] == "GLOSSY") {
+                type = GLOSSY;
+            } else if (tokens[1] == "FRESNEL") {
+                type = FRESNEL;
+            } else {
+                sceneError(file, line, tokens[1], "invalid material type");
+                continue;
             }
-            // process the tokens
-            if (tokens.size() != 7) {
-                std::cout << "Invalid argument count at line " << line_num << std::endl;
+            // read material diffuse, specular and emissive colors
+            float3 diffuse, specular, emissive;
+            if (!parseSceneVec3(tokens[2], diffuse)) {
+                sceneError(file, line, tokens[2], "invalid material diffuse color");
                 continue;
             }
-
-            // check if we're reading material, geometry or camera
-            if (strcmp(tokens[0].c_str(), "MATERIAL") == 0) {
-                // read material type
-                Material type;
-                if (strcmp(tokens[1].c_str(), "EMISSIVE") == 0) {
-                    type = EMISSIVE;
-                } else if (strcmp(tokens[1].c_str(), "DIFFUSE") == 0) {
-                    type = DIFFUSE;
-                } else if (strcmp(tokens[1].c_str(), "MIRROR") == 0) {
-                    type = MIRROR;
-                } else if (strcmp(tokens[1].c_str(), "GLOSSY") == 0) {
-                    type = GLOSSY;
-                } else if (strcmp(tokens[1].c_str(), "FRESNEL") == 0) {
-                    type = FRESNEL;
-                } else {
-                    std::cout << "Invalid material type at line " << line_num << std::endl;
-                    continue;
-                }
-                // read material diffuse color
-                float3 diffuse;
-                std::vector<float> diffuse_val;
-                std::stringstream vec3_tokenizer(tokens[2]);
-                std::string float_token;
-                while (std::getline(vec3_tokenizer, float_token, ',')) {
-                    diffuse_val.push_back(atof(float_token.c_str()));
-                }
-                if (diffuse_val.size() != 3) {
-                    std::cout << "Invalid material diffuse color at line" << line_num << std::endl;
-                    continue;
-                }
-                diffuse = make_float3(diffuse_val[0], diffuse_val[1], diffuse_val[2]);
-                // read material specular color
-                float3 specular;
-                std::vector<float> specular_val;
-                vec3_tokenizer.clear();
-                vec3_tokenizer.str(tokens[3]);
-                while (std::getline(vec3_tokenizer, float_token, ',')) {
-                    specular_val.push_back(atof(float_token.c_str()));
-                }
-                if (specular_val.size() != 3) {
-                    std::cout << "Invalid material specular color at line" << line_num << std::endl;
-                    continue;
-                }
-                specular = make_float3(specular_val[0], specular_val[1], specular_val[2]);
-                // read material emissive color
-                float3 emissive;
-                std::vector<float> emissive_val;
-                vec3_tokenizer.clear();
-                vec3_tokenizer.str(tokens[4]);
-                while (std::getline(vec3_tokenizer, float_token, ',')) {
-                    emissive_val.push_back(atof(float_token.c_str()));
-                }
-                if (emissive_val.size() != 3) {
-                    std::cout << "Invalid material emissive color at line" << line_num << std::endl;
-                    continue;
-                }
-                emissive = make_float3(emissive_val[0], emissive_val[1], emissive_val[2]);
-                // read material specular exponent
-                float spec_exp = atof(tokens[5].c_str());
-                // read material ior
-                float ior = atof(tokens[6].c_str());
-                // add material
-                std::cout << type << " material added!" << std::endl;
-                addMaterial(type, diffuse, specular, emissive, spec_exp, ior);
-            } else if (strcmp(tokens[0].c_str(), "GEOMETRY") == 0) {
-                // read geometry type
-                Geom type;
-                if (strcmp(tokens[1].c_str(), "CUBE") == 0) {
-                    type = CUBE;
-                } else if (strcmp(tokens[1].c_str(), "ICOSPHERE") == 0) {
-                    type = ICOSPHERE;
-                } else if (strcmp(tokens[1].c_str(), "MESH") == 0) {
-                    type = MESH;
-                } else if (strcmp(tokens[1].c_str(), "AREA_LIGHT") == 0) {
-                    type = AREA_LIGHT;
-                } else if (strcmp(tokens[1].c_str(), "POINT_LIGHT") == 0) {
-                    type = POINT_LIGHT;
-                } else if (strcmp(tokens[1].c_str(), "SPOT_LIGHT") == 0) {
-                    type = SPOT_LIGHT;
-                } else {
-                    std::cout << "Invalid geometry type at line " << line_num << std::endl;
-                    continue;
-                }
-                // read geometry material id
-                int mat_id = atoi(tokens[2].c_str());
-                // read geometry translate
-                glm::vec3 translate;
-                std::vector<float> translate_val;
-                std::stringstream vec3_tokenizer(tokens[3]);
-                std::string float_token;
-                while (std::getline(vec3_tokenizer, float_token, ',')) {
-                    translate_val.push_back(atof(float_token.c_str()));
-                }
-                if (translate_val.size() != 3) {
-                    std::cout << "Invalid geometry translate vector at line" << line_num << std::endl;
-                    continue;
-                }
-                translate = glm::vec3(translate_val[0], translate_val[1], translate_val[2]);
-                // read geometry rotate
-                glm::vec3 rotate;
-                std::vector<float> rotate_val;
-                vec3_tokenizer.clear();
-                vec3_tokenizer.str(tokens[4]);
-                while (std::getline(vec3_tokenizer, float_token, ',')) {
-                    rotate_val.push_back(atof(float_token.c_str()));
-                }
-                if (rotate_val.size() != 3) {
-                    std::cout << "Invalid geometry rotate vector at line" << line_num << std::endl;
-                    continue;
-                }
-                rotate = glm::vec3(rotate_val[0], rotate_val[1], rotate_val[2]);
-                // read geometry scale
-                glm::vec3 scale;
-                std::vector<float> scale_val;
-                vec3_tokenizer.clear();
-                vec3_tokenizer.str(tokens[5]);
-                while (std::getline(vec3_tokenizer, float_token, ',')) {
-                    scale_val.push_back(atof(float_token.c_str()));
-                }
-                if (scale_val.size() != 3) {
-                    std::cout << "Invalid geometry scale vector at line" << line_num << std::endl;
-                    continue;
-                }
-                scale = glm::vec3(scale_val[0], scale_val[1], scale_val[2]);
-                // read obj file path
-                std::string obj_file = tokens[6];
-                // create geometry
-                std::cout << type << " geometry added!" << std::endl;
-                addSceneGeometry(type, mat_id, translate, rotate, scale, obj_file);
-            } else if (strcmp(tokens[0].c_str(), "CAMERA") == 0) {
-                if (cam_set) {
-                    // A camera for this scene is already set
-                    std::cout << "A camera for this scene is already set - ignoring line " << line_num << std::endl;
-                    continue;
-                }
-                // read scene width & height
-                width = atoi(tokens[1].c_str());
-                height = atoi(tokens[2].c_str());
-                // read camera eye
-                std::vector<float> eye_val;
-                std::stringstream vec3_tokenizer(tokens[3]);
-                std::string float_token;
-                while (std::getline(vec3_tokenizer, float_token, ',')) {
-                    eye_val.push_back(atof(float_token.c_str()));
-                }
-                if (eye_val.size() != 3) {
-                    std::cout << "Invalid camera eye vector at line" << line_num << std::endl;
-                    continue;
-                }
-                camera.setEye(make_float3(eye_val[0], eye_val[1], eye_val[2]));
-                // read camera look at
-                std::vector<float> lookat_val;
-                vec3_tokenizer.clear();
-                vec3_tokenizer.str(tokens[4]);
-                while (std::getline(vec3_tokenizer, float_token, ',')) {
-                    lookat_val.push_back(atof(float_token.c_str()));
-                }
-                if (lookat_val.size() != 3) {
-                    std::cout << "Invalid camera lookat vector at line" << line_num << std::endl;
+            if (!parseSceneVec3(tokens[3], specular)) {
+                sceneError(file, line, tokens[3], "invalid material specular color");
+                continue;
+            }
+            if (!parseSceneVec3(tokens[4], emissive)) {
+                sceneError(file, line, tokens[4], "invalid material emissive color");
+                continue;
+            }
+            // read material specular exponent and ior
+            float spec_exp, ior;
+            if (!parseSceneFloat(tokens[5], spec_exp)) {
+                sceneError(file, line, tokens[5], "invalid material specular exponent");
+                continue;
+            }
+            if (!parseSceneFloat(tokens[6], ior)) {
+                sceneError(file, line, tokens[6], "invalid material index of refraction");
+                continue;
+            }
+            // add material
+            std::cout << type << " material added!" << std::endl;
+            scene_items.push_back(materialItem(line, diffuse, specular, emissive, spec_exp, ior));
+            scene_items.back().material = addMaterial(type, diffuse, specular, emissive, spec_exp, ior);
+        } else if (tokens[0] == "GEOMETRY" || tokens[0] == "INSTANCE") {
+            // INSTANCE places a cached copy of a CUBE, ICOSPHERE or MESH, GEOMETRY bakes it
+            const bool instance = tokens[0] == "INSTANCE";
+            // read geometry type
+            Geom type;
+            if (tokens[1] == "CUBE") {
+                type = CUBE;
+            } else if (tokens[1] == "ICOSPHERE") {
+                type = ICOSPHERE;
+            } else if (tokens[1] == "MESH") {
+                type = MESH;
+            } else if (tokens[1] == "AREA_LIGHT") {
+                type = AREA_LIGHT;
+            } else if (tokens[1] == "POINT_LIGHT") {
+                type = POINT_LIGHT;
+            } else if (tokens[1] == "SPOT_LIGHT") {
+                type = SPOT_LIGHT;
+            } else {
+                sceneError(file, line, tokens[1], "invalid geometry type");
+                continue;
+            }
+            // read geometry material id
+            int mat_id;
+            if (!parseSceneInt(tokens[2], mat_id)) {
+                sceneError(file, line, tokens[2], "invalid geometry material id");
+                continue;
+            }
+            // read geometry translate, rotate and scale
+            float3 translate, rotate, scale;
+            if (!parseSceneVec3(tokens[3], translate)) {
+                sceneError(file, line, tokens[3], "invalid geometry translate vector");
+                continue;
+            }
+            if (!parseSceneVec3(tokens[4], rotate)) {
+                sceneError(file, line, tokens[4], "invalid geometry rotate vector");
+                continue;
+            }
+            if (!parseSceneVec3(tokens[5], scale)) {
+                sceneError(file, line, tokens[5], "invalid geometry scale vector");
+                continue;
+            }
+            // create geometry, the last token is the obj file path
+            const SceneItem item = geometryItem(line, mat_id, translate, rotate, scale);
+            const size_t objects = scene_instances.size(), lights = d_lights.size();
+            if (instance) {
+                if (type != CUBE && type != ICOSPHERE && type != MESH) {
+                    sceneError(file, line, tokens[1], "geometry type cannot be instanced");
                     continue;
                 }
-                camera.setLookat(make_float3(lookat_val[0], lookat_val[1], lookat_val[2]));
-                // read camera up
-                std::vector<float> up_val;
-                vec3_tokenizer.clear();
-                vec3_tokenizer.str(tokens[5]);
-                while (std::getline(vec3_tokenizer, float_token, ',')) {
-                    up_val.push_back(atof(float_token.c_str()));
-                }
-                if (up_val.size() != 3) {
-                    std::cout << "Invalid camera up vector at line" << line_num << std::endl;
+                if (mat_id < 0 || mat_id >= MAT_COUNT) {
+                    sceneError(file, line, tokens[2], "invalid instance material id");
                     continue;
                 }
-                camera.setUp(make_float3(up_val[0], up_val[1], up_val[2]));
-                // read camera fovy
-                camera.setFovY(atof(tokens[6].c_str()));
-                // setup trackball
-                camera_changed = true;
-                trackball.setCamera(&camera);
-                trackball.setMoveSpeed(10.0f);
-                trackball.setDirMoveSpeed(1.0f);
-                trackball.setReferenceFrame(
-                        make_float3(1.0f, 0.0f, 0.0f),
-                        make_float3(0.0f, 0.0f, 1.0f),
-                        make_float3(0.0f, 1.0f, 0.0f)
-                );
-                trackball.setGimbalLock(true);
-                cam_set = true;
-            } else {
-                std::cout << "Invalid item at line " << line_num << std::endl;
+                addSceneInstance(type, mat_id, glm::vec3(translate.x, translate.y, translate.z),
+                                 glm::vec3(rotate.x, rotate.y, rotate.z), glm::vec3(scale.x, scale.y, scale.z),
+                                 tokens[6].str());
+                recordSceneItem(item, objects, lights);
+                continue;
+            }
+            std::cout << type << " geometry added!" << std::endl;
+            addSceneGeometry(type, mat_id, glm::vec3(translate.x, translate.y, translate.z),
+                             glm::vec3(rotate.x, rotate.y, rotate.z), glm::vec3(scale.x, scale.y, scale.z),
+                             tokens[6].str());
+            recordSceneItem(item, objects, lights);
+        } else if (tokens[0] == "CAMERA") {
+            if (cam_set) {
+                // A camera for this scene is already set
+                std::cout << file.location(line, tokens[0]) << ": a camera for this scene is already set - ignoring line"
+                          << std::endl;
+                continue;
+            }
+            // read scene width & height
+            int scene_width, scene_height;
+            if (!parseSceneInt(tokens[1], scene_width) || scene_width <= 0) {
+                sceneError(file, line, tokens[1], "invalid camera width");
+                continue;
+            }
+            if (!parseSceneInt(tokens[2], scene_height) || scene_height <= 0) {
+                sceneError(file, line, tokens[2], "invalid camera height");
+                continue;
+            }
+            // read camera eye, look at, up and fovy
+            float3 eye, lookat, up;
+            float fovy;
+            if (!parseSceneVec3(tokens[3], eye)) {
+                sceneError(file, line, tokens[3], "invalid camera eye vector");
+                continue;
+            }
+            if (!parseSceneVec3(tokens[4], lookat)) {
+                sceneError(file, line, tokens[4], "invalid camera lookat vector");
                 continue;
             }
+            if (!parseSceneVec3(tokens[5], up)) {
+                sceneError(file, line, tokens[5], "invalid camera up vector");
+                continue;
+            }
+            if (!parseSceneFloat(tokens[6], fovy)) {
+                sceneError(file, line, tokens[6], "invalid camera fovy");
+                continue;
+            }
+            setSceneCamera(scene_width, scene_height, eye, lookat, up, fovy);
+            cam_set = true;
+        } else {
+            sceneError(file, line, tokens[0], "invalid item");
+            continue;
         }
     }
+    reportInstancing();
+}
+
+/*
+*   Reads the scene file again and applies its edits as scene updates: material colors and
+*   coefficients, moved lights and moved, added or removed objects. Other edits of baked
+*   geometry, a changed material type or added materials and lights would need the scene
+*   to be rebuilt; then nothing is applied and false is returned. The camera is left where
+*   the user moved it.
+*/
+bool reloadSceneFile(const std::string &scene_file) {
+    if (scene_items.empty()) {
+        std::cout << "Cannot reload " << scene_file << ", it was loaded as a prepared scene" << std::endl;
+        return false;
+    }
+    SceneFile file;
+    if (!file.open(scene_file) || !file.detach()) {
+        std::cout << "Could not open scene file " << scene_file << std::endl;
+        return false;
+    }
+    std::vector<SceneItem> baked, objects;
+    SceneLine line;
+    while (file.nextLine(line)) {
+        if (line.tokens[0] == "CAMERA") continue;
+        SceneItem item;
+        if (!parseSceneItem(line, item)) {
+            std::cout << file.location(line, line.tokens[0]) << ": invalid line, the scene is not reloaded" << std::endl;
+            return false;
+        }
+        (placesObject(item) ? objects : baked).push_back(item);
+    }
+    std::vector<const SceneItem *> old_baked, old_objects;
+    for (const SceneItem &item: scene_items)
+        (placesObject(item) ? old_objects : old_baked).push_back(&item);
+
+    // Everything is checked before the first update, a reload is applied entirely or not at all
+    const auto rebuildNeeded = [&](int line_number, const char *what) {
+        std::cout << scene_file << ":" << line_number << ": " << what << ", restart to apply the edits" << std::endl;
+        return false;
+    };
+    if (baked.size() != old_baked.size()) {
+        std::cout << scene_file << ": materials or baked geometry added or removed, restart to apply the edits"
+                  << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < baked.size(); ++i) {
+        const SceneItem &before = *old_baked[i], &after = baked[i];
+        if (sameSceneItem(before, after)) continue;
+        if (before.kind != after.kind || before.type != after.type)
+            return rebuildNeeded(after.line, "type changed");
+        if (after.kind == "MATERIAL") continue;
+        // A light keeps its material, orientation and size, only moving it is an update
+        if (before.light < 0 || after.material != before.material || after.objfile != before.objfile ||
+            !sameValues(after.values[1], before.values[1]) || !sameValues(after.values[2], before.values[2]))
+            return rebuildNeeded(after.line, "baked geometry changed");
+    }
+    for (const SceneItem &item: objects) {
+        if (item.type != "CUBE" && item.type != "ICOSPHERE" && item.type != "MESH")
+            return rebuildNeeded(item.line, "geometry type cannot be instanced");
+        if (item.material < 0 || item.material >= MAT_COUNT)
+            return rebuildNeeded(item.line, "invalid instance material id");
+    }
+
+    for (size_t i = 0; i < baked.size(); ++i) {
+        const SceneItem &before = *old_baked[i];
+        SceneItem &after = baked[i];
+        if (after.kind == "MATERIAL") after.material = before.material;
+        after.light = before.light;
+        if (sameSceneItem(before, after)) continue;
+        if (after.kind == "MATERIAL") {
+            updateSceneMaterial(before.material, after.values[0], after.values[1], after.values[2], after.spec_exp,
+                                after.ior);
+        } else {
+            moveSceneLight(static_cast<uint32_t>(before.light), after.values[0] - before.values[0]);
+        }
+    }
+    for (size_t i = 0; i < objects.size(); ++i) {
+        SceneItem &after = objects[i];
+        const glm::vec3 pos(after.values[0].x, after.values[0].y, after.values[0].z);
+        const glm::vec3 rot(after.values[1].x, after.values[1].y, after.values[1].z);
+        const glm::vec3 s(after.values[2].x, after.values[2].y, after.values[2].z);
+        if (i < old_objects.size()) {
+            const SceneItem &before = *old_objects[i];
+            after.object = before.object;
+            if (sameSceneItem(before, after)) continue;
+            // The same mesh with the same material only moves, anything else is a new object
+            if (after.type == before.type && after.objfile == before.objfile && after.material == before.material) {
+                transformSceneObject(static_cast<uint32_t>(before.object), pos, rot, s);
+                continue;
+            }
+            removeSceneObject(static_cast<uint32_t>(before.object));
+        }
+        after.object = static_cast<int32_t>(addSceneObject(objectType(after), after.material, pos, rot, s,
+                                                           after.objfile.str()));
+    }
+    for (size_t i = objects.size(); i < old_objects.size(); ++i)
+        removeSceneObject(static_cast<uint32_t>(old_objects[i]->object));
+
+    std::vector<SceneItem> items;
+    items.reserve(baked.size() + objects.size());
+    items.insert(items.end(), baked.begin(), baked.end());
+    items.insert(items.end(), objects.begin(), objects.end());
+    scene_items.swap(items);
+    scene_items_file.swap(file);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+//
+// Prepared scenes
+//
+//------------------------------------------------------------------------------
+
+// What a prepared scene restores besides the arrays
+struct PreparedSceneInfo {
+    int32_t width, height;
+    float3 eye, lookat, up;
+    float fovy;
+    int32_t triangle_count;
+    int32_t mat_count;
+    uint32_t num_meshes;
+    uint32_t num_bindings;
+    uint32_t num_textures;
+};
+
+// What the buffers depend on besides the inputs, options and the layout of the stored types
+struct PreparedSceneSettings {
+    int32_t icosphere_level;
+    int32_t analytic_spheres;
+    uint32_t type_sizes[8];
+};
+
+// How to relocate the GAS copied from the device into the "gas" section
+struct PreparedGas {
+    OptixAccelRelocationInfo relocation_info;
+    uint64_t temp_update_size;
+};
+
+static PreparedSceneSettings preparedSceneSettings() {
+    PreparedSceneSettings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.icosphere_level = icosphere_level;
+    settings.analytic_spheres = analytic_spheres ? 1 : 0;
+    const uint32_t type_sizes[] = {sizeof(Vertex), sizeof(Light), sizeof(Instance), sizeof(LightSource),
+                                   sizeof(Material), sizeof(PreparedSceneInfo),
+                                   static_cast<uint32_t>(CpuBvh::nodeSize()),
+                                   static_cast<uint32_t>(CpuBvh::triangleSize())};
+    memcpy(settings.type_sizes, type_sizes, sizeof(type_sizes));
+    return settings;
+}
+
+static std::string meshSection(size_t mesh, const char *name) {
+    return "mesh." + std::to_string(mesh) + "." + name;
+}
+
+// Empties the scene buffers that readSceneFile() appends to
+static void clearSceneData() {
+    TRIANGLE_COUNT = MAT_COUNT = 0;
+    d_textureIds.clear();
+    d_vertices.clear();
+    d_texcoords.clear();
+    d_mat_types.clear();
+    d_material_indices.clear();
+    d_emission_colors.clear();
+    d_diffuse_colors.clear();
+    d_spec_colors.clear();
+    d_spec_exp.clear();
+    d_ior.clear();
+    d_lights.clear();
+    light_sources.clear();
+    mesh_cache.clear();
+    mesh_cache_index.clear();
+    instance_bindings.clear();
+    instance_binding_index.clear();
+    scene_instances.clear();
+    free_instances.clear();
+}
+
+/*
+*   Writes the scene as readSceneFile() left it to a prepared scene: the host buffers, the
+*   mesh cache and instances, the textures, the CPU BVH (built here if cpu_bvh is null) and,
+*   with state, the scene GAS as it is on the device. Every input file is stored with its
+*   content hash.
+*/
+void savePreparedScene(const std::string &filename, const PathTracerState *state, const CpuBvh *cpu_bvh) {
+    SUTIL_PROFILE_SCOPE("prepared scene write");
+    const auto t0 = std::chrono::steady_clock::now();
+    prepared_scene_stale = false;
+
+    std::vector<std::string> inputs;
+    for (const std::string &input: scene_inputs)
+        if (std::find(inputs.begin(), inputs.end(), input) == inputs.end()) inputs.push_back(input);
+    std::vector<uint64_t> input_hashes;
+    std::string input_names;
+    for (const std::string &input: inputs) {
+        input_hashes.push_back(hashFile(input));
+        input_names += input + '\n';
+    }
+
+    const PreparedSceneSettings settings = preparedSceneSettings();
+    PreparedSceneInfo info;
+    info.width = width;
+    info.height = height;
+    info.eye = camera.eye();
+    info.lookat = camera.lookat();
+    info.up = camera.up();
+    info.fovy = camera.fovY();
+    info.triangle_count = TRIANGLE_COUNT;
+    info.mat_count = MAT_COUNT;
+    info.num_meshes = static_cast<uint32_t>(mesh_cache.size());
+    info.num_bindings = static_cast<uint32_t>(instance_bindings.size());
+    info.num_textures = MODEL ? static_cast<uint32_t>(MODEL->textures.size()) : 0;
+
+    SnapshotWriter writer;
+    writer.add("settings", &settings, sizeof(settings));
+    writer.add("input_hashes", input_hashes);
+    writer.add("input_names", input_names.data(), input_names.size());
+    writer.add("info", &info, sizeof(info));
+    writer.add("vertices", d_vertices);
+    writer.add("texcoords", d_texcoords);
+    writer.add("material_indices", d_material_indices);
+    writer.add("mat_types", d_mat_types);
+    writer.add("diffuse_colors", d_diffuse_colors);
+    writer.add("spec_colors", d_spec_colors);
+    writer.add("emission_colors", d_emission_colors);
+    writer.add("spec_exp", d_spec_exp);
+    writer.add("ior", d_ior);
+    writer.add("texture_ids", d_textureIds);
+    writer.add("lights", d_lights);
+    writer.add("light_sources", light_sources);
+    writer.add("instances", scene_instances);
+    writer.add("free_instances", free_instances);
+    for (size_t i = 0; i < mesh_cache.size(); ++i) {
+        const CachedMesh &mesh = mesh_cache[i];
+        writer.add(meshSection(i, "key"), mesh.key.data(), mesh.key.size());
+        writer.add(meshSection(i, "vertices"), mesh.vertices);
+        writer.add(meshSection(i, "texcoords"), mesh.texcoords);
+        writer.add(meshSection(i, "material_indices"), mesh.material_indices);
+        writer.add(meshSection(i, "materials"), mesh.materials);
+    }
+    std::vector<uint32_t> binding_meshes;
+    for (size_t i = 0; i < instance_bindings.size(); ++i) {
+        binding_meshes.push_back(instance_bindings[i].mesh);
+        writer.add("binding." + std::to_string(i) + ".materials", instance_bindings[i].materials);
+    }
+    writer.add("binding_meshes", binding_meshes);
+    std::vector<glm::ivec2> texture_sizes;
+    for (uint32_t i = 0; i < info.num_textures; ++i) {
+        const Texture *texture = MODEL->textures[i];
+        texture_sizes.push_back(texture->resolution);
+        writer.add("texture." + std::to_string(i), texture->pixel,
+                   static_cast<size_t>(texture->resolution.x) * texture->resolution.y * sizeof(uint32_t));
+    }
+    writer.add("texture_sizes", texture_sizes);
+
+    CpuBvh built_bvh;
+    if (!cpu_bvh) {
+        built_bvh.build(reinterpret_cast<const float4 *>(d_vertices.data()), d_vertices.size() / 3);
+        cpu_bvh = &built_bvh;
+    }
+    writer.add("cpu_bvh.nodes", cpu_bvh->nodeData(), cpu_bvh->nodeBytes());
+    writer.add("cpu_bvh.triangles", cpu_bvh->triangleData(), cpu_bvh->triangleBytes());
+
+    PreparedGas gas;
+    std::vector<char> gas_data;
+    if (state && state->gas_handle) {
+        OPTIX_CHECK(optixAccelGetRelocationInfo(state->context, state->gas_handle, &gas.relocation_info));
+        gas.temp_update_size = state->gas_temp_update_size;
+        gas_data.resize(state->gas_output_size);
+        CUDA_CHECK(cudaMemcpy(gas_data.data(), reinterpret_cast<void *>( state->d_gas_output_buffer ),
+                              gas_data.size(), cudaMemcpyDeviceToHost));
+        writer.add("gas_info", &gas, sizeof(gas));
+        writer.add("gas", gas_data);
+    }
+
+    if (!writer.write(filename)) {
+        std::cerr << "Could not write the prepared scene " << filename << std::endl;
+        return;
+    }
+    const auto t1 = std::chrono::steady_clock::now();
+    std::cout << "Wrote prepared scene " << filename << " (" << inputs.size() << " inputs"
+              << (gas_data.empty() ? "" : ", with GAS") << ") in " << std::fixed << std::setprecision(1)
+              << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms" << std::endl;
+}
+
+/*
+*   Restores the scene from a prepared scene written for scene_file, if the options match
+*   and none of the inputs changed since. Keeps the file mapped in prepared_scene, the BVH
+*   and GAS in it are taken by the next buildCpuScene() and buildMeshAccel().
+*/
+bool loadPreparedScene(const std::string &filename, const std::string &scene_file) {
+    SUTIL_PROFILE_SCOPE("prepared scene load");
+    const auto t0 = std::chrono::steady_clock::now();
+    SnapshotReader &snapshot = prepared_scene;
+    if (!snapshot.open(filename)) {
+        std::cout << "No usable prepared scene in " << filename << std::endl;
+        return false;
+    }
+
+    const PreparedSceneSettings settings = preparedSceneSettings();
+    const void *data;
+    size_t size;
+    bool valid = snapshot.find("settings", data, size) && size == sizeof(settings) &&
+                 memcmp(data, &settings, size) == 0;
+    std::vector<uint64_t> input_hashes;
+    std::vector<std::string> inputs;
+    if (valid && snapshot.read("input_hashes", input_hashes) && snapshot.find("input_names", data, size)) {
+        std::istringstream names(std::string(static_cast<const char *>(data), size));
+        std::string name;
+        while (std::getline(names, name))
+            inputs.push_back(name);
+    }
+    valid = valid && !inputs.empty() && inputs.size() == input_hashes.size() && inputs[0] == scene_file;
+    for (size_t i = 0; i < inputs.size() && valid; ++i) {
+        if (hashFile(inputs[i]) != input_hashes[i]) {
+            std::cout << "Prepared scene " << filename << " is stale, " << inputs[i] << " changed" << std::endl;
+            valid = false;
+        }
+    }
+    PreparedSceneInfo info;
+    valid = valid && snapshot.find("info", data, size) && size == sizeof(info);
+    if (!valid) {
+        snapshot.close();
+        return false;
+    }
+    memcpy(&info, data, sizeof(info));
+
+    bool ok = snapshot.read("vertices", d_vertices) && snapshot.read("texcoords", d_texcoords) &&
+              snapshot.read("material_indices", d_material_indices) && snapshot.read("mat_types", d_mat_types) &&
+              snapshot.read("diffuse_colors", d_diffuse_colors) && snapshot.read("spec_colors", d_spec_colors) &&
+              snapshot.read("emission_colors", d_emission_colors) && snapshot.read("spec_exp", d_spec_exp) &&
+              snapshot.read("ior", d_ior) && snapshot.read("texture_ids", d_textureIds) &&
+              snapshot.read("lights", d_lights) && snapshot.read("light_sources", light_sources) &&
+              snapshot.read("instances", scene_instances) && snapshot.read("free_instances", free_instances);
+    mesh_cache.resize(info.num_meshes);
+    for (uint32_t i = 0; i < info.num_meshes && ok; ++i) {
+        CachedMesh &mesh = mesh_cache[i];
+        ok = snapshot.find(meshSection(i, "key"), data, size) && snapshot.read(meshSection(i, "vertices"), mesh.vertices) &&
+             snapshot.read(meshSection(i, "texcoords"), mesh.texcoords) &&
+             snapshot.read(meshSection(i, "material_indices"), mesh.material_indices) &&
+             snapshot.read(meshSection(i, "materials"), mesh.materials);
+        if (!ok) break;
+        mesh.key.assign(static_cast<const char *>(data), size);
+        mesh_cache_index[mesh.key] = i;
+    }
+    std::vector<uint32_t> binding_meshes;
+    ok = ok && snapshot.read("binding_meshes", binding_meshes) && binding_meshes.size() == info.num_bindings;
+    instance_bindings.resize(info.num_bindings);
+    for (uint32_t i = 0; i < info.num_bindings && ok; ++i) {
+        InstanceBinding &binding = instance_bindings[i];
+        binding.mesh = binding_meshes[i];
+        ok = binding.mesh < info.num_meshes &&
+             snapshot.read("binding." + std::to_string(i) + ".materials", binding.materials);
+        if (!ok) break;
+        // Same key as addSceneInstance()
+        const std::vector<uint32_t> &mesh_materials = mesh_cache[binding.mesh].materials;
+        const size_t local = std::find(mesh_materials.begin(), mesh_materials.end(), INSTANCE_MATERIAL) -
+                             mesh_materials.begin();
+        instance_binding_index[std::make_pair(binding.mesh, local < binding.materials.size()
+                                                            ? binding.materials[local] : INSTANCE_MATERIAL)] = i;
+    }
+    std::vector<glm::ivec2> texture_sizes;
+    ok = ok && snapshot.read("texture_sizes", texture_sizes) && texture_sizes.size() == info.num_textures;
+    Model *model = info.num_textures ? new Model : nullptr;
+    for (uint32_t i = 0; i < info.num_textures && ok; ++i) {
+        const size_t num_pixels = static_cast<size_t>(texture_sizes[i].x) * texture_sizes[i].y;
+        ok = snapshot.find("texture." + std::to_string(i), data, size) && size == num_pixels * sizeof(uint32_t);
+        if (!ok) break;
+        Texture *texture = new Texture;
+        texture->resolution = texture_sizes[i];
+        texture->pixel = static_cast<uint32_t *>(malloc(size));
+        memcpy(texture->pixel, data, size);
+        model->material = true;
+        model->textures.push_back(texture);
+        accountTexture(*texture, "texture." + std::to_string(i) + " of " + filename);
+    }
+    if (!ok) {
+        std::cout << "Prepared scene " << filename << " is damaged" << std::endl;
+        delete model;
+        clearSceneData();
+        snapshot.close();
+        return false;
+    }
+
+    if (model) MODEL = model;
+    TRIANGLE_COUNT = info.triangle_count;
+    MAT_COUNT = info.mat_count;
+    setSceneCamera(info.width, info.height, info.eye, info.lookat, info.up, info.fovy);
+    prepared_gas = snapshot.find("gas", data, size);
+    prepared_cpu_bvh = snapshot.find("cpu_bvh.nodes", data, size);
+    scene_inputs = inputs;
+
+    const auto t1 = std::chrono::steady_clock::now();
+    std::cout << "Loaded prepared scene " << filename << ": " << d_vertices.size() / 3 << " triangles, "
+              << MAT_COUNT << " materials, " << scene_instances.size() << " instances in " << std::fixed
+              << std::setprecision(1) << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms"
+              << std::endl;
+    return true;
+}
+
+/*
+*   Accounts what the host arrays of the scene hold as geometry, in place of what the last
+*   call accounted. Throws std::runtime_error if it is over the geometry budget, before the
+*   device copies add to it
+*/
+void accountHostGeometry() {
+    size_t bytes = vectorBytes(d_vertices) + vectorBytes(d_texcoords) + vectorBytes(d_material_indices) +
+                   vectorBytes(d_triangles) + vectorBytes(d_lights) + vectorBytes(light_sources) +
+                   vectorBytes(scene_instances);
+    for (const CachedMesh &mesh: mesh_cache)
+        bytes += vectorBytes(mesh.vertices) + vectorBytes(mesh.texcoords) + vectorBytes(mesh.material_indices);
+    if (MODEL)
+        for (const Mesh *mesh: MODEL->meshes)
+            bytes += vectorBytes(mesh->triangles) + vectorBytes(mesh->vertex) + vectorBytes(mesh->normal) +
+                     vectorBytes(mesh->texcoord) + vectorBytes(mesh->index);
+    MemoryAccounting &accounting = memoryAccounting();
+    accounting.release(MEMORY_GEOMETRY, MEMORY_HOST, accounted_host_geometry);
+    accounted_host_geometry = 0;
+    if (!accounting.tryAllocate(MEMORY_GEOMETRY, MEMORY_HOST, bytes))
+        throw std::runtime_error("The scene does not fit: " +
+                                 accounting.budgetError(MEMORY_GEOMETRY, MEMORY_HOST, bytes));
+    accounted_host_geometry = bytes;
+}
+
+/*
+*   readSceneFile(), or the prepared scene while it matches the inputs. When it does not,
+*   the scene file is read and the prepared scene is rewritten once the scene is built.
+*/
+void loadScene(std::string &scene_file) {
+    if (!prepared_scene_file.empty() && loadPreparedScene(prepared_scene_file, scene_file)) {
+        accountHostGeometry();
+        return;
+    }
+    textures_downscaled = false;
+    readSceneFile(scene_file);
+    // A prepared scene would keep downscaled textures downscaled without the budget
+    prepared_scene_stale = !prepared_scene_file.empty() && !textures_downscaled;
+    accountHostGeometry();
+}
+
+// The scene GAS of the prepared scene copied to the device, instead of building it
+bool relocatePreparedGas(PathTracerState &state) {
+    if (!prepared_gas) return false;
+    prepared_gas = false;
+    const void *info_data, *gas_data;
+    size_t info_size, gas_size;
+    if (!prepared_scene.find("gas_info", info_data, info_size) || info_size != sizeof(PreparedGas) ||
+        !prepared_scene.find("gas", gas_data, gas_size))
+        return false;
+    PreparedGas gas;
+    memcpy(&gas, info_data, sizeof(gas));
+    int compatible = 0;
+    OPTIX_CHECK(optixAccelCheckRelocationCompatibility(state.context, &gas.relocation_info, &compatible));
+    if (!compatible) {
+        std::cout << "The prepared GAS does not fit this device or driver, building it" << std::endl;
+        return false;
+    }
+
+    trackedCudaMalloc(reinterpret_cast<void **>( &state.d_gas_output_buffer ), gas_size, MEMORY_ACCELERATION);
+    CUDA_CHECK(cudaMemcpy(reinterpret_cast<void *>( state.d_gas_output_buffer ), gas_data, gas_size,
+                          cudaMemcpyHostToDevice));
+    OPTIX_CHECK(optixAccelRelocate(state.context, 0, &gas.relocation_info, 0, 0, state.d_gas_output_buffer, gas_size,
+                                   &state.gas_handle));
+    state.gas_output_size = gas_size;
+    state.gas_temp_update_size = static_cast<size_t>(gas.temp_update_size);
+    return true;
 }
 
 
@@ -1333,7 +2451,21 @@ void createContext(PathTracerState &state) {
     state.context = context;
 }
 
+// Frees the texture objects and arrays of createTextures()
+void destroyTextures() {
+    for (cudaTextureObject_t texture: textureObjects)
+        CUDA_CHECK(cudaDestroyTextureObject(texture));
+    for (cudaArray_t array: textureArrays) {
+        memoryAccounting().releaseAddress(array);
+        CUDA_CHECK(cudaFreeArray(array));
+    }
+    textureObjects.clear();
+    textureArrays.clear();
+}
+
+// Device copies of the model's textures, replacing those of the last call
 void createTextures() {
+    destroyTextures();
     if (MODEL == NULL) {
         return;
     }
@@ -1355,9 +2487,13 @@ void createTextures() {
         channel_desc = cudaCreateChannelDesc<uchar4>();
 
         cudaArray_t &pixelArray = textureArrays[textureID];
+        const size_t bytes = static_cast<size_t>(pitch) * height;
+        if (!memoryAccounting().tryAllocate(MEMORY_TEXTURES, MEMORY_DEVICE, bytes))
+            throw std::runtime_error(memoryAccounting().budgetError(MEMORY_TEXTURES, MEMORY_DEVICE, bytes));
         CUDA_CHECK(cudaMallocArray(&pixelArray,
                                    &channel_desc,
                                    width, height));
+        memoryAccounting().trackAddress(pixelArray, MEMORY_TEXTURES, MEMORY_DEVICE, bytes);
 
         CUDA_CHECK(cudaMemcpy2DToArray(pixelArray,
                 /* offset */0, 0,
@@ -1388,58 +2524,50 @@ void createTextures() {
     }
 }
 
-void buildMeshAccel(PathTracerState &state) {
-    //
-    // copy mesh data to device
-    //
-    const size_t vertices_size_in_bytes = d_vertices.size() * sizeof(Vertex);
-    CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>( &state.d_vertices ), vertices_size_in_bytes));
-    CUDA_CHECK(cudaMemcpy(
-            reinterpret_cast<void *>( state.d_vertices ),
-            d_vertices.data(), vertices_size_in_bytes,
-            cudaMemcpyHostToDevice
-    ));
-    const size_t textcoords_size_in_bytes = d_texcoords.size() * sizeof(float2);
-    CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>(&state.d_texcoords), textcoords_size_in_bytes));
-    CUDA_CHECK(cudaMemcpy(
-            reinterpret_cast<void *>(state.d_texcoords),
-            d_texcoords.data(), textcoords_size_in_bytes,
-            cudaMemcpyHostToDevice
-    ));
-
-    CUdeviceptr d_mat_indices = 0;
-    const size_t mat_indices_size_in_bytes = d_material_indices.size() * sizeof(uint32_t);
-    CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>( &d_mat_indices ), mat_indices_size_in_bytes));
-    CUDA_CHECK(cudaMemcpy(
-            reinterpret_cast<void *>( d_mat_indices ),
-            d_material_indices.data(),
-            mat_indices_size_in_bytes,
-            cudaMemcpyHostToDevice
-    ));
-
-    //
-    // Build triangle GAS
-    //
-
-    std::vector<uint32_t> triangle_input_flags; // One per SBT record for this build input
-    for (int i = 0; i < MAT_COUNT; ++i) {
-        triangle_input_flags.push_back(OPTIX_GEOMETRY_FLAG_DISABLE_ANYHIT);
-    }
-
+/*
+*   Triangle build input over a triangle soup (three vertices per triangle) with one SBT
+*   record per material index in d_mat_indices. The buffers behind the pointers have to
+*   stay alive until the build or update is done.
+*/
+OptixBuildInput triangleBuildInput(const CUdeviceptr *d_vertex_buffer,
+                                   size_t num_vertices,
+                                   CUdeviceptr d_mat_indices,
+                                   const std::vector<uint32_t> &triangle_input_flags) {
     OptixBuildInput triangle_input = {};
     triangle_input.type = OPTIX_BUILD_INPUT_TYPE_TRIANGLES;
     triangle_input.triangleArray.vertexFormat = OPTIX_VERTEX_FORMAT_FLOAT3;
     triangle_input.triangleArray.vertexStrideInBytes = sizeof(Vertex);
-    triangle_input.triangleArray.numVertices = static_cast<uint32_t>( d_vertices.size());
-    triangle_input.triangleArray.vertexBuffers = &state.d_vertices;
+    triangle_input.triangleArray.numVertices = static_cast<uint32_t>( num_vertices );
+    triangle_input.triangleArray.vertexBuffers = d_vertex_buffer;
     triangle_input.triangleArray.flags = triangle_input_flags.data();
-    triangle_input.triangleArray.numSbtRecords = MAT_COUNT;
+    triangle_input.triangleArray.numSbtRecords = static_cast<uint32_t>( triangle_input_flags.size());
     triangle_input.triangleArray.sbtIndexOffsetBuffer = d_mat_indices;
     triangle_input.triangleArray.sbtIndexOffsetSizeInBytes = sizeof(uint32_t);
     triangle_input.triangleArray.sbtIndexOffsetStrideInBytes = sizeof(uint32_t);
+    return triangle_input;
+}
+
+/*
+*   Builds and compacts a GAS over a triangle soup with one SBT record per material index in
+*   d_mat_indices. Returns the size of the GAS in bytes. With temp_update_size set the GAS
+*   can be refit later, with a temporary buffer of that size.
+*/
+size_t buildTriangleGas(PathTracerState &state,
+                        CUdeviceptr d_vertex_buffer,
+                        size_t num_vertices,
+                        CUdeviceptr d_mat_indices,
+                        uint32_t num_sbt_records,
+                        OptixTraversableHandle &handle,
+                        CUdeviceptr &d_output_buffer,
+                        size_t *temp_update_size = nullptr) {
+    // One per SBT record for this build input
+    const std::vector<uint32_t> triangle_input_flags(num_sbt_records, OPTIX_GEOMETRY_FLAG_DISABLE_ANYHIT);
+    OptixBuildInput triangle_input = triangleBuildInput(&d_vertex_buffer, num_vertices, d_mat_indices,
+                                                        triangle_input_flags);
 
     OptixAccelBuildOptions accel_options = {};
     accel_options.buildFlags = OPTIX_BUILD_FLAG_ALLOW_COMPACTION;
+    if (temp_update_size) accel_options.buildFlags |= OPTIX_BUILD_FLAG_ALLOW_UPDATE;
     accel_options.operation = OPTIX_BUILD_OPERATION_BUILD;
 
     OptixAccelBufferSizes gas_buffer_sizes;
@@ -1450,17 +2578,17 @@ void buildMeshAccel(PathTracerState &state) {
             1,  // num_build_inputs
             &gas_buffer_sizes
     ));
+    if (temp_update_size) *temp_update_size = gas_buffer_sizes.tempUpdateSizeInBytes;
 
     CUdeviceptr d_temp_buffer;
-    CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>( &d_temp_buffer ), gas_buffer_sizes.tempSizeInBytes));
+    trackedCudaMalloc(reinterpret_cast<void **>( &d_temp_buffer ), gas_buffer_sizes.tempSizeInBytes,
+                      MEMORY_ACCELERATION);
 
     // non-compacted output
     CUdeviceptr d_buffer_temp_output_gas_and_compacted_size;
     size_t compactedSizeOffset = roundUp<size_t>(gas_buffer_sizes.outputSizeInBytes, 8ull);
-    CUDA_CHECK(cudaMalloc(
-            reinterpret_cast<void **>( &d_buffer_temp_output_gas_and_compacted_size ),
-            compactedSizeOffset + 8
-    ));
+    trackedCudaMalloc(reinterpret_cast<void **>( &d_buffer_temp_output_gas_and_compacted_size ),
+                      compactedSizeOffset + 8, MEMORY_ACCELERATION);
 
     OptixAccelEmitDesc emitProperty = {};
     emitProperty.type = OPTIX_PROPERTY_TYPE_COMPACTED_SIZE;
@@ -1476,28 +2604,255 @@ void buildMeshAccel(PathTracerState &state) {
             gas_buffer_sizes.tempSizeInBytes,
             d_buffer_temp_output_gas_and_compacted_size,
             gas_buffer_sizes.outputSizeInBytes,
-            &state.gas_handle,
+            &handle,
             &emitProperty,                      // emitted property list
             1                                   // num emitted properties
     ));
 
-    CUDA_CHECK(cudaFree(reinterpret_cast<void *>( d_temp_buffer )));
-    CUDA_CHECK(cudaFree(reinterpret_cast<void *>( d_mat_indices )));
+    trackedCudaFree(reinterpret_cast<void *>( d_temp_buffer ));
 
     size_t compacted_gas_size;
     CUDA_CHECK(cudaMemcpy(&compacted_gas_size, (void *) emitProperty.result, sizeof(size_t), cudaMemcpyDeviceToHost));
 
     if (compacted_gas_size < gas_buffer_sizes.outputSizeInBytes) {
-        CUDA_CHECK(cudaMalloc(reinterpret_cast<void **>( &state.d_gas_output_buffer ), compacted_gas_size));
+        trackedCudaMalloc(reinterpret_cast<void **>( &d_output_buffer ), compacted_gas_size, MEMORY_ACCELERATION);
 
         // use handle as input and output
-        OPTIX_CHECK(optixAccelCompact(state.context, 0, state.gas_handle, state.d_gas_output_buffer, compacted_gas_size,
-                                      &state.gas_handle));
+        OPTIX_CHECK(optixAccelCompact(state.context, 0, handle, d_output_buffer, compacted_gas_size,
+                                      &handle));
 
-        CUDA_CHECK(cudaFree((void *) d_buffer_temp_output_gas_and_compacted_size));
-    } else {
-        state.d_gas_output_buffer = d_buffer_temp_output_gas_and_compacted_size;
+        trackedCudaFree(reinterpret_cast<void *>( d_buffer_temp_output_gas_and_compacted_size ));
+        return compacted_gas_size;
+    }
+    d_output_buffer = d_buffer_temp_output_gas_and_compacted_size;
+    return gas_buffer_sizes.outputSizeInBytes;
+}
+
+
+// Hit group record index of every instance binding, after the MAT_COUNT records of the GAS
+std::vector<uint32_t> instanceSbtOffsets() {
+    std::vector<uint32_t> offsets;
+    uint32_t offset = MAT_COUNT;
+    for (const InstanceBinding &binding: instance_bindings) {
+        offsets.push_back(offset);
+        offset += static_cast<uint32_t>(binding.materials.size());
+    }
+    return offsets;
+}
+
+/*
+*   Uploads the meshes of mesh_cache that are not on the device yet and builds a GAS for
+*   each. Returns the size of the new GASes in bytes.
+*/
+size_t buildCachedMeshAccels(PathTracerState &state) {
+    size_t gas_bytes = 0;
+    for (size_t i = state.mesh_gas_handles.size(); i < mesh_cache.size(); ++i) {
+        const CachedMesh &mesh = mesh_cache[i];
+        CUdeviceptr d_mesh_vertices = 0, d_mesh_texcoords = 0, d_mesh_mat_indices = 0;
+        trackedCudaMalloc(reinterpret_cast<void **>( &d_mesh_vertices ), mesh.vertices.size() * sizeof(Vertex),
+                          MEMORY_GEOMETRY);
+        CUDA_CHECK(cudaMemcpy(reinterpret_cast<void *>( d_mesh_vertices ), mesh.vertices.data(),
+                              mesh.vertices.size() * sizeof(Vertex), cudaMemcpyHostToDevice));
+        trackedCudaMalloc(reinterpret_cast<void **>( &d_mesh_texcoords ), mesh.texcoords.size() * sizeof(float2),
+                          MEMORY_GEOMETRY);
+        CUDA_CHECK(cudaMemcpy(reinterpret_cast<void *>( d_mesh_texcoords ), mesh.texcoords.data(),
+                              mesh.texcoords.size() * sizeof(float2), cudaMemcpyHostToDevice));
+        trackedCudaMalloc(reinterpret_cast<void **>( &d_mesh_mat_indices ),
+                          mesh.material_indices.size() * sizeof(uint32_t), MEMORY_GEOMETRY);
+        CUDA_CHECK(cudaMemcpy(reinterpret_cast<void *>( d_mesh_mat_indices ), mesh.material_indices.data(),
+                              mesh.material_indices.size() * sizeof(uint32_t), cudaMemcpyHostToDevice));
+
+        OptixTraversableHandle handle = 0;
+        CUdeviceptr d_gas_output_buffer = 0;
+        gas_bytes += buildTriangleGas(state, d_mesh_vertices, mesh.vertices.size(), d_mesh_mat_indices,
+                                      static_cast<uint32_t>(mesh.materials.size()), handle, d_gas_output_buffer);
+        trackedCudaFree(reinterpret_cast<void *>( d_mesh_mat_indices ));
+
+        state.mesh_gas_handles.push_back(handle);
+        state.d_mesh_gas_output_buffers.push_back(d_gas_output_buffer);
+        state.d_mesh_vertices.push_back(d_mesh_vertices);
+        state.d_mesh_texcoords.push_back(d_mesh_texcoords);
+    }
+    return gas_bytes;
+}
+
+/*
+*   Builds the IAS over the scene GAS and the instances, or refits it in place when only
+*   transforms, visibility or the referenced GASes changed (update, same instance count).
+*   Returns the size of the IAS in bytes.
+*/
+size_t buildInstanceAs(PathTracerState &state, bool update) {
+    // The GEOMETRY lines stay in one GAS, placed with the identity transform
+    std::vector<OptixInstance> instances;
+    if (state.gas_handle) {
+        OptixInstance scene_gas = {};
+        const float identity[12] = {1.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f};
+        memcpy(scene_gas.transform, identity, sizeof(identity));
+        scene_gas.visibilityMask = 255;
+        scene_gas.flags = OPTIX_INSTANCE_FLAG_NONE;
+        scene_gas.traversableHandle = state.gas_handle;
+        instances.push_back(scene_gas);
     }
+    const std::vector<uint32_t> sbt_offsets = instanceSbtOffsets();
+    for (size_t i = 0; i < scene_instances.size(); ++i) {
+        const Instance &instance = scene_instances[i];
+        OptixInstance optix_instance = {};
+        memcpy(optix_instance.transform, instance.transform, sizeof(instance.transform));
+        optix_instance.instanceId = static_cast<unsigned int>(i + 1);
+        // Removed instances keep their slot until it is reused, no ray ever reaches them
+        optix_instance.visibilityMask = instance.visible ? 255 : 0;
+        optix_instance.sbtOffset = sbt_offsets[instance.binding] * RAY_TYPE_COUNT;
+        optix_instance.flags = OPTIX_INSTANCE_FLAG_NONE;
+        optix_instance.traversableHandle = state.mesh_gas_handles[instance.mesh];
+        instances.push_back(optix_instance);
+    }
+    update = update && state.ias_handle && instances.size() == state.ias_num_instances;
+
+    const size_t instances_size_in_bytes = instances.size() * sizeof(OptixInstance);
+    if (!update) {
+        trackedCudaFree(reinterpret_cast<void *>( state.d_instances ));
+        trackedCudaMalloc(reinterpret_cast<void **>( &state.d_instances ), instances_size_in_bytes,
+                          MEMORY_ACCELERATION);
+    }
+    CUDA_CHECK(cudaMemcpy(reinterpret_cast<void *>( state.d_instances ), instances.data(), instances_size_in_bytes,
+                          cudaMemcpyHostToDevice));
+
+    OptixBuildInput instance_input = {};
+    instance_input.type = OPTIX_BUILD_INPUT_TYPE_INSTANCES;
+    instance_input.instanceArray.instances = state.d_instances;
+    instance_input.instanceArray.numInstances = static_cast<unsigned int>(instances.size());
+
+    OptixAccelBuildOptions accel_options = {};
+    accel_options.buildFlags = OPTIX_BUILD_FLAG_ALLOW_UPDATE;
+    accel_options.operation = update ? OPTIX_BUILD_OPERATION_UPDATE : OPTIX_BUILD_OPERATION_BUILD;
+
+    if (!update) {
+        OptixAccelBufferSizes ias_buffer_sizes;
+        OPTIX_CHECK(optixAccelComputeMemoryUsage(state.context, &accel_options, &instance_input, 1,
+                                                 &ias_buffer_sizes));
+        trackedCudaFree(reinterpret_cast<void *>( state.d_ias_output_buffer ));
+        trackedCudaFree(reinterpret_cast<void *>( state.d_ias_temp_buffer ));
+        state.ias_output_size = ias_buffer_sizes.outputSizeInBytes;
+        // The temporary buffer is kept for the refits, which need less than the build
+        state.ias_temp_size = std::max(ias_buffer_sizes.tempSizeInBytes, ias_buffer_sizes.tempUpdateSizeInBytes);
+        trackedCudaMalloc(reinterpret_cast<void **>( &state.d_ias_output_buffer ), state.ias_output_size,
+                          MEMORY_ACCELERATION);
+        trackedCudaMalloc(reinterpret_cast<void **>( &state.d_ias_temp_buffer ), state.ias_temp_size,
+                          MEMORY_ACCELERATION);
+        state.ias_num_instances = instances.size();
+    }
+
+    OPTIX_CHECK(optixAccelBuild(
+            state.context,
+            0,                                  // CUDA stream
+            &accel_options,
+            &instance_input,
+            1,                                  // num build inputs
+            state.d_ias_temp_buffer,
+            state.ias_temp_size,
+            state.d_ias_output_buffer,
+            state.ias_output_size,
+            &state.ias_handle,
+            nullptr,                            // emitted property list
+            0                                   // num emitted properties
+    ));
+    return state.ias_output_size;
+}
+
+/*
+*   Uploads the cached meshes, builds a GAS for each and an IAS over the scene GAS and the
+*   instances. params.handle becomes the IAS.
+*/
+void buildInstanceAccel(PathTracerState &state) {
+    const size_t gas_bytes = buildCachedMeshAccels(state);
+    const size_t ias_bytes = buildInstanceAs(state, false);
+    std::cout << std::fixed << std::setprecision(2) << "Instance acceleration structures: "
+              << gas_bytes / (1024.0 * 1024.0) << " MB for " << mesh_cache.size() << " mesh GAS, "
+              << ias_bytes / (1024.0 * 1024.0) << " MB for the IAS over "
+              << state.ias_num_instances << " instances" << std::endl;
+}
+
+
+void buildMeshAccel(PathTracerState &state) {
+    SUTIL_PROFILE_SCOPE("accel build");
+    //
+    // copy mesh data to device
+    //
+    const size_t vertices_size_in_bytes = d_vertices.size() * sizeof(Vertex);
+    trackedCudaMalloc(reinterpret_cast<void **>( &state.d_vertices ), vertices_size_in_bytes, MEMORY_GEOMETRY);
+    CUDA_CHECK(cudaMemcpy(
+            reinterpret_cast<void *>( state.d_vertices ),
+            d_vertices.data(), vertices_size_in_bytes,
+            cudaMemcpyHostToDevice
+    ));
+    const size_t textcoords_size_in_bytes = d_texcoords.size() * sizeof(float2);
+    trackedCudaMalloc(reinterpret_cast<void **>(&state.d_texcoords), textcoords_size_in_bytes, MEMORY_GEOMETRY);
+    CUDA_CHECK(cudaMemcpy(
+            reinterpret_cast<void *>(state.d_texcoords),
+            d_texcoords.data(), textcoords_size_in_bytes,
+            cudaMemcpyHostToDevice
+    ));
+
+    // Kept for refits of the GAS, which need the same build input
+    const size_t mat_indices_size_in_bytes = d_material_indices.size() * sizeof(uint32_t);
+    trackedCudaMalloc(reinterpret_cast<void **>( &state.d_mat_indices ), mat_indices_size_in_bytes, MEMORY_GEOMETRY);
+    CUDA_CHECK(cudaMemcpy(
+            reinterpret_cast<void *>( state.d_mat_indices ),
+            d_material_indices.data(),
+            mat_indices_size_in_bytes,
+            cudaMemcpyHostToDevice
+    ));
+
+    // A scene of INSTANCE lines only has no GAS of its own. Area lights can be moved by scene
+    // updates, so the GAS is built to be refit.
+    if ((!d_vertices.empty() || scene_instances.empty()) && !relocatePreparedGas(state)) {
+        state.gas_output_size = buildTriangleGas(state, state.d_vertices, d_vertices.size(), state.d_mat_indices,
+                                                 MAT_COUNT, state.gas_handle, state.d_gas_output_buffer,
+                                                 &state.gas_temp_update_size);
+    }
+
+    if (!scene_instances.empty()) {
+        buildInstanceAccel(state);
+    }
+}
+
+/*
+*   Refits the scene GAS after the vertices of scene_updates' triangle range moved. Only the
+*   changed range is uploaded.
+*/
+void refitSceneGas(PathTracerState &state) {
+    const size_t first_vertex = 3 * static_cast<size_t>(scene_updates.first_triangle);
+    const size_t num_vertices = 3 * static_cast<size_t>(scene_updates.end_triangle - scene_updates.first_triangle);
+    CUDA_CHECK(cudaMemcpy(
+            reinterpret_cast<void *>( state.d_vertices + first_vertex * sizeof(Vertex)),
+            d_vertices.data() + first_vertex, num_vertices * sizeof(Vertex),
+            cudaMemcpyHostToDevice
+    ));
+
+    const std::vector<uint32_t> triangle_input_flags(MAT_COUNT, OPTIX_GEOMETRY_FLAG_DISABLE_ANYHIT);
+    OptixBuildInput triangle_input = triangleBuildInput(&state.d_vertices, d_vertices.size(), state.d_mat_indices,
+                                                        triangle_input_flags);
+    OptixAccelBuildOptions accel_options = {};
+    accel_options.buildFlags = OPTIX_BUILD_FLAG_ALLOW_COMPACTION | OPTIX_BUILD_FLAG_ALLOW_UPDATE;
+    accel_options.operation = OPTIX_BUILD_OPERATION_UPDATE;
+
+    if (!state.d_gas_temp_buffer)
+        trackedCudaMalloc(reinterpret_cast<void **>( &state.d_gas_temp_buffer ), state.gas_temp_update_size,
+                          MEMORY_ACCELERATION);
+    OPTIX_CHECK(optixAccelBuild(
+            state.context,
+            0,                                  // CUDA stream
+            &accel_options,
+            &triangle_input,
+            1,                                  // num build inputs
+            state.d_gas_temp_buffer,
+            state.gas_temp_update_size,
+            state.d_gas_output_buffer,
+            state.gas_output_size,
+            &state.gas_handle,
+            nullptr,                            // emitted property list
+            0                                   // num emitted properties
+    ));
 }
 
 
@@ -1508,7 +2863,9 @@ void createModule(PathTracerState &state) {
     module_compile_options.debugLevel = OPTIX_COMPILE_DEBUG_LEVEL_DEFAULT;
 
     state.pipeline_compile_options.usesMotionBlur = false;
-    state.pipeline_compile_options.traversableGraphFlags = OPTIX_TRAVERSABLE_GRAPH_FLAG_ALLOW_SINGLE_GAS;
+    state.pipeline_compile_options.traversableGraphFlags = scene_instances.empty()
+                                                           ? OPTIX_TRAVERSABLE_GRAPH_FLAG_ALLOW_SINGLE_GAS
+                                                           : OPTIX_TRAVERSABLE_GRAPH_FLAG_ALLOW_SINGLE_LEVEL_INSTANCING;
     state.pipeline_compile_options.numPayloadValues = 2;
     state.pipeline_compile_options.numAttributeValues = 2;
 #ifdef DEBUG // Enables debug exceptions during optix launches. This may incur significant performance cost and should only be done during development.
@@ -1573,8 +2930,8 @@ void createProgramGroups(PathTracerState &state) {
 
         memset(&miss_prog_group_desc, 0, sizeof(OptixProgramGroupDesc));
         miss_prog_group_desc.kind = OPTIX_PROGRAM_GROUP_KIND_MISS;
-        miss_prog_group_desc.miss.module = nullptr;  // NULL miss program for occlusion rays
-        miss_prog_group_desc.miss.entryFunctionName = nullptr;
+        miss_prog_group_desc.miss.module = state.ptx_module;
+        miss_prog_group_desc.miss.entryFunctionName = "__miss__occlusion";
         sizeof_log = sizeof(log);
         OPTIX_CHECK_LOG(optixProgramGroupCreate(
                 state.context, &miss_prog_group_desc,
@@ -1602,10 +2959,10 @@ void createProgramGroups(PathTracerState &state) {
                 &state.radiance_hit_group
         ));
 
+        // Occlusion rays are traced with closest hit and any hit disabled and only their miss
+        // program writes the payload, so their hit group has no programs
         memset(&hit_prog_group_desc, 0, sizeof(OptixProgramGroupDesc));
         hit_prog_group_desc.kind = OPTIX_PROGRAM_GROUP_KIND_HITGROUP;
-        hit_prog_group_desc.hitgroup.moduleCH = state.ptx_module;
-        hit_prog_group_desc.hitgroup.entryFunctionNameCH = "__closesthit__occlusion";
         sizeof_log = sizeof(log);
         OPTIX_CHECK(optixProgramGroupCreate(
                 state.context,
@@ -1672,7 +3029,7 @@ void createPipeline(PathTracerState &state) {
             &continuation_stack_size
     ));
 
-    const uint32_t max_traversal_depth = 1;
+    const uint32_t max_traversal_depth = scene_instances.empty() ? 1 : 2;
     OPTIX_CHECK(optixPipelineSetStackSize(
             state.pipeline,
             direct_callable_stack_size_from_traversal,
@@ -1683,6 +3040,125 @@ void createPipeline(PathTracerState &state) {
 }
 
 
+// Texture object of every material, the TEXTURE materials get the textures in order
+std::vector<cudaTextureObject_t> materialTextures() {
+    std::vector<cudaTextureObject_t> material_textures(MAT_COUNT, 0);
+    int texture_id = 0;
+    for (int i = 0; i < MAT_COUNT; ++i) {
+        if (d_mat_types[i] == TEXTURE) {
+            if (textureObjects.size() > texture_id) {
+                material_textures[i] = textureObjects[texture_id];
+            } else {
+                material_textures[i] = textureObjects[0];
+            }
+            texture_id++;
+        }
+    }
+    return material_textures;
+}
+
+// Radiance record of the ith material on the given vertex and texture coordinate buffers
+void packRadianceRecord(const PathTracerState &state, int i, CUdeviceptr d_vertices, CUdeviceptr d_texcoords,
+                        const std::vector<cudaTextureObject_t> &material_textures, HitGroupRecord &record) {
+    OPTIX_CHECK(optixSbtRecordPackHeader(state.radiance_hit_group, &record));
+    record.data.emission_color = d_emission_colors[i];
+    record.data.diffuse_color = d_diffuse_colors[i];
+    record.data.specular_color = d_spec_colors[i];
+    record.data.spec_exp = d_spec_exp[i];
+    record.data.ior = d_ior[i];
+    record.data.vertices = reinterpret_cast<float4 *>( d_vertices );
+    record.data.mat = d_mat_types[i];
+    if (d_mat_types[i] == TEXTURE) {
+        record.data.texture = material_textures[i];
+        record.data.texcoord = reinterpret_cast<float2 *>(d_texcoords);
+    }
+}
+
+/*
+*   (Re)creates the hit group records: the GAS uses the first MAT_COUNT materials, every
+*   instance binding its own range after them
+*/
+void createHitgroupRecords(PathTracerState &state) {
+    const std::vector<uint32_t> sbt_offsets = instanceSbtOffsets();
+    uint32_t material_records = MAT_COUNT;
+    for (const InstanceBinding &binding: instance_bindings)
+        material_records += static_cast<uint32_t>(binding.materials.size());
+
+    CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.sbt.hitgroupRecordBase )));
+    CUdeviceptr d_hitgroup_records;
+    const size_t hitgroup_record_size = sizeof(HitGroupRecord);
+    CUDA_CHECK(cudaMalloc(
+            reinterpret_cast<void **>( &d_hitgroup_records ),
+            hitgroup_record_size * RAY_TYPE_COUNT * material_records
+    ));
+
+    const std::vector<cudaTextureObject_t> material_textures = materialTextures();
+    std::vector<HitGroupRecord> hitgroup_records;
+    for (uint32_t i = 0; i < RAY_TYPE_COUNT * material_records; ++i) {
+        hitgroup_records.push_back(HitGroupRecord());
+    }
+    const auto packMaterial = [&](uint32_t record, int i, CUdeviceptr d_vertices, CUdeviceptr d_texcoords) {
+        {
+            const uint32_t sbt_idx = record * RAY_TYPE_COUNT + 0;  // SBT for radiance ray-type for ith material
+            packRadianceRecord(state, i, d_vertices, d_texcoords, material_textures, hitgroup_records[sbt_idx]);
+        }
+
+        {
+            const uint32_t sbt_idx = record * RAY_TYPE_COUNT + 1;  // SBT for occlusion ray-type for ith material
+            memset(&hitgroup_records[sbt_idx], 0, hitgroup_record_size);
+
+            OPTIX_CHECK(optixSbtRecordPackHeader(state.occlusion_hit_group, &hitgroup_records[sbt_idx]));
+        }
+    };
+    for (int i = 0; i < MAT_COUNT; ++i) {
+        packMaterial(i, i, state.d_vertices, state.d_texcoords);
+    }
+    for (size_t b = 0; b < instance_bindings.size(); ++b) {
+        const InstanceBinding &binding = instance_bindings[b];
+        for (size_t m = 0; m < binding.materials.size(); ++m) {
+            packMaterial(sbt_offsets[b] + m, binding.materials[m], state.d_mesh_vertices[binding.mesh],
+                         state.d_mesh_texcoords[binding.mesh]);
+        }
+    }
+
+    CUDA_CHECK(cudaMemcpy(
+            reinterpret_cast<void *>( d_hitgroup_records ),
+            hitgroup_records.data(),
+            hitgroup_record_size * RAY_TYPE_COUNT * material_records,
+            cudaMemcpyHostToDevice
+    ));
+
+    state.sbt.hitgroupRecordBase = d_hitgroup_records;
+    state.sbt.hitgroupRecordStrideInBytes = static_cast<uint32_t>( hitgroup_record_size );
+    state.sbt.hitgroupRecordCount = RAY_TYPE_COUNT * material_records;
+}
+
+// Rewrites the radiance records of the materials scene updates changed, nothing else is uploaded
+void updateMaterialRecords(PathTracerState &state) {
+    const std::vector<cudaTextureObject_t> material_textures = materialTextures();
+    const auto writeRecord = [&](uint32_t record, int i, CUdeviceptr d_vertices, CUdeviceptr d_texcoords) {
+        HitGroupRecord hitgroup_record = {};
+        packRadianceRecord(state, i, d_vertices, d_texcoords, material_textures, hitgroup_record);
+        const size_t offset = static_cast<size_t>(record) * RAY_TYPE_COUNT * sizeof(HitGroupRecord);
+        CUDA_CHECK(cudaMemcpy(reinterpret_cast<void *>( state.sbt.hitgroupRecordBase + offset ), &hitgroup_record,
+                              sizeof(HitGroupRecord), cudaMemcpyHostToDevice));
+    };
+    const std::vector<bool> &dirty = scene_updates.materials;
+    for (int i = 0; i < MAT_COUNT && i < static_cast<int>(dirty.size()); ++i) {
+        if (dirty[i]) writeRecord(i, i, state.d_vertices, state.d_texcoords);
+    }
+    const std::vector<uint32_t> sbt_offsets = instanceSbtOffsets();
+    for (size_t b = 0; b < instance_bindings.size(); ++b) {
+        const InstanceBinding &binding = instance_bindings[b];
+        for (size_t m = 0; m < binding.materials.size(); ++m) {
+            if (binding.materials[m] < dirty.size() && dirty[binding.materials[m]]) {
+                writeRecord(sbt_offsets[b] + m, binding.materials[m], state.d_mesh_vertices[binding.mesh],
+                            state.d_mesh_texcoords[binding.mesh]);
+            }
+        }
+    }
+}
+
 void createSBT(PathTracerState &state) {
     CUdeviceptr d_raygen_record;
     const size_t raygen_record_size = sizeof(RayGenRecord);
@@ -1716,67 +3192,16 @@ void createSBT(PathTracerState &state) {
             cudaMemcpyHostToDevice
     ));
 
-    CUdeviceptr d_hitgroup_records;
-    const size_t hitgroup_record_size = sizeof(HitGroupRecord);
-    CUDA_CHECK(cudaMalloc(
-            reinterpret_cast<void **>( &d_hitgroup_records ),
-            hitgroup_record_size * RAY_TYPE_COUNT * MAT_COUNT
-    ));
-
-    std::vector<HitGroupRecord> hitgroup_records;
-    for (int i = 0; i < RAY_TYPE_COUNT * MAT_COUNT; ++i) {
-        hitgroup_records.push_back(HitGroupRecord());
-    }
-    int texture_id = 0;
-    for (int i = 0; i < MAT_COUNT; ++i) {
-        {
-            const int sbt_idx = i * RAY_TYPE_COUNT + 0;  // SBT for radiance ray-type for ith material
-
-            OPTIX_CHECK(optixSbtRecordPackHeader(state.radiance_hit_group, &hitgroup_records[sbt_idx]));
-            hitgroup_records[sbt_idx].data.emission_color = d_emission_colors[i];
-            hitgroup_records[sbt_idx].data.diffuse_color = d_diffuse_colors[i];
-            hitgroup_records[sbt_idx].data.specular_color = d_spec_colors[i];
-            hitgroup_records[sbt_idx].data.spec_exp = d_spec_exp[i];
-            hitgroup_records[sbt_idx].data.ior = d_ior[i];
-            hitgroup_records[sbt_idx].data.vertices = reinterpret_cast<float4 *>( state.d_vertices );
-            hitgroup_records[sbt_idx].data.mat = d_mat_types[i];
-            if (d_mat_types[i] == TEXTURE) {
-                if (textureObjects.size() > texture_id) {
-                    hitgroup_records[sbt_idx].data.texture = textureObjects[texture_id];
-                } else {
-                    hitgroup_records[sbt_idx].data.texture = textureObjects[0];
-                }
-                hitgroup_records[sbt_idx].data.texcoord = reinterpret_cast<float2 *>(state.d_texcoords);
-                texture_id++;
-            }
-        }
-
-        {
-            const int sbt_idx = i * RAY_TYPE_COUNT + 1;  // SBT for occlusion ray-type for ith material
-            memset(&hitgroup_records[sbt_idx], 0, hitgroup_record_size);
-
-            OPTIX_CHECK(optixSbtRecordPackHeader(state.occlusion_hit_group, &hitgroup_records[sbt_idx]));
-        }
-    }
-
-    CUDA_CHECK(cudaMemcpy(
-            reinterpret_cast<void *>( d_hitgroup_records ),
-            hitgroup_records.data(),
-            hitgroup_record_size * RAY_TYPE_COUNT * MAT_COUNT,
-            cudaMemcpyHostToDevice
-    ));
+    createHitgroupRecords(state);
 
     state.sbt.raygenRecord = d_raygen_record;
     state.sbt.missRecordBase = d_miss_records;
     state.sbt.missRecordStrideInBytes = static_cast<uint32_t>( miss_record_size );
     state.sbt.missRecordCount = RAY_TYPE_COUNT;
-    state.sbt.hitgroupRecordBase = d_hitgroup_records;
-    state.sbt.hitgroupRecordStrideInBytes = static_cast<uint32_t>( hitgroup_record_size );
-    state.sbt.hitgroupRecordCount = RAY_TYPE_COUNT * MAT_COUNT;
 }
 
 
-void cleanupState(PathTracerState &state) {
+void destroyPipeline(PathTracerState &state) {
     OPTIX_CHECK(optixPipelineDestroy(state.pipeline));
     OPTIX_CHECK(optixProgramGroupDestroy(state.raygen_prog_group));
     OPTIX_CHECK(optixProgramGroupDestroy(state.radiance_miss_group));
@@ -1784,20 +3209,264 @@ void cleanupState(PathTracerState &state) {
     OPTIX_CHECK(optixProgramGroupDestroy(state.occlusion_hit_group));
     OPTIX_CHECK(optixProgramGroupDestroy(state.occlusion_miss_group));
     OPTIX_CHECK(optixModuleDestroy(state.ptx_module));
+}
+
+// Frees the device copies of the geometry, the acceleration structures and the lights
+void freeSceneBuffers(PathTracerState &state) {
+    trackedCudaFree(reinterpret_cast<void *>( state.d_vertices ));
+    trackedCudaFree(reinterpret_cast<void *>( state.d_texcoords ));
+    trackedCudaFree(reinterpret_cast<void *>( state.d_mat_indices ));
+    trackedCudaFree(reinterpret_cast<void *>( state.d_lights ));
+    trackedCudaFree(reinterpret_cast<void *>( state.d_light_tree ));
+    trackedCudaFree(reinterpret_cast<void *>( state.d_gas_output_buffer ));
+    trackedCudaFree(reinterpret_cast<void *>( state.d_gas_temp_buffer ));
+    trackedCudaFree(reinterpret_cast<void *>( state.d_ias_output_buffer ));
+    trackedCudaFree(reinterpret_cast<void *>( state.d_ias_temp_buffer ));
+    trackedCudaFree(reinterpret_cast<void *>( state.d_instances ));
+    for (size_t i = 0; i < state.d_mesh_gas_output_buffers.size(); ++i) {
+        trackedCudaFree(reinterpret_cast<void *>( state.d_mesh_gas_output_buffers[i] ));
+        trackedCudaFree(reinterpret_cast<void *>( state.d_mesh_vertices[i] ));
+        trackedCudaFree(reinterpret_cast<void *>( state.d_mesh_texcoords[i] ));
+    }
+    state.d_vertices = state.d_texcoords = state.d_mat_indices = 0;
+    state.d_lights = state.d_light_tree = 0;
+    state.light_tree_nodes = 0;
+    state.params.num_lights = 0;
+    state.gas_handle = state.ias_handle = 0;
+    state.d_gas_output_buffer = state.d_gas_temp_buffer = 0;
+    state.d_ias_output_buffer = state.d_ias_temp_buffer = state.d_instances = 0;
+    state.ias_num_instances = 0;
+    state.ias_refits = 0;
+    state.mesh_gas_handles.clear();
+    state.d_mesh_gas_output_buffers.clear();
+    state.d_mesh_vertices.clear();
+    state.d_mesh_texcoords.clear();
+}
+
+/*
+*   Uploads the whole scene again and rebuilds every acceleration structure, the hit group
+*   records and the light tree, what changing the scene took before scene updates
+*/
+void rebuildScene(PathTracerState &state) {
+    freeSceneBuffers(state);
+    buildMeshAccel(state);
+    createHitgroupRecords(state);
+    uploadLights(state);
+    state.params.handle = state.ias_handle ? state.ias_handle : state.gas_handle;
+    scene_updates = SceneUpdates();
+}
+
+/*
+*   Brings the device up to date with scene_updates:
+*   - moved area light triangles: upload of the range and a refit of the scene GAS
+*   - new meshes or bindings: a GAS per new mesh and new hit group records
+*   - changed materials: only their radiance records are rewritten
+*   - moved, removed or reused instance slots: an IAS refit, appended instances an IAS rebuild
+*   - lights: upload and a new light tree
+*   Accumulation has to restart afterwards.
+*/
+void commitSceneUpdates(PathTracerState &state) {
+    if (!scene_updates.pending()) return;
+    SUTIL_PROFILE_SCOPE("scene update");
+
+    // The first instance in a scene without any, the pipeline was compiled for a single GAS
+    if (!scene_instances.empty() && !state.ias_handle) {
+        destroyPipeline(state);
+        createModule(state);
+        createProgramGroups(state);
+        createPipeline(state);
+        CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.sbt.raygenRecord )));
+        CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.sbt.missRecordBase )));
+        freeSceneBuffers(state);
+        buildMeshAccel(state);
+        createSBT(state);
+        uploadLights(state);
+        state.params.handle = state.ias_handle;
+        scene_updates = SceneUpdates();
+        return;
+    }
+
+    const bool gas_moved = scene_updates.first_triangle >= 0;
+    if (gas_moved) refitSceneGas(state);
+    if (scene_updates.bindings) {
+        buildCachedMeshAccels(state);
+        createHitgroupRecords(state);
+    } else if (std::find(scene_updates.materials.begin(), scene_updates.materials.end(), true) !=
+               scene_updates.materials.end()) {
+        updateMaterialRecords(state);
+    }
+    if (state.ias_handle && (gas_moved || scene_updates.instances || scene_updates.instance_count ||
+                             scene_updates.bindings)) {
+        const bool refit = !scene_updates.instance_count && state.ias_refits < IAS_MAX_REFITS;
+        buildInstanceAs(state, refit);
+        state.ias_refits = refit ? state.ias_refits + 1 : 0;
+    }
+    if (scene_updates.lights) uploadLights(state);
+
+    state.params.handle = state.ias_handle ? state.ias_handle : state.gas_handle;
+    scene_updates = SceneUpdates();
+}
+
+
+/*
+*   Frees everything the OptiX state of a scene holds on the device, including the textures
+*   and the denoiser, so that the next scene starts from an empty device
+*/
+void cleanupState(PathTracerState &state) {
+    if (state.denoiser) {
+        OPTIX_CHECK(optixDenoiserDestroy(state.denoiser));
+        trackedCudaFree(reinterpret_cast<void *>( state.denoiserScratch ));
+        trackedCudaFree(reinterpret_cast<void *>( state.denoiserState ));
+        CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.denoiserParams.hdrIntensity )));
+        state.denoiser = nullptr;
+        state.denoiserScratch = state.denoiserState = 0;
+    }
+    destroyPipeline(state);
     OPTIX_CHECK(optixDeviceContextDestroy(state.context));
 
 
     CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.sbt.raygenRecord )));
     CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.sbt.missRecordBase )));
     CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.sbt.hitgroupRecordBase )));
-    CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.d_vertices )));
-    CUDA_CHECK(cudaFree(reinterpret_cast<void *>(state.d_texcoords)));
-    CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.d_lights )));
-    CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.d_gas_output_buffer )));
-    CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.params.accum_buffer )));
+    freeSceneBuffers(state);
+    trackedCudaFree(reinterpret_cast<void *>( state.params.accum_buffer ));
+    trackedCudaFree(reinterpret_cast<void *>( state.params.moments_buffer ));
+    trackedCudaFree(reinterpret_cast<void *>( state.params.albedo_buffer ));
+    trackedCudaFree(reinterpret_cast<void *>( state.params.normal_buffer ));
+    trackedCudaFree(reinterpret_cast<void *>( state.params.depth_buffer ));
+    freeTemporalBuffers(state);
+    CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.d_active_pixels )));
     CUDA_CHECK(cudaFree(reinterpret_cast<void *>( state.d_params )));
+    destroyTextures();
+    if (state.stream) CUDA_CHECK(cudaStreamDestroy(state.stream));
+    state.stream = 0;
+}
+
+
+//------------------------------------------------------------------------------
+//
+// CPU renderer
+//
+//------------------------------------------------------------------------------
+
+/*
+*   Host copy of everything the hit group records point to, for the CPU renderer. Materials
+*   get their textures in the same order as in createSBT().
+*/
+// Copies the materials like createSBT() packs them into hit group records
+void fillCpuMaterials(CpuScene &scene) {
+    scene.materials.clear();
+    int texture_id = 0;
+    for (int i = 0; i < MAT_COUNT; ++i) {
+        CpuMaterial material;
+        material.mat = d_mat_types[i];
+        material.emission_color = d_emission_colors[i];
+        material.diffuse_color = d_diffuse_colors[i];
+        material.specular_color = d_spec_colors[i];
+        material.spec_exp = d_spec_exp[i];
+        material.ior = d_ior[i];
+        if (d_mat_types[i] == TEXTURE && MODEL && !MODEL->textures.empty()) {
+            const Texture *texture = MODEL->textures[texture_id < static_cast<int>(MODEL->textures.size()) ? texture_id : 0];
+            material.texture.pixels = texture->pixel;
+            material.texture.width = texture->resolution.x;
+            material.texture.height = texture->resolution.y;
+            texture_id++;
+        }
+        scene.materials.push_back(material);
+    }
+}
+
+// Builds the BVHs of the meshes scene does not have yet and the instance BVH over all instances
+void buildCpuInstances(CpuScene &scene) {
+    for (size_t i = scene.meshes.size(); i < mesh_cache.size(); ++i) {
+        scene.meshes.push_back(CpuMesh());
+        CpuMesh &mesh = scene.meshes.back();
+        mesh.vertices = reinterpret_cast<const float4 *>(mesh_cache[i].vertices.data());
+        mesh.texcoords = mesh_cache[i].texcoords.data();
+        mesh.material_indices = mesh_cache[i].material_indices.data();
+        mesh.sphere = analytic_spheres && mesh_cache[i].key == "ICOSPHERE";
+        if (!mesh.sphere) mesh.bvh.build(mesh.vertices, mesh_cache[i].vertices.size() / 3);
+    }
+    scene.instances.clear();
+    std::vector<CpuInstance> instances;
+    for (const Instance &instance: scene_instances) {
+        if (!instance.visible) continue;
+        CpuMeshInstance mesh_instance;
+        mesh_instance.mesh = instance.mesh;
+        mesh_instance.materials = instance_bindings[instance.binding].materials.data();
+        scene.instances.push_back(mesh_instance);
+        CpuInstance cpu_instance;
+        memcpy(cpu_instance.transform, instance.transform, sizeof(instance.transform));
+        cpu_instance.bvh = scene.meshes[instance.mesh].sphere ? nullptr : &scene.meshes[instance.mesh].bvh;
+        instances.push_back(cpu_instance);
+    }
+    scene.instance_bvh.build(instances);
+}
+
+void buildCpuScene(CpuScene &scene) {
+    scene.vertices = reinterpret_cast<const float4 *>(d_vertices.data());
+    scene.texcoords = d_texcoords.size() >= d_vertices.size() ? d_texcoords.data() : nullptr;
+    scene.material_indices = d_material_indices.data();
+    fillCpuMaterials(scene);
+    const void *nodes, *triangles;
+    size_t node_bytes, triangle_bytes;
+    if (!prepared_cpu_bvh || !prepared_scene.find("cpu_bvh.nodes", nodes, node_bytes) ||
+        !prepared_scene.find("cpu_bvh.triangles", triangles, triangle_bytes) ||
+        !scene.bvh.load(nodes, node_bytes, triangles, triangle_bytes, d_vertices.size() / 3))
+        scene.bvh.build(scene.vertices, d_vertices.size() / 3);
+    prepared_cpu_bvh = false;
+    scene.meshes.clear();
+    buildCpuInstances(scene);
+}
+
+void initCpuFrame(CpuFrame &frame, int w, int h) {
+    const size_t num_pixels = static_cast<size_t>(w) * h;
+    frame.accum.assign(num_pixels, make_float4(0.f));
+    frame.albedo.assign(num_pixels, make_float4(0.f));
+    frame.normal.assign(num_pixels, make_float4(0.f));
+    frame.frame.assign(num_pixels, make_float4(0.f));
+    frame.moments.assign(num_pixels, make_float2(0.f));
+    frame.depth.assign(num_pixels, 0.f);
+    frame.light_tree.clear();
+    if (d_lights.size() > 1) frame.light_tree = buildLightTree(d_lights);
+
+    Params &params = frame.params;
+    params = Params();
+    params.accum_buffer = frame.accum.data();
+    params.moments_buffer = frame.moments.data();
+    params.albedo_buffer = frame.albedo.data();
+    params.normal_buffer = frame.normal.data();
+    params.depth_buffer = frame.depth.data();
+    params.frame_buffer = frame.frame.data();
+    params.width = w;
+    params.height = h;
+    params.samples_per_launch = samples_per_launch;
+    params.depth = depth;
+    params.lights = d_lights.data();
+    params.num_lights = d_lights.size();
+    params.light_tree = frame.light_tree.empty() ? nullptr : frame.light_tree.data();
+    camera.setAspectRatio(static_cast<float>(w) / static_cast<float>(h));
+    params.eye = camera.eye();
+    camera.UVWFrame(params.U, params.V, params.W);
 }
 
+/*
+*   CPU counterpart of commitSceneUpdates(): refits the scene BVH after area lights moved and
+*   rebuilds the instance BVH, which is cheap next to the mesh BVHs it points to
+*/
+void commitCpuSceneUpdates(CpuScene &scene, CpuFrame &frame) {
+    if (scene_updates.first_triangle >= 0) scene.bvh.refit(scene.vertices);
+    if (scene_updates.instances || scene_updates.instance_count || scene_updates.bindings)
+        buildCpuInstances(scene);
+    if (std::find(scene_updates.materials.begin(), scene_updates.materials.end(), true) !=
+        scene_updates.materials.end())
+        fillCpuMaterials(scene);
+    if (scene_updates.lights && d_lights.size() > 1) {
+        frame.light_tree = buildLightTree(d_lights);
+        frame.params.light_tree = frame.light_tree.data();
+    }
+    scene_updates = SceneUpdates();
+}
 
 //------------------------------------------------------------------------------
 //
@@ -1805,6 +3474,317 @@ void cleanupState(PathTracerState &state) {
 //
 //------------------------------------------------------------------------------
 
+/*
+*   Renders tiles of the loaded scene for coordinators on port, one connection after the
+*   other, until the process is killed. The coordinator has to run with the same scene and
+*   options.
+*/
+int runRenderWorker(uint16_t port) {
+    CpuScene scene;
+    buildCpuScene(scene);
+    CpuFrame shared;
+    initCpuFrame(shared, 1, 1);
+    const int listen_fd = listenTcp(port);
+    if (listen_fd < 0) {
+        std::cerr << "render worker: cannot listen on port " << port << std::endl;
+        return 1;
+    }
+    std::cout << "render worker listening on port " << port << std::endl;
+    TileWorker worker(scene, shared.params);
+    for (int fd = acceptTcp(listen_fd); fd >= 0; fd = acceptTcp(listen_fd)) {
+        std::cout << "render worker: coordinator connected" << std::endl;
+        if (!worker.serve(fd)) std::cout << "render worker: coordinator sent a broken message" << std::endl;
+    }
+    closeSocket(listen_fd);
+    return 1;
+}
+
+/*
+*   The render loop's subframes rendered by the --cluster-workers instead of the GPU. The
+*   coordinator renders the tiles of late and lost workers itself, the accumulated frame is
+*   uploaded into the output buffer that is displayed and streamed as usual. Adaptive
+*   sampling, the denoisers and temporal reuse need buffers the workers do not return.
+*/
+struct ClusterSession {
+    CpuScene scene;
+    CpuFrame frame;
+    // Declared last, it points into scene and into frame's light tree
+    std::unique_ptr<TileCoordinator> coordinator;
+};
+
+// False if no render worker could be reached
+bool startClusterSession(ClusterSession &cluster) {
+    buildCpuScene(cluster.scene);
+    initCpuFrame(cluster.frame, width, height);
+    cluster.frame.params.adaptive_threshold = 0.f;
+    cluster.coordinator.reset(new TileCoordinator(cluster.scene, cluster.frame.params));
+    for (const std::string &address: cluster_worker_addresses)
+        if (!cluster.coordinator->addWorker(address)) std::cout << "cannot reach render worker " << address << std::endl;
+    std::cout << "rendering on " << cluster.coordinator->numWorkers() << " render workers" << std::endl;
+    return cluster.coordinator->numWorkers() > 0;
+}
+
+void launchClusterSubframe(sutil::CUDAOutputBuffer<float4> &output_buffer, PathTracerState &state,
+                           ClusterSession &cluster) {
+    SUTIL_PROFILE_SCOPE("cluster");
+    CpuFrame &frame = cluster.frame;
+    Params &params = frame.params;
+    const size_t num_pixels = static_cast<size_t>(state.params.width) * state.params.height;
+    if (params.width != state.params.width || params.height != state.params.height) {
+        // The pixel buffers only, the coordinator keeps pointing at the light tree
+        frame.accum.assign(num_pixels, make_float4(0.f));
+        frame.moments.assign(num_pixels, make_float2(0.f));
+        frame.frame.assign(num_pixels, make_float4(0.f));
+        params.accum_buffer = frame.accum.data();
+        params.moments_buffer = frame.moments.data();
+        params.frame_buffer = frame.frame.data();
+        params.width = state.params.width;
+        params.height = state.params.height;
+    }
+    params.samples_per_launch = state.params.samples_per_launch;
+    params.depth = state.params.depth;
+    params.eye = state.params.eye;
+    params.U = state.params.U;
+    params.V = state.params.V;
+    params.W = state.params.W;
+    params.subframe_index = state.params.subframe_index;
+    if (!state.params.redraw_only) cluster.coordinator->launch(params);
+
+    CUDA_CHECK(cudaMemcpy(
+            reinterpret_cast<void *>(output_buffer.map()),
+            frame.frame.data(), num_pixels * sizeof(float4),
+            cudaMemcpyHostToDevice
+    ));
+    output_buffer.unmap();
+    state.frameID++;
+}
+
+/*
+*   Encodes buffer once as PPM and hands it to every streaming subscriber, to the MJPEG
+*   preview and, stripe coded, to the lossless viewers, the latter two only while they have
+*   viewers. Waits for none of them
+*/
+void streamFrame(const std::string &outfile, const sutil::ImageBuffer &buffer, FrameOutputs &outputs) {
+    std::vector<unsigned char> encoded;
+    sutil::encodeImage(outfile.c_str(), buffer, false, encoded);
+    if (encoded.empty()) return;
+    // The PPM pixels are the RGB24 rows behind its header
+    const size_t pixel_bytes = static_cast<size_t>(buffer.width) * buffer.height * 3;
+    const unsigned char *rgb = encoded.data() + encoded.size() - pixel_bytes;
+    if (outputs.mjpeg) outputs.mjpeg->submit(rgb, buffer.width, buffer.height);
+    if (outputs.lossless && outputs.lossless->numSubscribers() > 0) {
+        SUTIL_PROFILE_SCOPE("lossless");
+        std::vector<unsigned char> frame;
+        outputs.codec.encode(rgb, buffer.width, buffer.height, frame);
+        outputs.lossless->publish(std::move(frame));
+    }
+    outputs.ppm.publish(std::move(encoded));
+}
+
+RenderLoopMetrics::RenderLoopMetrics()
+        : frames(metrics.counter("pt_frames_total", "Subframes rendered")),
+          samples(metrics.counter("pt_samples_total", "Path samples traced")),
+          frame_seconds(metrics.histogram("pt_frame_seconds", "Time to render, display and stream a subframe",
+                                          exponentialBuckets(0.001, 2.0, 14))),
+          fps(metrics.gauge("pt_fps", "Subframes per second")),
+          samples_per_second(metrics.gauge("pt_samples_per_second", "Path samples per second")) {
+    Histogram &histogram = frame_seconds;
+    for (const char *quantile: {"0.5", "0.95", "0.99"}) {
+        const double q = atof(quantile);
+        metrics.gaugeCallback("pt_frame_latency_seconds", "Quantiles of pt_frame_seconds",
+                              std::string("quantile=\"") + quantile + "\"",
+                              [&histogram, q]() { return histogram.quantile(q); });
+    }
+}
+
+void RenderLoopMetrics::recordFrame(double seconds, uint64_t frame_samples) {
+    frames.add();
+    samples.add(frame_samples);
+    frame_seconds.observe(seconds);
+    const auto now = std::chrono::steady_clock::now();
+    const double interval = std::chrono::duration<double>(now - last_frame).count();
+    if (has_last_frame && interval > 0.0) {
+        const double weight = frames.value() > 2 ? METRICS_RATE_SMOOTHING : 1.0;
+        fps.set(fps.value() + weight * (1.0 / interval - fps.value()));
+        samples_per_second.set(samples_per_second.value() +
+                               weight * (frame_samples / interval - samples_per_second.value()));
+    }
+    last_frame = now;
+    has_last_frame = true;
+}
+
+/*
+*   Sets the time the scene load spent in stage to the time since start, returns the start
+*   of the next stage
+*/
+std::chrono::steady_clock::time_point recordLoadStage(const char *stage, std::chrono::steady_clock::time_point start) {
+    const auto now = std::chrono::steady_clock::now();
+    metrics.gauge("pt_scene_load_seconds", "Time the scene load spent per stage",
+                  std::string("stage=\"") + stage + "\"").set(std::chrono::duration<double>(now - start).count());
+    return now;
+}
+
+/*
+*   Memory in use and its high-water mark per subsystem and memory space from the memory
+*   accounting, the budgets that are set and the resident set size of the process, all read
+*   when scraped
+*/
+void registerMemoryMetrics() {
+    const MemoryAccounting &accounting = memoryAccounting();
+    for (int i = 0; i <= MEMORY_TOTAL; ++i) {
+        const MemoryTag tag = static_cast<MemoryTag>(i);
+        const std::string subsystem = std::string("subsystem=\"") + memoryTagName(tag) + "\"";
+        if (accounting.budget(tag) > 0)
+            metrics.gaugeCallback("pt_memory_budget_bytes", "Budget of a subsystem on the host and on the device each",
+                                  subsystem, [&accounting, tag]() { return static_cast<double>(accounting.budget(tag)); });
+        // The sum is left to the queries
+        if (tag == MEMORY_TOTAL) continue;
+        for (int j = 0; j < MEMORY_SPACE_COUNT; ++j) {
+            const MemorySpace space = static_cast<MemorySpace>(j);
+            const std::string labels = subsystem + ",space=\"" + memorySpaceName(space) + "\"";
+            metrics.gaugeCallback("pt_memory_bytes", "Memory in use by subsystem", labels, [&accounting, tag, space]() {
+                return static_cast<double>(accounting.current(tag, space));
+            });
+            metrics.gaugeCallback("pt_memory_peak_bytes", "High-water mark of pt_memory_bytes", labels,
+                                  [&accounting, tag, space]() {
+                                      return static_cast<double>(accounting.peak(tag, space));
+                                  });
+        }
+    }
+    metrics.gaugeCallback("pt_process_resident_bytes", "Resident set size of the process", "",
+                          []() { return static_cast<double>(processResidentBytes()); });
+}
+
+/*
+*   Subscribers, queued frames and frames dropped for slow subscribers of every stream output,
+*   labelled output="ppm", "mjpeg" or "lossless" and read when scraped
+*/
+void registerOutputMetrics(const FrameOutputs &outputs) {
+    const auto fanoutMetrics = [](const FrameFanout &fanout, const std::string &labels) {
+        metrics.gaugeCallback("pt_stream_subscribers", "Connected subscribers of a stream output", labels,
+                              [&fanout]() { return static_cast<double>(fanout.numSubscribers()); });
+        metrics.gaugeCallback("pt_stream_queued_frames", "Frames queued for the subscribers of a stream output",
+                              labels, [&fanout]() {
+            size_t queued = 0;
+            for (const SubscriberStats &stats: fanout.stats())
+                queued += stats.queued;
+            return static_cast<double>(queued);
+        });
+        metrics.counterCallback("pt_stream_dropped_frames_total", "Frames dropped for slow subscribers", labels,
+                                [&fanout]() { return static_cast<double>(fanout.framesDropped()); });
+    };
+    fanoutMetrics(outputs.ppm, "output=\"ppm\"");
+    if (outputs.lossless) fanoutMetrics(*outputs.lossless, "output=\"lossless\"");
+    if (outputs.mjpeg) {
+        const MjpegServer &mjpeg = *outputs.mjpeg;
+        const std::string labels = "output=\"mjpeg\"";
+        metrics.gaugeCallback("pt_stream_subscribers", "", labels,
+                              [&mjpeg]() { return static_cast<double>(mjpeg.numViewers()); });
+        metrics.gaugeCallback("pt_stream_queued_frames", "", labels, [&mjpeg]() {
+            size_t queued = 0;
+            for (const SubscriberStats &stats: mjpeg.viewerStats())
+                queued += stats.queued;
+            return static_cast<double>(queued);
+        });
+        metrics.counterCallback("pt_stream_dropped_frames_total", "", labels,
+                                [&mjpeg]() { return static_cast<double>(mjpeg.framesDropped()); });
+        metrics.gaugeCallback("pt_mjpeg_encode_seconds", "Time the last MJPEG frame took to encode", "",
+                              [&mjpeg]() { return mjpeg.stats().last_encode_ms / 1000.0; });
+    }
+}
+
+// The session scheduler and the viewers behind --serve on the metrics endpoint
+void registerServingMetrics(const SessionScheduler &scheduler, const SessionServer &viewers) {
+    metrics.gaugeCallback("pt_scheduler_queue_depth", "Quanta ready to run over all sessions", "", [&scheduler]() {
+        return static_cast<double>(scheduler.stats().queue_depth);
+    });
+    metrics.gaugeCallback("pt_scheduler_running", "Quanta being rendered", "", [&scheduler]() {
+        return static_cast<double>(scheduler.stats().running);
+    });
+    metrics.counterCallback("pt_scheduler_late_quanta_total",
+                            "Quanta run first for a session past its latency target", "", [&scheduler]() {
+                                return static_cast<double>(scheduler.stats().late_quanta);
+                            });
+    metrics.gaugeCallback("pt_session_viewers", "Connected viewers of render sessions", "", [&viewers]() {
+        return static_cast<double>(viewers.numViewers());
+    });
+    metrics.counterCallback("pt_session_dropped_frames_total", "Session frames dropped for slow viewers", "",
+                            [&viewers]() { return static_cast<double>(viewers.framesDropped()); });
+}
+
+/*
+*   Serves render sessions of the loaded scene to viewers connecting on port until the
+*   process is killed, every one rendered on the host from the scene's view at the scene's
+*   size, capped to SESSION_MAX_WIDTH columns. A SessionScheduler shares the threads
+*   between the sessions, with --metrics-port its queue and every session's frame rate
+*   are served as metrics.
+*/
+int runSessionServer(uint16_t port) {
+    CpuScene scene;
+    buildCpuScene(scene);
+    CpuFrame shared;
+    initCpuFrame(shared, 1, 1);
+    const int w = std::min(width, SESSION_MAX_WIDTH);
+    const int h = std::max(1, height * w / std::max(1, width));
+    RenderServer server(scene, shared.params);
+    SessionScheduler scheduler(server);
+    SessionServer viewers(server, w, h, camera);
+    std::unique_ptr<MetricsServer> metrics_server;
+    if (metrics_port > 0) {
+        registerMemoryMetrics();
+        registerServingMetrics(scheduler, viewers);
+        viewers.setMetrics(metrics);
+        metrics_server.reset(new MetricsServer(metrics));
+        if (!metrics_server->listen(static_cast<uint16_t>(metrics_port))) {
+            std::cout << "cannot serve metrics on port " << metrics_port << std::endl;
+            metrics_server.reset();
+        }
+    }
+    if (!viewers.listen(port)) {
+        std::cerr << "cannot serve render sessions on port " << port << std::endl;
+        return 1;
+    }
+    std::cout << "serving " << w << "x" << h << " render sessions on port " << port << std::endl;
+    scheduler.start();
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(FANOUT_STATS_INTERVAL));
+        const SchedulerStats stats = scheduler.stats();
+        std::cout << std::fixed << std::setprecision(1) << viewers.numViewers() << " viewers, " << stats.quanta
+                  << " quanta, " << stats.queue_depth << " queued, fps";
+        for (const SessionShare &session: stats.sessions)
+            std::cout << " " << session.id << ":" << session.recent_fps;
+        std::cout << std::endl;
+    }
+}
+
+/*
+*   Prints one line per subscriber of fanout
+*/
+void printFanoutStats(const FrameFanout &fanout) {
+    for (const SubscriberStats &stats: fanout.stats()) {
+        std::cout << std::fixed << std::setprecision(2) << "  " << stats.name << ": " << stats.frames_sent
+                  << " frames sent, " << stats.frames_dropped << " dropped, " << stats.queued << " queued, "
+                  << stats.lag_frames << " behind, latency " << stats.last_latency_ms << " ms (max "
+                  << stats.max_latency_ms << " ms), " << stats.bytes_sent / (1024.0 * 1024.0) << " MB" << std::endl;
+    }
+}
+
+void printLosslessStats(const LosslessFrameStats &frame) {
+    std::cout << std::fixed << std::setprecision(2) << "  lossless: " << frame.raw_bytes / 1024.0 << " KB to "
+              << frame.encoded_bytes / 1024.0 << " KB, ratio " << frame.ratio() << ", " << frame.encode_ms << " ms, "
+              << frame.megabytesPerSecond() << " MB/s on " << frame.stripes << " stripes" << std::endl;
+}
+
+void printMjpegStats(const MjpegServer &mjpeg) {
+    const MjpegStats stats = mjpeg.stats();
+    std::cout << std::fixed << std::setprecision(2) << "  mjpeg: " << mjpeg.numViewers() << " viewers, "
+              << stats.frames_encoded << " frames encoded, " << stats.frames_replaced << " replaced, last "
+              << stats.last_encode_ms << " ms and " << stats.last_frame_bytes / 1024.0 << " KB" << std::endl;
+    for (const SubscriberStats &viewer: mjpeg.viewerStats())
+        std::cout << "  " << viewer.name << ": " << viewer.frames_sent << " frames sent, " << viewer.frames_dropped
+                  << " dropped, " << viewer.lag_frames << " behind" << std::endl;
+}
+
 int main(int argc, char *argv[]) {
 //    my_init_code();
     PathTracerState state;
@@ -1816,14 +3796,33 @@ int main(int argc, char *argv[]) {
     //
     std::string outfile;
     std::string scene_file;
+    int bench_shadow_points = 0;
+    int bench_light_points = 0;
+    int bench_temporal_frames = 0;
+    int bench_parse_lines = 0;
+    int bench_work_distribution_subframes = 0;
+    int bench_delta_count = 0;
+    int bench_session_count = 0;
+    double bench_fairness_seconds = 0.0;
+    int bench_cluster_workers = 0;
+    int bench_fanout_viewers = 0;
+    int bench_mjpeg_frames = 0;
+    int bench_lossless_frames = 0;
+    int bench_metrics_frames = 0;
+    bool bench_memory = false;
+    bool bench_camera_path = false;
+    std::string replay_camera_file;
+    int render_worker_port = 0;
+    int serve_port = 0;
+    std::vector<std::string> bench_denoiser_files;
+    std::string bench_scene_file;
+    std::string bench_out_file = "ptbench.jsonl";
+    std::string golden_scene_file;
+    GoldenMode golden_mode = GOLDEN_COMPARE;
 
-    FILE * ffmpeg_file = popen("ffmpeg -y -pixel_format rgb24 -r 60 -i - -pix_fmt yuv420p -f flv rtmp://rtmp_server:1935/live/stream1", "w");
-    if ( !ffmpeg_file ) {
-        std::cout << "popen error" << std::endl;
-        exit(1);
-    }
     for (int i = 1; i < argc; ++i) {
         const std::string arg = argv[i];
+        const char *value;
         if (arg == "--help" || arg == "-h") {
             printUsageAndExit(argv[0]);
         } else if (arg == "--no-gl-interop") {
@@ -1836,16 +3835,146 @@ int main(int argc, char *argv[]) {
             if (i >= argc - 1)
                 printUsageAndExit(argv[0]);
             scene_file = argv[++i];
-        } else if (arg.substr(0, 6) == "--dim=") {
-            const std::string dims_arg = arg.substr(6);
-            int w, h;
-            sutil::parseDimensions(dims_arg.c_str(), w, h);
-            state.params.width = w;
-            state.params.height = h;
+        } else if (matchOption(arg, "--dim", &value)) {
+            const std::string dims = stringOption(argv[0], arg, value);
+            const size_t x = dims.find('x');
+            if (x == std::string::npos) badOptionValue(argv[0], arg);
+            state.params.width = intOption(argv[0], arg, dims.substr(0, x).c_str(), 1, 1 << 16);
+            state.params.height = intOption(argv[0], arg, dims.substr(x + 1).c_str(), 1, 1 << 16);
+        } else if (matchOption(arg, "--adaptive-min", &value)) {
+            adaptive_min_samples = intOption(argv[0], arg, value, 1, INT_MAX);
+        } else if (matchOption(arg, "--adaptive", &value)) {
+            adaptive_threshold = static_cast<float>(doubleOption(argv[0], arg, value, 0.0));
+        } else if (matchOption(arg, "--max-subframes", &value)) {
+            max_subframes = intOption(argv[0], arg, value, 0, INT_MAX);
+        } else if (matchOption(arg, "--keepalive", &value)) {
+            keepalive_interval = doubleOption(argv[0], arg, value, 0.0);
+        } else if (matchOption(arg, "--denoiser", &value)) {
+            const std::string type = stringOption(argv[0], arg, value);
+            if (type == "optix") {
+                denoiser_type = DENOISER_OPTIX;
+            } else if (type == "atrous") {
+                denoiser_type = DENOISER_ATROUS;
+            } else if (type == "none") {
+                denoiser_type = DENOISER_NONE;
+            } else {
+                std::cerr << "Unknown denoiser '" << type << "'\n";
+                printUsageAndExit(argv[0]);
+            }
+        } else if (arg == "--bench-denoiser") {
+            if (i >= argc - 2)
+                printUsageAndExit(argv[0]);
+            bench_denoiser_files.push_back(argv[++i]);
+            bench_denoiser_files.push_back(argv[++i]);
+            if (i < argc - 2 && argv[i + 1][0] != '-' && argv[i + 2][0] != '-') {
+                bench_denoiser_files.push_back(argv[++i]);
+                bench_denoiser_files.push_back(argv[++i]);
+            }
+        } else if (arg == "--bench") {
+            if (i >= argc - 1)
+                printUsageAndExit(argv[0]);
+            bench_scene_file = argv[++i];
+        } else if (matchOption(arg, "--bench-out", &value)) {
+            bench_out_file = stringOption(argv[0], arg, value);
+        } else if (matchOption(arg, "--bench-subframes", &value)) {
+            bench_subframes = intOption(argv[0], arg, value, 1, INT_MAX);
+        } else if (matchOption(arg, "--bench-width", &value)) {
+            bench_width = intOption(argv[0], arg, value, 0, 1 << 16);
+        } else if (arg == "--golden") {
+            if (i >= argc - 1)
+                printUsageAndExit(argv[0]);
+            golden_scene_file = argv[++i];
+        } else if (arg == "--golden-update") {
+            golden_mode = GOLDEN_UPDATE;
+        } else if (arg == "--golden-bootstrap") {
+            golden_mode = GOLDEN_BOOTSTRAP;
+        } else if (matchOption(arg, "--backend", &value)) {
+            const std::string type = stringOption(argv[0], arg, value);
+            if (type == "auto") {
+                bench_backend = BENCH_BACKEND_AUTO;
+            } else if (type == "gpu") {
+                bench_backend = BENCH_BACKEND_GPU;
+            } else if (type == "cpu") {
+                bench_backend = BENCH_BACKEND_CPU;
+            } else {
+                std::cerr << "Unknown backend '" << type << "'\n";
+                printUsageAndExit(argv[0]);
+            }
+        } else if (matchOption(arg, "--prepared", &value)) {
+            prepared_scene_file = stringOption(argv[0], arg, value);
+        } else if (matchOption(arg, "--icosphere-level", &value)) {
+            icosphere_level = intOption(argv[0], arg, value, 0, MAX_ICOSPHERE_LEVEL);
+        } else if (arg == "--analytic-spheres") {
+            analytic_spheres = true;
+        } else if (matchOption(arg, "--profile", &value)) {
+            profile_file = value ? stringOption(argv[0], arg, value) : "trace.json";
+            sutil::Profiler::instance().setEnabled(true);
+        } else if (arg == "--temporal") {
+            temporal_enabled = true;
+        } else if (matchOption(arg, "--bench-temporal", &value)) {
+            bench_temporal_frames = value ? intOption(argv[0], arg, value, 1, INT_MAX) : 60;
+        } else if (matchOption(arg, "--bench-sessions", &value)) {
+            bench_session_count = value ? intOption(argv[0], arg, value, 1, INT_MAX) : 8;
+        } else if (matchOption(arg, "--bench-fairness", &value)) {
+            bench_fairness_seconds = value ? doubleOption(argv[0], arg, value, std::numeric_limits<double>::min()) : 2.0;
+        } else if (matchOption(arg, "--serve", &value)) {
+            serve_port = value ? intOption(argv[0], arg, value, 1, 65535) : SESSION_SERVER_PORT;
+        } else if (matchOption(arg, "--render-worker", &value)) {
+            render_worker_port = value ? intOption(argv[0], arg, value, 1, 65535) : TILE_CLUSTER_PORT;
+        } else if (matchOption(arg, "--bench-cluster", &value)) {
+            bench_cluster_workers = value ? intOption(argv[0], arg, value, 1, INT_MAX) : 3;
+        } else if (matchOption(arg, "--cluster-workers", &value)) {
+            std::stringstream list(stringOption(argv[0], arg, value));
+            std::string address;
+            while (std::getline(list, address, ','))
+                if (!address.empty()) cluster_worker_addresses.push_back(address);
+        } else if (matchOption(arg, "--fanout-port", &value)) {
+            fanout_port = intOption(argv[0], arg, value, 0, 65535);
+        } else if (matchOption(arg, "--bench-fanout", &value)) {
+            bench_fanout_viewers = value ? intOption(argv[0], arg, value, 1, INT_MAX) : 4;
+        } else if (matchOption(arg, "--mjpeg-port", &value)) {
+            mjpeg_port = value ? intOption(argv[0], arg, value, 0, 65535) : MJPEG_PORT;
+        } else if (matchOption(arg, "--bench-mjpeg", &value)) {
+            bench_mjpeg_frames = value ? intOption(argv[0], arg, value, 1, INT_MAX) : 30;
+        } else if (matchOption(arg, "--lossless-port", &value)) {
+            lossless_port = value ? intOption(argv[0], arg, value, 0, 65535) : LOSSLESS_PORT;
+        } else if (matchOption(arg, "--bench-lossless", &value)) {
+            bench_lossless_frames = value ? intOption(argv[0], arg, value, 1, INT_MAX) : 8;
+        } else if (matchOption(arg, "--metrics-port", &value)) {
+            metrics_port = value ? intOption(argv[0], arg, value, 0, 65535) : METRICS_PORT;
+        } else if (matchOption(arg, "--bench-metrics", &value)) {
+            bench_metrics_frames = value ? intOption(argv[0], arg, value, 1, INT_MAX) : 16;
+        } else if (matchOption(arg, "--memory-budget", &value)) {
+            const std::string budgets = stringOption(argv[0], arg, value);
+            if (!parseMemoryBudgets(budgets, memoryAccounting())) {
+                std::cerr << "Bad memory budget '" << budgets << "'\n";
+                printUsageAndExit(argv[0]);
+            }
+        } else if (arg == "--bench-memory") {
+            bench_memory = true;
+        } else if (matchOption(arg, "--record-camera", &value)) {
+            camera_record_file = stringOption(argv[0], arg, value);
+        } else if (matchOption(arg, "--replay-camera", &value)) {
+            replay_camera_file = stringOption(argv[0], arg, value);
+        } else if (matchOption(arg, "--replay-fps", &value)) {
+            replay_fps = doubleOption(argv[0], arg, value, std::numeric_limits<double>::min());
+        } else if (arg == "--bench-camera-path") {
+            bench_camera_path = true;
+        } else if (matchOption(arg, "--bench-deltas", &value)) {
+            bench_delta_count = value ? intOption(argv[0], arg, value, 1, INT_MAX) : 4096;
+        } else if (matchOption(arg, "--bench-work-distribution", &value)) {
+            bench_work_distribution_subframes = value ? intOption(argv[0], arg, value, 1, INT_MAX) : 60;
+        } else if (matchOption(arg, "--bench-parse", &value)) {
+            bench_parse_lines = value ? intOption(argv[0], arg, value, 1, INT_MAX) : 100000;
+        } else if (matchOption(arg, "--bench-shadow", &value)) {
+            bench_shadow_points = value ? intOption(argv[0], arg, value, 1, INT_MAX) : 256 * 256;
+        } else if (matchOption(arg, "--bench-lights", &value)) {
+            bench_light_points = value ? intOption(argv[0], arg, value, 1, INT_MAX) : 128 * 128;
         } else if (arg == "--launch-samples" || arg == "-s") {
             if (i >= argc - 1)
                 printUsageAndExit(argv[0]);
-            samples_per_launch = atoi(argv[++i]);
+            const std::string count = argv[++i];
+            samples_per_launch = intOption(argv[0], arg, count.c_str(), 1, INT_MAX);
         } else {
             std::cerr << "Unknown option '" << argv[i] << "'\n";
             printUsageAndExit(argv[0]);
@@ -1863,29 +3992,139 @@ int main(int argc, char *argv[]) {
     Py_Finalize();*/
 
     try {
+        if (!bench_denoiser_files.empty()) {
+            return benchmarkDenoiser(bench_denoiser_files) ? 0 : 1;
+        }
+        if (!bench_scene_file.empty()) {
+            return benchmarkScene(bench_scene_file, bench_out_file) ? 0 : 1;
+        }
+        if (bench_parse_lines > 0) {
+            return benchmarkSceneParser(bench_parse_lines) ? 0 : 1;
+        }
+        if (bench_work_distribution_subframes > 0) {
+            return benchmarkWorkDistribution(bench_work_distribution_subframes) ? 0 : 1;
+        }
+        if (!golden_scene_file.empty()) {
+            return checkGoldenImage(golden_scene_file, golden_mode) ? 0 : 1;
+        }
+
         // Set up the scene
-        readSceneFile(scene_file);
+        auto load_stage_start = std::chrono::steady_clock::now();
+        loadScene(scene_file);
+        load_stage_start = recordLoadStage("scene", load_stage_start);
         prev_lookat = camera.lookat();
+        if (bench_shadow_points > 0) {
+            return benchmarkShadowRays(bench_shadow_points) ? 0 : 1;
+        }
+        if (bench_light_points > 0) {
+            return benchmarkLightSampling(bench_light_points) ? 0 : 1;
+        }
+        if (bench_temporal_frames > 0) {
+            return benchmarkTemporal(bench_temporal_frames) ? 0 : 1;
+        }
+        if (bench_delta_count > 0) {
+            return benchmarkSceneUpdates(bench_delta_count) ? 0 : 1;
+        }
+        if (bench_session_count > 0) {
+            return benchmarkSessions(bench_session_count) ? 0 : 1;
+        }
+        if (bench_fairness_seconds > 0.0) {
+            return benchmarkFairness(bench_fairness_seconds) ? 0 : 1;
+        }
+        if (serve_port > 0) {
+            return runSessionServer(static_cast<uint16_t>(serve_port));
+        }
+        if (render_worker_port > 0) {
+            return runRenderWorker(static_cast<uint16_t>(render_worker_port));
+        }
+        if (bench_cluster_workers > 0) {
+            return benchmarkCluster(bench_cluster_workers) ? 0 : 1;
+        }
+        if (bench_fanout_viewers > 0) {
+            return benchmarkFanout(bench_fanout_viewers) ? 0 : 1;
+        }
+        if (bench_mjpeg_frames > 0) {
+            return benchmarkMjpeg(bench_mjpeg_frames) ? 0 : 1;
+        }
+        if (bench_lossless_frames > 0) {
+            return benchmarkLossless(bench_lossless_frames) ? 0 : 1;
+        }
+        if (bench_metrics_frames > 0) {
+            return benchmarkMetrics(bench_metrics_frames) ? 0 : 1;
+        }
+        if (bench_memory) {
+            return benchmarkMemory() ? 0 : 1;
+        }
+        if (!replay_camera_file.empty()) {
+            return replayCameraPath(replay_camera_file, scene_file, bench_out_file) ? 0 : 1;
+        }
+        if (bench_camera_path) {
+            return benchmarkCameraPath() ? 0 : 1;
+        }
         state.params.width = width;
         state.params.height = height;
-        state.params.denoiser = 1;
+        state.params.denoiser = denoiser_type != DENOISER_NONE ? 1u : 0u;
 
         //
         // Set up OptiX state
         //
         createContext(state);
+        load_stage_start = recordLoadStage("context", load_stage_start);
         buildMeshAccel(state);
+        load_stage_start = recordLoadStage("acceleration", load_stage_start);
         createModule(state);
         createProgramGroups(state);
         createPipeline(state);
+        load_stage_start = recordLoadStage("pipeline", load_stage_start);
         if (MODEL && !MODEL->textures.empty()) {
             createTextures();
         }
+        load_stage_start = recordLoadStage("textures", load_stage_start);
         createSBT(state);
         initLaunchParams(state);
+        recordLoadStage("launch_params", load_stage_start);
+        memoryAccounting().report(std::cout);
+        if (prepared_scene_stale) savePreparedScene(prepared_scene_file, &state, nullptr);
 
 
         if (outfile.empty()) {
+            // Only the interactive mode streams, the benchmarks above run without ffmpeg
+            FILE * ffmpeg_file = popen("ffmpeg -y -pixel_format rgb24 -r 60 -i - -pix_fmt yuv420p -f flv rtmp://rtmp_server:1935/live/stream1", "w");
+            if ( !ffmpeg_file ) {
+                std::cout << "popen error" << std::endl;
+                exit(1);
+            }
+            // A subscriber whose pipe closed is dropped instead of ending the process
+            signal(SIGPIPE, SIG_IGN);
+            FrameOutputs outputs;
+            outputs.ppm.subscribe(fileno(ffmpeg_file), "ffmpeg");
+            if (fanout_port > 0 && !outputs.ppm.listen(static_cast<uint16_t>(fanout_port)))
+                std::cout << "cannot listen for viewers on port " << fanout_port << std::endl;
+            if (mjpeg_port > 0) {
+                outputs.mjpeg.reset(new MjpegServer());
+                if (!outputs.mjpeg->listen(static_cast<uint16_t>(mjpeg_port))) {
+                    std::cout << "cannot serve the MJPEG preview on port " << mjpeg_port << std::endl;
+                    outputs.mjpeg.reset();
+                }
+            }
+            if (lossless_port > 0) {
+                outputs.lossless.reset(new FrameFanout());
+                if (!outputs.lossless->listen(static_cast<uint16_t>(lossless_port))) {
+                    std::cout << "cannot listen for lossless viewers on port " << lossless_port << std::endl;
+                    outputs.lossless.reset();
+                }
+            }
+            // Declared after the outputs, it stops serving before the outputs it reads go away
+            std::unique_ptr<MetricsServer> metrics_server;
+            if (metrics_port > 0) {
+                registerMemoryMetrics();
+                registerOutputMetrics(outputs);
+                metrics_server.reset(new MetricsServer(metrics));
+                if (!metrics_server->listen(static_cast<uint16_t>(metrics_port))) {
+                    std::cout << "cannot serve metrics on port " << metrics_port << std::endl;
+                    metrics_server.reset();
+                }
+            }
             GLFWwindow *window = sutil::initUI("optixPathTracer", state.params.width, state.params.height);
             glfwSetMouseButtonCallback(window, mouseButtonCallback);
             glfwSetCursorPosCallback(window, cursorPosCallback);
@@ -1897,6 +4136,15 @@ int main(int argc, char *argv[]) {
 
             outfile = "../../frames/output.ppm";
 
+            std::unique_ptr<ClusterSession> cluster;
+            if (!cluster_worker_addresses.empty()) {
+                cluster.reset(new ClusterSession());
+                if (!startClusterSession(*cluster)) {
+                    std::cout << "no render worker reachable, rendering on the GPU" << std::endl;
+                    cluster.reset();
+                }
+            }
+
             //
             // Render loop
             //
@@ -1935,6 +4183,10 @@ int main(int argc, char *argv[]) {
                 std::chrono::duration<double> render_time(0.0);
                 std::chrono::duration<double> display_time(0.0);
                 std::chrono::duration<double> save_time(0.0);
+                auto last_send_time = std::chrono::steady_clock::now();
+                auto last_fanout_stats_time = last_send_time;
+                RenderLoopMetrics loop_metrics;
+                if (!camera_record_file.empty()) camera_recorder.start();
                 do {
                     float3 curr_lookat = readCameraFile(scene_file);
                     float3 diff = curr_lookat - prev_lookat;
@@ -1947,13 +4199,57 @@ int main(int argc, char *argv[]) {
                     }
 
                     auto t0 = std::chrono::steady_clock::now();
-                    glfwPollEvents();
+                    // Sleep until input arrives while idle, the timeout keeps the camera file polled
+                    if (isIdle(state))
+                        glfwWaitEventsTimeout(IDLE_POLL_INTERVAL);
+                    else
+                        glfwPollEvents();
 
+                    camera_recorder.recordCamera(currentCameraState());
                     updateState(output_buffer, state);
                     auto t1 = std::chrono::steady_clock::now();
+                    if (saveRequestedAovs) {
+                        saveRequestedAovs = false;
+                        saveAovs(state, "../../frames/aov");
+                    }
+                    if (saveRequestedProfile) {
+                        saveRequestedProfile = false;
+                        writeProfile();
+                    }
+                    if (memoryReportRequested) {
+                        memoryReportRequested = false;
+                        memoryAccounting().report(std::cout);
+                    }
+                    if (sceneReloadRequested) {
+                        sceneReloadRequested = false;
+                        if (cluster)
+                            std::cout << "scene edits do not reach render workers, restart them with the edited scene"
+                                      << std::endl;
+                        else
+                            reloadSceneFile(scene_file);
+                    }
+                    // Committed before the idle check, an edit wakes a finished frame up
+                    if (scene_updates.pending()) {
+                        commitSceneUpdates(state);
+                        accountHostGeometry();
+                        state.params.subframe_index = 0;
+                        state.converged = false;
+                    }
+                    if (isIdle(state)) {
+                        if (keepalive_interval > 0.0 && buffer.data &&
+                            std::chrono::duration<double>(t1 - last_send_time).count() >= keepalive_interval) {
+                            streamFrame(outfile, buffer, outputs);
+                            last_send_time = t1;
+                        }
+                        continue;
+                    }
+                    sutil::ScopedTimer frame_timer("frame");
+                    const auto frame_start = std::chrono::steady_clock::now();
+                    // A redraw of a finished frame shows its display settings without adding samples
+                    state.params.redraw_only = isFinished(state) ? 1u : 0u;
+                    state.redraw = false;
                     state_update_time += t1 - t0;
                     t0 = t1;
-                    state.params.denoiser = denoiser_enabled ? 1 : 0;
 //                    if (saveRequestedQuarter) { // D key
 //                        // row 1
 //                        timer().startCpuTimer();
@@ -1978,9 +4274,23 @@ int main(int argc, char *argv[]) {
                     t1 = std::chrono::steady_clock::now();
                     save_time += t1 - t0;
                     t0 = t1;
-                    launchSubframe(output_buffer, state);
-                    if (state.params.denoiser) {
-                        launchDenoisedBuffer(denoised_output_buffer, state);
+                    // With adaptive sampling only the pixels still active after the last launch get samples
+                    const uint64_t sampled_pixels = state.params.redraw_only ? 0
+                                                    : !cluster && state.params.active_pixels &&
+                                                      state.params.subframe_index > 0
+                                                    ? state.active_pixels
+                                                    : static_cast<uint64_t>(state.params.width) * state.params.height;
+                    if (cluster)
+                        launchClusterSubframe(output_buffer, state, *cluster);
+                    else
+                        launchSubframe(output_buffer, state);
+                    if (!cluster && temporal_enabled && !state.params.show_convergence)
+                        resolveTemporal(output_buffer, state);
+                    if (!cluster && state.params.denoiser) {
+                        if (denoiser_type == DENOISER_ATROUS)
+                            launchAtrousDenoiser(output_buffer, denoised_output_buffer, state);
+                        else
+                            launchDenoisedBuffer(denoised_output_buffer, state);
                         t1 = std::chrono::steady_clock::now();
                         render_time += t1 - t0;
                         t0 = t1;
@@ -1999,7 +4309,18 @@ int main(int argc, char *argv[]) {
                         buffer.height = output_buffer.height();
                         buffer.pixel_format = sutil::BufferImageFormat::FLOAT4;
                     }
-                    sutil::sendImage(outfile.c_str(), buffer, false, python_sock, ffmpeg_file);
+                    streamFrame(outfile, buffer, outputs);
+                    last_send_time = std::chrono::steady_clock::now();
+                    if (std::chrono::duration<double>(last_send_time - last_fanout_stats_time).count() >=
+                        FANOUT_STATS_INTERVAL) {
+                        printFanoutStats(outputs.ppm);
+                        if (outputs.mjpeg) printMjpegStats(*outputs.mjpeg);
+                        if (outputs.lossless && outputs.lossless->numSubscribers() > 0) {
+                            printFanoutStats(*outputs.lossless);
+                            printLosslessStats(outputs.codec.lastFrame());
+                        }
+                        last_fanout_stats_time = last_send_time;
+                    }
 
                     t1 = std::chrono::steady_clock::now();
                     display_time += t1 - t0;
@@ -2007,20 +4328,24 @@ int main(int argc, char *argv[]) {
                     sutil::displayStats(state_update_time, render_time, display_time, save_time);
 
                     glfwSwapBuffers(window);
+                    frame_timer.stop();
+                    loop_metrics.recordFrame(
+                            std::chrono::duration<double>(std::chrono::steady_clock::now() - frame_start).count(),
+                            sampled_pixels * state.params.samples_per_launch);
 
-                    ++state.params.subframe_index;
-                    /*if (scene_changed) {
-                        scene_changed = false;
-                        scene_file = new_scene_file;
-                        readSceneFile(scene_file);
-                        prev_lookat = camera.lookat();
-                        if (MODEL && !MODEL->textures.empty()) {
-                            createTextures();
-                        }
-                    }*/
+                    if (!state.params.redraw_only)
+                        ++state.params.subframe_index;
                 } while (!glfwWindowShouldClose(window));
                 CUDA_SYNC_CHECK();
             }
+            if (camera_recorder.recording()) {
+                const CameraPath &path = camera_recorder.path();
+                if (path.save(camera_record_file))
+                    std::cout << "Wrote " << path.keyframes().size() << " camera keyframes and " << path.events().size()
+                              << " input events to " << camera_record_file << std::endl;
+                else
+                    std::cout << "cannot write the camera path to " << camera_record_file << std::endl;
+            }
 
             sutil::cleanupUI(window);
         } else {
@@ -2053,6 +4378,7 @@ int main(int argc, char *argv[]) {
         }
 
         cleanupState(state);
+        writeProfile();
     }
     catch (std::exception &e) {
         std::cerr << "Caught exception: " << e.what() << "\n";
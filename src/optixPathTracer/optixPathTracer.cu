@@ -28,6 +28,7 @@
 #include <optix.h>
 
 #include "optixPathTracer.h"
+#include "light_sampling.h"
 #include "random.h"
 
 #include <sutil/vec_math.h>
@@ -56,6 +57,9 @@ struct RadiancePRD
     float3       attenuation;
     float3       origin;
     float3       direction;
+    float3       albedo;        // of the first surface hit, for the denoiser guide layers
+    float3       normal;
+    float        depth;
     unsigned int seed;
     int          countEmitted;
     int          done;
@@ -275,7 +279,9 @@ static __forceinline__ __device__ bool traceOcclusion(
         float                  tmax
         )
 {
-    unsigned int occluded = 0u;
+    // Only a boolean is needed: assume the ray is blocked and let the miss program clear
+    // the flag, so no closest hit program has to run for any intersection.
+    unsigned int occluded = 1u;
     optixTrace(
             handle,
             ray_origin,
@@ -284,7 +290,7 @@ static __forceinline__ __device__ bool traceOcclusion(
             tmax,
             0.0f,                    // rayTime
             OptixVisibilityMask( 1 ),
-            OPTIX_RAY_FLAG_TERMINATE_ON_FIRST_HIT,
+            OPTIX_RAY_FLAG_TERMINATE_ON_FIRST_HIT | OPTIX_RAY_FLAG_DISABLE_CLOSESTHIT | OPTIX_RAY_FLAG_DISABLE_ANYHIT,
             RAY_TYPE_OCCLUSION,      // SBT offset
             RAY_TYPE_COUNT,          // SBT stride
             RAY_TYPE_OCCLUSION,      // missSBTIndex
@@ -293,6 +299,34 @@ static __forceinline__ __device__ bool traceOcclusion(
 }
 
 
+static __forceinline__ __device__ float luminance( const float3& c )
+{
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+
+/*
+    Relative standard error of a pixel's accumulated mean, estimated from the spread of the
+    per-launch means. Dark pixels are measured against a floor so they can converge too.
+*/
+static __forceinline__ __device__ float pixelError( const float2& moments, const float launches )
+{
+    const float variance = fmaxf( moments.y - moments.x * moments.x, 0.0f );
+    return sqrtf( variance / launches ) / fmaxf( moments.x, 0.01f );
+}
+
+
+static __forceinline__ __device__ float4 heatmapColor( const float t )
+{
+    // Blue (converged) over green to red (far above the threshold)
+    const float x = clamp( t, 0.0f, 2.0f ) * 0.5f;
+    return make_float4( clamp( 2.0f * x - 0.5f, 0.0f, 1.0f ),
+                        clamp( 1.5f - fabsf( 4.0f * x - 2.0f ), 0.0f, 1.0f ),
+                        clamp( 1.5f - 2.0f * x, 0.0f, 1.0f ) * 0.8f,
+                        1.0f );
+}
+
+
 //------------------------------------------------------------------------------
 //
 //
@@ -309,10 +343,28 @@ extern "C" __global__ void __raygen__rg()
     const float3 W   = params.W;
     const uint3  idx = optixGetLaunchIndex();
     const int    subframe_index = params.subframe_index;
+    const unsigned int image_index = idx.y * params.width + idx.x;
+
+    // A pixel that has converged keeps its accumulated value until the next reset, a redraw keeps all of them
+    const float4 accum_prev   = subframe_index > 0 ? params.accum_buffer[ image_index ] : make_float4( 0.0f );
+    const float2 moments_prev = subframe_index > 0 ? params.moments_buffer[ image_index ] : make_float2( 0.0f );
+    const float  launches     = accum_prev.w;
+    const float  threshold    = params.adaptive_threshold > 0.0f ? params.adaptive_threshold : 0.01f;
+    if( params.redraw_only || ( params.adaptive_threshold > 0.0f && launches >= params.adaptive_min_samples
+        && pixelError( moments_prev, launches ) < threshold ) )
+    {
+        params.frame_buffer[ image_index ] = params.show_convergence
+                ? heatmapColor( pixelError( moments_prev, launches ) / threshold )
+                : make_color_float4( make_float3( accum_prev ) );
+        return;
+    }
 
     unsigned int seed = tea<4>( idx.y*w + idx.x, subframe_index );
 
     float3 result = make_float3( 0.0f );
+    float3 albedo = make_float3( 0.0f );
+    float3 normal = make_float3( 0.0f );
+    float  first_depth = 0.0f;
     int i = params.samples_per_launch;
     do
     {
@@ -334,6 +386,9 @@ extern "C" __global__ void __raygen__rg()
         prd.done         = false;
         prd.seed         = seed;
         prd.hitLight     = false;
+        prd.albedo       = make_float3(0.f);
+        prd.normal       = make_float3(0.f);
+        prd.depth        = 0.f;
 
         int depth = 0;
         for( ;; )
@@ -346,6 +401,14 @@ extern "C" __global__ void __raygen__rg()
                     1e16f,  // tmax
                     &prd );
 
+            if( depth == 0 )
+            {
+                albedo += prd.albedo;
+                normal += prd.normal;
+                if( i == params.samples_per_launch )
+                    first_depth = prd.depth;
+            }
+
             result += prd.emitted;
             result += prd.radiance * prd.attenuation;
 
@@ -387,19 +450,39 @@ extern "C" __global__ void __raygen__rg()
     }
     while( --i );
 
-    const uint3    launch_index = optixGetLaunchIndex();
-    const unsigned int image_index  = launch_index.y * params.width + launch_index.x;
-    float3         accum_color  = result / static_cast<float>( params.samples_per_launch );
-
-    if( subframe_index > 0 )
+    const float3 launch_color  = result / static_cast<float>( params.samples_per_launch );
+    const float3 launch_albedo = albedo / static_cast<float>( params.samples_per_launch );
+    // The denoiser wants normals in camera space
+    const float3 launch_normal = make_float3(
+            dot( normal, normalize( U ) ), dot( normal, normalize( V ) ), dot( normal, normalize( W ) ) )
+            / static_cast<float>( params.samples_per_launch );
+    const float  launch_lum   = luminance( launch_color );
+    float3       accum_color  = launch_color;
+    float2       moments      = make_float2( launch_lum, launch_lum * launch_lum );
+    float3       accum_albedo = launch_albedo;
+    float3       accum_normal = launch_normal;
+
+    if( launches > 0.0f )
     {
-        const float                 a = 1.0f / static_cast<float>( subframe_index+1 );
-        const float3 accum_color_prev = make_float3( params.accum_buffer[ image_index ]);
-        accum_color = lerp( accum_color_prev, accum_color, a );
+        const float a = 1.0f / ( launches + 1.0f );
+        accum_color  = lerp( make_float3( accum_prev ), accum_color, a );
+        moments      = lerp( moments_prev, moments, a );
+        accum_albedo = lerp( make_float3( params.albedo_buffer[ image_index ] ), accum_albedo, a );
+        accum_normal = lerp( make_float3( params.normal_buffer[ image_index ] ), accum_normal, a );
     }
-    params.accum_buffer[ image_index ] = make_float4( accum_color, 1.0f);
-    params.frame_buffer[ image_index ] = make_color_float4 ( accum_color );
-//    params.frame_buffer[ image_index ] = make_float4(255, 0, 0, 1);
+    params.accum_buffer[ image_index ]   = make_float4( accum_color, launches + 1.0f );
+    params.moments_buffer[ image_index ] = moments;
+    params.albedo_buffer[ image_index ]  = make_float4( accum_albedo, 1.0f );
+    params.normal_buffer[ image_index ]  = make_float4( accum_normal, 0.0f );
+    params.depth_buffer[ image_index ]   = first_depth;
+
+    const float error = pixelError( moments, launches + 1.0f );
+    if( params.active_pixels && ( launches + 1.0f < params.adaptive_min_samples || error >= threshold ) )
+        atomicAdd( params.active_pixels, 1u );
+
+    params.frame_buffer[ image_index ] = params.show_convergence
+            ? heatmapColor( error / threshold )
+            : make_color_float4( accum_color );
 }
 
 
@@ -413,9 +496,9 @@ extern "C" __global__ void __miss__radiance()
 }
 
 
-extern "C" __global__ void __closesthit__occlusion()
+extern "C" __global__ void __miss__occlusion()
 {
-    setPayloadOcclusion( true );
+    setPayloadOcclusion( false );
 }
 
 
@@ -435,19 +518,28 @@ extern "C" __global__ void __closesthit__radiance()
     const float3 v1 = make_float3(rt_data->vertices[vert_idx_offset + 1]);
     const float3 v2 = make_float3(rt_data->vertices[vert_idx_offset + 2]);
 
-    const float3 N_0 = normalize(cross(v1 - v0, v2 - v0));
+    // Vertices are in object space for instanced meshes, the transform is identity otherwise
+    const float3 N_0 = normalize(optixTransformNormalFromObjectToWorldSpace(cross(v1 - v0, v2 - v0)));
 
     const float3 N    = faceforward( N_0, -ray_dir, N_0 );
 
     RadiancePRD* prd = getPRD();
 
+    const bool first_hit = prd->countEmitted;
     if( prd->countEmitted )
         prd->emitted = rt_data->emission_color;
     else
         prd->emitted = make_float3( 0.0f );
+    if( first_hit )
+    {
+        prd->normal = N;
+        prd->depth  = optixGetRayTmax();
+    }
 
     // Return if a light source is hit
     if (mat == EMISSIVE) {
+        if( first_hit )
+            prd->albedo = clamp( rt_data->emission_color, 0.0f, 1.0f );
         prd->hitLight = true;
         prd->radiance += rt_data->emission_color;
         return;
@@ -467,6 +559,7 @@ extern "C" __global__ void __closesthit__radiance()
         // Update attenuation with brdf sample
         if (mat == GLOSSY || mat == MIRROR || mat == FRESNEL) {
             prd->attenuation *= (rt_data->specular_color);
+            if (first_hit) prd->albedo = rt_data->specular_color;
         }
         else if (mat == TEXTURE && rt_data->texcoord) {
             const float2 tc
@@ -477,9 +570,11 @@ extern "C" __global__ void __closesthit__radiance()
             float4 fromTexture = tex2D<float4>(rt_data->texture, tc.x, tc.y);
             rt_data->diffuse_color = make_float3(fromTexture);
             prd->attenuation *= (rt_data->diffuse_color);
+            if (first_hit) prd->albedo = rt_data->diffuse_color;
         }
         else {
             prd->attenuation *= (rt_data->diffuse_color);
+            if (first_hit) prd->albedo = rt_data->diffuse_color;
         }
         prd->countEmitted = false;
     }
@@ -488,114 +583,41 @@ extern "C" __global__ void __closesthit__radiance()
     const float z2 = rnd(seed);
     prd->seed = seed;
 
-    // Choose a random light to sample from
+    // Choose a light to sample from
     // if there is no light in the scene return
     if (params.num_lights == 0) return;
-    Light light = params.lights[lcg(seed) % params.num_lights];
-    if (light.shape == POINT_LIGHT) {
-        const float dist = length(light.corner - P);
-        if (dist <= 0.01f) {
-            // too close to point light -> consider this as intersection with the point light
-            prd->hitLight = true;
-            prd->radiance += rt_data->emission_color;
-            return;
-        }
-        const float3 L = normalize(light.corner - P);
-        float nDl = dot(N, L);
-        float weight = 0.f;
-        // Check occlusion
-        if (nDl > 0.f) {
-            const bool occluded = traceOcclusion(
-                params.handle,
-                P,
-                L,
-                0.01f,         // tmin
-                dist - 0.01f  // tmax
-            );
-
-            // If the point light is not occluded, add emission / distance squared to radiance
-            // With scenes of only point lights we expect sharp shadows
-            if (!occluded) {
-                const float dist_2 = dist * dist;
-                if (dist_2 > 0.f) {
-                    weight = nDl / dist_2;
-                }
-            }
-        }
-        prd->radiance += (light.emission * weight);
+    unsigned int light_idx;
+    float selection_weight = 1.f;
+    if (params.light_tree) {
+        // Pick lights proportionally to their estimated contribution and rescale, so the
+        // estimate matches the one of uniform selection (which is 1 / num_lights per light)
+        float pdf;
+        const int picked = sampleLightTree(params.light_tree, P, N, rnd(seed), pdf);
+        if (picked < 0 || pdf <= 0.f) return;
+        light_idx = picked;
+        selection_weight = 1.f / (pdf * params.num_lights);
     }
-    else if (light.shape == SPOT_LIGHT) {
-        const float dist = length(light.corner - P);
-        if (dist <= 0.01f) {
-            // too close to spot light -> consider this as intersection with the spot light
+    else {
+        light_idx = lcg(seed) % params.num_lights;
+    }
+
+    LightSample sample;
+    if (!sampleLight(params.lights[light_idx], P, N, z1, z2, sample)) {
+        if (sample.hit_light) {
+            // too close to a point or spot light -> consider this as intersection with the light
             prd->hitLight = true;
             prd->radiance += rt_data->emission_color;
-            return;
         }
-        float3 L = normalize(light.corner - P);
-        float nDl = dot(N, L);
-        float weight = 0.f;
-        // Check occlusion
-        if (nDl > 0.f) {
-            const bool occluded = traceOcclusion(
-                params.handle,
-                P,
-                L,
-                0.01f,         // tmin
-                dist - 0.01f  // tmax
-            );
-
-            // If the point light is not occluded, add emission / distance squared to radiance
-            // With scenes of only point lights we expect sharp shadows
-            if (!occluded) {
-                const float dist_2 = dist * dist;
-                if (dist_2 > 0.f) {
-                    // Compute falloff
-                    float falloff = 0.f;
-                    float cos_angle = dot(normalize(P - light.corner), light.normal);
-                    if (cos_angle < light.width) return;
-                    else if (cos_angle > light.falloff_start) {
-                        falloff = 1.f;
-                    }
-                    else {
-                        if (light.falloff_start - light.width != 0.f) {
-                            float delta = (cos_angle - light.width) / (light.falloff_start - light.width);
-                            falloff = delta * delta * delta * delta;
-                        }
-                    }
-                    weight = nDl * falloff / dist_2;
-                }
-            }
-        }
-        prd->radiance += (light.emission * weight);
+        return;
     }
-    else {
-        const float3 light_pos = light.corner + light.v1 * z1 + light.v2 * z2;
-
-        // Calculate properties of light sample (for area based pdf)
-        const float  Ldist = length(light_pos - P);
-        const float3 L = normalize(light_pos - P);
-        const float  nDl = dot(N, L);
-        const float  LnDl = -dot(light.normal, L);
-
-        float weight = 0.0f;
-        if (nDl > 0.0f && LnDl > 0.0f)
-        {
-            const bool occluded = traceOcclusion(
-                params.handle,
-                P,
-                L,
-                0.01f,         // tmin
-                Ldist - 0.01f  // tmax
-            );
-
-            if (!occluded)
-            {
-                const float A = length(cross(light.v1, light.v2));
-                weight = nDl * LnDl * A / (M_PIf * Ldist * Ldist);
-            }
-        }
 
-        prd->radiance += (light.emission * weight);
-    }
+    const bool occluded = traceOcclusion(
+        params.handle,
+        P,
+        sample.direction,
+        0.01f,                  // tmin
+        sample.distance - 0.01f // tmax
+    );
+    if (!occluded)
+        prd->radiance += sample.radiance * selection_weight;
 }
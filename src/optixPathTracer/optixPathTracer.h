@@ -25,6 +25,8 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //
+#pragma once
+
 //#include "gdt/gdt/math/AffineSpace.h"
 //#include <vector>
 //using namespace gdt;
@@ -69,9 +71,27 @@ struct Light {
     float falloff_start; // used for spot lights
 };
 
+/*
+*   Node of the light tree used to pick a light proportionally to its estimated
+*   contribution at a shading point (see light_sampling.h)
+*/
+struct LightTreeNode {
+    float3 bmin, bmax;   // bounds of the emitters below this node
+    float3 axis;         // emission orientation cone: axis,
+    float theta_o;       // half-angle of the cone the normals lie in,
+    float theta_e;       // and how far around the normals light is emitted
+    float energy;        // estimated power of the emitters below this node
+    int child;           // interior: index of the first child, the second one follows it
+    int light;           // leaf: index into Params::lights, -1 for interior nodes
+};
+
 struct Params {
     unsigned int subframe_index;
-    float4 *accum_buffer;
+    float4 *accum_buffer;           // w holds the number of launches accumulated into the pixel
+    float2 *moments_buffer;         // running mean of the luminance of a launch and of its square
+    float4 *albedo_buffer;          // first hit albedo, accumulated like accum_buffer
+    float4 *normal_buffer;          // first hit normal in camera space (x right, y up, z forward)
+    float *depth_buffer;            // distance to the first hit of the launch's first sample, 0 on a miss
     float4 *frame_buffer;
     unsigned int width;
     unsigned int height;
@@ -80,12 +100,21 @@ struct Params {
     unsigned int num_lights;
     unsigned int denoiser;
 
+    // Adaptive sampling: pixels whose estimated relative error drops below the threshold
+    // stop being traced until the accumulation is reset
+    float adaptive_threshold;           // 0 samples every pixel on every launch
+    unsigned int adaptive_min_samples;  // launches before a pixel may be considered converged
+    unsigned int *active_pixels;        // counts the pixels that still need samples after a launch
+    unsigned int show_convergence;      // write the convergence heatmap instead of the image
+    unsigned int redraw_only;           // write the accumulated image again without taking samples
+
     float3 eye;
     float3 U;
     float3 V;
     float3 W;
 
     Light *lights;
+    LightTreeNode *light_tree; // nullptr selects lights uniformly
     OptixTraversableHandle handle;
 };
 
@@ -0,0 +1,357 @@
+#pragma once
+
+#include <optix.h>
+#include <cuda_runtime.h>
+
+#include <glm/glm.hpp>
+
+#include <sutil/CUDAOutputBuffer.h>
+#include <sutil/Camera.h>
+
+#include "optixPathTracer.h"
+#include "atrous_denoiser.h"
+#include "camera_path.h"
+#include "cpu_bvh.h"
+#include "cpu_renderer.h"
+#include "frame_fanout.h"
+#include "lossless_codec.h"
+#include "memory_accounting.h"
+#include "metrics.h"
+#include "mjpeg_server.h"
+#include "scene_parser.h"
+#include "temporal_reprojection.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+*   Host side of the path tracer shared between its translation units: the types of the
+*   scene and the device state, and the scene, settings and helpers optixPathTracer.cpp
+*   defines, which benchmarks.cpp renders and checks the loaded scene with.
+*/
+
+template<typename T>
+struct Record {
+    __align__(OPTIX_SBT_RECORD_ALIGNMENT) char header[OPTIX_SBT_RECORD_HEADER_SIZE];
+    T data;
+};
+
+typedef Record<RayGenData> RayGenRecord;
+typedef Record<MissData> MissRecord;
+typedef Record<HitGroupData> HitGroupRecord;
+
+struct Vertex {
+    float x, y, z, pad;
+};
+
+
+struct IndexedTriangle {
+    uint32_t v1, v2, v3, pad;
+};
+
+
+// An INSTANCE line: a mesh of the mesh cache placed with its own transform and material
+struct Instance {
+    float transform[12];    // object to world, row major 3x4 like OptixInstance::transform
+    uint32_t mesh;          // index into mesh_cache
+    uint32_t binding;       // index into instance_bindings
+    bool visible;           // false once removed, the slot is reused by the next added instance
+};
+
+// A mesh placed with INSTANCE, stored once in object space
+struct CachedMesh {
+    std::string key;                        // obj file, or CUBE / ICOSPHERE
+    std::vector<Vertex> vertices;           // three per triangle
+    std::vector<float2> texcoords;          // three per triangle
+    std::vector<uint32_t> material_indices; // one per triangle, into materials
+    std::vector<uint32_t> materials;        // scene material ids, INSTANCE_MATERIAL for the instance's own
+};
+
+// Scene materials of a mesh's materials for one distinct (mesh, material) pair of INSTANCE
+// lines, each gets its own range of hit group records
+struct InstanceBinding {
+    uint32_t mesh;
+    std::vector<uint32_t> materials;
+};
+
+// Where a light of d_lights comes from, so that scene updates can follow it
+struct LightSource {
+    int material;
+    int32_t first_triangle;     // AREA_LIGHT: first of the two triangles of its quad, -1 otherwise
+};
+
+/*
+*   Changes made through the scene update functions that the device (or the CPU scene) has
+*   not seen yet. commitSceneUpdates() does the least work that covers them.
+*/
+struct SceneUpdates {
+    bool instances = false;             // transforms, visibility or meshes of existing instance slots
+    bool instance_count = false;        // instances were appended, the IAS is rebuilt instead of refit
+    bool bindings = false;              // new meshes or instance bindings, the hit group records grow
+    std::vector<bool> materials;        // per material id, records to rewrite
+    int32_t first_triangle = -1;        // range of d_vertices triangles that moved, -1 if none
+    int32_t end_triangle = -1;
+    bool lights = false;
+
+    bool pending() const {
+        return instances || instance_count || bindings || lights || first_triangle >= 0 ||
+               std::find(materials.begin(), materials.end(), true) != materials.end();
+    }
+};
+
+/*
+*   A MATERIAL, GEOMETRY or INSTANCE line of the scene file as it was last applied, with
+*   what it added to the scene, so that reloadSceneFile() can turn edits into scene updates.
+*   The tokens point into the mapping of the scene file the line was read from.
+*/
+struct SceneItem {
+    SceneToken kind;            // MATERIAL, GEOMETRY or INSTANCE
+    SceneToken type;            // material or geometry type
+    int material = -1;          // id a MATERIAL line added, the material of geometry otherwise
+    float3 values[3];           // diffuse, specular and emissive color, or translate, rotate and scale
+    float spec_exp = 0.f;
+    float ior = 0.f;
+    SceneToken objfile;
+    int line = 0;
+    int32_t object = -1;        // instance id the line placed
+    int32_t light = -1;         // index into d_lights of the light the line made
+};
+
+struct Triangle {
+    glm::vec3 vertex[3];     // Vertices
+    glm::vec3 normal;        // Normal
+    glm::vec2 texcoord;
+    //Material data;
+    glm::vec3 diffuse;
+};
+
+// The pixels are malloc()ed, as stbi_load() returns them, and accounted by accountTexture()
+struct Texture {
+    ~Texture() {
+        if (pixel) {
+            memoryAccounting().release(MEMORY_TEXTURES, MEMORY_HOST, bytes());
+            free(pixel);
+        }
+    }
+
+    size_t bytes() const {
+        return pixel ? static_cast<size_t>(resolution.x) * resolution.y * sizeof(uint32_t) : 0;
+    }
+
+    uint32_t *pixel{nullptr};
+    glm::ivec2 resolution{-1};
+};
+
+struct Mesh {
+    std::vector<Triangle *> triangles;
+    std::vector<glm::vec3> vertex;
+    std::vector<glm::vec3> normal;
+    std::vector<glm::vec2> texcoord;
+    std::vector<glm::ivec3> index;
+
+    glm::vec3 diffuse;
+    int diffuseTextureID{-1};
+};
+
+struct Model {
+    ~Model() {
+        for (auto mesh: meshes) delete mesh;
+    }
+
+    bool material;
+    std::vector<Mesh *> meshes;
+    std::vector<Texture *> textures;
+};
+
+struct PathTracerState {
+    OptixDeviceContext context = 0;
+
+    OptixTraversableHandle gas_handle = 0;  // Traversable handle for triangle AS
+    CUdeviceptr d_gas_output_buffer = 0;  // Triangle AS memory
+    size_t gas_output_size = 0;
+    size_t gas_temp_update_size = 0;
+    CUdeviceptr d_gas_temp_buffer = 0;      // allocated by the first refit
+    CUdeviceptr d_vertices = 0;
+    CUdeviceptr d_texcoords = 0;
+    CUdeviceptr d_mat_indices = 0;
+    CUdeviceptr d_lights = 0;
+    CUdeviceptr d_light_tree = 0;
+    size_t light_tree_nodes = 0;
+
+    // Instancing: one GAS per cached mesh under an IAS that also holds the GAS above
+    OptixTraversableHandle ias_handle = 0;  // 0 without INSTANCE lines, the GAS is traced directly
+    CUdeviceptr d_ias_output_buffer = 0;
+    CUdeviceptr d_ias_temp_buffer = 0;      // kept for refits
+    size_t ias_output_size = 0;
+    size_t ias_temp_size = 0;
+    size_t ias_num_instances = 0;
+    int32_t ias_refits = 0;                 // since the last build
+    CUdeviceptr d_instances = 0;
+    std::vector<OptixTraversableHandle> mesh_gas_handles;
+    std::vector<CUdeviceptr> d_mesh_gas_output_buffers;
+    std::vector<CUdeviceptr> d_mesh_vertices;
+    std::vector<CUdeviceptr> d_mesh_texcoords;
+
+    OptixModule ptx_module = 0;
+    OptixPipelineCompileOptions pipeline_compile_options = {};
+    OptixPipeline pipeline = 0;
+
+    OptixProgramGroup raygen_prog_group = 0;
+    OptixProgramGroup radiance_miss_group = 0;
+    OptixProgramGroup occlusion_miss_group = 0;
+    OptixProgramGroup radiance_hit_group = 0;
+    OptixProgramGroup occlusion_hit_group = 0;
+
+    CUstream stream = 0;
+    Params params = {};
+    Params *d_params;
+
+    OptixShaderBindingTable sbt = {};
+    Model *model;
+
+    OptixDenoiser denoiser = nullptr;
+    CUdeviceptr denoiserScratch = 0;
+    uint32_t denoiserScratchSize;
+    CUdeviceptr denoiserState = 0;
+    uint32_t denoiserStateSize;
+    OptixDenoiserParams denoiserParams;
+
+    AtrousDenoiser atrous_denoiser;
+    std::vector<float4> atrous_output;
+    std::vector<float4> atrous_albedo;
+    std::vector<float4> atrous_normal;
+
+    bool camera_moved = false;          // the camera changed since the last temporal resolve
+    TemporalSettings temporal_settings;
+    TemporalDeviceBuffers temporal_buffers;     // by allocPixelBuffers() with --temporal
+    ReprojectionCamera temporal_camera;         // of the frame in temporal_buffers
+    bool temporal_history = false;              // temporal_buffers hold a resolved frame
+
+    unsigned int *d_active_pixels = nullptr;
+    unsigned int active_pixels = 0;     // pixels that still needed samples after the last launch
+    bool converged = false;             // every pixel reached the adaptive threshold
+    bool redraw = false;                // the display settings changed, launch even if idle
+
+    int frameID = 0;
+};
+
+// Where the render loop streams its frames to
+struct FrameOutputs {
+    FrameFanout ppm;                        // ffmpeg and --fanout-port viewers
+    std::unique_ptr<MjpegServer> mjpeg;     // --mjpeg-port
+    std::unique_ptr<FrameFanout> lossless;  // --lossless-port
+    LosslessCodec codec;
+};
+
+// Host pixel buffers and launch parameters for rendering the current scene with CpuRenderer
+struct CpuFrame {
+    std::vector<float4> accum, albedo, normal, frame;
+    std::vector<float2> moments;
+    std::vector<float> depth;
+    std::vector<LightTreeNode> light_tree;
+    Params params;
+};
+
+/*
+*   The metrics the render loop records per frame. A frame's latency runs from the launch to
+*   the frame being displayed and handed to the streams; fps and samples per second are
+*   moving averages with METRICS_RATE_SMOOTHING over the time between frames, idle included
+*/
+struct RenderLoopMetrics {
+    Counter &frames;
+    Counter &samples;
+    Histogram &frame_seconds;
+    Gauge &fps;
+    Gauge &samples_per_second;
+    std::chrono::steady_clock::time_point last_frame;
+    bool has_last_frame = false;
+
+    RenderLoopMetrics();
+
+    void recordFrame(double seconds, uint64_t frame_samples);
+};
+
+// Scene parameters
+extern sutil::Camera camera;
+extern int32_t samples_per_launch;
+extern int width;
+extern int height;
+
+// Prepared scene snapshot (--prepared)
+extern std::string prepared_scene_file;
+extern bool prepared_scene_stale;       // loading it failed, it is written once the scene is built
+
+// Distributed rendering (--render-worker, --bench-cluster)
+extern std::vector<std::string> cluster_worker_addresses;
+
+// Prometheus metrics (--metrics-port, --bench-metrics)
+extern MetricsRegistry metrics;
+
+// Memory accounting (--memory-budget, --bench-memory)
+const int32_t MIN_TEXTURE_SIZE = 16;    // textures are not downscaled below to fit the texture budget
+extern bool textures_downscaled;        // by the last loadScene(), to fit the texture budget
+
+// Scene data, filled by readSceneFile()
+extern int32_t MAT_COUNT;
+extern std::vector<Vertex> d_vertices;
+extern std::vector<float2> d_texcoords;
+extern std::vector<Material> d_mat_types;
+extern std::vector<uint32_t> d_material_indices;
+extern std::vector<float3> d_emission_colors;
+extern std::vector<float3> d_diffuse_colors;
+extern std::vector<float3> d_spec_colors;
+extern std::vector<float> d_spec_exp;
+extern std::vector<float> d_ior;
+extern std::vector<Light> d_lights;
+extern const Model *MODEL;
+
+// Instancing
+extern std::vector<CachedMesh> mesh_cache;
+extern std::vector<InstanceBinding> instance_bindings;
+extern std::vector<Instance> scene_instances;
+extern SceneUpdates scene_updates;
+
+// Scene loading and updates
+void readSceneFile(std::string &scene_file);
+void loadScene(std::string &scene_file);
+void savePreparedScene(const std::string &filename, const PathTracerState *state, const CpuBvh *cpu_bvh);
+void accountTexture(Texture &texture, const std::string &name);
+void addSceneInstance(Geom type, int mat_id, glm::vec3 pos, glm::vec3 rot, glm::vec3 s, const std::string &objfile);
+uint32_t addSceneObject(Geom type, int mat_id, glm::vec3 pos, glm::vec3 rot, glm::vec3 s,
+                        const std::string &objfile);
+void removeSceneObject(uint32_t id);
+void transformSceneObject(uint32_t id, glm::vec3 pos, glm::vec3 rot, glm::vec3 s);
+void updateSceneMaterial(int mat_id, float3 dif_col, float3 spec_col, float3 em_col, float spec_exp, float ior);
+void moveSceneLight(uint32_t light, const float3 &offset);
+
+// Camera
+void handleCameraUpdate(Params &params);
+CameraState currentCameraState();
+void setCameraState(const CameraState &view);
+
+// Device state
+void createContext(PathTracerState &state);
+void createTextures();
+void buildMeshAccel(PathTracerState &state);
+void createModule(PathTracerState &state);
+void createProgramGroups(PathTracerState &state);
+void createPipeline(PathTracerState &state);
+void createSBT(PathTracerState &state);
+void initLaunchParams(PathTracerState &state);
+void launchSubframe(sutil::CUDAOutputBuffer<float4> &output_buffer, PathTracerState &state);
+void rebuildScene(PathTracerState &state);
+void commitSceneUpdates(PathTracerState &state);
+void cleanupState(PathTracerState &state);
+
+// CPU renderer
+void buildCpuScene(CpuScene &scene);
+void initCpuFrame(CpuFrame &frame, int w, int h);
+void commitCpuSceneUpdates(CpuScene &scene, CpuFrame &frame);
+
+// Outputs
+void registerMemoryMetrics();
+void printFanoutStats(const FrameFanout &fanout);
@@ -0,0 +1,223 @@
+#include <optix.h>
+#include <cuda_runtime.h>
+
+#include "render_session.h"
+
+#include <algorithm>
+
+RenderSession::RenderSession(uint32_t id, int width, int height, const sutil::Camera &camera, FrameSink *sink)
+        : m_id(id), m_width(std::max(1, width)), m_height(std::max(1, height)), m_sink(sink),
+          m_opened(std::chrono::steady_clock::now()), m_camera(camera), m_camera_moved(m_opened) {
+    const size_t num_pixels = static_cast<size_t>(m_width) * m_height;
+    m_accum.assign(num_pixels, make_float4(0.f));
+    m_albedo.assign(num_pixels, make_float4(0.f));
+    m_normal.assign(num_pixels, make_float4(0.f));
+    m_frame.assign(num_pixels, make_float4(0.f));
+    m_moments.assign(num_pixels, make_float2(0.f));
+    m_depth.assign(num_pixels, 0.f);
+}
+
+void RenderSession::setCamera(const sutil::Camera &camera) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_camera = camera;
+        m_camera_changed = true;
+        m_camera_moved = std::chrono::steady_clock::now();
+        ++m_stats.camera_changes;
+    }
+    if (m_server) m_server->notifyChange();
+}
+
+sutil::Camera RenderSession::camera() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_camera;
+}
+
+void RenderSession::setSampleBudget(int32_t max_subframes) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_max_subframes = std::max(0, max_subframes);
+    }
+    if (m_server) m_server->notifyChange();
+}
+
+void RenderSession::setWeight(float weight) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_weight = std::max(1e-3f, weight);
+    }
+    if (m_server) m_server->notifyChange();
+}
+
+float RenderSession::weight() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_weight;
+}
+
+void RenderSession::setLatencyTarget(double ms) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_latency_target_ms = std::max(1.0, ms);
+}
+
+double RenderSession::latencyTarget() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_latency_target_ms;
+}
+
+bool RenderSession::interactive(std::chrono::steady_clock::time_point now) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return std::chrono::duration<double>(now - m_camera_moved).count() < INTERACTIVE_WINDOW;
+}
+
+bool RenderSession::active() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_camera_changed) return true;
+    return !m_converged && (m_max_subframes == 0 || m_subframe_index < static_cast<uint32_t>(m_max_subframes));
+}
+
+SessionStats RenderSession::stats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    SessionStats stats = m_stats;
+    const auto now = std::chrono::steady_clock::now();
+    const double seconds = std::chrono::duration<double>(now - m_opened).count();
+    stats.fps = seconds > 0.0 ? stats.subframes / seconds : 0.0;
+    // Decays while no frame arrives, a stalled session does not keep its last rate
+    const double idle = std::chrono::duration<double>(now - m_last_sent).count();
+    if (stats.subframes > 0 && idle > 1.0 / std::max(stats.recent_fps, 1e-3))
+        stats.recent_fps = std::min(stats.recent_fps, 1.0 / idle);
+    stats.active = m_camera_changed ||
+                   (!m_converged && (m_max_subframes == 0 || m_subframe_index < static_cast<uint32_t>(m_max_subframes)));
+    stats.interactive = std::chrono::duration<double>(now - m_camera_moved).count() < INTERACTIVE_WINDOW;
+    return stats;
+}
+
+size_t RenderSession::memoryUsage() const {
+    return m_accum.size() * sizeof(float4) * 4 + m_moments.size() * sizeof(float2) + m_depth.size() * sizeof(float);
+}
+
+bool RenderSession::beginSubframe(const Params &shared, Params &params) {
+    params = shared;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_closed) return false;
+        if (m_camera_changed) {
+            m_camera_changed = false;
+            m_subframe_index = 0;
+            m_converged = false;
+        }
+        m_camera.setAspectRatio(static_cast<float>(m_width) / static_cast<float>(m_height));
+        params.eye = m_camera.eye();
+        m_camera.UVWFrame(params.U, params.V, params.W);
+        params.subframe_index = m_subframe_index;
+        m_rendering = true;
+        m_subframe_start = std::chrono::steady_clock::now();
+    }
+    params.width = m_width;
+    params.height = m_height;
+    params.accum_buffer = m_accum.data();
+    params.moments_buffer = m_moments.data();
+    params.albedo_buffer = m_albedo.data();
+    params.normal_buffer = m_normal.data();
+    params.depth_buffer = m_depth.data();
+    params.frame_buffer = m_frame.data();
+    params.active_pixels = nullptr;
+    return true;
+}
+
+void RenderSession::finishSubframe(const Params &params, unsigned int active_pixels, double render_ms) {
+    if (m_sink) m_sink->sendFrame(*this, m_frame.data(), m_width, m_height);
+    const auto now = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // A camera change during the subframe restarts the next one, the stale one still counts
+    ++m_subframe_index;
+    m_converged = params.adaptive_threshold > 0.f && active_pixels == 0;
+    const double latency_ms = std::chrono::duration<double, std::milli>(now - m_subframe_start).count();
+    if (m_stats.subframes > 0) {
+        // Exponential average of the frame rate with a time constant of about a second
+        const double interval = std::max(1e-6, std::chrono::duration<double>(now - m_last_sent).count());
+        const double alpha = std::min(1.0, interval);
+        m_stats.recent_fps += alpha * (1.0 / interval - m_stats.recent_fps);
+    }
+    m_last_sent = now;
+    if (std::chrono::duration<double>(now - m_camera_moved).count() < INTERACTIVE_WINDOW &&
+        latency_ms > m_latency_target_ms)
+        ++m_stats.late_subframes;
+    ++m_stats.subframes;
+    m_stats.samples += static_cast<uint64_t>(m_width) * m_height * params.samples_per_launch;
+    m_stats.render_ms += render_ms;
+    m_stats.last_latency_ms = latency_ms;
+    m_rendering = false;
+    m_rendered.notify_all();
+}
+
+void RenderSession::close() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_closed = true;
+    m_rendered.wait(lock, [this]() { return !m_rendering; });
+}
+
+RenderServer::RenderServer(const CpuScene &scene, const Params &shared, unsigned int num_threads)
+        : m_scene(scene), m_shared(shared) {
+    m_renderer.setNumThreads(num_threads);
+}
+
+std::shared_ptr<RenderSession> RenderServer::openSession(int width, int height, const sutil::Camera &camera,
+                                                         FrameSink *sink) {
+    std::shared_ptr<RenderSession> session;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        session.reset(new RenderSession(m_next_id++, width, height, camera, sink));
+        session->m_server = this;
+        m_sessions.push_back(session);
+    }
+    notifyChange();
+    return session;
+}
+
+void RenderServer::closeSession(uint32_t id) {
+    std::shared_ptr<RenderSession> session;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto found = std::find_if(m_sessions.begin(), m_sessions.end(),
+                                        [id](const std::shared_ptr<RenderSession> &s) { return s->id() == id; });
+        if (found == m_sessions.end()) return;
+        session = *found;
+        m_sessions.erase(found);
+    }
+    session->close();
+    notifyChange();
+}
+
+std::vector<std::shared_ptr<RenderSession>> RenderServer::sessions() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_sessions;
+}
+
+void RenderServer::setChangeListener(std::function<void()> listener) {
+    std::lock_guard<std::mutex> lock(m_listener_mutex);
+    m_listener = std::move(listener);
+}
+
+void RenderServer::notifyChange() {
+    std::lock_guard<std::mutex> lock(m_listener_mutex);
+    if (m_listener) m_listener();
+}
+
+size_t RenderServer::renderRound() {
+    size_t rendered = 0;
+    for (const std::shared_ptr<RenderSession> &session: sessions()) {
+        if (!session->active()) continue;
+        // Skips sessions closed since the list was taken
+        Params params;
+        if (!session->beginSubframe(m_shared, params)) continue;
+        unsigned int active_pixels = 0;
+        params.active_pixels = &active_pixels;
+        const auto t0 = std::chrono::steady_clock::now();
+        m_renderer.launch(m_scene, params);
+        const auto t1 = std::chrono::steady_clock::now();
+        session->finishSubframe(params, active_pixels, std::chrono::duration<double, std::milli>(t1 - t0).count());
+        ++rendered;
+    }
+    return rendered;
+}
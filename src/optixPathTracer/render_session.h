@@ -0,0 +1,179 @@
+#pragma once
+
+#include <sutil/Camera.h>
+#include <sutil/vec_math.h>
+
+#include "optixPathTracer.h"
+#include "cpu_renderer.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+*   Several viewers of one scene in one process. The scene and the launch parameters it
+*   brings (lights, light tree, depth, samples) are shared and must not change while
+*   sessions render it. Every session has its own camera, accumulation buffers, sample
+*   budget and output sink. Sessions render with CpuRenderer.
+*/
+
+class RenderSession;
+class RenderServer;
+
+// A session counts as interactive for this long after its camera moved, in seconds
+const double INTERACTIVE_WINDOW = 0.5;
+// Time from starting a subframe of an interactive session to sending it that it should not exceed
+const double DEFAULT_LATENCY_TARGET_MS = 50.0;
+
+// Where the frames of a session go, called on the render thread after every subframe
+class FrameSink {
+public:
+    virtual ~FrameSink() {}
+
+    // width x height linear RGBA, only valid during the call
+    virtual void sendFrame(const RenderSession &session, const float4 *pixels, int width, int height) = 0;
+};
+
+struct SessionStats {
+    uint64_t subframes = 0;         // rendered since the session was opened
+    uint64_t samples = 0;           // paths traced, before adaptive sampling skips pixels
+    uint32_t camera_changes = 0;
+    double render_ms = 0.0;         // rendering its subframes, pieces rendered in parallel add up
+    double last_latency_ms = 0.0;   // from starting the last subframe to sending it
+    uint64_t late_subframes = 0;    // interactive subframes over the latency target
+    double fps = 0.0;               // subframes per second since the session was opened
+    double recent_fps = 0.0;        // over about the last second
+    bool active = false;            // the budget is not spent
+    bool interactive = false;       // the camera moved within INTERACTIVE_WINDOW
+};
+
+class RenderSession {
+public:
+    RenderSession(uint32_t id, int width, int height, const sutil::Camera &camera, FrameSink *sink);
+
+    RenderSession(const RenderSession &) = delete;
+    RenderSession &operator=(const RenderSession &) = delete;
+
+    uint32_t id() const { return m_id; }
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+
+    // Thread safe, accumulation restarts with the next subframe. The setters notify the server's listener.
+    void setCamera(const sutil::Camera &camera);
+    sutil::Camera camera() const;
+
+    // Subframes per view before the session stops rendering, 0 renders until it converges
+    void setSampleBudget(int32_t max_subframes);
+
+    // Share of the render time against other sessions of the same kind (SessionScheduler)
+    void setWeight(float weight);
+    float weight() const;
+
+    void setLatencyTarget(double ms);
+    double latencyTarget() const;
+
+    // The camera moved within INTERACTIVE_WINDOW of now
+    bool interactive(std::chrono::steady_clock::time_point now) const;
+
+    // There is a subframe to render: the budget is not spent and the frame has not converged
+    bool active() const;
+    SessionStats stats() const;
+
+    // Bytes of the session's own buffers
+    size_t memoryUsage() const;
+
+private:
+    /*
+    *   The render side, for RenderServer and SessionScheduler. beginSubframe() fills params
+    *   for the next subframe, false if the session is closed. Pixels may be rendered in
+    *   any number of pieces on any threads, then finishSubframe() sends the frame.
+    */
+    bool beginSubframe(const Params &shared, Params &params);
+    void finishSubframe(const Params &params, unsigned int active_pixels, double render_ms);
+
+    // No subframe starts after it returns, and the one in progress has been sent
+    void close();
+
+    const uint32_t m_id;
+    const int m_width;
+    const int m_height;
+    FrameSink *const m_sink;
+    RenderServer *m_server = nullptr;   // set by openSession() before the session is listed
+    const std::chrono::steady_clock::time_point m_opened;
+
+    mutable std::mutex m_mutex;     // everything below but the buffers
+    sutil::Camera m_camera;
+    bool m_camera_changed = true;
+    std::chrono::steady_clock::time_point m_camera_moved;
+    int32_t m_max_subframes = 0;
+    float m_weight = 1.f;
+    double m_latency_target_ms = DEFAULT_LATENCY_TARGET_MS;
+    uint32_t m_subframe_index = 0;  // of the current view
+    bool m_converged = false;
+    SessionStats m_stats;
+    std::chrono::steady_clock::time_point m_subframe_start;
+    std::chrono::steady_clock::time_point m_last_sent;
+    bool m_rendering = false;       // between beginSubframe() and finishSubframe()
+    bool m_closed = false;
+    std::condition_variable m_rendered;
+
+    // Written by the render threads between beginSubframe() and finishSubframe()
+    std::vector<float4> m_accum, m_albedo, m_normal, m_frame;
+    std::vector<float2> m_moments;
+    std::vector<float> m_depth;
+
+    friend class RenderServer;
+    friend class SessionScheduler;
+};
+
+/*
+*   Holds the shared scene and the open sessions. Sessions can be opened, closed and steered
+*   from any thread, renderRound() is called from one render thread.
+*/
+class RenderServer {
+public:
+    // scene and the lights and light tree in shared have to outlive the server
+    RenderServer(const CpuScene &scene, const Params &shared, unsigned int num_threads = 0);
+
+    // sink has to stay valid until the session is closed
+    std::shared_ptr<RenderSession> openSession(int width, int height, const sutil::Camera &camera, FrameSink *sink);
+
+    // Returns once a subframe of the session in progress is done, the sink is not called after
+    void closeSession(uint32_t id);
+
+    std::vector<std::shared_ptr<RenderSession>> sessions() const;
+
+    /*
+    *   Called on the calling thread after a session is opened, closed or steered, without
+    *   the locks of the server and the session. Replacing it waits for a call in progress,
+    *   an empty listener removes it.
+    */
+    void setChangeListener(std::function<void()> listener);
+
+    // One whole subframe for every active session in turn, returns how many were rendered
+    size_t renderRound();
+
+    const CpuScene &scene() const { return m_scene; }
+    const Params &sharedParams() const { return m_shared; }
+    const CpuRenderer &renderer() const { return m_renderer; }
+
+private:
+    void notifyChange();
+
+    const CpuScene &m_scene;
+    const Params m_shared;
+    CpuRenderer m_renderer;
+
+    mutable std::mutex m_mutex;
+    std::vector<std::shared_ptr<RenderSession>> m_sessions;
+    uint32_t m_next_id = 1;
+
+    std::mutex m_listener_mutex;    // held while the listener runs
+    std::function<void()> m_listener;
+
+    friend class RenderSession;
+};
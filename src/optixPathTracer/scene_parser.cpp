@@ -0,0 +1,234 @@
+#include <cuda_runtime.h>
+
+#include "scene_parser.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    // Powers of ten that are exact in a float
+    const float EXACT_POWERS[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+    const int MAX_EXACT_POWER = 10;
+    const uint64_t MAX_EXACT_MANTISSA = 1ull << 24;
+    const int MAX_MANTISSA_DIGITS = 19;     // fit into uint64_t
+
+    inline bool isDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    inline bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    // strtof on a terminated copy of the token, for what the fast path cannot round exactly
+    bool parseFloatSlow(const char *begin, const char *end, float &value) {
+        char buffer[128];
+        const size_t size = static_cast<size_t>(end - begin);
+        if (size >= sizeof(buffer)) return false;
+        memcpy(buffer, begin, size);
+        buffer[size] = '\0';
+        char *parsed_end = nullptr;
+        value = strtof(buffer, &parsed_end);
+        return parsed_end == buffer + size;
+    }
+}
+
+bool SceneToken::operator==(const char *text) const {
+    const size_t length = strlen(text);
+    return size() == length && memcmp(begin, text, length) == 0;
+}
+
+bool SceneToken::operator==(const SceneToken &other) const {
+    return size() == other.size() && memcmp(begin, other.begin, size()) == 0;
+}
+
+SceneFile::~SceneFile() {
+    close();
+}
+
+bool SceneFile::open(const std::string &filename) {
+    close();
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        return false;
+    }
+    m_size = static_cast<size_t>(info.st_size);
+    if (m_size > 0) {
+        void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            ::close(fd);
+            m_size = 0;
+            return false;
+        }
+        madvise(data, m_size, MADV_SEQUENTIAL);
+        m_data = static_cast<const char *>(data);
+    }
+    // The mapping stays valid without the descriptor
+    ::close(fd);
+    m_filename = filename;
+    m_cursor = m_data;
+    m_line = 0;
+    return true;
+}
+
+void SceneFile::close() {
+    if (m_data) munmap(const_cast<char *>(m_data), m_size);
+    m_data = nullptr;
+    m_size = 0;
+    m_cursor = nullptr;
+    m_line = 0;
+}
+
+bool SceneFile::detach() {
+    if (!m_data) return true;
+    // Truncating the file drops even copied-on-write pages of a private file mapping
+    void *copy = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (copy == MAP_FAILED) return false;
+    memcpy(copy, m_data, m_size);
+    mprotect(copy, m_size, PROT_READ);
+    m_cursor = static_cast<const char *>(copy) + (m_cursor - m_data);
+    munmap(const_cast<char *>(m_data), m_size);
+    m_data = static_cast<const char *>(copy);
+    return true;
+}
+
+void SceneFile::swap(SceneFile &other) {
+    std::swap(m_filename, other.m_filename);
+    std::swap(m_data, other.m_data);
+    std::swap(m_size, other.m_size);
+    std::swap(m_cursor, other.m_cursor);
+    std::swap(m_line, other.m_line);
+}
+
+bool SceneFile::nextLine(SceneLine &line) {
+    const char *const file_end = m_data + m_size;
+    while (m_cursor && m_cursor < file_end) {
+        const char *line_end = static_cast<const char *>(memchr(m_cursor, '\n', file_end - m_cursor));
+        if (!line_end) line_end = file_end;
+
+        line.number = ++m_line;
+        line.begin = m_cursor;
+        line.count = 0;
+        const char *c = m_cursor;
+        while (c < line_end) {
+            while (c < line_end && isSpace(*c)) ++c;
+            if (c == line_end) break;
+            const char *token_begin = c;
+            while (c < line_end && !isSpace(*c)) ++c;
+            if (line.count < SceneLine::MAX_TOKENS) {
+                line.tokens[line.count].begin = token_begin;
+                line.tokens[line.count].end = c;
+            }
+            ++line.count;
+        }
+
+        m_cursor = line_end < file_end ? line_end + 1 : file_end;
+        if (line.count > 0) return true;
+    }
+    return false;
+}
+
+std::string SceneFile::location(const SceneLine &line, const SceneToken &token) const {
+    return m_filename + ":" + std::to_string(line.number) + ":" + std::to_string(line.column(token));
+}
+
+bool parseSceneFloat(const char *begin, const char *end, float &value) {
+    const char *c = begin;
+    const bool negative = c < end && *c == '-';
+    if (c < end && (*c == '-' || *c == '+')) ++c;
+
+    // Significant digits go into the mantissa, the ones that do not fit only shift the exponent
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any_digit = false;
+    for (; c < end && isDigit(*c); ++c) {
+        any_digit = true;
+        if (digits < MAX_MANTISSA_DIGITS) {
+            mantissa = mantissa * 10 + (*c - '0');
+            if (mantissa) ++digits;
+        } else {
+            ++exponent;
+        }
+    }
+    if (c < end && *c == '.') {
+        for (++c; c < end && isDigit(*c); ++c) {
+            any_digit = true;
+            if (digits < MAX_MANTISSA_DIGITS) {
+                mantissa = mantissa * 10 + (*c - '0');
+                if (mantissa) ++digits;
+                --exponent;
+            }
+        }
+    }
+    if (!any_digit) return false;
+    if (c < end && (*c == 'e' || *c == 'E')) {
+        ++c;
+        const bool negative_exponent = c < end && *c == '-';
+        if (c < end && (*c == '-' || *c == '+')) ++c;
+        if (c == end || !isDigit(*c)) return false;
+        int e = 0;
+        for (; c < end && isDigit(*c); ++c) {
+            if (e < 100000) e = e * 10 + (*c - '0');
+        }
+        exponent += negative_exponent ? -e : e;
+    }
+    if (c != end) return false;
+
+    if (mantissa == 0) {
+        value = negative ? -0.f : 0.f;
+        return true;
+    }
+    // Both operands are exact floats, so the single float division or product is correctly
+    // rounded. Going through double would round twice.
+    if (digits == MAX_MANTISSA_DIGITS || mantissa > MAX_EXACT_MANTISSA ||
+        exponent < -MAX_EXACT_POWER || exponent > MAX_EXACT_POWER) {
+        return parseFloatSlow(begin, end, value);
+    }
+    float result = static_cast<float>(mantissa);
+    result = exponent < 0 ? result / EXACT_POWERS[-exponent] : result * EXACT_POWERS[exponent];
+    value = negative ? -result : result;
+    return true;
+}
+
+bool parseSceneFloat(const SceneToken &token, float &value) {
+    return parseSceneFloat(token.begin, token.end, value);
+}
+
+bool parseSceneInt(const SceneToken &token, int &value) {
+    const char *c = token.begin;
+    const bool negative = c < token.end && *c == '-';
+    if (c < token.end && (*c == '-' || *c == '+')) ++c;
+    if (c == token.end) return false;
+    int64_t result = 0;
+    for (; c < token.end; ++c) {
+        if (!isDigit(*c)) return false;
+        result = result * 10 + (*c - '0');
+        if (result > INT32_MAX) return false;
+    }
+    value = static_cast<int>(negative ? -result : result);
+    return true;
+}
+
+bool parseSceneVec3(const SceneToken &token, float3 &value) {
+    float v[3];
+    const char *c = token.begin;
+    for (int i = 0; i < 3; ++i) {
+        const char *comma = c;
+        while (comma < token.end && *comma != ',') ++comma;
+        if ((comma == token.end) != (i == 2)) return false;
+        if (!parseSceneFloat(c, comma, v[i])) return false;
+        c = comma + 1;
+    }
+    value = make_float3(v[0], v[1], v[2]);
+    return true;
+}
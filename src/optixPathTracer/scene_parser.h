@@ -0,0 +1,81 @@
+#pragma once
+
+#include <sutil/vec_math.h>
+
+#include <cstddef>
+#include <string>
+
+/*
+*   Single pass tokenizer for the scene text format. The file is memory mapped, every line
+*   is split into whitespace separated tokens that point into the mapping and numbers are
+*   parsed in place, so nothing is allocated per line or per token.
+*/
+
+// A token, a view into the mapped file
+struct SceneToken {
+    const char *begin = nullptr;
+    const char *end = nullptr;
+
+    size_t size() const { return static_cast<size_t>(end - begin); }
+    bool operator==(const char *text) const;
+    bool operator!=(const char *text) const { return !(*this == text); }
+    bool operator==(const SceneToken &other) const;
+    bool operator!=(const SceneToken &other) const { return !(*this == other); }
+    std::string str() const { return std::string(begin, end); }
+};
+
+struct SceneLine {
+    static const int MAX_TOKENS = 8;
+
+    int number = 0;                 // 1-based
+    const char *begin = nullptr;    // first character of the line, for columns
+    SceneToken tokens[MAX_TOKENS];
+    int count = 0;                  // tokens on the line, only the first MAX_TOKENS are stored
+
+    int column(const SceneToken &token) const { return static_cast<int>(token.begin - begin) + 1; }
+};
+
+class SceneFile {
+public:
+    SceneFile() = default;
+    ~SceneFile();
+
+    SceneFile(const SceneFile &) = delete;
+    SceneFile &operator=(const SceneFile &) = delete;
+
+    // Maps the file, returns false if it cannot be opened
+    bool open(const std::string &filename);
+    void close();
+
+    /*
+    *   Moves the mapped file into anonymous memory, tokens from before are invalidated.
+    *   Tokens kept after parsing then stay valid and unchanged when the file is rewritten
+    *   in place or truncated, like editors do, which a file mapping does not survive.
+    */
+    bool detach();
+
+    void swap(SceneFile &other);
+
+    // Tokenizes the next line that is not blank, returns false at the end of the file
+    bool nextLine(SceneLine &line);
+
+    // "<file>:<line>:<column>" of a token, for error messages
+    std::string location(const SceneLine &line, const SceneToken &token) const;
+
+    const std::string &filename() const { return m_filename; }
+
+private:
+    std::string m_filename;
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    const char *m_cursor = nullptr;
+    int m_line = 0;
+};
+
+// The whole token has to be a number, like 1, -2.5, .5 or 1e-3
+bool parseSceneFloat(const char *begin, const char *end, float &value);
+bool parseSceneFloat(const SceneToken &token, float &value);
+bool parseSceneInt(const SceneToken &token, int &value);
+
+// Three comma separated floats, like 0,1.5,-2
+bool parseSceneVec3(const SceneToken &token, float3 &value);
@@ -0,0 +1,203 @@
+#include "scene_snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    const char SNAPSHOT_MAGIC[8] = {'P', 'T', 'S', 'N', 'A', 'P', '\0', '\0'};
+    const size_t HASH_CHUNK_SIZE = size_t(4) << 20;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t num_sections;
+        uint64_t file_size;         // catches truncated files
+        uint64_t table_hash;        // FNV-1a of the section table
+    };
+
+    size_t alignUp(size_t offset) {
+        return (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+    }
+
+    bool writeAll(FILE *file, const void *data, size_t size) {
+        return size == 0 || fwrite(data, 1, size, file) == size;
+    }
+
+    // FNV-1a of HASH_CHUNK_SIZE chunks on all hardware threads, then of the chunk hashes and the size
+    uint64_t hashChunks(const char *data, size_t size) {
+        const size_t num_chunks = (size + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE;
+        std::vector<uint64_t> chunk_hashes(num_chunks);
+        std::atomic<size_t> next_chunk(0);
+        const auto hashChunk = [&]() {
+            for (size_t chunk = next_chunk++; chunk < num_chunks; chunk = next_chunk++) {
+                const size_t begin = chunk * HASH_CHUNK_SIZE;
+                chunk_hashes[chunk] = fnv1a64(data + begin, std::min(HASH_CHUNK_SIZE, size - begin));
+            }
+        };
+        const size_t num_threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), num_chunks);
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < num_threads; ++i)
+            threads.emplace_back(hashChunk);
+        hashChunk();
+        for (std::thread &thread: threads)
+            thread.join();
+
+        const uint64_t size64 = size;
+        const uint64_t hash = fnv1a64(&size64, sizeof(size64));
+        return fnv1a64(chunk_hashes.data(), chunk_hashes.size() * sizeof(uint64_t), hash);
+    }
+}
+
+struct SnapshotSectionEntry {
+    char name[SNAPSHOT_MAX_NAME + 1];
+    uint64_t offset;
+    uint64_t size;
+    uint64_t hash;      // of the payload, the table hash covers it
+};
+
+uint64_t fnv1a64(const void *data, size_t size, uint64_t hash) {
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= FNV1A64_PRIME;
+    }
+    return hash;
+}
+
+uint64_t hashFile(const std::string &filename) {
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        return 0;
+    }
+    const size_t size = static_cast<size_t>(info.st_size);
+    const char *data = nullptr;
+    if (size > 0) {
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            ::close(fd);
+            return 0;
+        }
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(mapping);
+    }
+    ::close(fd);
+
+    const uint64_t hash = hashChunks(data, size);
+    if (data) munmap(const_cast<char *>(data), size);
+    // 0 is reserved for unreadable files
+    return hash ? hash : 1;
+}
+
+void SnapshotWriter::add(const std::string &name, const void *data, size_t size) {
+    m_sections.push_back({name.substr(0, SNAPSHOT_MAX_NAME), data, size});
+}
+
+bool SnapshotWriter::write(const std::string &filename) const {
+    std::vector<SnapshotSectionEntry> table(m_sections.size());
+    size_t offset = alignUp(sizeof(FileHeader) + table.size() * sizeof(SnapshotSectionEntry));
+    for (size_t i = 0; i < m_sections.size(); ++i) {
+        memset(&table[i], 0, sizeof(table[i]));
+        memcpy(table[i].name, m_sections[i].name.c_str(), m_sections[i].name.size());
+        table[i].offset = offset;
+        table[i].size = m_sections[i].size;
+        table[i].hash = hashChunks(static_cast<const char *>(m_sections[i].data), m_sections[i].size);
+        offset = alignUp(offset + m_sections[i].size);
+    }
+
+    FileHeader header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.num_sections = static_cast<uint32_t>(table.size());
+    header.file_size = offset;
+    header.table_hash = fnv1a64(table.data(), table.size() * sizeof(SnapshotSectionEntry));
+
+    const std::string temp_filename = filename + ".tmp";
+    FILE *file = fopen(temp_filename.c_str(), "wb");
+    if (!file) return false;
+    static const char padding[SNAPSHOT_ALIGNMENT] = {};
+    bool ok = writeAll(file, &header, sizeof(header)) &&
+              writeAll(file, table.data(), table.size() * sizeof(SnapshotSectionEntry));
+    size_t written = sizeof(header) + table.size() * sizeof(SnapshotSectionEntry);
+    for (size_t i = 0; i < m_sections.size() && ok; ++i) {
+        ok = writeAll(file, padding, table[i].offset - written) &&
+             writeAll(file, m_sections[i].data, m_sections[i].size);
+        written = table[i].offset + m_sections[i].size;
+    }
+    ok = ok && writeAll(file, padding, offset - written);
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp_filename.c_str(), filename.c_str()) != 0) {
+        remove(temp_filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+SnapshotReader::~SnapshotReader() {
+    close();
+}
+
+bool SnapshotReader::open(const std::string &filename) {
+    close();
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(FileHeader)) {
+        ::close(fd);
+        return false;
+    }
+    const size_t size = static_cast<size_t>(info.st_size);
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) return false;
+    m_data = static_cast<const char *>(mapping);
+    m_size = size;
+
+    FileHeader header;
+    memcpy(&header, m_data, sizeof(header));
+    const size_t table_size = static_cast<size_t>(header.num_sections) * sizeof(SnapshotSectionEntry);
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION ||
+        header.file_size != size || table_size > size - sizeof(FileHeader) ||
+        fnv1a64(m_data + sizeof(FileHeader), table_size) != header.table_hash) {
+        close();
+        return false;
+    }
+    m_sections = reinterpret_cast<const SnapshotSectionEntry *>(m_data + sizeof(FileHeader));
+    m_num_sections = header.num_sections;
+    for (uint32_t i = 0; i < m_num_sections; ++i) {
+        if (m_sections[i].offset > size || m_sections[i].size > size - m_sections[i].offset ||
+            hashChunks(m_data + m_sections[i].offset, m_sections[i].size) != m_sections[i].hash) {
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void SnapshotReader::close() {
+    if (m_data) munmap(const_cast<char *>(m_data), m_size);
+    m_data = nullptr;
+    m_size = 0;
+    m_sections = nullptr;
+    m_num_sections = 0;
+}
+
+bool SnapshotReader::find(const std::string &name, const void *&data, size_t &size) const {
+    for (uint32_t i = 0; i < m_num_sections; ++i) {
+        if (strncmp(m_sections[i].name, name.c_str(), SNAPSHOT_MAX_NAME + 1) != 0) continue;
+        data = m_data + m_sections[i].offset;
+        size = static_cast<size_t>(m_sections[i].size);
+        return true;
+    }
+    return false;
+}
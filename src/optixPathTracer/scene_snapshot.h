@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+*   Prepared scene snapshots: named byte sections in one file that is memory mapped on load.
+*   Sections start at SNAPSHOT_ALIGNMENT, so arrays of the scene buffers can be copied (or
+*   used) straight from the mapping. Every section is hashed, so a damaged file is refused
+*   as a whole. The file does not know what it holds, the caller checks that its inputs are
+*   unchanged (content hashes) before using any section.
+*/
+
+const uint32_t SNAPSHOT_VERSION = 2;
+const size_t SNAPSHOT_ALIGNMENT = 64;
+const size_t SNAPSHOT_MAX_NAME = 47;    // characters of a section name
+
+const uint64_t FNV1A64_OFFSET = 0xcbf29ce484222325ull;
+const uint64_t FNV1A64_PRIME = 0x100000001b3ull;
+
+// FNV-1a over the bytes, continues hash
+uint64_t fnv1a64(const void *data, size_t size, uint64_t hash = FNV1A64_OFFSET);
+
+/*
+*   Content hash of a file: FNV-1a of 4 MiB chunks hashed on all hardware threads, then of
+*   the chunk hashes and the size, so hashing large obj files and textures scales with the cores.
+*   0 if the file cannot be read, which then is its hash as an input too.
+*/
+uint64_t hashFile(const std::string &filename);
+
+struct SnapshotSectionEntry;
+
+class SnapshotWriter {
+public:
+    // The data is not copied and has to stay alive until write()
+    void add(const std::string &name, const void *data, size_t size);
+
+    template<typename T>
+    void add(const std::string &name, const std::vector<T> &values) {
+        add(name, values.data(), values.size() * sizeof(T));
+    }
+
+    // Writes to <filename>.tmp and renames it, so a crash never leaves a partial snapshot
+    bool write(const std::string &filename) const;
+
+private:
+    struct Section {
+        std::string name;
+        const void *data;
+        size_t size;
+    };
+
+    std::vector<Section> m_sections;
+};
+
+class SnapshotReader {
+public:
+    SnapshotReader() = default;
+    ~SnapshotReader();
+
+    SnapshotReader(const SnapshotReader &) = delete;
+    SnapshotReader &operator=(const SnapshotReader &) = delete;
+
+    // Maps the file, false if it cannot be opened, has another version or any part of it is damaged
+    bool open(const std::string &filename);
+    void close();
+    bool isOpen() const { return m_data != nullptr; }
+
+    // Points data into the mapping, false if there is no such section
+    bool find(const std::string &name, const void *&data, size_t &size) const;
+
+    // Copies a section of T, false if it is missing or not a whole number of T
+    template<typename T>
+    bool read(const std::string &name, std::vector<T> &values) const {
+        const void *data;
+        size_t size;
+        if (!find(name, data, size) || size % sizeof(T) != 0) return false;
+        const T *begin = static_cast<const T *>(data);
+        values.assign(begin, begin + size / sizeof(T));
+        return true;
+    }
+
+    size_t size() const { return m_size; }
+
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    const SnapshotSectionEntry *m_sections = nullptr;
+    uint32_t m_num_sections = 0;
+};
@@ -0,0 +1,221 @@
+#include <optix.h>
+#include <cuda_runtime.h>
+
+#include "session_scheduler.h"
+
+#include <algorithm>
+
+SessionScheduler::SessionScheduler(RenderServer &server, unsigned int num_threads)
+        : m_server(server),
+          m_num_threads(num_threads > 0 ? num_threads : std::max(1u, std::thread::hardware_concurrency())) {}
+
+SessionScheduler::~SessionScheduler() {
+    stop();
+}
+
+void SessionScheduler::start() {
+    if (!m_threads.empty()) return;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = false;
+        m_sessions_changed = true;
+        m_quanta = 0;
+        m_late_quanta = 0;
+        for (auto &entry: m_entries)
+            entry.second.quanta = 0;
+    }
+    // Idle threads sleep until a session is opened, closed or steered, or a subframe is sent
+    m_server.setChangeListener([this]() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_sessions_changed = true;
+        }
+        m_wake.notify_all();
+    });
+    for (unsigned int i = 0; i < m_num_threads; ++i)
+        m_threads.emplace_back(&SessionScheduler::worker, this);
+}
+
+void SessionScheduler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    for (std::thread &thread: m_threads)
+        thread.join();
+    m_threads.clear();
+    m_server.setChangeListener(nullptr);
+}
+
+void SessionScheduler::syncEntries() {
+    const std::vector<std::shared_ptr<RenderSession>> sessions = m_server.sessions();
+    for (auto &entry: m_entries)
+        entry.second.listed = false;
+    for (const std::shared_ptr<RenderSession> &session: sessions) {
+        Entry &entry = m_entries[session->id()];
+        if (!entry.session) {
+            entry.session = session;
+            // A new session starts at the current virtual time, not with the credit of the whole past
+            entry.finish_tag = m_virtual_time;
+        }
+        entry.listed = true;
+    }
+    // Closed sessions go once their subframe in progress is sent
+    for (auto it = m_entries.begin(); it != m_entries.end();) {
+        if (!it->second.listed && it->second.state == EntryState::IDLE) it = m_entries.erase(it);
+        else ++it;
+    }
+}
+
+size_t SessionScheduler::queuedQuanta(const Entry &entry) const {
+    const int height = entry.session->height();
+    if (entry.state == EntryState::RENDERING)
+        return static_cast<size_t>((height - entry.next_row + SCHEDULER_QUANTUM_ROWS - 1) / SCHEDULER_QUANTUM_ROWS);
+    if (entry.state == EntryState::IDLE && entry.listed && !m_stopping && entry.session->active())
+        return static_cast<size_t>((height + SCHEDULER_QUANTUM_ROWS - 1) / SCHEDULER_QUANTUM_ROWS);
+    return 0;
+}
+
+bool SessionScheduler::pick(Quantum &quantum) {
+    if (m_sessions_changed) {
+        m_sessions_changed = false;
+        syncEntries();
+    }
+    const auto now = std::chrono::steady_clock::now();
+
+    Entry *best = nullptr;
+    double best_start = 0.0, best_finish = 0.0, best_overrun = 0.0;
+    for (auto &item: m_entries) {
+        Entry &entry = item.second;
+        if (queuedQuanta(entry) == 0) {
+            entry.start_tag = -1.0;
+            continue;
+        }
+        // Tagged once when it gets ready, so a waiting quantum gets older while virtual time advances
+        if (entry.start_tag < 0.0) entry.start_tag = std::max(m_virtual_time, entry.finish_tag);
+        RenderSession &session = *entry.session;
+        const bool interactive = session.interactive(now);
+        const double weight = session.weight() * (interactive ? INTERACTIVE_WEIGHT : 1.f);
+        const int first_row = entry.state == EntryState::RENDERING ? entry.next_row : 0;
+        const int rows = std::min(SCHEDULER_QUANTUM_ROWS, session.height() - first_row);
+        const double start = entry.start_tag;
+        const double finish = start + static_cast<double>(rows) * session.width() / weight;
+
+        // How far a subframe of an interactive session in progress is past its latency target
+        double overrun = 0.0;
+        if (interactive && entry.state == EntryState::RENDERING) {
+            std::lock_guard<std::mutex> lock(session.m_mutex);
+            overrun = std::chrono::duration<double, std::milli>(now - session.m_subframe_start).count() -
+                      session.m_latency_target_ms;
+        }
+        const bool better = !best ||
+                            (overrun > 0.0 ? overrun > best_overrun : best_overrun <= 0.0 && finish < best_finish);
+        if (better) {
+            best = &entry;
+            best_start = start;
+            best_finish = finish;
+            best_overrun = std::max(0.0, overrun);
+        }
+    }
+    if (!best) return false;
+
+    if (best->state == EntryState::IDLE) {
+        if (!best->session->beginSubframe(m_server.sharedParams(), best->params)) {
+            // Closed since the entries were synced
+            best->listed = false;
+            m_sessions_changed = true;
+            return false;
+        }
+        best->state = EntryState::RENDERING;
+        best->next_row = 0;
+        best->rows_done = 0;
+        best->active_pixels = 0;
+        best->render_ms = 0.0;
+    }
+    quantum.entry = best;
+    quantum.y0 = best->next_row;
+    quantum.y1 = std::min(best->next_row + SCHEDULER_QUANTUM_ROWS, best->session->height());
+    best->next_row = quantum.y1;
+    // Start-time fair queuing: virtual time is the start tag of the quantum in service
+    m_virtual_time = best_start;
+    best->finish_tag = best_finish;
+    best->start_tag = -1.0;
+    if (best_overrun > 0.0) ++m_late_quanta;
+    ++m_running;
+    return true;
+}
+
+void SessionScheduler::worker() {
+    const CpuScene &scene = m_server.scene();
+    const CpuRenderer &renderer = m_server.renderer();
+    for (;;) {
+        Quantum quantum;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!pick(quantum)) {
+                const bool in_progress = std::any_of(m_entries.begin(), m_entries.end(),
+                                                     [](const std::pair<const uint32_t, Entry> &item) {
+                                                         return item.second.state != EntryState::IDLE;
+                                                     });
+                if (m_stopping && !in_progress) return;
+                m_wake.wait(lock);
+            }
+        }
+
+        Entry &entry = *quantum.entry;
+        const auto t0 = std::chrono::steady_clock::now();
+        const unsigned int active = renderer.launchRect(scene, entry.params, 0, quantum.y0, entry.session->width(),
+                                                        quantum.y1);
+        const auto t1 = std::chrono::steady_clock::now();
+
+        bool finished;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            entry.active_pixels += active;
+            entry.render_ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+            entry.rows_done += quantum.y1 - quantum.y0;
+            ++entry.quanta;
+            ++m_quanta;
+            --m_running;
+            finished = entry.rows_done == entry.session->height();
+            // The frame buffer is read by the sink, the next subframe waits until it is sent
+            if (finished) entry.state = EntryState::FINISHING;
+        }
+        if (!finished) continue;
+        entry.session->finishSubframe(entry.params, entry.active_pixels, entry.render_ms);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            entry.state = EntryState::IDLE;
+            // A session closed during the subframe is dropped now
+            if (!entry.listed) m_sessions_changed = true;
+        }
+        m_wake.notify_all();
+    }
+}
+
+SchedulerStats SessionScheduler::stats() const {
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    SchedulerStats stats;
+    stats.running = m_running;
+    stats.quanta = m_quanta;
+    stats.late_quanta = m_late_quanta;
+    for (const auto &item: m_entries) {
+        const Entry &entry = item.second;
+        if (!entry.listed) continue;
+        const SessionStats session_stats = entry.session->stats();
+        SessionShare share;
+        share.id = item.first;
+        share.interactive = entry.session->interactive(now);
+        share.weight = entry.session->weight() * (share.interactive ? INTERACTIVE_WEIGHT : 1.f);
+        share.queued = queuedQuanta(entry);
+        share.quanta = entry.quanta;
+        share.recent_fps = session_stats.recent_fps;
+        share.last_latency_ms = session_stats.last_latency_ms;
+        share.late_subframes = session_stats.late_subframes;
+        stats.queue_depth += share.queued;
+        stats.sessions.push_back(share);
+    }
+    return stats;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "render_session.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+*   Shares the render threads of a RenderServer between its sessions by weighted fair
+*   queuing. Work is handed out in quanta of SCHEDULER_QUANTUM_ROWS rows of one subframe,
+*   so a large frame never holds the threads for a whole subframe. Each session carries a
+*   virtual finish time that grows by the pixels of every quantum over its weight, and the
+*   ready session with the smallest one runs next. Interactive sessions count
+*   INTERACTIVE_WEIGHT times their weight; one whose subframe in progress is past its
+*   latency target runs before all others, the furthest behind first.
+*/
+
+const int SCHEDULER_QUANTUM_ROWS = 8;
+const float INTERACTIVE_WEIGHT = 8.f;
+
+struct SessionShare {
+    uint32_t id = 0;
+    bool interactive = false;
+    float weight = 0.f;             // including INTERACTIVE_WEIGHT
+    size_t queued = 0;              // quanta ready to run
+    uint64_t quanta = 0;            // rendered since start()
+    double recent_fps = 0.0;        // achieved, see SessionStats
+    double last_latency_ms = 0.0;
+    uint64_t late_subframes = 0;
+};
+
+struct SchedulerStats {
+    size_t queue_depth = 0;         // quanta ready to run over all sessions
+    size_t running = 0;             // quanta being rendered
+    uint64_t quanta = 0;            // rendered since start()
+    uint64_t late_quanta = 0;       // of them run first for a session past its latency target
+    std::vector<SessionShare> sessions;
+};
+
+class SessionScheduler {
+public:
+    // 0 threads uses all hardware threads, the server has to outlive the scheduler
+    explicit SessionScheduler(RenderServer &server, unsigned int num_threads = 0);
+    ~SessionScheduler();
+
+    SessionScheduler(const SessionScheduler &) = delete;
+    SessionScheduler &operator=(const SessionScheduler &) = delete;
+
+    // Renders the sessions of the server on the scheduler threads until stop()
+    void start();
+
+    // Returns once the subframes in progress are sent, no new ones start
+    void stop();
+
+    SchedulerStats stats() const;
+
+private:
+    enum class EntryState { IDLE, RENDERING, FINISHING };
+
+    struct Entry {
+        std::shared_ptr<RenderSession> session;
+        bool listed = true;         // not closed on the server
+        EntryState state = EntryState::IDLE;
+        Params params;              // of the subframe in progress
+        int next_row = 0;           // first row not handed out
+        int rows_done = 0;
+        unsigned int active_pixels = 0;
+        double render_ms = 0.0;
+        double finish_tag = 0.0;    // virtual finish time of the last quantum
+        double start_tag = -1.0;    // of the next quantum since it is ready, < 0 while none is
+        uint64_t quanta = 0;
+    };
+
+    struct Quantum {
+        Entry *entry = nullptr;
+        int y0 = 0, y1 = 0;
+    };
+
+    void worker();
+
+    // With m_mutex held: takes the next quantum, false if none is ready
+    bool pick(Quantum &quantum);
+    // With m_mutex held: adds the sessions opened on the server and drops the closed ones
+    void syncEntries();
+    size_t queuedQuanta(const Entry &entry) const;
+
+    RenderServer &m_server;
+    const unsigned int m_num_threads;
+    std::vector<std::thread> m_threads;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::map<uint32_t, Entry> m_entries;
+    double m_virtual_time = 0.0;
+    bool m_sessions_changed = true; // the entries have to be synced with the server
+    bool m_stopping = false;
+    size_t m_running = 0;
+    uint64_t m_quanta = 0;
+    uint64_t m_late_quanta = 0;
+};
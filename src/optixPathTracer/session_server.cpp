@@ -0,0 +1,193 @@
+#include <optix.h>
+#include <cuda_runtime.h>
+
+#include "session_server.h"
+#include "tcp_socket.h"
+
+#include <sutil/sutil.h>
+
+#include <cerrno>
+#include <sstream>
+#include <string>
+
+#include <sys/socket.h>
+
+namespace {
+    // A viewer sending longer lines is dropped
+    const size_t MAX_COMMAND_LENGTH = 1024;
+    const size_t SESSION_VIEWER_QUEUE_FRAMES = 2;
+
+    std::string sessionLabels(const RenderSession &session) {
+        return "session=\"" + std::to_string(session.id()) + "\"";
+    }
+
+    void applyCommand(RenderSession &session, const std::string &line) {
+        std::istringstream fields(line);
+        std::string kind;
+        if (!(fields >> kind)) return;
+        if (kind == "camera") {
+            float3 eye, lookat, up;
+            float fovy;
+            if (!(fields >> eye.x >> eye.y >> eye.z >> lookat.x >> lookat.y >> lookat.z >> up.x >> up.y >> up.z >>
+                  fovy))
+                return;
+            sutil::Camera view = session.camera();
+            view.setEye(eye);
+            view.setLookat(lookat);
+            view.setUp(up);
+            view.setFovY(fovy);
+            session.setCamera(view);
+        } else if (kind == "budget") {
+            int32_t subframes;
+            if (fields >> subframes) session.setSampleBudget(subframes);
+        }
+    }
+}
+
+// Sends the frames of its session to the connection
+class SessionServer::Viewer : public FrameSink {
+public:
+    explicit Viewer(int fd) : fd(fd), fanout(new FrameFanout(SESSION_VIEWER_QUEUE_FRAMES)) {}
+
+    ~Viewer() override {
+        // The sender thread is joined before the socket goes
+        fanout.reset();
+        closeSocket(fd);
+    }
+
+    void sendFrame(const RenderSession &, const float4 *pixels, int width, int height) override {
+        sutil::ImageBuffer image;
+        image.data = const_cast<float4 *>(pixels);
+        image.width = width;
+        image.height = height;
+        image.pixel_format = sutil::BufferImageFormat::FLOAT4;
+        std::vector<unsigned char> ppm;
+        sutil::encodeImage("session.ppm", image, false, ppm);
+        if (!ppm.empty()) fanout->publish(std::move(ppm));
+    }
+
+    const int fd;
+    std::unique_ptr<FrameFanout> fanout;
+    std::shared_ptr<RenderSession> session;
+    std::thread reader;
+    std::atomic<bool> finished{false};  // set under SessionServer::m_mutex
+};
+
+SessionServer::SessionServer(RenderServer &server, int width, int height, const sutil::Camera &camera)
+        : m_server(server), m_width(width), m_height(height), m_camera(camera) {}
+
+SessionServer::~SessionServer() {
+    if (m_listen_fd >= 0) {
+        // Wakes the acceptor blocked in accept()
+        shutdown(m_listen_fd, SHUT_RDWR);
+        m_acceptor.join();
+        closeSocket(m_listen_fd);
+    }
+    std::vector<std::unique_ptr<Viewer>> viewers;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        viewers.swap(m_viewers);
+    }
+    m_viewer_finished.notify_one();
+    if (m_reaper.joinable()) m_reaper.join();
+    // Wakes the readers, which close their sessions
+    for (const std::unique_ptr<Viewer> &viewer: viewers)
+        shutdown(viewer->fd, SHUT_RDWR);
+    for (const std::unique_ptr<Viewer> &viewer: viewers)
+        viewer->reader.join();
+}
+
+bool SessionServer::listen(uint16_t port, uint16_t *bound_port) {
+    if (m_listen_fd >= 0) return false;
+    m_listen_fd = listenTcp(port, false, bound_port);
+    if (m_listen_fd < 0) return false;
+    m_acceptor = std::thread(&SessionServer::accept, this);
+    m_reaper = std::thread(&SessionServer::reapFinished, this);
+    return true;
+}
+
+size_t SessionServer::numViewers() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t connected = 0;
+    for (const std::unique_ptr<Viewer> &viewer: m_viewers)
+        if (!viewer->finished) ++connected;
+    return connected;
+}
+
+uint64_t SessionServer::framesDropped() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t dropped = m_frames_dropped;
+    for (const std::unique_ptr<Viewer> &viewer: m_viewers)
+        dropped += viewer->fanout->framesDropped();
+    return dropped;
+}
+
+void SessionServer::accept() {
+    for (int fd = acceptTcp(m_listen_fd); fd >= 0; fd = acceptTcp(m_listen_fd)) {
+        std::unique_ptr<Viewer> viewer(new Viewer(fd));
+        viewer->session = m_server.openSession(m_width, m_height, m_camera, viewer.get());
+        viewer->fanout->subscribe(fd, "session " + std::to_string(viewer->session->id()));
+        if (m_metrics) {
+            const std::weak_ptr<RenderSession> session = viewer->session;
+            m_metrics->gaugeCallback("pt_session_fps", "Subframes per second of a session over about the last second",
+                                     sessionLabels(*viewer->session), [session]() {
+                                         const std::shared_ptr<RenderSession> open = session.lock();
+                                         return open ? open->stats().recent_fps : 0.0;
+                                     });
+        }
+        viewer->reader = std::thread(&SessionServer::serve, this, viewer.get());
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_viewers.push_back(std::move(viewer));
+    }
+}
+
+void SessionServer::serve(Viewer *viewer) {
+    std::string pending;
+    char chunk[256];
+    for (;;) {
+        const ssize_t received = recv(viewer->fd, chunk, sizeof(chunk), 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) break;
+        pending.append(chunk, static_cast<size_t>(received));
+        for (size_t end = pending.find('\n'); end != std::string::npos; end = pending.find('\n')) {
+            applyCommand(*viewer->session, pending.substr(0, end));
+            pending.erase(0, end + 1);
+        }
+        if (pending.size() > MAX_COMMAND_LENGTH) break;
+    }
+    m_server.closeSession(viewer->session->id());
+    if (m_metrics) m_metrics->removeCallback("pt_session_fps", sessionLabels(*viewer->session));
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        viewer->finished = true;
+    }
+    m_viewer_finished.notify_one();
+}
+
+void SessionServer::reapFinished() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopping) {
+        std::vector<std::unique_ptr<Viewer>> finished;
+        reap(finished);
+        if (finished.empty()) {
+            m_viewer_finished.wait(lock);
+            continue;
+        }
+        lock.unlock();
+        for (const std::unique_ptr<Viewer> &gone: finished)
+            gone->reader.join();
+        finished.clear();
+        lock.lock();
+    }
+}
+
+void SessionServer::reap(std::vector<std::unique_ptr<Viewer>> &finished) {
+    for (size_t i = m_viewers.size(); i-- > 0;) {
+        if (!m_viewers[i]->finished) continue;
+        m_frames_dropped += m_viewers[i]->fanout->framesDropped();
+        finished.push_back(std::move(m_viewers[i]));
+        m_viewers.erase(m_viewers.begin() + static_cast<std::ptrdiff_t>(i));
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <sutil/Camera.h>
+
+#include "frame_fanout.h"
+#include "metrics.h"
+#include "render_session.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+*   Remote viewers of a RenderServer over TCP (--serve). Every connection opens a session
+*   with the size and view the server was started with and receives its frames as binary
+*   PPM, back to back, through a FrameFanout of its own, so a slow viewer drops frames
+*   instead of holding up the render threads. A viewer steers its session with text lines,
+*   vectors as x y z, other lines are ignored:
+*
+*       camera <eye> <lookat> <up> <fovy>
+*       budget <subframes>                  0 renders until the view converges
+*
+*   Closing the connection closes the session. With a metrics registry every open session
+*   has its recent frame rate in pt_session_fps{session="<id>"}.
+*/
+
+const uint16_t SESSION_SERVER_PORT = 7620;  // default of --serve
+
+class SessionServer {
+public:
+    // The server has to outlive the session server
+    SessionServer(RenderServer &server, int width, int height, const sutil::Camera &camera);
+    ~SessionServer();
+
+    SessionServer(const SessionServer &) = delete;
+    SessionServer &operator=(const SessionServer &) = delete;
+
+    // Before listen(), the registry has to outlive the session server
+    void setMetrics(MetricsRegistry &metrics) { m_metrics = &metrics; }
+
+    // Port 0 picks one which is stored in *bound_port
+    bool listen(uint16_t port, uint16_t *bound_port = nullptr);
+
+    size_t numViewers() const;
+    // For slow viewers, including the ones gone since
+    uint64_t framesDropped() const;
+
+private:
+    class Viewer;
+
+    void accept();
+    // Applies the commands of the viewer until it disconnects, then closes its session
+    void serve(Viewer *viewer);
+    // Joins and frees the viewers as they disconnect, until the server is destroyed
+    void reapFinished();
+    // Moves out the viewers whose connection is gone, with m_mutex held; they are joined without it
+    void reap(std::vector<std::unique_ptr<Viewer>> &finished);
+
+    RenderServer &m_server;
+    const int m_width;
+    const int m_height;
+    const sutil::Camera m_camera;
+    MetricsRegistry *m_metrics = nullptr;
+
+    mutable std::mutex m_mutex;     // guards m_viewers, m_frames_dropped and m_stopping
+    std::condition_variable m_viewer_finished;
+    std::vector<std::unique_ptr<Viewer>> m_viewers;
+    uint64_t m_frames_dropped = 0;
+    bool m_stopping = false;
+
+    int m_listen_fd = -1;
+    std::thread m_acceptor;
+    std::thread m_reaper;
+};
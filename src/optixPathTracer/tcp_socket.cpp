@@ -0,0 +1,128 @@
+#include "tcp_socket.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace {
+    const size_t MAX_HTTP_REQUEST_BYTES = 8192;
+
+    void setNoDelay(int fd) {
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+}
+
+int listenTcp(uint16_t port, bool loopback_only, uint16_t *bound_port) {
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(loopback_only ? INADDR_LOOPBACK : INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (bound_port) {
+        socklen_t size = sizeof(address);
+        getsockname(fd, reinterpret_cast<sockaddr *>(&address), &size);
+        *bound_port = ntohs(address.sin_port);
+    }
+    return fd;
+}
+
+int connectTcp(const std::string &address) {
+    const size_t colon = address.rfind(':');
+    const std::string host = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+    const std::string port = colon == std::string::npos ? address : address.substr(colon + 1);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *results = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0) return -1;
+    int fd = -1;
+    for (addrinfo *result = results; result && fd < 0; result = result->ai_next) {
+        fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+        if (fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(results);
+    if (fd >= 0) setNoDelay(fd);
+    return fd;
+}
+
+int acceptTcp(int listen_fd) {
+    for (;;) {
+        const int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd >= 0) {
+            setNoDelay(fd);
+            return fd;
+        }
+        if (errno != EINTR) return -1;
+    }
+}
+
+bool sendAll(int fd, const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        const ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        bytes += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+bool recvAll(int fd, void *data, size_t size) {
+    char *bytes = static_cast<char *>(data);
+    while (size > 0) {
+        const ssize_t received = recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        bytes += received;
+        size -= static_cast<size_t>(received);
+    }
+    return true;
+}
+
+std::string readHttpGet(int fd, int timeout_s) {
+    timeval timeout = {timeout_s, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string request;
+    char chunk[512];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < MAX_HTTP_REQUEST_BYTES) {
+        const ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return std::string();
+        request.append(chunk, static_cast<size_t>(received));
+    }
+    if (request.compare(0, 4, "GET ") != 0) return std::string();
+    const size_t end = request.find(' ', 4);
+    return end == std::string::npos ? std::string() : request.substr(4, end - 4);
+}
+
+bool sendHttpStatus(int fd, const char *status) {
+    const std::string response = std::string("HTTP/1.0 ") + status + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    return sendAll(fd, response.data(), response.size());
+}
+
+void closeSocket(int fd) {
+    if (fd >= 0) close(fd);
+}
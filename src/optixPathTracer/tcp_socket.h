@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+*   Blocking TCP helpers for the render cluster and the embedded endpoints. Sockets are plain
+*   file descriptors, functions that create one return -1 on failure. Sending to a peer that
+*   went away fails instead of raising SIGPIPE.
+*/
+
+// Listens on port, 0 picks a free one which is stored in *bound_port
+int listenTcp(uint16_t port, bool loopback_only = false, uint16_t *bound_port = nullptr);
+
+// "host:port", or "port" for localhost
+int connectTcp(const std::string &address);
+
+// Waits for the next connection on a listening socket
+int acceptTcp(int listen_fd);
+
+bool sendAll(int fd, const void *data, size_t size);
+
+// False if the connection closed or failed before size bytes arrived
+bool recvAll(int fd, void *data, size_t size);
+
+// Reads the head of an HTTP request, waiting at most timeout_s for it, and returns the path
+// of a GET, empty for anything else
+std::string readHttpGet(int fd, int timeout_s);
+
+// Sends a response without a body, like "404 Not Found"
+bool sendHttpStatus(int fd, const char *status);
+
+void closeSocket(int fd);
@@ -0,0 +1,52 @@
+#include <cuda_runtime.h>
+
+#include "temporal_reprojection.h"
+
+#include <algorithm>
+
+void TemporalReprojection::reset() {
+    m_width = m_height = 0;
+    m_output.clear();
+    m_depth.clear();
+    m_normal.clear();
+    m_history.clear();
+    m_coverage = 0.f;
+}
+
+void TemporalReprojection::warpHistory(const float *depth, const float4 *normal, const ReprojectionCamera &camera) {
+    size_t covered = 0;
+    for (int y = 0; y < m_height; ++y) {
+        for (int x = 0; x < m_width; ++x) {
+            covered += warpPixel(x, y, m_width, m_height, depth, normal, camera, m_camera, m_output.data(),
+                                 m_depth.data(), m_normal.data(), settings, m_history[y * m_width + x]);
+        }
+    }
+    m_coverage = static_cast<float>(covered) / (m_width * m_height);
+}
+
+void TemporalReprojection::resolve(const float4 *accum, const float *depth, const float4 *normal, int width, int height,
+                                   const ReprojectionCamera &camera, bool camera_moved, float4 *output) {
+    const size_t num_pixels = static_cast<size_t>(width) * height;
+    if (width != m_width || height != m_height) {
+        m_width = width;
+        m_height = height;
+        m_output.assign(num_pixels, make_float4(0.f));
+        m_depth.assign(num_pixels, 0.f);
+        m_normal.assign(num_pixels, make_float3(0.f));
+        m_history.assign(num_pixels, make_float4(0.f));
+        m_coverage = 0.f;
+    } else if (camera_moved) {
+        warpHistory(depth, normal, camera);
+    }
+
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x)
+            output[y * width + x] = resolvePixel(x, y, width, height, accum, m_history[y * width + x], settings);
+    }
+
+    std::copy(output, output + num_pixels, m_output.begin());
+    std::copy(depth, depth + num_pixels, m_depth.begin());
+    for (size_t i = 0; i < num_pixels; ++i)
+        m_normal[i] = reprojectionNormal(camera, normal[i]);
+    m_camera = camera;
+}
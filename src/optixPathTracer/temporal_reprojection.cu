@@ -0,0 +1,49 @@
+#include <cuda_runtime.h>
+
+#include <sutil/Exception.h>
+
+#include "temporal_reprojection.h"
+
+namespace {
+    const dim3 TEMPORAL_BLOCK(16, 8);
+
+    __global__ void warpKernel(const float *depth, const float4 *normal, int width, int height,
+                               ReprojectionCamera camera, ReprojectionCamera prev, TemporalSettings settings,
+                               TemporalDeviceBuffers buffers) {
+        const int x = blockIdx.x * blockDim.x + threadIdx.x;
+        const int y = blockIdx.y * blockDim.y + threadIdx.y;
+        if (x >= width || y >= height) return;
+        warpPixel(x, y, width, height, depth, normal, camera, prev, buffers.frame, buffers.depth, buffers.normal,
+                  settings, buffers.history[y * width + x]);
+    }
+
+    // Also keeps the frame and its geometry for the next warp, which the warp has read by now
+    __global__ void resolveKernel(const float4 *accum, const float *depth, const float4 *normal, int width,
+                                  int height, ReprojectionCamera camera, TemporalSettings settings,
+                                  TemporalDeviceBuffers buffers, float4 *output) {
+        const int x = blockIdx.x * blockDim.x + threadIdx.x;
+        const int y = blockIdx.y * blockDim.y + threadIdx.y;
+        if (x >= width || y >= height) return;
+        const int i = y * width + x;
+        const float4 resolved = resolvePixel(x, y, width, height, accum, buffers.history[i], settings);
+        buffers.frame[i] = resolved;
+        buffers.depth[i] = depth[i];
+        buffers.normal[i] = reprojectionNormal(camera, normal[i]);
+        output[i] = make_float4(make_float3(resolved), 1.f);
+    }
+}
+
+void resolveTemporalOnDevice(const float4 *accum, const float *depth, const float4 *normal, int width, int height,
+                             const ReprojectionCamera &camera, const ReprojectionCamera &prev, bool warp,
+                             const TemporalSettings &settings, const TemporalDeviceBuffers &buffers, float4 *output,
+                             cudaStream_t stream) {
+    const dim3 grid((width + TEMPORAL_BLOCK.x - 1) / TEMPORAL_BLOCK.x,
+                    (height + TEMPORAL_BLOCK.y - 1) / TEMPORAL_BLOCK.y);
+    if (warp) {
+        warpKernel<<<grid, TEMPORAL_BLOCK, 0, stream>>>(depth, normal, width, height, camera, prev, settings, buffers);
+        CUDA_CHECK(cudaGetLastError());
+    }
+    resolveKernel<<<grid, TEMPORAL_BLOCK, 0, stream>>>(accum, depth, normal, width, height, camera, settings, buffers,
+                                                        output);
+    CUDA_CHECK(cudaGetLastError());
+}
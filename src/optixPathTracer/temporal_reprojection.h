@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include <sutil/vec_math.h>
+
+#include <vector>
+
+/*
+*   Temporal reprojection. When the camera moves the accumulation on the device restarts,
+*   so on its own every frame of a camera motion is a few samples of noise. This keeps the
+*   last resolved frame as history, warps it into the new view using the depth and normal
+*   of both frames, and blends it with the fresh accumulation until that has enough samples
+*   of its own. The render loop resolves on the device over the launch buffers
+*   (resolveTemporalOnDevice), TemporalReprojection does the same on the host.
+*/
+
+// Pinhole camera as in Params: primary ray directions are normalize(d.x * U + d.y * V + W)
+// for d in [-1, 1]^2, pixel (0, 0) is at d = (-1, -1)
+struct ReprojectionCamera {
+    float3 eye;
+    float3 U, V, W;
+};
+
+struct TemporalSettings {
+    float depth_tolerance = 0.05f;  // relative difference of the expected and the stored distance
+    float normal_tolerance = 0.9f;  // minimum cosine between the current and the stored normal
+    float clamp_gamma = 1.25f;      // history is clipped to mean +- gamma * stddev of the 3x3 neighborhood, 0 disables
+    float max_history = 32.f;       // weight of the history in launches, bounds how long stale samples survive
+};
+
+// Primary ray direction of pixel (x, y)
+SUTIL_INLINE SUTIL_HOSTDEVICE float3 reprojectionDirection(const ReprojectionCamera &camera, int x, int y, int width,
+                                                           int height) {
+    const float dx = 2.f * (x + 0.5f) / width - 1.f;
+    const float dy = 2.f * (y + 0.5f) / height - 1.f;
+    return normalize(dx * camera.U + dy * camera.V + camera.W);
+}
+
+// Camera space normal as in Params::normal_buffer to world space, zero stays zero
+SUTIL_INLINE SUTIL_HOSTDEVICE float3 reprojectionNormal(const ReprojectionCamera &camera, const float4 &n) {
+    const float3 world = n.x * normalize(camera.U) + n.y * normalize(camera.V) + n.z * normalize(camera.W);
+    const float len2 = dot(world, world);
+    return len2 > 0.f ? world / sqrtf(len2) : make_float3(0.f);
+}
+
+/*
+*   History of pixel (x, y) of the current view: the previous frame prev_frame, resolved
+*   with prev_depth and the world space prev_normal from camera prev, looked up where the
+*   first hit of the pixel was seen. Bilinear, taps on a different surface are skipped.
+*   Returns false and zero history if no tap is valid.
+*/
+SUTIL_INLINE SUTIL_HOSTDEVICE bool warpPixel(int x, int y, int width, int height, const float *depth,
+                                             const float4 *normal, const ReprojectionCamera &camera,
+                                             const ReprojectionCamera &prev, const float4 *prev_frame,
+                                             const float *prev_depth, const float3 *prev_normal,
+                                             const TemporalSettings &settings, float4 &history) {
+    const int i = y * width + x;
+    history = make_float4(0.f);
+    const float3 N = reprojectionNormal(camera, normal[i]);
+    if (depth[i] <= 0.f || dot(N, N) == 0.f) return false;
+
+    // World position of the first hit, projected into the previous view
+    const float3 P = camera.eye + depth[i] * reprojectionDirection(camera, x, y, width, height);
+    const float3 v = P - prev.eye;
+    const float c = dot(v, prev.W) / dot(prev.W, prev.W);
+    if (c <= 0.f) return false;
+    const float px = (dot(v, prev.U) / dot(prev.U, prev.U) / c + 1.f) * 0.5f * width - 0.5f;
+    const float py = (dot(v, prev.V) / dot(prev.V, prev.V) / c + 1.f) * 0.5f * height - 0.5f;
+    const float distance = length(v);
+
+    const int x0 = static_cast<int>(floorf(px));
+    const int y0 = static_cast<int>(floorf(py));
+    const float fx = px - x0;
+    const float fy = py - y0;
+    float4 sum = make_float4(0.f);
+    float weight_sum = 0.f;
+    for (int t = 0; t < 4; ++t) {
+        const int tx = x0 + (t & 1);
+        const int ty = y0 + (t >> 1);
+        if (tx < 0 || ty < 0 || tx >= width || ty >= height) continue;
+        const int j = ty * width + tx;
+        if (fabsf(prev_depth[j] - distance) > settings.depth_tolerance * distance) continue;
+        if (dot(prev_normal[j], N) < settings.normal_tolerance) continue;
+
+        const float w = ((t & 1) ? fx : 1.f - fx) * ((t >> 1) ? fy : 1.f - fy);
+        sum += prev_frame[j] * w;
+        weight_sum += w;
+    }
+    if (weight_sum <= 1e-3f) return false;
+    history = sum / weight_sum;
+    return true;
+}
+
+/*
+*   Blends the accumulation of pixel (x, y) with its warped history, w of the result is the
+*   sample weight of both
+*/
+SUTIL_INLINE SUTIL_HOSTDEVICE float4 resolvePixel(int x, int y, int width, int height, const float4 *accum,
+                                                  const float4 &history_sample, const TemporalSettings &settings) {
+    const int i = y * width + x;
+    const float3 current = make_float3(accum[i]);
+    const float n = accum[i].w;
+    float3 history = make_float3(history_sample);
+    const float h = fminf(history_sample.w, settings.max_history);
+
+    if (h > 0.f && settings.clamp_gamma > 0.f) {
+        // Variance clipping against the fresh samples, removes history the warp got wrong
+        float3 mean = make_float3(0.f), mean2 = make_float3(0.f);
+        float count = 0.f;
+        for (int ny = max(y - 1, 0); ny <= min(y + 1, height - 1); ++ny) {
+            for (int nx = max(x - 1, 0); nx <= min(x + 1, width - 1); ++nx) {
+                const float3 c = make_float3(accum[ny * width + nx]);
+                mean += c;
+                mean2 += c * c;
+                count += 1.f;
+            }
+        }
+        mean /= count;
+        const float3 variance = mean2 / count - mean * mean;
+        const float3 sigma = make_float3(sqrtf(fmaxf(variance.x, 0.f)), sqrtf(fmaxf(variance.y, 0.f)),
+                                         sqrtf(fmaxf(variance.z, 0.f)));
+        history = clamp(history, mean - settings.clamp_gamma * sigma, mean + settings.clamp_gamma * sigma);
+    }
+
+    const float total = h + n;
+    return total > 0.f ? make_float4((history * h + current * n) / total, total) : make_float4(current, 0.f);
+}
+
+// What the device resolve keeps between frames, width x height each, allocated by the caller
+struct TemporalDeviceBuffers {
+    float4 *frame = nullptr;        // the last resolved frame, w is its sample weight
+    float *depth = nullptr;         // and the geometry it was resolved with
+    float3 *normal = nullptr;       // world space
+    float4 *history = nullptr;      // aligned with the current view, only changes when the camera moves
+};
+
+/*
+*   TemporalReprojection::resolve() on the device, enqueued on stream. accum, depth and
+*   normal are the launch buffers, prev the camera of the frame in buffers. warp is set on
+*   the first frame after a camera change, unless buffers hold no frame yet, then history
+*   has to be zero. Writes the blended color to output with w = 1, for display.
+*/
+void resolveTemporalOnDevice(const float4 *accum, const float *depth, const float4 *normal, int width, int height,
+                             const ReprojectionCamera &camera, const ReprojectionCamera &prev, bool warp,
+                             const TemporalSettings &settings, const TemporalDeviceBuffers &buffers, float4 *output,
+                             cudaStream_t stream);
+
+class TemporalReprojection {
+public:
+    void reset();
+
+    /*
+    *   Resolves a frame. accum is the device accumulation since the last camera change with
+    *   the launch count in w, depth the distance along the primary ray to the first hit (0 on
+    *   a miss) and normal the first hit normal in camera space, as in Params::normal_buffer.
+    *   camera_moved must be set on the first frame after a camera change, it warps the
+    *   history into the new view. Writes the blended color to output, w is the sample weight.
+    */
+    void resolve(const float4 *accum, const float *depth, const float4 *normal, int width, int height,
+                 const ReprojectionCamera &camera, bool camera_moved, float4 *output);
+
+    // Fraction of the pixels that found valid history in the last warp
+    float historyCoverage() const { return m_coverage; }
+
+    TemporalSettings settings;
+
+private:
+    void warpHistory(const float *depth, const float4 *normal, const ReprojectionCamera &camera);
+
+    int m_width = 0;
+    int m_height = 0;
+    ReprojectionCamera m_camera;
+
+    // The last resolved frame and the geometry it was resolved with
+    std::vector<float4> m_output;
+    std::vector<float> m_depth;
+    std::vector<float3> m_normal;   // world space
+
+    // History aligned with the current view, only changes when the camera moves
+    std::vector<float4> m_history;
+    float m_coverage = 0.f;
+};
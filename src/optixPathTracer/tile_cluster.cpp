@@ -0,0 +1,416 @@
+#include <optix.h>
+#include <cuda_runtime.h>
+
+#include "tile_cluster.h"
+#include "tcp_socket.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+#include <poll.h>
+#include <sys/socket.h>
+
+namespace {
+    const uint32_t CLUSTER_MAGIC = 0x50544331;      // "PTC1"
+    const uint32_t MAX_MESSAGE_SIZE = 1u << 30;
+    const size_t RECEIVE_CHUNK = size_t(1) << 20;
+    // Before the first reply there is nothing to measure the deadline against
+    const double FIRST_TIMEOUT_MS = 10000.0;
+    // A busy worker whose late reply has not arrived after this many subframes is given up
+    const int MAX_BUSY_SUBFRAMES = 8;
+
+    enum MessageType : uint32_t {
+        MESSAGE_CAMERA = 1,     // TileCamera
+        MESSAGE_TILES = 2,      // TilesMessage, then int2 origins
+        MESSAGE_RESULT = 3      // ResultMessage, then float4 pixels of every tile
+    };
+
+    struct MessageHeader {
+        uint32_t magic;
+        uint32_t type;
+        uint32_t frame;         // of the coordinator, replies carry the one of their request
+        uint32_t size;          // bytes that follow
+    };
+
+    struct TilesMessage {
+        uint32_t subframe_index;
+        uint32_t num_tiles;
+    };
+
+    // 16 bytes, so the pixels after it stay aligned
+    struct ResultMessage {
+        uint32_t num_tiles;
+        float render_ms;
+        uint32_t pad[2];
+    };
+
+    size_t tilePixels() {
+        return static_cast<size_t>(DynamicWorkDistribution::tileWidth()) * DynamicWorkDistribution::tileHeight();
+    }
+
+    void applyCamera(Params &params, const TileCamera &camera) {
+        params.width = camera.width;
+        params.height = camera.height;
+        params.samples_per_launch = camera.samples_per_launch;
+        params.depth = camera.depth;
+        params.eye = camera.eye;
+        params.U = camera.U;
+        params.V = camera.V;
+        params.W = camera.W;
+    }
+
+    double millisecondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+TileRenderer::TileRenderer(unsigned int num_threads)
+        : m_num_threads(num_threads > 0 ? num_threads : std::max(1u, std::thread::hardware_concurrency())) {}
+
+void TileRenderer::render(const CpuScene &scene, const Params &params, const int2 *origins, size_t num_tiles,
+                          float4 *out) {
+    const int w = static_cast<int>(params.width);
+    const int h = static_cast<int>(params.height);
+    const size_t num_pixels = static_cast<size_t>(w) * h;
+    if (m_accum.size() != num_pixels) {
+        m_accum.assign(num_pixels, make_float4(0.f));
+        m_albedo.assign(num_pixels, make_float4(0.f));
+        m_normal.assign(num_pixels, make_float4(0.f));
+        m_frame.assign(num_pixels, make_float4(0.f));
+        m_moments.assign(num_pixels, make_float2(0.f));
+        m_depth.assign(num_pixels, 0.f);
+    }
+    Params launch = params;
+    launch.accum_buffer = m_accum.data();
+    launch.moments_buffer = m_moments.data();
+    launch.albedo_buffer = m_albedo.data();
+    launch.normal_buffer = m_normal.data();
+    launch.depth_buffer = m_depth.data();
+    launch.frame_buffer = m_frame.data();
+    launch.active_pixels = nullptr;
+    launch.adaptive_threshold = 0.f;
+    launch.show_convergence = 0;
+
+    const int tile_width = DynamicWorkDistribution::tileWidth();
+    const int tile_height = DynamicWorkDistribution::tileHeight();
+    std::atomic<size_t> next_tile(0);
+    const auto worker = [&]() {
+        for (size_t tile = next_tile++; tile < num_tiles; tile = next_tile++) {
+            float4 *tile_out = out + tile * tilePixels();
+            std::fill(tile_out, tile_out + tilePixels(), make_float4(0.f));
+            const int x0 = origins[tile].x, y0 = origins[tile].y;
+            if (x0 < 0 || y0 < 0 || x0 >= w || y0 >= h) continue;
+            const int x1 = std::min(x0 + tile_width, w), y1 = std::min(y0 + tile_height, h);
+            // No launches so far, so the pixels hold this launch alone
+            for (int y = y0; y < y1; ++y)
+                for (int x = x0; x < x1; ++x)
+                    m_accum[static_cast<size_t>(y) * w + x].w = 0.f;
+            m_renderer.launchRect(scene, launch, x0, y0, x1, y1);
+            for (int y = y0; y < y1; ++y) {
+                for (int x = x0; x < x1; ++x) {
+                    const size_t i = static_cast<size_t>(y) * w + x;
+                    tile_out[(y - y0) * tile_width + x - x0] = make_float4(make_float3(m_accum[i]), m_moments[i].x);
+                }
+            }
+        }
+    };
+    const unsigned int num_threads = static_cast<unsigned int>(std::min<size_t>(m_num_threads, num_tiles));
+    std::vector<std::thread> threads;
+    for (unsigned int t = 1; t < num_threads; ++t)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread &thread: threads)
+        thread.join();
+}
+
+TileWorker::TileWorker(const CpuScene &scene, const Params &shared, unsigned int num_threads)
+        : m_scene(scene), m_params(shared), m_tiles(num_threads) {}
+
+bool TileWorker::serve(int fd) {
+    bool ok = true;
+    bool has_camera = false;
+    std::vector<char> payload;
+    std::vector<int2> origins;
+    std::vector<float4> pixels;
+    MessageHeader header;
+    while (recvAll(fd, &header, sizeof(header))) {
+        if (header.magic != CLUSTER_MAGIC || header.size > MAX_MESSAGE_SIZE) {
+            ok = false;
+            break;
+        }
+        payload.resize(header.size);
+        if (!recvAll(fd, payload.data(), payload.size())) break;
+
+        if (header.type == MESSAGE_CAMERA && header.size == sizeof(TileCamera)) {
+            TileCamera camera;
+            memcpy(&camera, payload.data(), sizeof(camera));
+            applyCamera(m_params, camera);
+            has_camera = true;
+        } else if (header.type == MESSAGE_TILES && has_camera && header.size >= sizeof(TilesMessage)) {
+            TilesMessage tiles;
+            memcpy(&tiles, payload.data(), sizeof(tiles));
+            if (header.size != sizeof(tiles) + static_cast<size_t>(tiles.num_tiles) * sizeof(int2)) {
+                ok = false;
+                break;
+            }
+            origins.resize(tiles.num_tiles);
+            memcpy(origins.data(), payload.data() + sizeof(tiles), origins.size() * sizeof(int2));
+            pixels.resize(origins.size() * tilePixels());
+            m_params.subframe_index = tiles.subframe_index;
+
+            const auto t0 = std::chrono::steady_clock::now();
+            m_tiles.render(m_scene, m_params, origins.data(), origins.size(), pixels.data());
+            ResultMessage result;
+            memset(&result, 0, sizeof(result));
+            result.num_tiles = tiles.num_tiles;
+            result.render_ms = static_cast<float>(millisecondsSince(t0));
+            if (m_reply_delay_ms > 0.0)
+                std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(m_reply_delay_ms));
+
+            MessageHeader reply = {CLUSTER_MAGIC, MESSAGE_RESULT, header.frame,
+                                   static_cast<uint32_t>(sizeof(result) + pixels.size() * sizeof(float4))};
+            if (!sendAll(fd, &reply, sizeof(reply)) || !sendAll(fd, &result, sizeof(result)) ||
+                !sendAll(fd, pixels.data(), pixels.size() * sizeof(float4)))
+                break;
+        } else {
+            ok = false;
+            break;
+        }
+    }
+    closeSocket(fd);
+    return ok;
+}
+
+TileCoordinator::TileCoordinator(const CpuScene &scene, const Params &shared, unsigned int num_threads)
+        : m_scene(scene), m_shared(shared), m_tiles(num_threads) {}
+
+TileCoordinator::~TileCoordinator() {
+    for (Worker &worker: m_workers)
+        closeSocket(worker.fd);
+}
+
+bool TileCoordinator::addWorker(const std::string &address) {
+    if (m_workers.size() >= static_cast<size_t>(DynamicWorkDistribution::MAX_WORKERS)) return false;
+    const int fd = connectTcp(address);
+    if (fd < 0) return false;
+    m_workers.emplace_back();
+    m_workers.back().fd = fd;
+    return true;
+}
+
+void TileCoordinator::setTimeout(double min_ms, double factor) {
+    m_min_timeout_ms = std::max(0.0, min_ms);
+    m_timeout_factor = std::max(1.0, factor);
+}
+
+bool TileCoordinator::sendRequest(Worker &worker, const TileCamera &camera, uint32_t subframe_index) {
+    // Only what changed: the camera rarely, the subframe and tiles every time
+    if (!worker.sent_camera || memcmp(&worker.camera, &camera, sizeof(camera)) != 0) {
+        const MessageHeader header = {CLUSTER_MAGIC, MESSAGE_CAMERA, m_frame, sizeof(camera)};
+        if (!sendAll(worker.fd, &header, sizeof(header)) || !sendAll(worker.fd, &camera, sizeof(camera)))
+            return false;
+        worker.camera = camera;
+        worker.sent_camera = true;
+        m_stats.bytes_sent += sizeof(header) + sizeof(camera);
+    }
+    const TilesMessage tiles = {subframe_index, static_cast<uint32_t>(worker.tiles.size())};
+    const MessageHeader header = {CLUSTER_MAGIC, MESSAGE_TILES, m_frame,
+                                  static_cast<uint32_t>(sizeof(tiles) + worker.tiles.size() * sizeof(int2))};
+    if (!sendAll(worker.fd, &header, sizeof(header)) || !sendAll(worker.fd, &tiles, sizeof(tiles)) ||
+        !sendAll(worker.fd, worker.tiles.data(), worker.tiles.size() * sizeof(int2)))
+        return false;
+    m_stats.bytes_sent += header.size + sizeof(header);
+    ++m_stats.requests;
+    worker.in_flight = true;
+    worker.sent = std::chrono::steady_clock::now();
+    return true;
+}
+
+bool TileCoordinator::receive(size_t index, const Params &params, double &fastest_ms) {
+    Worker &worker = m_workers[index];
+    for (;;) {
+        const size_t size = worker.inbox.size();
+        worker.inbox.resize(size + RECEIVE_CHUNK);
+        const ssize_t received = recv(worker.fd, worker.inbox.data() + size, RECEIVE_CHUNK, MSG_DONTWAIT);
+        worker.inbox.resize(size + static_cast<size_t>(std::max<ssize_t>(received, 0)));
+        if (received == 0) return false;
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        m_stats.bytes_received += static_cast<uint64_t>(received);
+    }
+
+    size_t consumed = 0;
+    while (worker.inbox.size() - consumed >= sizeof(MessageHeader)) {
+        MessageHeader header;
+        memcpy(&header, worker.inbox.data() + consumed, sizeof(header));
+        if (header.magic != CLUSTER_MAGIC || header.type != MESSAGE_RESULT || header.size < sizeof(ResultMessage) ||
+            header.size > MAX_MESSAGE_SIZE)
+            return false;
+        if (worker.inbox.size() - consumed < sizeof(header) + header.size) break;
+        const char *payload = worker.inbox.data() + consumed + sizeof(header);
+        consumed += sizeof(header) + header.size;
+        if (header.frame != m_frame || !worker.in_flight) {
+            // The late reply of an earlier subframe, those tiles were rendered without it
+            worker.busy = false;
+            worker.busy_subframes = 0;
+            continue;
+        }
+        ResultMessage result;
+        memcpy(&result, payload, sizeof(result));
+        if (result.num_tiles != worker.tiles.size() ||
+            header.size != sizeof(result) + result.num_tiles * tilePixels() * sizeof(float4))
+            return false;
+        // inbox starts aligned and every message is a multiple of 16 bytes
+        accumulate(params, worker.tiles, reinterpret_cast<const float4 *>(payload + sizeof(result)));
+        const double ms = millisecondsSince(worker.sent);
+        m_distribution.reportWorkerTime(static_cast<int32_t>(index), ms / 1000.0);
+        fastest_ms = fastest_ms > 0.0 ? std::min(fastest_ms, ms) : ms;
+        worker.in_flight = false;
+    }
+    worker.inbox.erase(worker.inbox.begin(), worker.inbox.begin() + consumed);
+    return true;
+}
+
+void TileCoordinator::accumulate(const Params &params, const std::vector<int2> &tiles, const float4 *pixels) const {
+    const int w = static_cast<int>(params.width);
+    const int h = static_cast<int>(params.height);
+    const int tile_width = DynamicWorkDistribution::tileWidth();
+    const int tile_height = DynamicWorkDistribution::tileHeight();
+    for (size_t tile = 0; tile < tiles.size(); ++tile) {
+        const float4 *tile_pixels = pixels + tile * tilePixels();
+        for (int ty = 0; ty < tile_height; ++ty) {
+            for (int tx = 0; tx < tile_width; ++tx) {
+                const int x = tiles[tile].x + tx, y = tiles[tile].y + ty;
+                if (x < 0 || y < 0 || x >= w || y >= h) continue;
+                const size_t i = static_cast<size_t>(y) * w + x;
+                const float4 launch = tile_pixels[ty * tile_width + tx];
+
+                // As in CpuRenderer::launchRect
+                const float4 accum_prev = params.subframe_index > 0 ? params.accum_buffer[i] : make_float4(0.f);
+                const float2 moments_prev = params.subframe_index > 0 ? params.moments_buffer[i] : make_float2(0.f);
+                const float launches = accum_prev.w;
+                float3 accum_color = make_float3(launch);
+                float2 moments = make_float2(launch.w, launch.w * launch.w);
+                if (launches > 0.0f) {
+                    const float a = 1.0f / (launches + 1.0f);
+                    accum_color = lerp(make_float3(accum_prev), accum_color, a);
+                    moments = lerp(moments_prev, moments, a);
+                }
+                params.accum_buffer[i] = make_float4(accum_color, launches + 1.0f);
+                params.moments_buffer[i] = moments;
+                params.frame_buffer[i] = make_float4(accum_color, 1.f);
+            }
+        }
+    }
+}
+
+void TileCoordinator::launch(const Params &params) {
+    const auto t0 = std::chrono::steady_clock::now();
+    ++m_frame;
+    const int w = static_cast<int>(params.width);
+    const int h = static_cast<int>(params.height);
+    if (w != m_width || h != m_height) {
+        m_distribution.setRasterSize(w, h);
+        m_width = w;
+        m_height = h;
+    }
+    // With no workers left the coordinator renders everything as worker 0
+    const int32_t num_workers = std::max<int32_t>(1, static_cast<int32_t>(m_workers.size()));
+    if (m_distribution.numWorkers() != num_workers) m_distribution.setNumWorkers(num_workers);
+    for (Worker &worker: m_workers)
+        if (worker.busy && ++worker.busy_subframes > MAX_BUSY_SUBFRAMES) worker.lost = true;
+
+    const TileCamera camera = {params.width, params.height, params.samples_per_launch, params.depth,
+                               params.eye, params.U, params.V, params.W};
+    Params local_params = m_shared;
+    applyCamera(local_params, camera);
+    local_params.subframe_index = params.subframe_index;
+
+    std::vector<int2> local;
+    for (int32_t i = 0; i < m_distribution.numWorkers(); ++i) {
+        std::vector<int2> tiles(static_cast<size_t>(m_distribution.numTiles(i)));
+        for (size_t t = 0; t < tiles.size(); ++t)
+            tiles[t] = m_distribution.getTileOrigin(i, static_cast<int32_t>(t));
+        if (i < static_cast<int32_t>(m_workers.size()) && !m_workers[i].busy && !m_workers[i].lost) {
+            Worker &worker = m_workers[i];
+            worker.tiles.swap(tiles);
+            if (sendRequest(worker, camera, params.subframe_index)) continue;
+            worker.lost = true;
+            tiles.swap(worker.tiles);
+        }
+        local.insert(local.end(), tiles.begin(), tiles.end());
+    }
+    const auto requests_sent = std::chrono::steady_clock::now();
+
+    // The tiles of busy workers while the others render
+    std::vector<float4> pixels;
+    const auto renderLocal = [&]() {
+        if (local.empty()) return;
+        pixels.resize(local.size() * tilePixels());
+        m_tiles.render(m_scene, local_params, local.data(), local.size(), pixels.data());
+        accumulate(params, local, pixels.data());
+        m_stats.local_tiles += local.size();
+        local.clear();
+    };
+    renderLocal();
+
+    const double timeout_ms = m_fastest_ms > 0.0 ? std::max(m_min_timeout_ms, m_timeout_factor * m_fastest_ms)
+                                                 : FIRST_TIMEOUT_MS;
+    double fastest_ms = 0.0;
+    std::vector<pollfd> fds;
+    std::vector<size_t> owners;
+    for (;;) {
+        fds.clear();
+        owners.clear();
+        bool waiting = false;
+        for (size_t i = 0; i < m_workers.size(); ++i) {
+            const Worker &worker = m_workers[i];
+            if (worker.lost || (!worker.in_flight && !worker.busy)) continue;
+            fds.push_back({worker.fd, POLLIN, 0});
+            owners.push_back(i);
+            waiting = waiting || worker.in_flight;
+        }
+        // The deadline runs from the requests, not from after the local tiles
+        const double remaining_ms = timeout_ms - millisecondsSince(requests_sent);
+        if (!waiting || remaining_ms <= 0.0) break;
+        const int ready = poll(fds.data(), fds.size(), static_cast<int>(std::ceil(remaining_ms)));
+        if (ready < 0 && errno != EINTR) break;
+        for (size_t k = 0; k < fds.size() && ready > 0; ++k)
+            if (fds[k].revents && !receive(owners[k], params, fastest_ms)) m_workers[owners[k]].lost = true;
+    }
+
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        Worker &worker = m_workers[i];
+        if (!worker.in_flight) continue;
+        worker.in_flight = false;
+        local.insert(local.end(), worker.tiles.begin(), worker.tiles.end());
+        if (worker.lost) continue;
+        worker.busy = true;
+        worker.busy_subframes = 0;
+        ++m_stats.late_replies;
+        m_distribution.reportWorkerTime(static_cast<int32_t>(i), millisecondsSince(worker.sent) / 1000.0);
+    }
+    renderLocal();
+
+    // The next subframe splits the raster among the workers that are left, by what they measured so far
+    for (size_t i = m_workers.size(); i-- > 0;) {
+        if (!m_workers[i].lost) continue;
+        closeSocket(m_workers[i].fd);
+        m_workers.erase(m_workers.begin() + static_cast<std::ptrdiff_t>(i));
+        m_distribution.removeWorker(static_cast<int32_t>(i));
+        ++m_stats.lost_workers;
+    }
+    m_distribution.rebalance();
+    if (fastest_ms > 0.0) m_fastest_ms = fastest_ms;
+
+    ++m_stats.subframes;
+    m_stats.last_timeout_ms = timeout_ms;
+    m_stats.last_subframe_ms = millisecondsSince(t0);
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <sutil/WorkDistribution.h>
+#include <sutil/vec_math.h>
+
+#include "optixPathTracer.h"
+#include "cpu_renderer.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+*   Subframes rendered by several processes over TCP. The coordinator splits every subframe
+*   into the tiles of DynamicWorkDistribution, sends each worker the camera when it changed
+*   and the origins of its tiles, and accumulates the launch colors that come back into its
+*   own buffers the way CpuRenderer does, so frames match a local render bit for bit. Workers
+*   load the same scene with the same options and render with CpuRenderer.
+*
+*   A worker that drops its connection is removed, the others keep their measured shares. One
+*   that misses the deadline gets no new tiles until its late reply arrived, which is then
+*   thrown away; the coordinator renders the tiles it is missing and the slow worker's share
+*   of the next subframes shrinks. A reply still missing after 8 subframes removes the worker.
+*   Adaptive sampling and the albedo, normal and depth buffers are not distributed.
+*/
+
+const uint16_t TILE_CLUSTER_PORT = 7600;    // default of --render-worker
+
+// What a worker renders with besides its own scene, sent when it changes
+struct TileCamera {
+    uint32_t width, height;
+    uint32_t samples_per_launch, depth;
+    float3 eye, U, V, W;
+};
+
+// Renders tiles of one launch without accumulation into scratch buffers, for both ends
+class TileRenderer {
+public:
+    explicit TileRenderer(unsigned int num_threads = 0);
+
+    /*
+    *   Renders the launch of params over the DynamicWorkDistribution tiles at origins into
+    *   out, tileWidth() x tileHeight() pixels per tile in tile order: the launch color and its
+    *   luminance. Pixels outside the raster are zero.
+    */
+    void render(const CpuScene &scene, const Params &params, const int2 *origins, size_t num_tiles, float4 *out);
+
+private:
+    CpuRenderer m_renderer;
+    unsigned int m_num_threads;
+    std::vector<float4> m_accum, m_albedo, m_normal, m_frame;
+    std::vector<float2> m_moments;
+    std::vector<float> m_depth;
+};
+
+class TileWorker {
+public:
+    // scene and the lights and light tree in shared have to outlive the worker
+    TileWorker(const CpuScene &scene, const Params &shared, unsigned int num_threads = 0);
+
+    // Serves a coordinator on fd until it disconnects and closes fd, false on a broken message
+    bool serve(int fd);
+
+    // Sleeps this long before every reply, to try out slow workers
+    void setReplyDelay(double ms) { m_reply_delay_ms = ms; }
+
+private:
+    const CpuScene &m_scene;
+    Params m_params;
+    TileRenderer m_tiles;
+    double m_reply_delay_ms = 0.0;
+};
+
+struct ClusterStats {
+    uint64_t subframes = 0;
+    uint64_t requests = 0;          // tile lists sent to workers
+    uint64_t late_replies = 0;      // requests that missed their deadline
+    uint64_t lost_workers = 0;
+    uint64_t local_tiles = 0;       // rendered by the coordinator for late, busy or lost workers
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    double last_subframe_ms = 0.0;
+    double last_timeout_ms = 0.0;
+};
+
+class TileCoordinator {
+public:
+    // Renders the tiles workers miss, with the same scene and options as the workers
+    TileCoordinator(const CpuScene &scene, const Params &shared, unsigned int num_threads = 0);
+    ~TileCoordinator();
+
+    TileCoordinator(const TileCoordinator &) = delete;
+    TileCoordinator &operator=(const TileCoordinator &) = delete;
+
+    // "host:port", false if it cannot connect or DynamicWorkDistribution::MAX_WORKERS are connected
+    bool addWorker(const std::string &address);
+
+    // Replies are due factor times the fastest reply of the last subframe after the request, at least min_ms
+    void setTimeout(double min_ms, double factor);
+
+    /*
+    *   Renders one subframe like CpuRenderer::launch with the camera, size and subframe_index
+    *   of params, accumulating into its accum_buffer, moments_buffer and frame_buffer
+    */
+    void launch(const Params &params);
+
+    size_t numWorkers() const { return m_workers.size(); }
+    float workerShare(size_t worker) const { return m_distribution.share(static_cast<int32_t>(worker)); }
+    const ClusterStats &stats() const { return m_stats; }
+
+private:
+    struct Worker {
+        int fd = -1;
+        bool sent_camera = false;
+        TileCamera camera;          // last sent
+        bool in_flight = false;     // has tiles of the current subframe
+        bool busy = false;          // a late reply is still on its way
+        int busy_subframes = 0;     // launched without it since
+        bool lost = false;
+        std::chrono::steady_clock::time_point sent;
+        std::vector<int2> tiles;
+        std::vector<char> inbox;    // a partial message
+    };
+
+    bool sendRequest(Worker &worker, const TileCamera &camera, uint32_t subframe_index);
+    // Reads what arrived, false once the connection is gone or sent garbage
+    bool receive(size_t worker, const Params &params, double &fastest_ms);
+    void accumulate(const Params &params, const std::vector<int2> &tiles, const float4 *pixels) const;
+
+    const CpuScene &m_scene;
+    const Params m_shared;
+    TileRenderer m_tiles;
+    DynamicWorkDistribution m_distribution;
+    std::vector<Worker> m_workers;
+    uint32_t m_frame = 0;
+    int m_width = 0, m_height = 0;
+    double m_min_timeout_ms = 20.0;
+    double m_timeout_factor = 3.0;
+    double m_fastest_ms = 0.0;      // reply of the last subframe, 0 before the first
+    ClusterStats m_stats;
+};
@@ -0,0 +1,199 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+
+namespace sutil
+{
+
+uint64_t ProfileRing::drain( std::vector<ProfileEvent>& events )
+{
+    const uint64_t head  = m_head.load( std::memory_order_acquire );
+    uint64_t       lost  = 0;
+    uint64_t       first = m_tail;
+    if( head - first > CAPACITY )
+    {
+        lost  = head - first - CAPACITY;
+        first = head - CAPACITY;
+    }
+
+    const size_t begin = events.size();
+    for( uint64_t i = first; i < head; ++i )
+    {
+        const Slot&  slot = m_slots[i & ( CAPACITY - 1 )];
+        ProfileEvent event;
+        event.name     = slot.name.load( std::memory_order_relaxed );
+        event.begin_ns = slot.begin_ns.load( std::memory_order_relaxed );
+        event.end_ns   = slot.end_ns.load( std::memory_order_relaxed );
+        event.thread   = m_thread;
+        events.push_back( event );
+    }
+
+    // The writer may have lapped the slots read above while copying, drop what it overwrote
+    const uint64_t head_after = m_head.load( std::memory_order_acquire );
+    if( head_after - first > CAPACITY )
+    {
+        const uint64_t overwritten = std::min<uint64_t>( head_after - first - CAPACITY, head - first );
+        events.erase( events.begin() + begin, events.begin() + begin + overwritten );
+        lost += overwritten;
+    }
+
+    m_tail = head;
+    return lost;
+}
+
+
+Profiler& Profiler::instance()
+{
+    static Profiler profiler;
+    return profiler;
+}
+
+
+Profiler::Profiler() : m_epoch( std::chrono::steady_clock::now() )
+{
+}
+
+
+int64_t Profiler::now() const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - m_epoch ).count();
+}
+
+
+ProfileRing& Profiler::threadRing()
+{
+    // Rings live as long as the profiler, so events of exited threads can still be collected
+    thread_local ProfileRing* ring = nullptr;
+    if( !ring )
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        m_rings.emplace_back( new ProfileRing( static_cast<uint32_t>( m_rings.size() ) ) );
+        ring = m_rings.back().get();
+    }
+    return *ring;
+}
+
+
+void Profiler::record( const char* name, int64_t begin_ns, int64_t end_ns )
+{
+    threadRing().push( name, begin_ns, end_ns );
+}
+
+
+void Profiler::collect()
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    for( const std::unique_ptr<ProfileRing>& ring : m_rings )
+        m_dropped += ring->drain( m_history );
+
+    if( m_history.size() > MAX_HISTORY )
+    {
+        const size_t excess = m_history.size() - MAX_HISTORY;
+        m_history.erase( m_history.begin(), m_history.begin() + excess );
+        m_dropped += excess;
+    }
+}
+
+
+std::vector<ProfileStageStats> Profiler::stageStats()
+{
+    collect();
+    std::lock_guard<std::mutex> lock( m_mutex );
+
+    // Stage names are few, a linear lookup by pointer then by content is cheaper than a map
+    std::vector<const char*>         names;
+    std::vector<std::vector<double>> durations;
+    for( const ProfileEvent& event : m_history )
+    {
+        size_t stage = 0;
+        while( stage < names.size() && names[stage] != event.name && std::string( names[stage] ) != event.name )
+            ++stage;
+        if( stage == names.size() )
+        {
+            names.push_back( event.name );
+            durations.emplace_back();
+        }
+        durations[stage].push_back( ( event.end_ns - event.begin_ns ) * 1e-6 );
+    }
+
+    std::vector<ProfileStageStats> stats;
+    for( size_t stage = 0; stage < names.size(); ++stage )
+    {
+        std::vector<double>& d = durations[stage];
+        std::sort( d.begin(), d.end() );
+        const auto percentile = [&d]( double p ) {
+            return d[std::min( d.size() - 1, static_cast<size_t>( p * d.size() ) )];
+        };
+
+        ProfileStageStats s;
+        s.name  = names[stage];
+        s.count = d.size();
+        double sum = 0.0;
+        for( double v : d )
+            sum += v;
+        s.mean_ms = sum / d.size();
+        s.p50_ms  = percentile( 0.50 );
+        s.p95_ms  = percentile( 0.95 );
+        s.p99_ms  = percentile( 0.99 );
+        s.max_ms  = d.back();
+        stats.push_back( s );
+    }
+    return stats;
+}
+
+
+void Profiler::printSummary( std::ostream& out )
+{
+    const std::vector<ProfileStageStats> stats = stageStats();
+    const std::ios::fmtflags flags = out.flags();
+    out << std::left << std::setw( 16 ) << "stage" << std::right << std::setw( 9 ) << "count" << std::setw( 10 ) << "mean"
+        << std::setw( 10 ) << "p50" << std::setw( 10 ) << "p95" << std::setw( 10 ) << "p99" << std::setw( 10 ) << "max"
+        << "  (ms)\n";
+    out << std::fixed << std::setprecision( 3 );
+    for( const ProfileStageStats& s : stats )
+    {
+        out << std::left << std::setw( 16 ) << s.name << std::right << std::setw( 9 ) << s.count << std::setw( 10 )
+            << s.mean_ms << std::setw( 10 ) << s.p50_ms << std::setw( 10 ) << s.p95_ms << std::setw( 10 ) << s.p99_ms
+            << std::setw( 10 ) << s.max_ms << "\n";
+    }
+    if( m_dropped > 0 )
+        out << m_dropped << " events dropped\n";
+    out.flags( flags );
+}
+
+
+void Profiler::writeChromeTrace( const std::string& filename )
+{
+    collect();
+    std::lock_guard<std::mutex> lock( m_mutex );
+
+    std::ofstream out( filename.c_str() );
+    if( !out )
+        throw std::runtime_error( "Profiler: Could not open " + filename + " for writing" );
+
+    // Timestamps are in microseconds, stage names are literals without characters to escape
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out << std::fixed << std::setprecision( 3 );
+    for( size_t i = 0; i < m_history.size(); ++i )
+    {
+        const ProfileEvent& event = m_history[i];
+        out << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.thread
+            << ",\"ts\":" << event.begin_ns * 1e-3 << ",\"dur\":" << ( event.end_ns - event.begin_ns ) * 1e-3 << "}"
+            << ( i + 1 < m_history.size() ? ",\n" : "\n" );
+    }
+    out << "]}\n";
+}
+
+
+void Profiler::clear()
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_history.clear();
+    m_dropped = 0;
+}
+
+} // end namespace sutil
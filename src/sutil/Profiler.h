@@ -0,0 +1,157 @@
+#pragma once
+
+#include "sutilapi.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sutil
+{
+
+//
+// Frame stage instrumentation. Scopes are timed with SUTIL_PROFILE_SCOPE( "stage" ) and
+// recorded into a ring per thread, so the hot path is two clock reads and a few relaxed
+// stores with no lock. collect() drains the rings from any thread; the drained events
+// feed the per-stage percentiles and the Chrome trace (chrome://tracing, Perfetto).
+//
+// Stage names must be string literals or otherwise outlive the profiler.
+//
+
+struct ProfileEvent
+{
+    const char* name;
+    int64_t     begin_ns;   // relative to the profiler's creation
+    int64_t     end_ns;
+    uint32_t    thread;
+};
+
+struct ProfileStageStats
+{
+    std::string name;
+    size_t      count;
+    double      mean_ms;
+    double      p50_ms;
+    double      p95_ms;
+    double      p99_ms;
+    double      max_ms;
+};
+
+// Single producer ring, the owning thread writes and collect() reads. When the reader
+// falls more than CAPACITY events behind the oldest ones are dropped.
+class ProfileRing
+{
+public:
+    static const size_t CAPACITY = 1 << 14;
+
+    explicit ProfileRing( uint32_t thread ) : m_thread( thread ) {}
+
+    void push( const char* name, int64_t begin_ns, int64_t end_ns )
+    {
+        const uint64_t head = m_head.load( std::memory_order_relaxed );
+        Slot& slot = m_slots[head & ( CAPACITY - 1 )];
+        slot.name.store( name, std::memory_order_relaxed );
+        slot.begin_ns.store( begin_ns, std::memory_order_relaxed );
+        slot.end_ns.store( end_ns, std::memory_order_relaxed );
+        m_head.store( head + 1, std::memory_order_release );
+    }
+
+    // Appends the events written since the last drain, returns how many were lost to overwrites
+    uint64_t drain( std::vector<ProfileEvent>& events );
+
+private:
+    struct Slot
+    {
+        std::atomic<const char*> name;
+        std::atomic<int64_t>     begin_ns;
+        std::atomic<int64_t>     end_ns;
+    };
+
+    Slot                  m_slots[CAPACITY];
+    std::atomic<uint64_t> m_head{0};
+    uint64_t              m_tail = 0;   // reader side only
+    const uint32_t        m_thread;
+};
+
+class SUTILCLASSAPI Profiler
+{
+public:
+    SUTILAPI static Profiler& instance();
+
+    void setEnabled( bool enabled ) { m_enabled.store( enabled, std::memory_order_relaxed ); }
+    bool enabled() const { return m_enabled.load( std::memory_order_relaxed ); }
+
+    // Nanoseconds since the profiler was created
+    SUTILAPI int64_t now() const;
+
+    // Records a finished scope on the calling thread's ring
+    SUTILAPI void record( const char* name, int64_t begin_ns, int64_t end_ns );
+
+    // Moves the events of all rings into the profiler's history
+    SUTILAPI void collect();
+
+    // Percentiles of every stage over the collected history, in order of first appearance
+    SUTILAPI std::vector<ProfileStageStats> stageStats();
+    SUTILAPI void printSummary( std::ostream& out );
+
+    // Writes the collected history as complete ("X") events of the Chrome trace format
+    SUTILAPI void writeChromeTrace( const std::string& filename );
+
+    // Drops the collected history, events still in the rings are kept
+    SUTILAPI void clear();
+
+    uint64_t droppedEvents() const { return m_dropped; }
+
+private:
+    Profiler();
+    ProfileRing& threadRing();
+
+    // Bounds the collected history, about 24 MB of events
+    static const size_t MAX_HISTORY = 1 << 20;
+
+    std::atomic<bool>                         m_enabled{false};
+    std::chrono::steady_clock::time_point     m_epoch;
+    std::mutex                                m_mutex;
+    std::vector<std::unique_ptr<ProfileRing>> m_rings;
+    std::vector<ProfileEvent>                 m_history;
+    uint64_t                                  m_dropped = 0;
+};
+
+// Times the enclosing scope, does nothing while the profiler is disabled
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer( const char* name )
+        : m_name( name )
+        , m_begin_ns( Profiler::instance().enabled() ? Profiler::instance().now() : -1 )
+    {
+    }
+
+    ~ScopedTimer() { stop(); }
+
+    // Ends the scope early, for stages that do not match a block
+    void stop()
+    {
+        if( m_begin_ns >= 0 )
+            Profiler::instance().record( m_name, m_begin_ns, Profiler::instance().now() );
+        m_begin_ns = -1;
+    }
+
+    ScopedTimer( const ScopedTimer& ) = delete;
+    ScopedTimer& operator=( const ScopedTimer& ) = delete;
+
+private:
+    const char*   m_name;
+    int64_t       m_begin_ns;
+};
+
+} // end namespace sutil
+
+#define SUTIL_PROFILE_CONCAT2( a, b ) a##b
+#define SUTIL_PROFILE_CONCAT( a, b ) SUTIL_PROFILE_CONCAT2( a, b )
+#define SUTIL_PROFILE_SCOPE( name ) sutil::ScopedTimer SUTIL_PROFILE_CONCAT( profile_scope_, __LINE__ )( name )
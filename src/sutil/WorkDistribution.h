@@ -89,3 +89,265 @@ private:
     static const int32_t TILE_WIDTH  = 8;
     static const int32_t TILE_HEIGHT = 4;
 };
+
+
+//
+// Splits the raster into TILE_WIDTH x TILE_HEIGHT tiles and hands every worker a share of
+// them that follows its measured throughput.  The distribution only needs to be told how
+// long each worker took for the tiles it was given in the previous subframe.  Its workers
+// are the render processes of a TileCoordinator (tile_cluster.h); the device and the CPU
+// threads of one process do not split a subframe with it.
+//
+// A worker's tiles form a contiguous range in a strided permutation of the tile grid, so
+// every worker gets tiles scattered over the whole image and its timing is not skewed by
+// one expensive region of the scene.
+//
+class DynamicWorkDistribution
+{
+public:
+    static const int32_t MAX_WORKERS = 8;
+
+    SUTIL_INLINE SUTIL_HOSTDEVICE void setRasterSize( int width, int height )
+    {
+        m_width  = width  > 0 ? width  : 0;
+        m_height = height > 0 ? height : 0;
+        m_num_tile_cols = m_width /TILE_WIDTH  + ( m_width %TILE_WIDTH  == 0 ? 0 : 1 );
+        m_num_tile_rows = m_height/TILE_HEIGHT + ( m_height%TILE_HEIGHT == 0 ? 0 : 1 );
+        m_num_tiles     = m_num_tile_cols*m_num_tile_rows;
+        m_tile_stride   = computeTileStride( m_num_tiles );
+        assignTiles();
+    }
+
+
+    // Resets all workers to an equal share.
+    SUTIL_INLINE SUTIL_HOSTDEVICE void setNumWorkers( int32_t num_workers )
+    {
+        m_num_workers = num_workers < 1 ? 1 : ( num_workers > MAX_WORKERS ? MAX_WORKERS : num_workers );
+        for( int32_t i = 0; i < MAX_WORKERS; ++i )
+        {
+            m_throughput[i] = 0.0f;
+            m_share[i]      = i < m_num_workers ? 1.0f / static_cast<float>( m_num_workers ) : 0.0f;
+        }
+        assignTiles();
+    }
+
+
+    // Drops a worker; the ones after it move down one index and keep their throughput, the
+    // remaining shares are scaled back up to the whole frame.  The last worker is reset to an
+    // equal share instead.
+    SUTIL_INLINE SUTIL_HOSTDEVICE void removeWorker( int32_t worker_idx )
+    {
+        if( worker_idx < 0 || worker_idx >= m_num_workers )
+            return;
+        if( m_num_workers == 1 )
+        {
+            setNumWorkers( 1 );
+            return;
+        }
+
+        for( int32_t i = worker_idx; i + 1 < m_num_workers; ++i )
+        {
+            m_share[i]      = m_share[i + 1];
+            m_throughput[i] = m_throughput[i + 1];
+        }
+        --m_num_workers;
+        m_share[m_num_workers]      = 0.0f;
+        m_throughput[m_num_workers] = 0.0f;
+
+        float total = 0.0f;
+        for( int32_t i = 0; i < m_num_workers; ++i )
+            total += m_share[i];
+        for( int32_t i = 0; i < m_num_workers; ++i )
+            m_share[i] = total > 0.0f ? m_share[i] / total : 1.0f / static_cast<float>( m_num_workers );
+        assignTiles();
+    }
+
+
+    SUTIL_INLINE SUTIL_HOSTDEVICE int32_t numWorkers() const { return m_num_workers; }
+    SUTIL_INLINE SUTIL_HOSTDEVICE int32_t numTiles() const { return m_num_tiles; }
+    SUTIL_INLINE SUTIL_HOSTDEVICE int32_t numTiles( int32_t worker_idx ) const { return m_tile_count[worker_idx]; }
+    SUTIL_INLINE SUTIL_HOSTDEVICE float   share( int32_t worker_idx ) const { return m_share[worker_idx]; }
+    SUTIL_INLINE SUTIL_HOSTDEVICE float   throughput( int32_t worker_idx ) const { return m_throughput[worker_idx]; }
+
+    static SUTIL_INLINE SUTIL_HOSTDEVICE int32_t tileWidth() { return TILE_WIDTH; }
+    static SUTIL_INLINE SUTIL_HOSTDEVICE int32_t tileHeight() { return TILE_HEIGHT; }
+
+
+    SUTIL_INLINE SUTIL_HOSTDEVICE int32_t numSamples( int32_t worker_idx ) const
+    {
+        return m_tile_count[worker_idx]*TILE_WIDTH*TILE_HEIGHT;
+    }
+
+
+    // Top left pixel of the tile_idx'th tile owned by the worker.  Before setRasterSize() and
+    // for an empty raster no worker owns a tile, and this is (0, 0).
+    SUTIL_INLINE SUTIL_HOSTDEVICE int2 getTileOrigin( int32_t worker_idx, int32_t tile_idx ) const
+    {
+        if( m_num_tiles == 0 )
+            return make_int2( 0, 0 );
+        const int32_t tile   = static_cast<int32_t>(
+            ( static_cast<int64_t>( m_tile_offset[worker_idx] + tile_idx ) * m_tile_stride ) % m_num_tiles );
+        const int32_t tile_y = tile / m_num_tile_cols;
+        const int32_t tile_x = tile - tile_y * m_num_tile_cols;
+        return make_int2( tile_x * TILE_WIDTH, tile_y * TILE_HEIGHT );
+    }
+
+
+    // Pixels of edge tiles may lie outside the raster; callers must discard those.
+    SUTIL_INLINE SUTIL_HOSTDEVICE int2 getSamplePixel( int32_t worker_idx, int32_t sample_idx ) const
+    {
+        const int  tile_idx       = sample_idx / ( TILE_WIDTH*TILE_HEIGHT );
+        const int  tile_pixel_idx = sample_idx - tile_idx * TILE_WIDTH*TILE_HEIGHT;
+        const int  tile_pixel_y   = tile_pixel_idx / TILE_WIDTH;
+        const int  tile_pixel_x   = tile_pixel_idx - tile_pixel_y * TILE_WIDTH;
+        const int2 origin         = getTileOrigin( worker_idx, tile_idx );
+        return make_int2( origin.x + tile_pixel_x, origin.y + tile_pixel_y );
+    }
+
+
+#if !defined(__CUDACC__)
+    // Records how long the worker took to render the tiles it was assigned for the last
+    // subframe.  Call once per worker and subframe, then rebalance().
+    void reportWorkerTime( int32_t worker_idx, double seconds )
+    {
+        if( worker_idx < 0 || worker_idx >= m_num_workers || m_tile_count[worker_idx] == 0 || seconds <= 0.0 )
+            return;
+
+        const float tiles_per_second = static_cast<float>( m_tile_count[worker_idx] / seconds );
+        if( m_throughput[worker_idx] <= 0.0f )
+            m_throughput[worker_idx] = tiles_per_second;
+        else
+            m_throughput[worker_idx] += THROUGHPUT_SMOOTHING * ( tiles_per_second - m_throughput[worker_idx] );
+    }
+
+
+    // Recomputes every worker's share from its smoothed throughput.  Workers that have not
+    // reported a measurement yet keep their current share.
+    void rebalance()
+    {
+        float measured_share      = 0.0f;
+        float measured_throughput = 0.0f;
+        for( int32_t i = 0; i < m_num_workers; ++i )
+        {
+            if( m_throughput[i] > 0.0f )
+            {
+                measured_share      += m_share[i];
+                measured_throughput += m_throughput[i];
+            }
+        }
+        if( measured_throughput <= 0.0f )
+            return;
+
+        // Every worker keeps at least MIN_SHARE of the frame, otherwise a worker that once
+        // had a slow frame would never be measured again.
+        const float equal_share = 1.0f / static_cast<float>( m_num_workers );
+        const float min_share   = MIN_SHARE < equal_share ? MIN_SHARE : equal_share;
+        float       total     = 0.0f;
+        for( int32_t i = 0; i < m_num_workers; ++i )
+        {
+            if( m_throughput[i] > 0.0f )
+            {
+                const float share = measured_share * m_throughput[i] / measured_throughput;
+                m_share[i]        = share > min_share ? share : min_share;
+            }
+            total += m_share[i];
+        }
+        for( int32_t i = 0; i < m_num_workers; ++i )
+            m_share[i] /= total;
+
+        assignTiles();
+    }
+#endif
+
+
+private:
+    SUTIL_INLINE SUTIL_HOSTDEVICE void assignTiles()
+    {
+        if( m_num_workers == 0 )
+            return;
+
+        // Largest remainder rounding of share * num_tiles, so that the counts add up.
+        int32_t assigned = 0;
+        float   remainder[MAX_WORKERS];
+        for( int32_t i = 0; i < m_num_workers; ++i )
+        {
+            const float exact = m_share[i] * static_cast<float>( m_num_tiles );
+            m_tile_count[i]   = static_cast<int32_t>( exact );
+            remainder[i]      = exact - static_cast<float>( m_tile_count[i] );
+            assigned         += m_tile_count[i];
+        }
+        while( assigned < m_num_tiles )
+        {
+            int32_t best = 0;
+            for( int32_t i = 1; i < m_num_workers; ++i )
+                if( remainder[i] > remainder[best] )
+                    best = i;
+            ++m_tile_count[best];
+            remainder[best] = -1.0f;
+            ++assigned;
+        }
+        while( assigned > m_num_tiles )
+        {
+            int32_t best = 0;
+            for( int32_t i = 1; i < m_num_workers; ++i )
+                if( m_tile_count[i] > m_tile_count[best] )
+                    best = i;
+            --m_tile_count[best];
+            --assigned;
+        }
+
+        int32_t offset = 0;
+        for( int32_t i = 0; i < MAX_WORKERS; ++i )
+        {
+            if( i >= m_num_workers )
+                m_tile_count[i] = 0;
+            m_tile_offset[i] = offset;
+            offset          += m_tile_count[i];
+        }
+    }
+
+
+    // Stride close to num_tiles / golden ratio that is coprime to num_tiles, so that
+    // k -> k * stride % num_tiles is a permutation of the tile indices.
+    static SUTIL_INLINE SUTIL_HOSTDEVICE int32_t computeTileStride( int32_t num_tiles )
+    {
+        if( num_tiles <= 2 )
+            return 1;
+        int32_t stride = static_cast<int32_t>( static_cast<float>( num_tiles ) * 0.6180339887f );
+        for( ;; ++stride )
+        {
+            int32_t a = stride;
+            int32_t b = num_tiles;
+            while( b != 0 )
+            {
+                const int32_t t = a % b;
+                a = b;
+                b = t;
+            }
+            if( a == 1 )
+                return stride;
+        }
+    }
+
+
+    int32_t m_num_workers   = 0;
+    int32_t m_width         = 0;
+    int32_t m_height        = 0;
+    int32_t m_num_tile_cols = 0;
+    int32_t m_num_tile_rows = 0;
+    int32_t m_num_tiles     = 0;
+    int32_t m_tile_stride   = 1;
+
+    int32_t m_tile_offset[MAX_WORKERS] = {};
+    int32_t m_tile_count [MAX_WORKERS] = {};
+    float   m_share      [MAX_WORKERS] = {};
+    float   m_throughput [MAX_WORKERS] = {};   // smoothed tiles per second
+
+    static const int32_t TILE_WIDTH  = 8;
+    static const int32_t TILE_HEIGHT = 4;
+
+#if !defined(__CUDACC__)
+    static constexpr float THROUGHPUT_SMOOTHING = 0.25f;
+    static constexpr float MIN_SHARE            = 0.02f;
+#endif
+};
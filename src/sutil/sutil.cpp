@@ -31,6 +31,7 @@
 #include <sutil/Exception.h>
 #include <sutil/GLDisplay.h>
 #include <sutil/PPMLoader.h>
+#include <sutil/Profiler.h>
 #include <sutil/sutil.h>
 #include <sutil/vec_math.h>
 
@@ -129,35 +130,11 @@ namespace sutil {
         OutFile.close();
     }
 
-    static void sendPPM(const unsigned char *Pix, const char *fname, int wid, int hgt, int chan, int sock, FILE* file) {
-        if (Pix == NULL || wid < 1 || hgt < 1)
-            throw Exception("savePPM: Image is ill-formed. Not saving");
-
-        if (chan != 1 && chan != 3 && chan != 4)
-            throw Exception("savePPM: Attempting to save image with channel count != 1, 3, or 4.");
-
-        std::stringstream output;
-
-        bool is_float = false;
-        output << 'P';
-        output << ((chan == 1 ? (is_float ? 'Z' : '5') : (chan == 3 ? (is_float ? '7' : '6') : '8')))
-               << std::endl;
-        output << wid << " " << hgt << std::endl << 255 << std::endl;
-        output.write(reinterpret_cast<char *>( const_cast<unsigned char *>( Pix )),
-                     wid * hgt * chan * (is_float ? 4 : 1));
-        fwrite(output.str().c_str(), 1, output.str().size(), file);
-         fflush(file);
-        // usleep(1000000/50);
-        // pclose(file);
-//        sync_produce(rkt, 3, output.str().c_str(), output.str().size(), NULL, 0);
-//        send(sock, output.str().c_str(),  output.str().size(), 0);
-    }
-
-    void sendImage(const char *fname, const ImageBuffer &image, bool disable_srgb_conversion, int sock, FILE* file) {
+    void encodeImage(const char *fname, const ImageBuffer &image, bool disable_srgb_conversion,
+                     std::vector<unsigned char> &encoded) {
         const std::string filename(fname);
         if (filename.length() < 5)
-            throw Exception("sutil::saveImage(): Failed to determine filename extension");
-        // std::cout << "IMAGE " << image.data << std::endl;
+            throw Exception("sutil::encodeImage(): Failed to determine filename extension");
 
         const std::string ext = filename.substr(filename.length() - 3);
         if (ext == "PPM" || ext == "ppm") {
@@ -166,7 +143,16 @@ namespace sutil {
             //
             const int32_t width = image.width;
             const int32_t height = image.height;
-            std::vector<unsigned char> pix(width * height * 3);
+            if (image.data == NULL || width < 1 || height < 1)
+                throw Exception("sutil::encodeImage(): Image is ill-formed. Not encoding");
+            // P6 header and pixels in one buffer, the pixels are converted in place
+            std::ostringstream header;
+            header << "P6" << std::endl << width << " " << height << std::endl << 255 << std::endl;
+            const std::string header_bytes = header.str();
+            encoded.resize(header_bytes.size() + static_cast<size_t>(width) * height * 3);
+            memcpy(encoded.data(), header_bytes.data(), header_bytes.size());
+            unsigned char *pix = encoded.data() + header_bytes.size();
+            sutil::ScopedTimer tonemap_timer("tonemap");
             switch (image.pixel_format) {
                 case BufferImageFormat::UNSIGNED_BYTE4: {
                     for (int j = height - 1; j >= 0; --j) {
@@ -236,14 +222,25 @@ namespace sutil {
                     break;
 
                 default: {
-                    throw Exception("sutil::saveImage(): Unrecognized image buffer pixel format.\n");
+                    throw Exception("sutil::encodeImage(): Unrecognized image buffer pixel format.\n");
                 }
             }
-//             std::cout << "PIX " << pix.data() << std::endl;
-            sendPPM(pix.data(), filename.c_str(), width, height, 3, sock, file);
+            tonemap_timer.stop();
+        } else {
+            encoded.clear();
         }
     }
 
+    void sendImage(const char *fname, const ImageBuffer &image, bool disable_srgb_conversion, int sock, FILE* file) {
+        std::vector<unsigned char> encoded;
+        encodeImage(fname, image, disable_srgb_conversion, encoded);
+        if (encoded.empty())
+            return;
+        SUTIL_PROFILE_SCOPE("send");
+        fwrite(encoded.data(), 1, encoded.size(), file);
+        fflush(file);
+    }
+
     static bool dirExists(const char *path) {
 #if defined( _WIN32 )
         DWORD attrib = GetFileAttributes( path );
@@ -33,6 +33,7 @@
 
 #include <cstdlib>
 #include <chrono>
+#include <vector>
 
 #include <vector_types.h>
 
@@ -93,6 +94,9 @@ SUTILAPI Texture loadTexture( const char* filename, float3 default_color, cudaTe
 // and will be written like that.
 SUTILAPI void        saveImage( const char* filename, const ImageBuffer& buffer, bool disable_srgb );
 SUTILAPI void        sendImage( const char* filename, const ImageBuffer& buffer, bool disable_srgb, int sock, FILE* file );
+// Encodes the buffer like sendImage writes it into encoded, which stays empty for formats other than ppm
+SUTILAPI void        encodeImage( const char* filename, const ImageBuffer& buffer, bool disable_srgb,
+                                  std::vector<unsigned char>& encoded );
 SUTILAPI ImageBuffer loadImage( const char* filename, int32_t force_components = 0 );
 
 SUTILAPI void displayBufferWindow( const char* argv, const ImageBuffer& buffer );